@@ -0,0 +1,302 @@
+// Procedural glTF scenes of any size, for benchmarks.
+//
+
+#include "gltf_generator.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace bench {
+
+// Returns a pseudo-random number in [0, 1) (xorshift32)
+static float next_random(uint32_t &state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return (state >> 8) * (1.0f / 16777216.0f);
+}
+
+static void generate_mesh(gltf::GLTFAsset &asset, int index, int gridSize, int material,
+                          uint32_t &random)
+{
+    const int n = gridSize + 1;  // Vertices per row
+    const float frequency = 1.0f + 4.0f * next_random(random);
+    std::vector<float> positions, normals, texcoords;
+    positions.reserve(3 * n * n);
+    normals.reserve(3 * n * n);
+    texcoords.reserve(2 * n * n);
+    for (int y = 0; y < n; ++y) {
+        for (int x = 0; x < n; ++x) {
+            const float u = float(x) / gridSize, v = float(y) / gridSize;
+            const float height = 0.05f * std::sin(frequency * u) * std::cos(frequency * v);
+            const float dx = 0.05f * frequency * std::cos(frequency * u) * std::cos(frequency * v);
+            const float dy = -0.05f * frequency * std::sin(frequency * u) * std::sin(frequency * v);
+            const float length = std::sqrt(dx * dx + dy * dy + 1.0f);
+            positions.insert(positions.end(), {u - 0.5f, v - 0.5f, height});
+            normals.insert(normals.end(), {-dx / length, -dy / length, 1.0f / length});
+            texcoords.insert(texcoords.end(), {u, v});
+        }
+    }
+    std::vector<uint32_t> indices;
+    indices.reserve(6 * gridSize * gridSize);
+    for (int y = 0; y < gridSize; ++y) {
+        for (int x = 0; x < gridSize; ++x) {
+            const uint32_t i = y * n + x;
+            indices.insert(indices.end(), {i, i + 1, i + n + 1, i, i + n + 1, i + n});
+        }
+    }
+
+    gltf::Primitive primitive;
+    primitive.attributes.push_back(
+        {"POSITION", gltf::append_accessor(asset, positions.data(), 0x1406, n * n, "VEC3"),
+         gltf::SEMANTIC_POSITION});
+    primitive.attributes.push_back(
+        {"NORMAL", gltf::append_accessor(asset, normals.data(), 0x1406, n * n, "VEC3"),
+         gltf::SEMANTIC_NORMAL});
+    primitive.attributes.push_back(
+        {"TEXCOORD_0", gltf::append_accessor(asset, texcoords.data(), 0x1406, n * n, "VEC2"),
+         gltf::SEMANTIC_TEXCOORD_0});
+    primitive.indices =
+        gltf::append_accessor(asset, indices.data(), 0x1405, int(indices.size()), "SCALAR");
+    primitive.material = material;
+    primitive.hasMaterial = material >= 0;
+
+    gltf::Mesh mesh;
+    mesh.name = "mesh" + std::to_string(index);
+    mesh.primitives.push_back(primitive);
+    asset.meshes.push_back(mesh);
+}
+
+void generate_gltf_asset(const GeneratorSettings &settings, gltf::GLTFAsset &asset)
+{
+    asset = gltf::GLTFAsset();
+    uint32_t random = settings.seed ? settings.seed : 1;
+
+    asset.materials.resize(settings.numMaterials);
+    for (int i = 0; i < settings.numMaterials; ++i) {
+        gltf::Material &material = asset.materials[i];
+        material.name = "material" + std::to_string(i);
+        material.type = gltf::PBR_METALLIC_ROUGHNESS;
+        material.pbrMetallicRoughness.baseColorFactor =
+            glm::vec4(next_random(random), next_random(random), next_random(random), 1.0f);
+        material.pbrMetallicRoughness.metallicFactor = next_random(random);
+        material.pbrMetallicRoughness.roughnessFactor = next_random(random);
+        material.pbrMetallicRoughness.hasBaseColorTexture = false;
+        material.pbrMetallicRoughness.hasMetallicRoughnessTexture = false;
+        material.hasNormalTexture = false;
+        material.hasOcclusionTexture = false;
+    }
+
+    for (int i = 0; i < settings.numMeshes; ++i) {
+        const int material = settings.numMaterials ? i % settings.numMaterials : -1;
+        generate_mesh(asset, i, settings.gridSize, material, random);
+    }
+
+    // Roots are spread on a square grid, and each chain grows away from its
+    // root in small steps
+    const int depth = std::max(1, settings.hierarchyDepth);
+    const int numRoots = (settings.numNodes + depth - 1) / depth;
+    const int side = std::max(1, int(std::ceil(std::sqrt(float(numRoots)))));
+    asset.scenes.resize(1);
+    asset.scenes[0].name = "scene";
+    asset.nodes.resize(settings.numNodes);
+    for (int i = 0; i < settings.numNodes; ++i) {
+        gltf::Node &node = asset.nodes[i];
+        node.name = "node" + std::to_string(i);
+        node.mesh = settings.numMeshes ? i % settings.numMeshes : 0;
+        node.light = -1;
+        node.skin = -1;
+        node.rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+        node.scale = glm::vec3(1.0f);
+        node.matrix = glm::mat4(1.0f);
+        node.hasMatrix = false;
+        node.isOccluder = false;
+        if (i % depth == 0) {
+            const int root = i / depth;
+            node.translation = 1.5f * glm::vec3(root % side - 0.5f * side,
+                                                root / side - 0.5f * side, 0.0f);
+            asset.scenes[0].nodes.push_back(i);
+        } else {
+            node.translation = 0.01f * glm::vec3(next_random(random), next_random(random), 1.0f);
+            asset.nodes[i - 1].children.push_back(i);
+        }
+    }
+}
+
+// Appends a tube along +Z, one segment per joint, with rings of vertices that
+// are weighted between the two nearest joints
+static int generate_tube_mesh(gltf::GLTFAsset &asset, int numJoints, float segment)
+{
+    const int sides = 8, ringsPerSegment = 2, rings = numJoints * ringsPerSegment + 1;
+    const float radius = 0.25f * segment;
+    std::vector<float> positions, normals, weights;
+    std::vector<uint8_t> joints;
+    for (int ring = 0; ring < rings; ++ring) {
+        const float z = ring * segment / ringsPerSegment;
+        const int joint = std::min(ring / ringsPerSegment, numJoints - 1);
+        const float blend = std::min(z / segment - joint, 1.0f);
+        const int next = std::min(joint + 1, numJoints - 1);
+        for (int side = 0; side < sides; ++side) {
+            const float angle = 6.2831853f * side / sides;
+            const float x = std::cos(angle), y = std::sin(angle);
+            positions.insert(positions.end(), {radius * x, radius * y, z});
+            normals.insert(normals.end(), {x, y, 0.0f});
+            joints.insert(joints.end(), {uint8_t(joint), uint8_t(next), 0, 0});
+            if (next == joint) {
+                weights.insert(weights.end(), {1.0f, 0.0f, 0.0f, 0.0f});
+            } else {
+                weights.insert(weights.end(), {1.0f - blend, blend, 0.0f, 0.0f});
+            }
+        }
+    }
+    std::vector<uint32_t> indices;
+    for (int ring = 0; ring + 1 < rings; ++ring) {
+        for (int side = 0; side < sides; ++side) {
+            const uint32_t i = ring * sides + side, j = ring * sides + (side + 1) % sides;
+            indices.insert(indices.end(), {i, j, j + sides, i, j + sides, i + sides});
+        }
+    }
+
+    const int numVertices = rings * sides;
+    gltf::Primitive primitive;
+    primitive.attributes.push_back(
+        {"POSITION", gltf::append_accessor(asset, positions.data(), 0x1406, numVertices, "VEC3"),
+         gltf::SEMANTIC_POSITION});
+    primitive.attributes.push_back(
+        {"NORMAL", gltf::append_accessor(asset, normals.data(), 0x1406, numVertices, "VEC3"),
+         gltf::SEMANTIC_NORMAL});
+    primitive.attributes.push_back(
+        {"JOINTS_0", gltf::append_accessor(asset, joints.data(), 0x1401, numVertices, "VEC4"),
+         gltf::SEMANTIC_JOINTS_0});
+    primitive.attributes.push_back(
+        {"WEIGHTS_0", gltf::append_accessor(asset, weights.data(), 0x1406, numVertices, "VEC4"),
+         gltf::SEMANTIC_WEIGHTS_0});
+    primitive.indices =
+        gltf::append_accessor(asset, indices.data(), 0x1405, int(indices.size()), "SCALAR");
+    primitive.material = -1;
+    primitive.hasMaterial = false;
+
+    gltf::Mesh mesh;
+    mesh.name = "character";
+    mesh.primitives.push_back(primitive);
+    asset.meshes.push_back(mesh);
+    return int(asset.meshes.size()) - 1;
+}
+
+static gltf::Node crowd_node(const std::string &name, const glm::vec3 &translation)
+{
+    gltf::Node node = gltf::Node();
+    node.name = name;
+    node.mesh = -1;
+    node.light = -1;
+    node.skin = -1;
+    node.translation = translation;
+    node.rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+    node.scale = glm::vec3(1.0f);
+    node.matrix = glm::mat4(1.0f);
+    return node;
+}
+
+void generate_skinned_crowd(const CrowdSettings &settings, gltf::GLTFAsset &asset)
+{
+    asset = gltf::GLTFAsset();
+    uint32_t random = settings.seed ? settings.seed : 1;
+    const int numJoints = std::max(1, std::min(settings.numJoints, 255));
+    const int numVariations = std::max(1, settings.numVariations);
+    const float segment = 0.1f;
+    const int mesh = generate_tube_mesh(asset, numJoints, segment);
+
+    // Joints are at the same place relative to their character in the bind
+    // pose, so all skins share their inverse bind matrices
+    std::vector<glm::mat4> inverseBindMatrices(numJoints);
+    for (int j = 0; j < numJoints; ++j) {
+        inverseBindMatrices[j] =
+            glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, -j * segment));
+    }
+    const int inverseBindAccessor =
+        gltf::append_accessor(asset, inverseBindMatrices.data(), 0x1406, numJoints, "MAT4");
+
+    // Keys of one looping second. Each variation sways about its own axis,
+    // with a phase that runs up the chain.
+    const int numKeys = std::max(1, settings.keysPerSecond) + 1;
+    std::vector<float> times(numKeys);
+    for (int k = 0; k < numKeys; ++k) times[k] = float(k) / (numKeys - 1);
+    const int timeAccessor = gltf::append_accessor(asset, times.data(), 0x1406, numKeys, "SCALAR");
+    gltf::Animation animation;
+    animation.name = "crowd";
+    for (int v = 0; v < numVariations; ++v) {
+        const float heading = 6.2831853f * next_random(random);
+        const float phase = next_random(random);
+        const float amplitude = 0.1f + 0.2f * next_random(random);
+        const glm::vec3 axis(std::cos(heading), std::sin(heading), 0.0f);
+        std::vector<glm::vec4> rotations(numKeys);
+        for (int j = 0; j < numJoints; ++j) {
+            for (int k = 0; k < numKeys; ++k) {
+                const float angle =
+                    amplitude * std::sin(6.2831853f * (times[k] + phase + 0.05f * j));
+                rotations[k] = glm::vec4(axis * std::sin(0.5f * angle), std::cos(0.5f * angle));
+            }
+            const gltf::AnimationSampler sampler = {
+                timeAccessor,
+                gltf::append_accessor(asset, rotations.data(), 0x1406, numKeys, "VEC4"),
+                gltf::INTERPOLATION_LINEAR};
+            animation.samplers.push_back(sampler);
+        }
+        std::vector<glm::vec3> translations(numKeys);
+        for (int k = 0; k < numKeys; ++k) {
+            const float bounce = std::abs(std::sin(6.2831853f * (times[k] + phase)));
+            translations[k] = glm::vec3(0.0f, 0.0f, 0.1f * segment * bounce);
+        }
+        const gltf::AnimationSampler sampler = {
+            timeAccessor,
+            gltf::append_accessor(asset, translations.data(), 0x1406, numKeys, "VEC3"),
+            gltf::INTERPOLATION_LINEAR};
+        animation.samplers.push_back(sampler);
+    }
+
+    // Each character is a root with the skinned mesh and the joint chain as
+    // its children
+    const int side = std::max(1, int(std::ceil(std::sqrt(float(settings.numCharacters)))));
+    asset.scenes.resize(1);
+    asset.scenes[0].name = "crowd";
+    for (int c = 0; c < settings.numCharacters; ++c) {
+        const int root = int(asset.nodes.size());
+        const glm::vec3 position(0.5f * (c % side - 0.5f * side), 0.5f * (c / side - 0.5f * side),
+                                 0.0f);
+        asset.nodes.push_back(crowd_node("character" + std::to_string(c), position));
+        asset.scenes[0].nodes.push_back(root);
+
+        gltf::Skin skin;
+        skin.name = "skin" + std::to_string(c);
+        skin.inverseBindMatrices = inverseBindAccessor;
+        skin.skeleton = root + 1;
+        const int variation = c % numVariations;
+        for (int j = 0; j < numJoints; ++j) {
+            const int node = int(asset.nodes.size());
+            const glm::vec3 offset(0.0f, 0.0f, j ? segment : 0.0f);
+            asset.nodes.push_back(crowd_node("joint" + std::to_string(j), offset));
+            asset.nodes[j ? node - 1 : root].children.push_back(node);
+            skin.joints.push_back(node);
+            const gltf::AnimationChannel channel = {variation * (numJoints + 1) + j, node,
+                                                    gltf::PATH_ROTATION};
+            animation.channels.push_back(channel);
+        }
+        const gltf::AnimationChannel channel = {variation * (numJoints + 1) + numJoints,
+                                                root + 1, gltf::PATH_TRANSLATION};
+        animation.channels.push_back(channel);
+
+        gltf::Node node = crowd_node("mesh" + std::to_string(c), glm::vec3(0.0f));
+        node.mesh = mesh;
+        node.skin = int(asset.skins.size());
+        asset.nodes[root].children.push_back(int(asset.nodes.size()));
+        asset.nodes.push_back(node);
+        asset.skins.push_back(skin);
+    }
+    asset.animations.push_back(animation);
+}
+
+}  // namespace bench
@@ -0,0 +1,42 @@
+// Procedural glTF scenes of any size, for benchmarks.
+//
+
+#pragma once
+
+#include "gltf_scene.h"
+
+#include <cstdint>
+#include <string>
+
+namespace bench {
+
+struct GeneratorSettings {
+    int numNodes = 1000;
+    int numMeshes = 100;
+    int numMaterials = 10;
+    int gridSize = 4;        // Each mesh is a (gridSize x gridSize)-quad height field
+    int hierarchyDepth = 1;  // Nodes form chains of this length (1 = flat scene)
+    uint32_t seed = 1;
+};
+
+// Builds the scene in memory. All meshes share one buffer (as the viewer
+// expects), and node i uses mesh i % numMeshes. Node transforms are small
+// offsets from their parent, so that deep chains stay near their root.
+void generate_gltf_asset(const GeneratorSettings &settings, gltf::GLTFAsset &asset);
+
+struct CrowdSettings {
+    int numCharacters = 1000;
+    int numJoints = 16;      // In a chain, from the feet up
+    int numVariations = 8;   // Of the motion, which characters take turns to use
+    int keysPerSecond = 30;  // The motion loops every second
+    uint32_t seed = 1;
+};
+
+// Builds a crowd of skinned characters on a square grid. Each is a tube mesh
+// (shared by all) bent by its own chain of joints, and one animation sways
+// every joint of every character (a rotation channel per joint, and a
+// translation of the first). Characters that use the same variation share
+// its samplers.
+void generate_skinned_crowd(const CrowdSettings &settings, gltf::GLTFAsset &asset);
+
+}  // namespace bench
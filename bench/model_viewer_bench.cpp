@@ -0,0 +1,427 @@
+// Benchmarks of the CPU hot paths of the viewer (asset loading, accessor
+// decoding, transform updates, culling, draw-list building, light binning,
+// shadow scheduling and animation playback) on generated scenes of 1k to 1M
+// elements. Runs without a window or OpenGL context.
+//
+// Usage: model_viewer_bench [--out results.json] [--max elements] [--filter name]
+//
+
+#include "gltf_animation.h"
+#include "gltf_generator.h"
+#include "gltf_io.h"
+#include "gltf_scene.h"
+#include "gltf_culling.h"
+#include "gltf_lights.h"
+#include "gltf_render.h"
+#include "gltf_shadows.h"
+#include "cg_parallel.h"
+#include "cg_utils.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+struct BenchResult {
+    std::string name;
+    int64_t elements;
+    int iterations;
+    double minMs;
+    double meanMs;
+};
+
+struct BenchSettings {
+    std::string outFilename = "model_viewer_bench.json";
+    std::string dataDir;  // For the generated .gltf and .bin files
+    int64_t maxElements = 1000000;
+    std::string filter;
+    double minSeconds = 0.5;  // Each measurement repeats until it has run this long...
+    int maxIterations = 100;  // ...or this many times
+};
+
+// Runs func repeatedly and returns the fastest and mean time of a run
+static BenchResult run_benchmark(const BenchSettings &settings, const std::string &name,
+                                 int64_t elements, const std::function<void()> &func)
+{
+    BenchResult result = {name, elements, 0, 1e30, 0.0};
+    double totalMs = 0.0;
+    while (result.iterations < settings.maxIterations &&
+           (result.iterations == 0 || totalMs < 1000.0 * settings.minSeconds)) {
+        const auto start = std::chrono::steady_clock::now();
+        func();
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        const double ms = std::chrono::duration<double, std::milli>(elapsed).count();
+        result.minMs = std::min(result.minMs, ms);
+        totalMs += ms;
+        result.iterations += 1;
+    }
+    result.meanMs = totalMs / result.iterations;
+    std::printf("%-24s %9lld elements %6d iterations %12.3f ms (min) %10.2f ns/element\n",
+                name.c_str(), (long long)elements, result.iterations, result.minMs,
+                1e6 * result.minMs / elements);
+    std::fflush(stdout);
+    return result;
+}
+
+// Returns a camera that looks down at the generated scene at an angle, so
+// that part of it is outside the view frustum
+static glm::mat4 bench_view_projection(const gltf::GLTFAsset &asset)
+{
+    std::vector<glm::mat4> matrices;
+    gltf::compute_world_matrices(asset, matrices);
+    float extent = 1.0f;
+    for (const auto &matrix : matrices) {
+        extent = std::max(extent, std::max(std::abs(matrix[3][0]), std::abs(matrix[3][1])));
+    }
+    const glm::mat4 view = glm::lookAt(glm::vec3(0.0f, -1.5f * extent, 0.75f * extent),
+                                       glm::vec3(0.0f, -0.25f * extent, 0.0f),
+                                       glm::vec3(0.0f, 0.0f, 1.0f));
+    return glm::perspective(glm::radians(65.0f), 16.0f / 9.0f, 0.1f, 4.0f * extent) * view;
+}
+
+static void bench_load(const BenchSettings &settings, int64_t n, std::vector<BenchResult> &out)
+{
+    bench::GeneratorSettings generator;
+    generator.numNodes = int(n);
+    generator.numMeshes = std::max(1, int(n / 100));
+    generator.numMaterials = std::max(1, int(n / 1000));
+    gltf::GLTFAsset asset;
+    bench::generate_gltf_asset(generator, asset);
+    const std::string filename = "bench_" + std::to_string(n) + ".gltf";
+    if (!gltf::save_gltf_asset(filename, settings.dataDir, asset)) return;
+
+    out.push_back(run_benchmark(settings, "load_gltf_asset", n, [&]() {
+        gltf::load_gltf_asset(filename, settings.dataDir, asset);
+    }));
+    std::remove((settings.dataDir + filename).c_str());
+    std::remove((settings.dataDir + asset.buffers[0].uri).c_str());
+}
+
+static void bench_accessors(const BenchSettings &settings, int64_t n,
+                            std::vector<BenchResult> &out)
+{
+    // One mesh with about n vertices (a "huge buffer")
+    bench::GeneratorSettings generator;
+    generator.numNodes = 1;
+    generator.numMeshes = 1;
+    generator.gridSize = std::max(1, int(std::sqrt(double(n))) - 1);
+    gltf::GLTFAsset asset;
+    bench::generate_gltf_asset(generator, asset);
+    const gltf::Primitive &primitive = asset.meshes[0].primitives[0];
+    const int positions = gltf::find_attribute(primitive, gltf::SEMANTIC_POSITION);
+    const int64_t vertices = asset.accessors[positions].count;
+
+    std::vector<float> data;
+    std::vector<uint32_t> indices;
+    out.push_back(run_benchmark(settings, "decode_accessors", vertices, [&]() {
+        for (const auto &attribute : primitive.attributes) {
+            gltf::read_accessor(asset, attribute.index, data);
+        }
+        gltf::read_indices(asset, primitive.indices, indices);
+    }));
+}
+
+static void bench_transforms(const BenchSettings &settings, int64_t n,
+                             std::vector<BenchResult> &out)
+{
+    bench::GeneratorSettings generator;
+    generator.numNodes = int(n);
+    generator.numMeshes = 1;
+    gltf::GLTFAsset asset;
+    std::vector<glm::mat4> matrices;
+
+    bench::generate_gltf_asset(generator, asset);
+    out.push_back(run_benchmark(settings, "world_matrices_flat", n, [&]() {
+        gltf::compute_world_matrices(asset, matrices);
+    }));
+
+    // A single chain, as deep as the scene is large
+    generator.hierarchyDepth = int(n);
+    bench::generate_gltf_asset(generator, asset);
+    out.push_back(run_benchmark(settings, "world_matrices_deep", n, [&]() {
+        gltf::compute_world_matrices(asset, matrices);
+    }));
+}
+
+static void bench_culling(const BenchSettings &settings, int64_t n, std::vector<BenchResult> &out)
+{
+    bench::GeneratorSettings generator;
+    generator.numNodes = int(n);
+    generator.numMeshes = std::max(1, int(n / 100));
+    generator.numMaterials = std::max(1, int(n / 1000));
+    gltf::GLTFAsset asset;
+    bench::generate_gltf_asset(generator, asset);
+
+    std::vector<gltf::CullingMesh> meshes;
+    gltf::create_culling_meshes(meshes, asset);
+    gltf::OcclusionBuffer buffer;
+    gltf::init_occlusion_buffer(buffer, 256, 128);
+    std::vector<glm::mat4> matrices;
+    gltf::compute_world_matrices(asset, matrices);
+    const glm::mat4 viewProj = bench_view_projection(asset);
+    std::vector<char> visible;
+    gltf::CullingStats stats;
+
+    gltf::CullingSettings cullingSettings;
+    cullingSettings.occlusionCulling = false;
+    out.push_back(run_benchmark(settings, "cull_frustum", n, [&]() {
+        stats = gltf::CullingStats();
+        gltf::cull_nodes(asset, meshes, matrices, viewProj, cullingSettings, buffer, visible,
+                         stats);
+    }));
+
+    cullingSettings.occlusionCulling = true;
+    out.push_back(run_benchmark(settings, "cull_frustum_occlusion", n, [&]() {
+        stats = gltf::CullingStats();
+        gltf::cull_nodes(asset, meshes, matrices, viewProj, cullingSettings, buffer, visible,
+                         stats);
+    }));
+
+    // Draw lists of the nodes that survive culling
+    gltf::DrawList drawList;
+    out.push_back(run_benchmark(settings, "build_draw_list", n, [&]() {
+        gltf::build_draw_list(asset, visible, drawList);
+    }));
+}
+
+// Bins point lights scattered over a large scene into the clusters of a
+// camera that looks at it from above
+static void bench_lights(const BenchSettings &settings, int64_t n, std::vector<BenchResult> &out)
+{
+    const gltf::AABB bounds = {glm::vec3(-50.0f, -50.0f, 0.0f), glm::vec3(50.0f, 50.0f, 10.0f)};
+    const float range = 0.5f * glm::length(bounds.max - bounds.min) / std::cbrt(float(n));
+    std::vector<gltf::PunctualLight> lights;
+    gltf::generate_test_lights(bounds, int(n), range, lights);
+    const glm::mat4 view = glm::lookAt(glm::vec3(0.0f, -75.0f, 40.0f), glm::vec3(0.0f),
+                                       glm::vec3(0.0f, 0.0f, 1.0f));
+    const glm::mat4 projection = glm::perspective(glm::radians(65.0f), 16.0f / 9.0f, 0.1f, 200.0f);
+    gltf::ClusterSettings clusterSettings;
+    gltf::LightClusters clusters;
+
+    out.push_back(run_benchmark(settings, "bin_lights", n, [&]() {
+        gltf::bin_lights(clusters, lights, view, projection, clusterSettings);
+    }));
+    std::printf("%-24s %9lld elements %12d indices %6d max per cluster %9d dropped\n",
+                "bin_lights_stats", (long long)n, clusters.stats.indices,
+                clusters.stats.maxPerCluster, clusters.stats.dropped);
+}
+
+// Schedules the shadow atlas tiles of 64 spot lights above a scene of n nodes,
+// in which one node and every fourth light move every frame
+static void bench_shadows(const BenchSettings &settings, int64_t n, std::vector<BenchResult> &out)
+{
+    bench::GeneratorSettings generator;
+    generator.numNodes = int(n);
+    generator.numMeshes = std::max(1, int(n / 100));
+    generator.numMaterials = std::max(1, int(n / 1000));
+    gltf::GLTFAsset asset;
+    bench::generate_gltf_asset(generator, asset);
+    std::vector<gltf::CullingMesh> meshes;
+    gltf::create_culling_meshes(meshes, asset);
+    std::vector<glm::mat4> matrices;
+    gltf::compute_world_matrices(asset, matrices);
+    float extent = 1.0f;
+    for (const auto &matrix : matrices) {
+        extent = std::max(extent, std::max(std::abs(matrix[3][0]), std::abs(matrix[3][1])));
+    }
+    const glm::mat4 view = glm::lookAt(glm::vec3(0.0f, -1.5f * extent, 0.75f * extent),
+                                       glm::vec3(0.0f, -0.25f * extent, 0.0f),
+                                       glm::vec3(0.0f, 0.0f, 1.0f));
+    const glm::mat4 projection =
+        glm::perspective(glm::radians(65.0f), 16.0f / 9.0f, 0.1f, 4.0f * extent);
+
+    std::vector<gltf::ShadowLight> lights;
+    for (int i = 0; i < 64; ++i) {
+        gltf::PunctualLight light;
+        light.type = gltf::LIGHT_SPOT;
+        light.position = glm::vec3(extent * ((i % 8) / 3.5f - 1.0f),
+                                   extent * ((i / 8) / 3.5f - 1.0f), 0.25f * extent);
+        light.direction = glm::vec3(0.0f, 0.0f, -1.0f);
+        light.range = 0.5f * extent;
+        light.outerConeAngle = glm::radians(45.0f);
+        const gltf::ShadowLight shadowLight = {
+            uint64_t(i), gltf::spot_light_view_proj(light),
+            gltf::light_importance(light.position, light.range, view, projection)};
+        lights.push_back(shadowLight);
+    }
+    gltf::ShadowSettings shadowSettings;
+    gltf::ShadowAtlas atlas;
+    gltf::init_shadow_atlas(atlas, shadowSettings);
+    std::vector<gltf::ShadowUpdate> updates;
+    int frame = 0;
+
+    out.push_back(run_benchmark(settings, "schedule_shadows", n, [&]() {
+        frame += 1;
+        matrices[0][3][2] = 0.01f * frame;
+        for (size_t i = 0; i < lights.size(); i += 4) {
+            lights[i].viewProj[3][0] += 0.001f;
+        }
+        gltf::schedule_shadow_updates(atlas, lights, asset, meshes, matrices, shadowSettings,
+                                      updates);
+        for (const gltf::ShadowUpdate &update : updates) {
+            gltf::finish_shadow_update(atlas, update);
+        }
+    }));
+    std::printf("%-24s %9lld elements %6d tiles %6d rendered %6d forced %6d deferred "
+                "%12lld triangles\n",
+                "schedule_shadows_stats", (long long)n, atlas.stats.tiles, atlas.stats.rendered,
+                atlas.stats.forced, atlas.stats.deferred, (long long)atlas.stats.triangles);
+}
+
+// Plays the animation of a crowd of n skinned characters (17 channels and 16
+// joints each): sampling the channels with one thread and with all of them,
+// at the frame rate (where the key of the last frame is reused) and when
+// seeking (binary search), then posing the nodes and computing the joint
+// matrices
+static void bench_animation(const BenchSettings &settings, int64_t n,
+                            std::vector<BenchResult> &out)
+{
+    if (n > 100000) return;  // Millions of nodes and skins
+    bench::CrowdSettings crowd;
+    crowd.numCharacters = int(n);
+    gltf::GLTFAsset asset;
+    bench::generate_skinned_crowd(crowd, asset);
+
+    // The animation and skins survive a round trip through the file format
+    if (n == 1000) {
+        const std::string filename = "bench_crowd.gltf";
+        gltf::GLTFAsset loaded;
+        gltf::AnimationSet saved, reloaded;
+        gltf::build_animation_set(asset, saved);
+        if (gltf::save_gltf_asset(filename, settings.dataDir, asset) &&
+            gltf::load_gltf_asset(filename, settings.dataDir, loaded)) {
+            gltf::build_animation_set(loaded, reloaded);
+            const bool same = reloaded.skins.size() == saved.skins.size() &&
+                              reloaded.clips.size() == 1 &&
+                              reloaded.clips[0].channels.size() == saved.clips[0].channels.size();
+            std::printf("%-24s %s\n", "crowd_round_trip", same ? "ok" : "MISMATCH");
+            std::remove((settings.dataDir + loaded.buffers[0].uri).c_str());
+        }
+        std::remove((settings.dataDir + filename).c_str());
+    }
+
+    gltf::AnimationSet set;
+    out.push_back(run_benchmark(settings, "build_animation_set", n, [&]() {
+        gltf::build_animation_set(asset, set);
+    }));
+    const gltf::AnimationClip &clip = set.clips[0];
+    const int64_t channels = int64_t(clip.channels.size());
+    gltf::AnimationCursor cursor;
+    std::vector<glm::vec4> values;
+    float time = 0.0f;
+    out.push_back(run_benchmark(settings, "sample_animation_1t", channels, [&]() {
+        time = std::fmod(time + 1.0f / 60.0f, clip.duration);
+        gltf::sample_animation(clip, time, cursor, values, 1);
+    }));
+    out.push_back(run_benchmark(settings, "sample_animation", channels, [&]() {
+        time = std::fmod(time + 1.0f / 60.0f, clip.duration);
+        gltf::sample_animation(clip, time, cursor, values);
+    }));
+    out.push_back(run_benchmark(settings, "sample_animation_seek", channels, [&]() {
+        time = std::fmod(time + 0.37f, clip.duration);
+        gltf::sample_animation(clip, time, cursor, values);
+    }));
+
+    std::vector<glm::mat4> matrices, jointMatrices;
+    std::vector<int> offsets;
+    int64_t joints = 0;
+    for (const gltf::SkinJoints &skin : set.skins) joints += int64_t(skin.joints.size());
+    out.push_back(run_benchmark(settings, "pose_and_joint_matrices", joints, [&]() {
+        gltf::apply_animation(clip, values, asset.nodes);
+        gltf::compute_world_matrices(asset, matrices);
+        gltf::compute_joint_matrices(asset, set, matrices, jointMatrices, offsets);
+    }));
+    std::printf("%-24s %9lld elements %9lld channels %9lld joints %6d samplers\n",
+                "animation_stats", (long long)n, (long long)channels, (long long)joints,
+                int(clip.tracks.size()));
+}
+
+static bool write_results(const std::string &filename, const std::vector<BenchResult> &results)
+{
+    std::ofstream file(filename);
+    if (!file) return false;
+    file << "{\n  \"threads\": " << cg::num_worker_threads() << ",\n  \"results\": [";
+    char buffer[512];
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult &result = results[i];
+        std::snprintf(buffer, sizeof(buffer),
+                      "%s\n    {\"name\": \"%s\", \"elements\": %lld, \"iterations\": %d, "
+                      "\"min_ms\": %.4f, \"mean_ms\": %.4f, \"ns_per_element\": %.3f}",
+                      i ? "," : "", result.name.c_str(), (long long)result.elements,
+                      result.iterations, result.minMs, result.meanMs,
+                      1e6 * result.minMs / result.elements);
+        file << buffer;
+    }
+    file << "\n  ]\n}\n";
+    return bool(file);
+}
+
+int main(int argc, char *argv[])
+{
+    BenchSettings settings;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (std::strcmp(argv[i], "--out") == 0) {
+            settings.outFilename = argv[i + 1];
+        } else if (std::strcmp(argv[i], "--max") == 0) {
+            settings.maxElements = std::atoll(argv[i + 1]);
+        } else if (std::strcmp(argv[i], "--filter") == 0) {
+            settings.filter = argv[i + 1];
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--out results.json] [--max elements] [--filter name]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Generated files go to the cache directory of the viewer when it is
+    // known, and otherwise to the working directory
+    const std::string rootDir = cg::get_env_var("MODEL_VIEWER_ROOT");
+    settings.dataDir = rootDir.empty() ? "./" : rootDir + "/cache/";
+#ifdef _WIN32
+    _mkdir(settings.dataDir.c_str());
+#else
+    mkdir(settings.dataDir.c_str(), 0755);
+#endif
+
+    typedef void (*BenchFunction)(const BenchSettings &, int64_t, std::vector<BenchResult> &);
+    const struct {
+        const char *name;
+        BenchFunction func;
+    } benchmarks[] = {{"load", bench_load},
+                      {"accessors", bench_accessors},
+                      {"transforms", bench_transforms},
+                      {"culling", bench_culling},
+                      {"lights", bench_lights},
+                      {"shadows", bench_shadows},
+                      {"animation", bench_animation}};
+
+    std::vector<BenchResult> results;
+    for (const auto &benchmark : benchmarks) {
+        if (!settings.filter.empty() && settings.filter != benchmark.name) continue;
+        for (int64_t n = 1000; n <= settings.maxElements; n *= 10) {
+            benchmark.func(settings, n, results);
+        }
+    }
+
+    if (!write_results(settings.outFilename, results)) {
+        std::cerr << "Error: Could not write " << settings.outFilename << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "Wrote " << settings.outFilename << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,377 @@
+// Encoders for the block-compressed (BCn) texture formats.
+//
+
+#include "cg_bcn.h"
+#include "cg_parallel.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <cstring>
+
+namespace cg {
+
+// Interpolation weights of BC1 colors (in index order) and 4-bit BC7 indices
+static const float BC1_WEIGHTS[4] = {0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f};
+static const int BC7_WEIGHTS[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+bool is_block_format(int format)
+{
+    return block_size(format) != 0;
+}
+
+int srgb_block_format(int format)
+{
+    switch (format) {
+    case FORMAT_BC1:
+        return FORMAT_BC1_SRGB;
+    case FORMAT_BC1_ALPHA:
+        return FORMAT_BC1_ALPHA_SRGB;
+    case FORMAT_BC3:
+        return FORMAT_BC3_SRGB;
+    case FORMAT_BC7:
+        return FORMAT_BC7_SRGB;
+    default:
+        return format;
+    }
+}
+
+int block_size(int format)
+{
+    switch (format) {
+    case FORMAT_BC1:
+    case FORMAT_BC1_ALPHA:
+    case FORMAT_BC4:
+        return 8;
+    case FORMAT_BC3:
+    case FORMAT_BC5:
+    case FORMAT_BC7:
+        return 16;
+    default:
+        return 0;
+    }
+}
+
+size_t compressed_image_size(int format, int width, int height)
+{
+    return size_t((width + 3) / 4) * size_t((height + 3) / 4) * block_size(format);
+}
+
+// Fits a line through the pixels (the principal axis of their covariance) and
+// returns the extreme points of the pixels projected onto it
+static void principal_endpoints(const glm::vec4 *pixels, bool useAlpha, glm::vec4 &a, glm::vec4 &b)
+{
+    const glm::vec4 mask(1.0f, 1.0f, 1.0f, useAlpha ? 1.0f : 0.0f);
+    glm::vec4 mean(0.0f), lo(255.0f), hi(0.0f);
+    for (int i = 0; i < 16; ++i) {
+        mean += pixels[i];
+        lo = glm::min(lo, pixels[i]);
+        hi = glm::max(hi, pixels[i]);
+    }
+    mean /= 16.0f;
+
+    glm::mat4 covariance(0.0f);
+    for (int i = 0; i < 16; ++i) {
+        const glm::vec4 d = (pixels[i] - mean) * mask;
+        covariance += glm::outerProduct(d, d);
+    }
+
+    // Power iteration, starting from the diagonal of the bounding box
+    glm::vec4 axis = (hi - lo) * mask;
+    for (int i = 0; i < 8; ++i) {
+        const glm::vec4 next = covariance * axis;
+        const float length = glm::length(next);
+        if (length < 1e-6f) break;
+        axis = next / length;
+    }
+    if (glm::dot(axis, axis) > 0.0f) axis = glm::normalize(axis);
+
+    float tMin = 0.0f, tMax = 0.0f;
+    for (int i = 0; i < 16; ++i) {
+        const float t = glm::dot(pixels[i] - mean, axis);
+        tMin = std::min(tMin, t);
+        tMax = std::max(tMax, t);
+    }
+    a = glm::clamp(mean + axis * tMax, 0.0f, 255.0f);
+    b = glm::clamp(mean + axis * tMin, 0.0f, 255.0f);
+}
+
+// Finds the endpoints that minimize the squared error when each pixel is
+// approximated by mix(a, b, weights[i]). Returns false if the weights do not
+// determine both endpoints.
+static bool fit_endpoints(const glm::vec4 *pixels, const float *weights, glm::vec4 &a,
+                          glm::vec4 &b)
+{
+    float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+    glm::vec4 pa(0.0f), pb(0.0f);
+    for (int i = 0; i < 16; ++i) {
+        const float w = weights[i], u = 1.0f - w;
+        aa += u * u;
+        ab += u * w;
+        bb += w * w;
+        pa += u * pixels[i];
+        pb += w * pixels[i];
+    }
+    const float det = aa * bb - ab * ab;
+    if (std::abs(det) < 1e-6f) return false;
+    a = glm::clamp((pa * bb - pb * ab) / det, 0.0f, 255.0f);
+    b = glm::clamp((pb * aa - pa * ab) / det, 0.0f, 255.0f);
+    return true;
+}
+
+static uint16_t pack_565(const glm::vec4 &color)
+{
+    const int r = std::min(31, int(color.r * (31.0f / 255.0f) + 0.5f));
+    const int g = std::min(63, int(color.g * (63.0f / 255.0f) + 0.5f));
+    const int b = std::min(31, int(color.b * (31.0f / 255.0f) + 0.5f));
+    return uint16_t((r << 11) | (g << 5) | b);
+}
+
+static glm::vec3 unpack_565(uint16_t value)
+{
+    const int r = (value >> 11) & 31, g = (value >> 5) & 63, b = value & 31;
+    return glm::vec3((r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2));
+}
+
+// Chooses the closest BC1 color for each pixel and returns the squared error
+static float bc1_indices(const glm::vec4 *pixels, uint16_t c0, uint16_t c1, uint32_t &indices)
+{
+    glm::vec3 palette[4];
+    for (int k = 0; k < 4; ++k) {
+        palette[k] = glm::mix(unpack_565(c0), unpack_565(c1), BC1_WEIGHTS[k]);
+    }
+    // Equal endpoints select the three-color mode, where only index 0 is safe
+    const int numColors = c0 == c1 ? 1 : 4;
+
+    float error = 0.0f;
+    indices = 0;
+    for (int i = 0; i < 16; ++i) {
+        int best = 0;
+        float bestDist = FLT_MAX;
+        for (int k = 0; k < numColors; ++k) {
+            const glm::vec3 d = glm::vec3(pixels[i]) - palette[k];
+            const float dist = glm::dot(d, d);
+            if (dist < bestDist) best = k, bestDist = dist;
+        }
+        indices |= uint32_t(best) << (2 * i);
+        error += bestDist;
+    }
+    return error;
+}
+
+static void encode_bc1_block(const glm::vec4 *pixels, uint8_t *output)
+{
+    glm::vec4 a, b;
+    principal_endpoints(pixels, false, a, b);
+
+    uint16_t bestC0 = 0, bestC1 = 0;
+    uint32_t bestIndices = 0;
+    float bestError = FLT_MAX;
+    for (int iter = 0; iter < 3; ++iter) {
+        uint16_t c0 = pack_565(a), c1 = pack_565(b);
+        if (c0 < c1) std::swap(c0, c1);  // Four-color mode needs c0 > c1
+        uint32_t indices;
+        const float error = bc1_indices(pixels, c0, c1, indices);
+        if (error < bestError) {
+            bestC0 = c0, bestC1 = c1, bestIndices = indices, bestError = error;
+        }
+        if (error == 0.0f || c0 == c1) break;
+
+        // Refine the endpoints for the chosen indices
+        float weights[16];
+        for (int i = 0; i < 16; ++i) weights[i] = BC1_WEIGHTS[(indices >> (2 * i)) & 3];
+        if (!fit_endpoints(pixels, weights, a, b)) break;
+    }
+
+    output[0] = bestC0 & 0xff, output[1] = bestC0 >> 8;
+    output[2] = bestC1 & 0xff, output[3] = bestC1 >> 8;
+    for (int k = 0; k < 4; ++k) output[4 + k] = (bestIndices >> (8 * k)) & 0xff;
+}
+
+// Encodes one channel in the eight-value mode of BC4 (also used for the alpha
+// of BC3 and for both channels of BC5)
+static void encode_bc4_block(const glm::vec4 *pixels, int channel, uint8_t *output)
+{
+    int values[16], lo = 255, hi = 0;
+    for (int i = 0; i < 16; ++i) {
+        values[i] = int(pixels[i][channel] + 0.5f);
+        lo = std::min(lo, values[i]);
+        hi = std::max(hi, values[i]);
+    }
+
+    // The palette is equally spaced from hi (index 0) to lo (index 1), with
+    // indices 2-7 in between, so the nearest entry can be found by rounding
+    uint64_t bits = 0;
+    if (hi > lo) {
+        for (int i = 0; i < 16; ++i) {
+            const int p = ((values[i] - lo) * 14 + (hi - lo)) / (2 * (hi - lo));
+            const int index = p == 7 ? 0 : (p == 0 ? 1 : 8 - p);
+            bits |= uint64_t(index) << (3 * i);
+        }
+    }
+
+    output[0] = uint8_t(hi), output[1] = uint8_t(lo);
+    for (int k = 0; k < 6; ++k) output[2 + k] = (bits >> (8 * k)) & 0xff;
+}
+
+// Quantizes an endpoint to the 7 bits per channel and shared p-bit of mode 6
+static void quantize_bc7_endpoint(const glm::vec4 &endpoint, int quantized[4], int &pbit)
+{
+    float bestError = FLT_MAX;
+    for (int p = 0; p < 2; ++p) {
+        int q[4];
+        float error = 0.0f;
+        for (int c = 0; c < 4; ++c) {
+            q[c] = glm::clamp(int((endpoint[c] - p) * 0.5f + 0.5f), 0, 127);
+            const float d = float(2 * q[c] + p) - endpoint[c];
+            error += d * d;
+        }
+        if (error < bestError) {
+            std::memcpy(quantized, q, sizeof(q));
+            pbit = p, bestError = error;
+        }
+    }
+}
+
+// Chooses the closest interpolated color for each pixel (in mode 6) and
+// returns the squared error
+static float bc7_indices(const glm::vec4 *pixels, const int q0[4], int p0, const int q1[4], int p1,
+                         int indices[16])
+{
+    glm::vec4 palette[16];
+    for (int k = 0; k < 16; ++k) {
+        for (int c = 0; c < 4; ++c) {
+            const int e0 = 2 * q0[c] + p0, e1 = 2 * q1[c] + p1;
+            palette[k][c] = float(((64 - BC7_WEIGHTS[k]) * e0 + BC7_WEIGHTS[k] * e1 + 32) >> 6);
+        }
+    }
+
+    float error = 0.0f;
+    for (int i = 0; i < 16; ++i) {
+        int best = 0;
+        float bestDist = FLT_MAX;
+        for (int k = 0; k < 16; ++k) {
+            const glm::vec4 d = pixels[i] - palette[k];
+            const float dist = glm::dot(d, d);
+            if (dist < bestDist) best = k, bestDist = dist;
+        }
+        indices[i] = best;
+        error += bestDist;
+    }
+    return error;
+}
+
+struct BitWriter {
+    uint8_t *data;
+    int position;
+
+    void write(uint32_t value, int numBits)
+    {
+        for (int i = 0; i < numBits; ++i, ++position) {
+            if ((value >> i) & 1) data[position >> 3] |= uint8_t(1 << (position & 7));
+        }
+    }
+};
+
+// Encodes a block in BC7 mode 6 (one subset, RGBA endpoints and 4-bit
+// indices), which suits the smooth color and alpha of most textures
+static void encode_bc7_block(const glm::vec4 *pixels, uint8_t *output)
+{
+    glm::vec4 a, b;
+    principal_endpoints(pixels, true, a, b);
+
+    int bestQ0[4] = {0}, bestQ1[4] = {0}, bestP0 = 0, bestP1 = 0, bestIndices[16] = {0};
+    float bestError = FLT_MAX;
+    for (int iter = 0; iter < 3; ++iter) {
+        int q0[4], q1[4], p0, p1, indices[16];
+        quantize_bc7_endpoint(a, q0, p0);
+        quantize_bc7_endpoint(b, q1, p1);
+        const float error = bc7_indices(pixels, q0, p0, q1, p1, indices);
+        if (error < bestError) {
+            std::memcpy(bestQ0, q0, sizeof(q0));
+            std::memcpy(bestQ1, q1, sizeof(q1));
+            std::memcpy(bestIndices, indices, sizeof(indices));
+            bestP0 = p0, bestP1 = p1, bestError = error;
+        }
+        if (error == 0.0f) break;
+
+        // Refine the endpoints for the chosen indices
+        float weights[16];
+        for (int i = 0; i < 16; ++i) weights[i] = BC7_WEIGHTS[indices[i]] / 64.0f;
+        if (!fit_endpoints(pixels, weights, a, b)) break;
+    }
+
+    // The most significant bit of the first index is implicitly zero, so swap
+    // the endpoints if necessary
+    if (bestIndices[0] & 8) {
+        for (int c = 0; c < 4; ++c) std::swap(bestQ0[c], bestQ1[c]);
+        std::swap(bestP0, bestP1);
+        for (int i = 0; i < 16; ++i) bestIndices[i] = 15 - bestIndices[i];
+    }
+
+    std::memset(output, 0, 16);
+    BitWriter writer = {output, 0};
+    writer.write(1 << 6, 7);  // Mode 6
+    for (int c = 0; c < 4; ++c) {
+        writer.write(bestQ0[c], 7);
+        writer.write(bestQ1[c], 7);
+    }
+    writer.write(bestP0, 1);
+    writer.write(bestP1, 1);
+    writer.write(bestIndices[0], 3);
+    for (int i = 1; i < 16; ++i) writer.write(bestIndices[i], 4);
+}
+
+// Reads a 4x4 block of pixels, clamping coordinates to the image
+static void load_block(const uint8_t *rgba, int width, int height, int blockX, int blockY,
+                       glm::vec4 *pixels)
+{
+    for (int y = 0; y < 4; ++y) {
+        const int sy = std::min(blockY * 4 + y, height - 1);
+        for (int x = 0; x < 4; ++x) {
+            const int sx = std::min(blockX * 4 + x, width - 1);
+            const uint8_t *texel = &rgba[(size_t(sy) * width + sx) * 4];
+            pixels[y * 4 + x] = glm::vec4(texel[0], texel[1], texel[2], texel[3]);
+        }
+    }
+}
+
+void compress_image(int format, const uint8_t *rgba, int width, int height,
+                    std::vector<char> &output)
+{
+    assert(is_block_format(format) && format != FORMAT_BC1_ALPHA);
+    const int blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+    const int blockBytes = block_size(format);
+    output.resize(compressed_image_size(format, width, height));
+
+    parallel_for(blocksY, [&](int blockY) {
+        for (int blockX = 0; blockX < blocksX; ++blockX) {
+            glm::vec4 pixels[16];
+            load_block(rgba, width, height, blockX, blockY, pixels);
+            uint8_t *block = (uint8_t *)&output[(size_t(blockY) * blocksX + blockX) * blockBytes];
+            switch (format) {
+            case FORMAT_BC1:
+                encode_bc1_block(pixels, block);
+                break;
+            case FORMAT_BC3:
+                encode_bc4_block(pixels, 3, block);
+                encode_bc1_block(pixels, block + 8);
+                break;
+            case FORMAT_BC4:
+                encode_bc4_block(pixels, 0, block);
+                break;
+            case FORMAT_BC5:
+                encode_bc4_block(pixels, 0, block);
+                encode_bc4_block(pixels, 1, block + 8);
+                break;
+            case FORMAT_BC7:
+                encode_bc7_block(pixels, block);
+                break;
+            }
+        }
+    });
+}
+
+}  // namespace cg
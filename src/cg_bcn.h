@@ -0,0 +1,47 @@
+// Encoders for the block-compressed (BCn) texture formats.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace cg {
+
+// OpenGL internal formats of the block-compressed formats. RGTC (BC4/BC5) is
+// core in OpenGL 3.0, S3TC (BC1/BC3) needs EXT_texture_compression_s3tc, and
+// BPTC (BC7) needs OpenGL 4.2 or ARB_texture_compression_bptc.
+const int FORMAT_BC1 = 0x83f0;       // GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+const int FORMAT_BC1_ALPHA = 0x83f1; // GL_COMPRESSED_RGBA_S3TC_DXT1_EXT (decode only)
+const int FORMAT_BC3 = 0x83f3;       // GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+const int FORMAT_BC4 = 0x8dbb;       // GL_COMPRESSED_RED_RGTC1
+const int FORMAT_BC5 = 0x8dbd;       // GL_COMPRESSED_RG_RGTC2
+const int FORMAT_BC7 = 0x8e8c;       // GL_COMPRESSED_RGBA_BPTC_UNORM
+
+// sRGB variants, for uploading color that the GL should decode to linear
+const int FORMAT_BC1_SRGB = 0x8c4c;        // GL_COMPRESSED_SRGB_S3TC_DXT1_EXT
+const int FORMAT_BC1_ALPHA_SRGB = 0x8c4d;  // GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT
+const int FORMAT_BC3_SRGB = 0x8c4f;        // GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT
+const int FORMAT_BC7_SRGB = 0x8e8d;        // GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM
+
+// Returns true if the format is one of the formats above (not the sRGB ones)
+bool is_block_format(int format);
+
+// Returns the sRGB variant of a format, or the format itself if it has none
+// (BC4 and BC5 hold data, not color)
+int srgb_block_format(int format);
+
+// Returns the size in bytes of one 4x4 block, or 0 for other formats
+int block_size(int format);
+
+// Returns the size in bytes of a compressed image (partial blocks are padded)
+size_t compressed_image_size(int format, int width, int height);
+
+// Compresses an RGBA8 image to BC1, BC3, BC4 (red), BC5 (red and green) or
+// BC7. Blocks on the right and bottom edges are padded by repeating the last
+// column and row. Rows of blocks are encoded in parallel.
+void compress_image(int format, const uint8_t *rgba, int width, int height,
+                    std::vector<char> &output);
+
+}  // namespace cg
@@ -0,0 +1,127 @@
+// Watches files for changes, for hot reloading of assets and shaders. Uses
+// inotify on Linux, and compares modification times on other platforms.
+//
+
+#include "cg_filewatch.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace cg {
+
+// Splits a path into its directory (without a trailing separator) and name,
+// and returns them joined again, so that the same file always gets the same key
+static std::string normalized_path(const std::string &filename, std::string &dirname)
+{
+    const size_t slash = filename.find_last_of("/\\");
+    dirname = slash == std::string::npos ? "." : filename.substr(0, slash);
+    while (dirname.size() > 1 && (dirname.back() == '/' || dirname.back() == '\\')) {
+        dirname.pop_back();
+    }
+    const std::string name = slash == std::string::npos ? filename : filename.substr(slash + 1);
+    return dirname + "/" + name;
+}
+
+static long long modification_time(const std::string &filename)
+{
+    struct stat info;
+    if (stat(filename.c_str(), &info) != 0) return 0;
+    return (long long)info.st_mtime;
+}
+
+void init_file_watcher(FileWatcher &watcher)
+{
+#ifdef __linux__
+    watcher.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+    watcher.lastScan = std::chrono::steady_clock::now();
+}
+
+void destroy_file_watcher(FileWatcher &watcher)
+{
+    unwatch_files(watcher);
+#ifdef __linux__
+    if (watcher.fd >= 0) close(watcher.fd);
+#endif
+    watcher.fd = -1;
+}
+
+void watch_file(FileWatcher &watcher, const std::string &filename)
+{
+    std::string dirname;
+    const std::string path = normalized_path(filename, dirname);
+    if (watcher.files.count(path)) return;
+    watcher.files[path] = modification_time(path);
+
+#ifdef __linux__
+    if (watcher.fd < 0) return;
+    for (const auto &it : watcher.directories) {
+        if (it.second == dirname) return;
+    }
+    const int wd =
+        inotify_add_watch(watcher.fd, dirname.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY);
+    if (wd >= 0) watcher.directories[wd] = dirname;
+#endif
+}
+
+void unwatch_files(FileWatcher &watcher)
+{
+#ifdef __linux__
+    for (const auto &it : watcher.directories) inotify_rm_watch(watcher.fd, it.first);
+#endif
+    watcher.directories.clear();
+    watcher.files.clear();
+    watcher.pending.clear();
+}
+
+std::vector<std::string> poll_file_changes(FileWatcher &watcher)
+{
+    const auto now = std::chrono::steady_clock::now();
+#ifdef __linux__
+    if (watcher.fd >= 0) {
+        // Events of files in watched directories that are not watched
+        // themselves are skipped
+        alignas(inotify_event) char buffer[4096];
+        ssize_t length;
+        while ((length = read(watcher.fd, buffer, sizeof(buffer))) > 0) {
+            for (ssize_t offset = 0; offset < length;) {
+                const inotify_event *event = (const inotify_event *)(buffer + offset);
+                offset += sizeof(inotify_event) + event->len;
+                auto dir = watcher.directories.find(event->wd);
+                if (dir == watcher.directories.end() || !event->len) continue;
+                const std::string path = dir->second + "/" + event->name;
+                if (watcher.files.count(path)) watcher.pending[path] = now;
+            }
+        }
+    }
+#endif
+    // Without inotify, the modification times are compared a few times per second
+    if (watcher.fd < 0 && now - watcher.lastScan > std::chrono::milliseconds(250)) {
+        watcher.lastScan = now;
+        for (auto &it : watcher.files) {
+            const long long time = modification_time(it.first);
+            if (time != it.second) {
+                it.second = time;
+                watcher.pending[it.first] = now;
+            }
+        }
+    }
+
+    std::vector<std::string> changed;
+    for (auto it = watcher.pending.begin(); it != watcher.pending.end();) {
+        if (now - it->second < std::chrono::milliseconds(watcher.settleMs)) {
+            ++it;
+            continue;
+        }
+        changed.push_back(it->first);
+        it = watcher.pending.erase(it);
+    }
+    return changed;
+}
+
+}  // namespace cg
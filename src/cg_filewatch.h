@@ -0,0 +1,42 @@
+// Watches files for changes, for hot reloading of assets and shaders. Uses
+// inotify on Linux, and compares modification times on other platforms.
+//
+// Directories are watched rather than files, since many editors save by
+// writing a new file and renaming it over the old one.
+//
+
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace cg {
+
+struct FileWatcher {
+    int fd = -1;                              // inotify instance (Linux)
+    std::map<int, std::string> directories;   // Directory of each inotify watch
+    std::map<std::string, long long> files;   // Watched path -> modification time
+    // Paths with unreported changes, and when they last changed. Saves often
+    // touch a file several times, so changes are reported once they settle.
+    std::map<std::string, std::chrono::steady_clock::time_point> pending;
+    std::chrono::steady_clock::time_point lastScan;
+    int settleMs = 100;
+};
+
+void init_file_watcher(FileWatcher &watcher);
+
+void destroy_file_watcher(FileWatcher &watcher);
+
+// Starts watching a file (it does not have to exist yet)
+void watch_file(FileWatcher &watcher, const std::string &filename);
+
+// Stops watching all files
+void unwatch_files(FileWatcher &watcher);
+
+// Returns the watched files that have changed since the last call and have
+// not changed again for settleMs. Never blocks.
+std::vector<std::string> poll_file_changes(FileWatcher &watcher);
+
+}  // namespace cg
@@ -0,0 +1,176 @@
+// Per-stage timing of asset loading (file I/O, parsing, decoding, mipmaps,
+// uploads, ...), for a startup report and trace.
+//
+
+#include "cg_loadstats.h"
+
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+
+namespace cg {
+
+static std::atomic<LoadReport *> activeReport(nullptr);
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::milli>(elapsed).count();
+}
+
+const char *load_stage_name(LoadStage stage)
+{
+    const char *names[] = {"shader_compile",      "file_io",        "json_parse",
+                           "image_decode",        "mip_generation", "prefilter",
+                           "texture_compression", "mesh_processing", "gl_upload"};
+    static_assert(sizeof(names) / sizeof(names[0]) == NUM_LOAD_STAGES, "Missing stage name");
+    return stage < NUM_LOAD_STAGES ? names[stage] : "unknown";
+}
+
+void begin_load_report(LoadReport &report, Profiler *profiler)
+{
+    report.profiler = profiler;
+    report.start = std::chrono::steady_clock::now();
+    activeReport.store(&report);
+}
+
+void end_load_report(LoadReport &report)
+{
+    report.totalMs = elapsed_ms(report.start);
+    LoadReport *expected = &report;
+    activeReport.compare_exchange_strong(expected, nullptr);
+}
+
+void count_cache_lookup(bool hit)
+{
+    LoadReport *report = activeReport.load();
+    if (!report) return;
+    if (hit) {
+        report->cacheHits += 1;
+    } else {
+        report->cacheMisses += 1;
+    }
+}
+
+const char *load_report_start_type(const LoadReport &report)
+{
+    return report.cacheMisses == 0 ? "warm" : "cold";
+}
+
+static double stage_ms(const LoadReport &report, int stage)
+{
+    return report.stages[stage].nanoseconds * 1e-6;
+}
+
+// Returns the throughput of a stage in MiB/s (0 if it processed no bytes)
+static double stage_mib_per_second(const LoadReport &report, int stage)
+{
+    const double ms = stage_ms(report, stage);
+    return ms > 0.0 ? report.stages[stage].bytes / 1048576.0 / (ms * 1e-3) : 0.0;
+}
+
+void print_load_report(const LoadReport &report, const std::string &label)
+{
+    std::printf("Startup report for %s (%s start, %d cache hit(s), %d miss(es))\n",
+                label.c_str(), load_report_start_type(report), report.cacheHits.load(),
+                report.cacheMisses.load());
+    std::printf("  %-20s %10s %7s %6s %12s %10s\n", "stage", "ms", "share", "calls", "KiB",
+                "MiB/s");
+    double sumMs = 0.0;
+    for (int i = 0; i < NUM_LOAD_STAGES; ++i) {
+        const LoadStageTotals &stage = report.stages[i];
+        if (!stage.calls) continue;
+        const double ms = stage_ms(report, i);
+        sumMs += ms;
+        std::printf("  %-20s %10.2f %6.1f%% %6llu %12.1f %10.1f\n",
+                    load_stage_name(LoadStage(i)), ms, 100.0 * ms / report.totalMs,
+                    (unsigned long long)stage.calls.load(), stage.bytes / 1024.0,
+                    stage_mib_per_second(report, i));
+    }
+    std::printf("  %-20s %10.2f %6.1f%%\n", "other", report.totalMs - sumMs,
+                100.0 * (report.totalMs - sumMs) / report.totalMs);
+    std::printf("  %-20s %10.2f\n", "total", report.totalMs);
+    std::fflush(stdout);
+}
+
+static std::string escape_json(const std::string &text)
+{
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+bool write_load_report_json(const LoadReport &report, const std::string &label,
+                            const std::string &filename)
+{
+    std::ofstream file(filename);
+    if (!file) return false;
+    char buffer[512];
+    std::snprintf(buffer, sizeof(buffer),
+                  "{\n  \"label\": \"%s\",\n  \"timestamp\": %lld,\n  \"start\": \"%s\",\n"
+                  "  \"cache_hits\": %d,\n  \"cache_misses\": %d,\n  \"total_ms\": %.3f,\n"
+                  "  \"stages\": [",
+                  escape_json(label).c_str(), (long long)std::time(nullptr),
+                  load_report_start_type(report), report.cacheHits.load(),
+                  report.cacheMisses.load(), report.totalMs);
+    file << buffer;
+    bool first = true;
+    for (int i = 0; i < NUM_LOAD_STAGES; ++i) {
+        const LoadStageTotals &stage = report.stages[i];
+        std::snprintf(buffer, sizeof(buffer),
+                      "%s\n    {\"name\": \"%s\", \"ms\": %.3f, \"calls\": %llu, "
+                      "\"bytes\": %llu, \"mib_per_s\": %.2f}",
+                      first ? "" : ",", load_stage_name(LoadStage(i)), stage_ms(report, i),
+                      (unsigned long long)stage.calls.load(),
+                      (unsigned long long)stage.bytes.load(), stage_mib_per_second(report, i));
+        file << buffer;
+        first = false;
+    }
+    file << "\n  ]\n}\n";
+    return bool(file);
+}
+
+bool append_load_history(const LoadReport &report, const std::string &label,
+                         const std::string &filename)
+{
+    const bool exists = bool(std::ifstream(filename));
+    std::ofstream file(filename, std::ios::app);
+    if (!file) return false;
+    if (!exists) {
+        file << "timestamp,label,start,total_ms";
+        for (int i = 0; i < NUM_LOAD_STAGES; ++i) {
+            file << "," << load_stage_name(LoadStage(i)) << "_ms";
+        }
+        file << "\n";
+    }
+    file << (long long)std::time(nullptr) << "," << label << ","
+         << load_report_start_type(report) << "," << report.totalMs;
+    for (int i = 0; i < NUM_LOAD_STAGES; ++i) file << "," << stage_ms(report, i);
+    file << "\n";
+    return bool(file);
+}
+
+LoadScope::LoadScope(LoadStage stage, const char *name, uint64_t bytes)
+    : report(activeReport.load()),
+      stage(stage),
+      bytes(bytes),
+      start(std::chrono::steady_clock::now()),
+      profileScope(report ? report->profiler : nullptr, name)
+{
+}
+
+LoadScope::~LoadScope()
+{
+    if (!report) return;
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    LoadStageTotals &totals = report->stages[stage];
+    totals.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    totals.bytes += bytes;
+    totals.calls += 1;
+}
+
+}  // namespace cg
@@ -0,0 +1,90 @@
+// Per-stage timing of asset loading (file I/O, parsing, decoding, mipmaps,
+// uploads, ...), for a startup report and trace.
+//
+// Loaders open a LoadScope around each stage. While a report is active, the
+// scope adds its time and bytes to the report and records a profiler event.
+// Otherwise it does nothing, so loading outside startup is not affected.
+//
+
+#pragma once
+
+#include "cg_profiler.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace cg {
+
+enum LoadStage {
+    LOAD_SHADER_COMPILE = 0,
+    LOAD_FILE_IO,
+    LOAD_JSON_PARSE,
+    LOAD_IMAGE_DECODE,
+    LOAD_MIP_GENERATION,
+    LOAD_PREFILTER,
+    LOAD_TEXTURE_COMPRESSION,
+    LOAD_MESH_PROCESSING,
+    LOAD_GL_UPLOAD,
+    NUM_LOAD_STAGES
+};
+
+struct LoadStageTotals {
+    std::atomic<uint64_t> nanoseconds{0};
+    std::atomic<uint64_t> bytes{0};  // Read, decoded, generated or uploaded
+    std::atomic<uint64_t> calls{0};
+};
+
+struct LoadReport {
+    Profiler *profiler = nullptr;  // Receives one event per scope (can be null)
+    std::chrono::steady_clock::time_point start;
+    double totalMs = 0.0;
+    LoadStageTotals stages[NUM_LOAD_STAGES];
+    // Lookups in the caches of derived data (compressed textures, prefiltered
+    // cubemaps). A start where every lookup hits is reported as warm.
+    std::atomic<int> cacheHits{0};
+    std::atomic<int> cacheMisses{0};
+};
+
+const char *load_stage_name(LoadStage stage);
+
+// Makes the report the one that scopes add to (on all threads), until
+// end_load_report() is called
+void begin_load_report(LoadReport &report, Profiler *profiler);
+
+void end_load_report(LoadReport &report);
+
+// Counts a cache lookup in the active report
+void count_cache_lookup(bool hit);
+
+// Returns "warm" if all cache lookups hit, and "cold" otherwise
+const char *load_report_start_type(const LoadReport &report);
+
+// Prints a table of the stages, with their share of the total time
+void print_load_report(const LoadReport &report, const std::string &label);
+
+// Writes the report as JSON (label is typically the glTF filename)
+bool write_load_report_json(const LoadReport &report, const std::string &label,
+                            const std::string &filename);
+
+// Appends one CSV row per start (with a timestamp) so that cold and warm start
+// times can be compared over time. Writes a header if the file is new.
+bool append_load_history(const LoadReport &report, const std::string &label,
+                         const std::string &filename);
+
+// Times the enclosing block as one stage. Stages should not nest, since the
+// time of both would be counted. Scopes on worker threads count thread time,
+// so the stages can add up to more than the total.
+struct LoadScope {
+    LoadReport *report;
+    LoadStage stage;
+    uint64_t bytes;
+    std::chrono::steady_clock::time_point start;
+    ProfileScope profileScope;
+
+    LoadScope(LoadStage stage, const char *name, uint64_t bytes = 0);
+    ~LoadScope();
+};
+
+}  // namespace cg
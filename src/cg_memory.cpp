@@ -0,0 +1,241 @@
+// Accounting of the memory held by a loaded scene: CPU copies of buffers and
+// images, and the GL objects created from them, broken down by category.
+//
+
+#include "cg_memory.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace cg {
+
+struct GpuObject {
+    MemoryCategory category;
+    GpuObjectType type;
+    unsigned name;
+    size_t bytes;
+    std::string label;
+};
+
+struct MemoryRegistry {
+    std::mutex mutex;
+    std::unordered_map<uint64_t, GpuObject> gpuObjects;  // Keyed by type and name
+    std::map<std::pair<int, const void *>, size_t> cpuOwners;
+    MemoryUsage usage;
+    int lastWarning = 0;  // Kind of warning of the last check (0 if none)
+};
+
+// Shared by all threads (and never destroyed, so that objects deleted during
+// shutdown can still be untracked)
+static MemoryRegistry &registry()
+{
+    static MemoryRegistry *instance = new MemoryRegistry();
+    return *instance;
+}
+
+static uint64_t object_key(GpuObjectType type, unsigned name)
+{
+    return (uint64_t(type) << 32) | name;
+}
+
+const char *memory_category_name(MemoryCategory category)
+{
+    const char *names[] = {"buffers", "textures", "cubemaps", "shadow_maps", "framebuffers"};
+    static_assert(sizeof(names) / sizeof(names[0]) == NUM_MEMORY_CATEGORIES,
+                  "Missing category name");
+    return category < NUM_MEMORY_CATEGORIES ? names[category] : "unknown";
+}
+
+void track_cpu_memory(MemoryCategory category, const void *owner, size_t bytes)
+{
+    MemoryRegistry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    size_t &tracked = r.cpuOwners[std::make_pair(int(category), owner)];
+    r.usage.categories[category].cpuBytes += bytes - tracked;
+    r.usage.cpuBytes += bytes - tracked;
+    r.usage.peakCpuBytes = std::max(r.usage.peakCpuBytes, r.usage.cpuBytes);
+    tracked = bytes;
+    if (!bytes) r.cpuOwners.erase(std::make_pair(int(category), owner));
+}
+
+// Removes an object from the totals (the registry must be locked)
+static void remove_object(MemoryRegistry &r, const GpuObject &object)
+{
+    MemoryCategoryUsage &usage = r.usage.categories[object.category];
+    usage.gpuBytes -= object.bytes;
+    usage.gpuObjects -= 1;
+    r.usage.gpuBytes -= object.bytes;
+}
+
+void track_gpu_object(MemoryCategory category, GpuObjectType type, unsigned name, size_t bytes,
+                      const std::string &label)
+{
+    if (!name) return;
+    MemoryRegistry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    auto it = r.gpuObjects.find(object_key(type, name));
+    if (it != r.gpuObjects.end()) {
+        remove_object(r, it->second);
+    } else {
+        it = r.gpuObjects.insert(std::make_pair(object_key(type, name), GpuObject())).first;
+    }
+    GpuObject &object = it->second;
+    object.category = category;
+    object.type = type;
+    object.name = name;
+    object.bytes = bytes;
+    object.label = label;
+
+    MemoryCategoryUsage &usage = r.usage.categories[category];
+    usage.gpuBytes += bytes;
+    usage.gpuObjects += 1;
+    r.usage.gpuBytes += bytes;
+    r.usage.peakGpuBytes = std::max(r.usage.peakGpuBytes, r.usage.gpuBytes);
+}
+
+void untrack_gpu_object(GpuObjectType type, unsigned name)
+{
+    MemoryRegistry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    auto it = r.gpuObjects.find(object_key(type, name));
+    if (it == r.gpuObjects.end()) return;
+    remove_object(r, it->second);
+    r.gpuObjects.erase(it);
+}
+
+size_t gpu_object_bytes(GpuObjectType type, unsigned name)
+{
+    MemoryRegistry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    auto it = r.gpuObjects.find(object_key(type, name));
+    return it != r.gpuObjects.end() ? it->second.bytes : 0;
+}
+
+MemoryUsage memory_usage()
+{
+    MemoryRegistry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    return r.usage;
+}
+
+static double mib(size_t bytes)
+{
+    return bytes / 1048576.0;
+}
+
+std::string check_memory_budget(const MemoryBudget &budget, size_t availableGpuBytes)
+{
+    const MemoryUsage usage = memory_usage();
+    char buffer[256] = "";
+    int kind = 0;
+    if (budget.gpuBytes && usage.gpuBytes > budget.warningFraction * budget.gpuBytes) {
+        std::snprintf(buffer, sizeof(buffer), "GPU memory at %.0f of %.0f MiB",
+                      mib(usage.gpuBytes), mib(budget.gpuBytes));
+        kind = 1;
+    } else if (budget.cpuBytes && usage.cpuBytes > budget.warningFraction * budget.cpuBytes) {
+        std::snprintf(buffer, sizeof(buffer), "CPU memory at %.0f of %.0f MiB",
+                      mib(usage.cpuBytes), mib(budget.cpuBytes));
+        kind = 2;
+    } else if (availableGpuBytes && availableGpuBytes < budget.minAvailableGpuBytes) {
+        std::snprintf(buffer, sizeof(buffer), "Only %.0f MiB of video memory left",
+                      mib(availableGpuBytes));
+        kind = 3;
+    }
+
+    // Only print when the kind of warning changes, not on every check
+    MemoryRegistry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    if (kind && kind != r.lastWarning) std::cerr << "Warning: " << buffer << std::endl;
+    r.lastWarning = kind;
+    return buffer;
+}
+
+void print_memory_report()
+{
+    const MemoryUsage usage = memory_usage();
+    std::printf("Memory report\n");
+    std::printf("  %-14s %12s %12s %8s\n", "category", "CPU KiB", "GPU KiB", "objects");
+    for (int i = 0; i < NUM_MEMORY_CATEGORIES; ++i) {
+        const MemoryCategoryUsage &category = usage.categories[i];
+        std::printf("  %-14s %12.1f %12.1f %8d\n", memory_category_name(MemoryCategory(i)),
+                    category.cpuBytes / 1024.0, category.gpuBytes / 1024.0,
+                    category.gpuObjects);
+    }
+    std::printf("  %-14s %12.1f %12.1f\n", "total", usage.cpuBytes / 1024.0,
+                usage.gpuBytes / 1024.0);
+    std::printf("  %-14s %12.1f %12.1f\n", "peak", usage.peakCpuBytes / 1024.0,
+                usage.peakGpuBytes / 1024.0);
+    std::fflush(stdout);
+}
+
+static std::string escape_json(const std::string &text)
+{
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+bool write_memory_report_json(const std::string &filename)
+{
+    MemoryUsage usage;
+    std::vector<GpuObject> objects;
+    {
+        MemoryRegistry &r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        usage = r.usage;
+        objects.reserve(r.gpuObjects.size());
+        for (const auto &it : r.gpuObjects) objects.push_back(it.second);
+    }
+    std::sort(objects.begin(), objects.end(), [](const GpuObject &a, const GpuObject &b) {
+        return a.bytes > b.bytes || (a.bytes == b.bytes && a.name < b.name);
+    });
+
+    std::ofstream file(filename);
+    if (!file) return false;
+    const char *types[] = {"buffer", "texture", "framebuffer", "renderbuffer"};
+    char buffer[512];
+    std::snprintf(buffer, sizeof(buffer),
+                  "{\n  \"timestamp\": %lld,\n  \"cpu_bytes\": %llu,\n  \"gpu_bytes\": %llu,\n"
+                  "  \"peak_cpu_bytes\": %llu,\n  \"peak_gpu_bytes\": %llu,\n  \"categories\": [",
+                  (long long)std::time(nullptr), (unsigned long long)usage.cpuBytes,
+                  (unsigned long long)usage.gpuBytes, (unsigned long long)usage.peakCpuBytes,
+                  (unsigned long long)usage.peakGpuBytes);
+    file << buffer;
+    for (int i = 0; i < NUM_MEMORY_CATEGORIES; ++i) {
+        const MemoryCategoryUsage &category = usage.categories[i];
+        std::snprintf(buffer, sizeof(buffer),
+                      "%s\n    {\"name\": \"%s\", \"cpu_bytes\": %llu, \"gpu_bytes\": %llu, "
+                      "\"gpu_objects\": %d}",
+                      i ? "," : "", memory_category_name(MemoryCategory(i)),
+                      (unsigned long long)category.cpuBytes,
+                      (unsigned long long)category.gpuBytes, category.gpuObjects);
+        file << buffer;
+    }
+    file << "\n  ],\n  \"objects\": [";
+    for (size_t i = 0; i < objects.size(); ++i) {
+        const GpuObject &object = objects[i];
+        std::snprintf(buffer, sizeof(buffer),
+                      "%s\n    {\"category\": \"%s\", \"type\": \"%s\", \"name\": %u, "
+                      "\"bytes\": %llu, \"label\": \"%s\"}",
+                      i ? "," : "", memory_category_name(object.category), types[object.type],
+                      object.name, (unsigned long long)object.bytes,
+                      escape_json(object.label).c_str());
+        file << buffer;
+    }
+    file << "\n  ]\n}\n";
+    return bool(file);
+}
+
+}  // namespace cg
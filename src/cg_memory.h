@@ -0,0 +1,83 @@
+// Accounting of the memory held by a loaded scene: CPU copies of buffers and
+// images, and the GL objects created from them, broken down by category.
+//
+// Code that creates or deletes a GL object reports it here, and owners of CPU
+// data report how much they hold. The totals can be shown in the UI, dumped
+// to a file, and checked against a budget.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace cg {
+
+enum MemoryCategory {
+    MEMORY_BUFFERS = 0,   // Vertex and index data
+    MEMORY_TEXTURES,      // Material and debug textures
+    MEMORY_CUBEMAPS,      // Environment maps
+    MEMORY_SHADOW_MAPS,
+    MEMORY_FRAMEBUFFERS,  // Framebuffer objects and render targets other than shadow maps
+    NUM_MEMORY_CATEGORIES
+};
+
+// GL object names are only unique within one type of object
+enum GpuObjectType { GPU_BUFFER = 0, GPU_TEXTURE, GPU_FRAMEBUFFER, GPU_RENDERBUFFER };
+
+struct MemoryCategoryUsage {
+    size_t cpuBytes = 0;
+    size_t gpuBytes = 0;
+    int gpuObjects = 0;
+};
+
+struct MemoryUsage {
+    MemoryCategoryUsage categories[NUM_MEMORY_CATEGORIES];
+    size_t cpuBytes = 0;  // Sums over the categories
+    size_t gpuBytes = 0;
+    size_t peakCpuBytes = 0;
+    size_t peakGpuBytes = 0;
+};
+
+struct MemoryBudget {
+    size_t cpuBytes = size_t(4096) << 20;  // 0 means no limit
+    size_t gpuBytes = size_t(2048) << 20;
+    float warningFraction = 0.9f;  // Warn when usage passes this fraction of a budget
+    // Also warn when the driver reports less free video memory than this
+    size_t minAvailableGpuBytes = size_t(256) << 20;
+};
+
+const char *memory_category_name(MemoryCategory category);
+
+// Sets the CPU memory that an owner (e.g., an asset) holds in a category,
+// replacing what it reported before. Reporting zero bytes removes the owner.
+// Can be called from any thread.
+void track_cpu_memory(MemoryCategory category, const void *owner, size_t bytes);
+
+// Records the GPU memory of a GL object, replacing what was recorded for it
+// before (e.g., when mip levels of a texture are streamed in or out). The
+// label identifies the object in memory dumps.
+void track_gpu_object(MemoryCategory category, GpuObjectType type, unsigned name, size_t bytes,
+                      const std::string &label);
+
+// Forgets a deleted GL object. Objects that were never tracked are ignored.
+void untrack_gpu_object(GpuObjectType type, unsigned name);
+
+// Returns the GPU memory recorded for a GL object (0 if it is not tracked)
+size_t gpu_object_bytes(GpuObjectType type, unsigned name);
+
+MemoryUsage memory_usage();
+
+// Returns a warning if usage is close to a budget, or if the driver has little
+// video memory left (availableGpuBytes, 0 if unknown), and otherwise an empty
+// string. Each warning is also printed once when it starts to fire.
+std::string check_memory_budget(const MemoryBudget &budget, size_t availableGpuBytes);
+
+// Prints a table of the categories, with CPU and GPU totals
+void print_memory_report();
+
+// Writes the totals per category and every tracked GL object (largest first)
+// as JSON
+bool write_memory_report_json(const std::string &filename);
+
+}  // namespace cg
@@ -0,0 +1,225 @@
+// CPU generation of mip chains for RGBA8 images.
+//
+
+#include "cg_mipmap.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CG_MIPMAP_SSE2 1
+#endif
+
+namespace cg {
+
+static const float KAISER_ALPHA = 4.0f;
+static const float KAISER_RADIUS = 2.0f;  // In texels of the destination level
+
+// Source texels and weights for each destination texel along one axis. Every
+// destination texel has numTaps taps (unused ones have zero weight), and the
+// source indices are clamped to the image.
+struct FilterTaps {
+    int numTaps;
+    std::vector<int> indices;
+    std::vector<float> weights;
+};
+
+// Zeroth-order modified Bessel function of the first kind
+static float bessel_i0(float x)
+{
+    float sum = 1.0f, term = 1.0f;
+    for (int k = 1; k < 16; ++k) {
+        const float f = x / (2.0f * k);
+        term *= f * f;
+        sum += term;
+    }
+    return sum;
+}
+
+// Returns the filter weight at a distance t, measured in destination texels
+static float filter_weight(MipFilter filter, float t)
+{
+    if (filter == MIP_FILTER_BOX) return std::abs(t) < 0.5f ? 1.0f : 0.0f;
+    if (std::abs(t) >= KAISER_RADIUS) return 0.0f;
+
+    const float pi = 3.14159265f;
+    const float sinc = t == 0.0f ? 1.0f : std::sin(pi * t) / (pi * t);
+    const float r = t / KAISER_RADIUS;
+    return sinc * bessel_i0(KAISER_ALPHA * std::sqrt(1.0f - r * r)) / bessel_i0(KAISER_ALPHA);
+}
+
+static FilterTaps compute_taps(MipFilter filter, int srcSize, int dstSize)
+{
+    const float scale = float(srcSize) / dstSize;
+    const float radius = (filter == MIP_FILTER_BOX ? 0.5f : KAISER_RADIUS) * scale;
+
+    FilterTaps taps;
+    taps.numTaps = int(std::ceil(2.0f * radius)) + 2;
+    taps.indices.resize(size_t(dstSize) * taps.numTaps);
+    taps.weights.resize(size_t(dstSize) * taps.numTaps);
+    for (int x = 0; x < dstSize; ++x) {
+        const float center = (x + 0.5f) * scale;
+        const int first = int(std::floor(center - radius - 0.5f));
+        int *indices = &taps.indices[size_t(x) * taps.numTaps];
+        float *weights = &taps.weights[size_t(x) * taps.numTaps];
+        float sum = 0.0f;
+        for (int k = 0; k < taps.numTaps; ++k) {
+            indices[k] = std::min(std::max(first + k, 0), srcSize - 1);
+            weights[k] = filter_weight(filter, (first + k + 0.5f - center) / scale);
+            sum += weights[k];
+        }
+        for (int k = 0; k < taps.numTaps; ++k) weights[k] /= sum;
+    }
+    return taps;
+}
+
+// Filters one row of RGBA texels (all four channels at once)
+static void filter_row(const float *src, const FilterTaps &taps, int dstWidth, float *dst)
+{
+    for (int x = 0; x < dstWidth; ++x) {
+        const int *indices = &taps.indices[size_t(x) * taps.numTaps];
+        const float *weights = &taps.weights[size_t(x) * taps.numTaps];
+#ifdef CG_MIPMAP_SSE2
+        __m128 sum = _mm_setzero_ps();
+        for (int k = 0; k < taps.numTaps; ++k) {
+            const __m128 texel = _mm_loadu_ps(src + 4 * indices[k]);
+            sum = _mm_add_ps(sum, _mm_mul_ps(texel, _mm_set1_ps(weights[k])));
+        }
+        _mm_storeu_ps(dst + 4 * x, sum);
+#else
+        float sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        for (int k = 0; k < taps.numTaps; ++k) {
+            for (int c = 0; c < 4; ++c) sum[c] += weights[k] * src[4 * indices[k] + c];
+        }
+        for (int c = 0; c < 4; ++c) dst[4 * x + c] = sum[c];
+#endif
+    }
+}
+
+// Adds weight * src to dst, where both have n values
+static void accumulate_row(const float *src, float weight, float *dst, size_t n)
+{
+    size_t i = 0;
+#ifdef CG_MIPMAP_SSE2
+    const __m128 w = _mm_set1_ps(weight);
+    for (; i + 4 <= n; i += 4) {
+        const __m128 sum = _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(src + i), w));
+        _mm_storeu_ps(dst + i, sum);
+    }
+#endif
+    for (; i < n; ++i) dst[i] += weight * src[i];
+}
+
+static float srgb_to_linear(float c)
+{
+    return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+// Linear value of each 8-bit sRGB value
+static const std::vector<float> &srgb_decode_table()
+{
+    static const std::vector<float> table = [] {
+        std::vector<float> values(256);
+        for (int i = 0; i < 256; ++i) values[i] = srgb_to_linear(i / 255.0f);
+        return values;
+    }();
+    return table;
+}
+
+// Linear values halfway between consecutive 8-bit sRGB values, so that
+// encoding is a search that rounds to the nearest sRGB value
+static const std::vector<float> &srgb_encode_thresholds()
+{
+    static const std::vector<float> table = [] {
+        std::vector<float> values(255);
+        for (int i = 0; i < 255; ++i) values[i] = srgb_to_linear((i + 0.5f) / 255.0f);
+        return values;
+    }();
+    return table;
+}
+
+static void renormalize(std::vector<float> &texels)
+{
+    for (size_t i = 0; i < texels.size(); i += 4) {
+        float n[3] = {texels[i] * 2.0f - 1.0f, texels[i + 1] * 2.0f - 1.0f,
+                      texels[i + 2] * 2.0f - 1.0f};
+        const float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        if (length < 1e-6f) continue;
+        for (int c = 0; c < 3; ++c) texels[i + c] = n[c] / length * 0.5f + 0.5f;
+    }
+}
+
+static void quantize(const std::vector<float> &texels, MipContent content,
+                     std::vector<char> &output)
+{
+    const std::vector<float> &thresholds = srgb_encode_thresholds();
+    output.resize(texels.size());
+    for (size_t i = 0; i < texels.size(); ++i) {
+        const float value = texels[i];
+        if (content == MIP_CONTENT_SRGB && (i & 3) != 3) {
+            output[i] = char(std::upper_bound(thresholds.begin(), thresholds.end(), value) -
+                             thresholds.begin());
+        } else {
+            output[i] = char(uint8_t(value * 255.0f + 0.5f));
+        }
+    }
+}
+
+int num_mip_levels(int width, int height)
+{
+    int levels = 1;
+    while (width > 1 || height > 1) {
+        width = std::max(1, width / 2), height = std::max(1, height / 2);
+        levels += 1;
+    }
+    return levels;
+}
+
+void generate_mip_chain(const uint8_t *rgba, int width, int height, MipFilter filter,
+                        MipContent content, std::vector<std::vector<char> > &levels)
+{
+    const size_t numTexels = size_t(width) * height;
+    levels.assign(num_mip_levels(width, height), std::vector<char>());
+    levels[0].assign((const char *)rgba, (const char *)rgba + 4 * numTexels);
+
+    const std::vector<float> &decode = srgb_decode_table();
+    std::vector<float> src(4 * numTexels), tmp, dst;
+    for (size_t i = 0; i < 4 * numTexels; ++i) {
+        const bool srgb = content == MIP_CONTENT_SRGB && (i & 3) != 3;
+        src[i] = srgb ? decode[rgba[i]] : rgba[i] / 255.0f;
+    }
+
+    int w = width, h = height;
+    for (size_t level = 1; level < levels.size(); ++level) {
+        const int dw = std::max(1, w / 2), dh = std::max(1, h / 2);
+        const FilterTaps tapsX = compute_taps(filter, w, dw);
+        const FilterTaps tapsY = compute_taps(filter, h, dh);
+
+        // Separable filter: first along rows, then along columns
+        tmp.resize(size_t(dw) * h * 4);
+        for (int y = 0; y < h; ++y) {
+            filter_row(&src[size_t(y) * w * 4], tapsX, dw, &tmp[size_t(y) * dw * 4]);
+        }
+        dst.assign(size_t(dw) * dh * 4, 0.0f);
+        for (int y = 0; y < dh; ++y) {
+            for (int k = 0; k < tapsY.numTaps; ++k) {
+                const float weight = tapsY.weights[size_t(y) * tapsY.numTaps + k];
+                if (weight == 0.0f) continue;
+                const int row = tapsY.indices[size_t(y) * tapsY.numTaps + k];
+                accumulate_row(&tmp[size_t(row) * dw * 4], weight, &dst[size_t(y) * dw * 4],
+                               size_t(dw) * 4);
+            }
+        }
+
+        // The negative lobes of the Kaiser filter can overshoot
+        for (float &value : dst) value = std::min(std::max(value, 0.0f), 1.0f);
+        if (content == MIP_CONTENT_NORMAL_MAP) renormalize(dst);
+        quantize(dst, content, levels[level]);
+
+        src.swap(dst);
+        w = dw, h = dh;
+    }
+}
+
+}  // namespace cg
@@ -0,0 +1,30 @@
+// CPU generation of mip chains for RGBA8 images.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace cg {
+
+enum MipFilter {
+    MIP_FILTER_BOX = 0,    // Average of the 2x2 texels below each texel
+    MIP_FILTER_KAISER = 1  // Kaiser-windowed sinc (sharper, less aliasing)
+};
+
+// What the channels of an image contain, which decides how it is filtered.
+// sRGB color is converted to linear before filtering (alpha is always
+// linear), and the XYZ of normal maps are renormalized on each level.
+enum MipContent { MIP_CONTENT_LINEAR = 0, MIP_CONTENT_SRGB = 1, MIP_CONTENT_NORMAL_MAP = 2 };
+
+// Returns the number of levels in a full mip chain
+int num_mip_levels(int width, int height);
+
+// Builds a full mip chain of an RGBA8 image, level 0 (a copy of the image)
+// first. Each level halves the size (rounding down) of the previous one,
+// which is filtered in floating point to avoid requantizing between levels.
+void generate_mip_chain(const uint8_t *rgba, int width, int height, MipFilter filter,
+                        MipContent content, std::vector<std::vector<char> > &levels);
+
+}  // namespace cg
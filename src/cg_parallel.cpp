@@ -0,0 +1,41 @@
+// Small helpers for spreading CPU work over multiple threads.
+//
+
+#include "cg_parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace cg {
+
+unsigned num_worker_threads()
+{
+    unsigned numThreads = std::thread::hardware_concurrency();
+    return std::max(numThreads, 1u);
+}
+
+void parallel_for(int count, const std::function<void(int)> &func, unsigned maxThreads)
+{
+    if (count <= 0) return;
+    if (maxThreads == 0) maxThreads = num_worker_threads();
+    const unsigned numThreads = std::min(maxThreads, unsigned(count));
+    if (numThreads <= 1) {
+        for (int i = 0; i < count; ++i) func(i);
+        return;
+    }
+
+    // Each thread grabs the next unprocessed item until all are done. The
+    // calling thread also takes part, so only numThreads - 1 are spawned.
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        for (int i = next++; i < count; i = next++) func(i);
+    };
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < numThreads; ++i) threads.emplace_back(worker);
+    worker();
+    for (auto &thread : threads) thread.join();
+}
+
+}  // namespace cg
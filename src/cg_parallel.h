@@ -0,0 +1,19 @@
+// Small helpers for spreading CPU work over multiple threads.
+//
+
+#pragma once
+
+#include <functional>
+
+namespace cg {
+
+// Returns the number of worker threads to use for parallel loops (always at
+// least one)
+unsigned num_worker_threads();
+
+// Calls func(i) for every i in [0, count) using up to maxThreads threads (0
+// means num_worker_threads()). Items are handed out dynamically, so callers
+// with very cheap items should process them in chunks.
+void parallel_for(int count, const std::function<void(int)> &func, unsigned maxThreads = 0);
+
+}  // namespace cg
@@ -0,0 +1,537 @@
+// CPU prefiltering of environment cubemaps with the GGX distribution, for
+// glossy reflections where each mip level holds one roughness.
+//
+
+#include "cg_prefilter.h"
+#include "cg_bcn.h"
+#include "cg_loadstats.h"
+#include "cg_parallel.h"
+#include "cg_utils.h"
+
+#include "stb_image.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CG_PREFILTER_SSE2 1
+#endif
+
+namespace cg {
+
+// Change this when the prefilter output changes, so that old cache entries
+// are not used
+static const uint32_t PREFILTER_VERSION = 1;
+static const char CACHE_MAGIC[4] = {'C', 'G', 'P', 'F'};
+
+static const float PI = 3.14159265f;
+
+// Linear RGBA mip chain of one face of the source cubemap
+struct SourceFace {
+    std::vector<int> sizes;
+    std::vector<std::vector<float> > levels;
+};
+
+// Importance samples of one roughness level, in the tangent space of the
+// normal (which is also the view direction). Stored as structure of arrays
+// and padded to a multiple of four with zero-weight samples.
+struct SampleSet {
+    std::vector<float> x, y, z, weight;
+    std::vector<int> level;  // Source mip level to read from
+    float invWeightSum;
+};
+
+static float srgb_to_linear(float c)
+{
+    return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+static uint8_t linear_to_srgb8(float c)
+{
+    c = std::min(std::max(c, 0.0f), 1.0f);
+    c = c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+    return uint8_t(c * 255.0f + 0.5f);
+}
+
+// Returns the direction through texel coordinates (s, t) in [-1, 1] of a
+// face, following the face orientations of the GL specification
+static void face_direction(int face, float s, float t, float dir[3])
+{
+    switch (face) {
+    case 0: dir[0] = 1.0f, dir[1] = -t, dir[2] = -s; break;
+    case 1: dir[0] = -1.0f, dir[1] = -t, dir[2] = s; break;
+    case 2: dir[0] = s, dir[1] = 1.0f, dir[2] = t; break;
+    case 3: dir[0] = s, dir[1] = -1.0f, dir[2] = -t; break;
+    case 4: dir[0] = s, dir[1] = -t, dir[2] = 1.0f; break;
+    default: dir[0] = -s, dir[1] = -t, dir[2] = -1.0f; break;
+    }
+}
+
+// Inverse of face_direction(), with s and t returned in [0, 1]
+static int direction_face(float x, float y, float z, float &s, float &t)
+{
+    const float ax = std::abs(x), ay = std::abs(y), az = std::abs(z);
+    int face;
+    float sc, tc, ma;
+    if (ax >= ay && ax >= az) {
+        face = x >= 0.0f ? 0 : 1;
+        sc = x >= 0.0f ? -z : z, tc = -y, ma = ax;
+    } else if (ay >= az) {
+        face = y >= 0.0f ? 2 : 3;
+        sc = x, tc = y >= 0.0f ? z : -z, ma = ay;
+    } else {
+        face = z >= 0.0f ? 4 : 5;
+        sc = z >= 0.0f ? x : -x, tc = -y, ma = az;
+    }
+    s = 0.5f * (sc / ma + 1.0f);
+    t = 0.5f * (tc / ma + 1.0f);
+    return face;
+}
+
+static void build_source_faces(const CubemapFaces &source, SourceFace faces[6],
+                               unsigned maxThreads)
+{
+    parallel_for(6, [&](int f) {
+        SourceFace &face = faces[f];
+        int size = source.size;
+        face.sizes.assign(1, size);
+        face.levels.assign(1, std::vector<float>(size_t(size) * size * 4));
+        const uint8_t *texels = (const uint8_t *)&source.faces[f][0];
+        for (size_t i = 0; i < face.levels[0].size(); ++i) {
+            const float value = texels[i] / 255.0f;
+            face.levels[0][i] = (i & 3) == 3 ? value : srgb_to_linear(value);
+        }
+
+        // Box filtered chain in linear space
+        while (size > 1) {
+            const int half = size / 2;
+            const std::vector<float> &src = face.levels.back();
+            std::vector<float> dst(size_t(half) * half * 4);
+            for (int y = 0; y < half; ++y) {
+                for (int x = 0; x < half; ++x) {
+                    for (int c = 0; c < 4; ++c) {
+                        const size_t i00 = (size_t(2 * y) * size + 2 * x) * 4 + c;
+                        const size_t i10 = i00 + size_t(size) * 4;
+                        dst[(size_t(y) * half + x) * 4 + c] =
+                            0.25f * (src[i00] + src[i00 + 4] + src[i10] + src[i10 + 4]);
+                    }
+                }
+            }
+            face.levels.push_back(std::move(dst));
+            face.sizes.push_back(half);
+            size = half;
+        }
+    }, maxThreads);
+}
+
+// Hammersley point i of n, with the radical inverse as second coordinate
+static void hammersley(uint32_t i, uint32_t n, float &u, float &v)
+{
+    uint32_t bits = i;
+    bits = (bits << 16) | (bits >> 16);
+    bits = ((bits & 0x55555555u) << 1) | ((bits & 0xaaaaaaaau) >> 1);
+    bits = ((bits & 0x33333333u) << 2) | ((bits & 0xccccccccu) >> 2);
+    bits = ((bits & 0x0f0f0f0fu) << 4) | ((bits & 0xf0f0f0f0u) >> 4);
+    bits = ((bits & 0x00ff00ffu) << 8) | ((bits & 0xff00ff00u) >> 8);
+    u = float(i) / n;
+    v = float(bits) * 2.3283064365386963e-10f;
+}
+
+static SampleSet build_samples(float alpha, int numSamples, int sourceSize, int numSourceLevels)
+{
+    SampleSet samples;
+    const float a2 = alpha * alpha;
+    // Solid angle of a source texel, for picking the source level whose
+    // texels cover about as much as each sample (filtered importance sampling)
+    const float texelSolidAngle = 4.0f * PI / (6.0f * sourceSize * sourceSize);
+    float weightSum = 0.0f;
+    for (int i = 0; i < numSamples; ++i) {
+        float u, v;
+        hammersley(i, numSamples, u, v);
+        const float phi = 2.0f * PI * u;
+        const float cosTheta = std::sqrt((1.0f - v) / (1.0f + (a2 - 1.0f) * v));
+        const float sinTheta = std::sqrt(1.0f - cosTheta * cosTheta);
+        const float hx = sinTheta * std::cos(phi), hy = sinTheta * std::sin(phi);
+
+        // Reflect the normal (= view direction) about the half vector
+        const float lz = 2.0f * cosTheta * cosTheta - 1.0f;
+        if (lz <= 0.0f) continue;
+
+        const float d = (a2 - 1.0f) * cosTheta * cosTheta + 1.0f;
+        const float pdf = a2 / (PI * d * d) / 4.0f;  // D(h) cos / (4 dot(v, h))
+        const float sampleSolidAngle = 1.0f / (numSamples * pdf + 1e-6f);
+        const float lod = 0.5f * std::log2(sampleSolidAngle / texelSolidAngle) + 1.0f;
+        const int level = std::min(std::max(int(lod + 0.5f), 0), numSourceLevels - 1);
+
+        samples.x.push_back(2.0f * cosTheta * hx);
+        samples.y.push_back(2.0f * cosTheta * hy);
+        samples.z.push_back(lz);
+        samples.weight.push_back(lz);
+        samples.level.push_back(level);
+        weightSum += lz;
+    }
+    while (samples.x.size() % 4) {
+        samples.x.push_back(0.0f), samples.y.push_back(0.0f), samples.z.push_back(1.0f);
+        samples.weight.push_back(0.0f), samples.level.push_back(0);
+    }
+    samples.invWeightSum = weightSum > 0.0f ? 1.0f / weightSum : 0.0f;
+    return samples;
+}
+
+// Bilinear lookup in one level of the source, clamped at face edges
+static inline void fetch(const SourceFace faces[6], float x, float y, float z, int level,
+                         float weight, float sum[4])
+{
+    float s, t;
+    const SourceFace &face = faces[direction_face(x, y, z, s, t)];
+    const int size = face.sizes[level];
+    const float *texels = &face.levels[level][0];
+    const float fx = std::min(std::max(s * size - 0.5f, 0.0f), size - 1.0f);
+    const float fy = std::min(std::max(t * size - 0.5f, 0.0f), size - 1.0f);
+    const int x0 = int(fx), y0 = int(fy);
+    const int x1 = std::min(x0 + 1, size - 1), y1 = std::min(y0 + 1, size - 1);
+    const float wx = fx - x0, wy = fy - y0;
+    const float *p00 = texels + (size_t(y0) * size + x0) * 4;
+    const float *p10 = texels + (size_t(y0) * size + x1) * 4;
+    const float *p01 = texels + (size_t(y1) * size + x0) * 4;
+    const float *p11 = texels + (size_t(y1) * size + x1) * 4;
+#ifdef CG_PREFILTER_SSE2
+    const __m128 w00 = _mm_set1_ps(weight * (1.0f - wx) * (1.0f - wy));
+    const __m128 w10 = _mm_set1_ps(weight * wx * (1.0f - wy));
+    const __m128 w01 = _mm_set1_ps(weight * (1.0f - wx) * wy);
+    const __m128 w11 = _mm_set1_ps(weight * wx * wy);
+    __m128 acc = _mm_loadu_ps(sum);
+    acc = _mm_add_ps(acc, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(p00), w00),
+                                     _mm_mul_ps(_mm_loadu_ps(p10), w10)));
+    acc = _mm_add_ps(acc, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(p01), w01),
+                                     _mm_mul_ps(_mm_loadu_ps(p11), w11)));
+    _mm_storeu_ps(sum, acc);
+#else
+    const float w00 = weight * (1.0f - wx) * (1.0f - wy), w10 = weight * wx * (1.0f - wy);
+    const float w01 = weight * (1.0f - wx) * wy, w11 = weight * wx * wy;
+    for (int c = 0; c < 4; ++c) {
+        sum[c] += p00[c] * w00 + p10[c] * w10 + p01[c] * w01 + p11[c] * w11;
+    }
+#endif
+}
+
+// Convolves the source with the samples around one normal
+static void convolve(const SourceFace faces[6], const SampleSet &samples, const float n[3],
+                     float sum[4])
+{
+    // Tangent frame around the normal
+    const float up[3] = {std::abs(n[2]) < 0.999f ? 0.0f : 1.0f, 0.0f,
+                         std::abs(n[2]) < 0.999f ? 1.0f : 0.0f};
+    float tx = up[1] * n[2] - up[2] * n[1], ty = up[2] * n[0] - up[0] * n[2],
+          tz = up[0] * n[1] - up[1] * n[0];
+    const float invLength = 1.0f / std::sqrt(tx * tx + ty * ty + tz * tz);
+    tx *= invLength, ty *= invLength, tz *= invLength;
+    const float bx = n[1] * tz - n[2] * ty, by = n[2] * tx - n[0] * tz, bz = n[0] * ty - n[1] * tx;
+
+    sum[0] = sum[1] = sum[2] = sum[3] = 0.0f;
+    const size_t count = samples.x.size();
+#ifdef CG_PREFILTER_SSE2
+    // Rotate four samples at a time to world space
+    const __m128 Tx = _mm_set1_ps(tx), Ty = _mm_set1_ps(ty), Tz = _mm_set1_ps(tz);
+    const __m128 Bx = _mm_set1_ps(bx), By = _mm_set1_ps(by), Bz = _mm_set1_ps(bz);
+    const __m128 Nx = _mm_set1_ps(n[0]), Ny = _mm_set1_ps(n[1]), Nz = _mm_set1_ps(n[2]);
+    for (size_t i = 0; i < count; i += 4) {
+        const __m128 sx = _mm_loadu_ps(&samples.x[i]);
+        const __m128 sy = _mm_loadu_ps(&samples.y[i]);
+        const __m128 sz = _mm_loadu_ps(&samples.z[i]);
+        float lx[4], ly[4], lz[4];
+        _mm_storeu_ps(lx, _mm_add_ps(_mm_add_ps(_mm_mul_ps(Tx, sx), _mm_mul_ps(Bx, sy)),
+                                     _mm_mul_ps(Nx, sz)));
+        _mm_storeu_ps(ly, _mm_add_ps(_mm_add_ps(_mm_mul_ps(Ty, sx), _mm_mul_ps(By, sy)),
+                                     _mm_mul_ps(Ny, sz)));
+        _mm_storeu_ps(lz, _mm_add_ps(_mm_add_ps(_mm_mul_ps(Tz, sx), _mm_mul_ps(Bz, sy)),
+                                     _mm_mul_ps(Nz, sz)));
+        for (int k = 0; k < 4; ++k) {
+            if (samples.weight[i + k] == 0.0f) continue;
+            fetch(faces, lx[k], ly[k], lz[k], samples.level[i + k], samples.weight[i + k], sum);
+        }
+    }
+#else
+    for (size_t i = 0; i < count; ++i) {
+        if (samples.weight[i] == 0.0f) continue;
+        const float sx = samples.x[i], sy = samples.y[i], sz = samples.z[i];
+        fetch(faces, tx * sx + bx * sy + n[0] * sz, ty * sx + by * sy + n[1] * sz,
+              tz * sx + bz * sy + n[2] * sz, samples.level[i], samples.weight[i], sum);
+    }
+#endif
+    for (int c = 0; c < 4; ++c) sum[c] *= samples.invWeightSum;
+}
+
+bool load_cubemap_faces(const std::string &dirname, CubemapFaces &cubemap)
+{
+    const char *filenames[] = {"posx.png", "negx.png", "posy.png",
+                               "negy.png", "posz.png", "negz.png"};
+    int sizes[6][2] = {};
+    std::string errors[6];
+    std::vector<char> files[6];
+    for (int i = 0; i < 6; ++i) {
+        std::string filename = dirname + "/" + filenames[i];
+        if (!read_file(filename, files[i])) errors[i] = filename + ": could not read file";
+    }
+    LoadScope scope(LOAD_IMAGE_DECODE, "decode_cubemap_faces");
+    parallel_for(6, [&](int i) {
+        if (!errors[i].empty()) return;
+        int comp;
+        uint8_t *image = stbi_load_from_memory((const stbi_uc *)files[i].data(),
+                                               int(files[i].size()), &sizes[i][0], &sizes[i][1],
+                                               &comp, 4);
+        if (image == nullptr) {
+            errors[i] = dirname + "/" + filenames[i] + ": " + stbi_failure_reason();
+            return;
+        }
+        cubemap.faces[i].assign((const char *)image,
+                                (const char *)image + size_t(sizes[i][0]) * sizes[i][1] * 4);
+        stbi_image_free(image);  // Clean up resources
+    });
+    for (const auto &face : cubemap.faces) scope.bytes += face.size();
+
+    cubemap.size = sizes[0][0];
+    for (int i = 0; i < 6; ++i) {
+        if (!errors[i].empty()) {
+            std::cerr << "Error: " << errors[i] << std::endl;
+            return false;
+        }
+        if (sizes[i][0] != cubemap.size || sizes[i][1] != cubemap.size) {
+            std::cerr << "Error: cubemap faces in " << dirname << " are not equal squares"
+                      << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+void prefilter_cubemap(const CubemapFaces &source, const PrefilterSettings &settings,
+                       std::vector<CubemapFaces> &levels, unsigned maxThreads)
+{
+    SourceFace faces[6];
+    build_source_faces(source, faces, maxThreads);
+    const int numSourceLevels = int(faces[0].levels.size());
+
+    const int numLevels = int(settings.specularPowers.size());
+    std::vector<SampleSet> samples(numLevels);
+    std::vector<int> firstRow(numLevels + 1, 0);  // Rows of all faces of earlier levels
+    levels.assign(numLevels, CubemapFaces());
+    for (int i = 0; i < numLevels; ++i) {
+        const float alpha = std::sqrt(2.0f / (settings.specularPowers[i] + 2.0f));
+        samples[i] = build_samples(alpha, settings.numSamples, source.size, numSourceLevels);
+        levels[i].size = std::max(1, settings.size >> i);
+        for (auto &face : levels[i].faces) {
+            face.resize(size_t(levels[i].size) * levels[i].size * 4);
+        }
+        firstRow[i + 1] = firstRow[i] + 6 * levels[i].size;
+    }
+
+    // One job per row of a face, so that even the smallest levels are spread
+    // over the threads
+    parallel_for(firstRow[numLevels], [&](int job) {
+        int i = 0;
+        while (job >= firstRow[i + 1]) i += 1;
+        const int size = levels[i].size;
+        const int face = (job - firstRow[i]) / size, y = (job - firstRow[i]) % size;
+        uint8_t *row = (uint8_t *)&levels[i].faces[face][size_t(y) * size * 4];
+        for (int x = 0; x < size; ++x) {
+            float n[3], sum[4];
+            face_direction(face, 2.0f * (x + 0.5f) / size - 1.0f, 2.0f * (y + 0.5f) / size - 1.0f,
+                           n);
+            const float invLength = 1.0f / std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            for (int c = 0; c < 3; ++c) n[c] *= invLength;
+            convolve(faces, samples[i], n, sum);
+            for (int c = 0; c < 3; ++c) row[4 * x + c] = linear_to_srgb8(sum[c]);
+            row[4 * x + 3] = uint8_t(std::min(std::max(sum[3], 0.0f), 1.0f) * 255.0f + 0.5f);
+        }
+    }, maxThreads);
+}
+
+void compress_cubemap(std::vector<CubemapFaces> &levels, int format)
+{
+    LoadScope scope(LOAD_TEXTURE_COMPRESSION, "compress_cubemap");
+    parallel_for(int(levels.size()) * 6, [&](int job) {
+        CubemapFaces &level = levels[job / 6];
+        std::vector<char> &face = level.faces[job % 6];
+        std::vector<char> blocks;
+        compress_image(format, (const uint8_t *)&face[0], level.size, level.size, blocks);
+        face.swap(blocks);
+    });
+    for (auto &level : levels) {
+        level.format = format;
+        scope.bytes += 6 * level.faces[0].size();
+    }
+}
+
+GLuint create_cubemap(const std::vector<CubemapFaces> &levels)
+{
+    const GLenum targets[] = {GL_TEXTURE_CUBE_MAP_POSITIVE_X, GL_TEXTURE_CUBE_MAP_NEGATIVE_X,
+                              GL_TEXTURE_CUBE_MAP_POSITIVE_Y, GL_TEXTURE_CUBE_MAP_NEGATIVE_Y,
+                              GL_TEXTURE_CUBE_MAP_POSITIVE_Z, GL_TEXTURE_CUBE_MAP_NEGATIVE_Z};
+
+    LoadScope scope(LOAD_GL_UPLOAD, "upload_cubemap");
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, int(levels.size()) - 1);
+    for (size_t i = 0; i < levels.size(); ++i) {
+        for (int j = 0; j < 6; ++j) {
+            const std::vector<char> &face = levels[i].faces[j];
+            if (levels[i].format) {
+                glCompressedTexImage2D(targets[j], i, srgb_block_format(levels[i].format),
+                                       levels[i].size, levels[i].size, 0, GLsizei(face.size()),
+                                       &face[0]);
+            } else {
+                glTexImage2D(targets[j], i, GL_SRGB8_ALPHA8, levels[i].size, levels[i].size, 0,
+                             GL_RGBA, GL_UNSIGNED_BYTE, &face[0]);
+            }
+            scope.bytes += face.size();
+        }
+    }
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+    return texture;
+}
+
+// Returns the cache file of a prefiltered cubemap, named by a hash (FNV-1a)
+// of the source faces and of the settings
+static std::string cache_filename(const std::string &cacheDir, const CubemapFaces &source,
+                                  const PrefilterSettings &settings)
+{
+    std::vector<uint32_t> header = {PREFILTER_VERSION, uint32_t(source.size),
+                                    uint32_t(settings.size), uint32_t(settings.numSamples)};
+    for (float power : settings.specularPowers) header.push_back(uint32_t(power * 1024.0f));
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < header.size() * sizeof(uint32_t); ++i) {
+        hash = (hash ^ ((const uint8_t *)&header[0])[i]) * 1099511628211ull;
+    }
+    for (const auto &face : source.faces) {
+        for (char c : face) hash = (hash ^ uint8_t(c)) * 1099511628211ull;
+    }
+    char name[64];
+    std::snprintf(name, sizeof(name), "/cubemap_%016llx.bin", (unsigned long long)hash);
+    return cacheDir + name;
+}
+
+static bool load_from_cache(const std::string &filename, const PrefilterSettings &settings,
+                            std::vector<CubemapFaces> &levels)
+{
+    LoadScope scope(LOAD_FILE_IO, "read_prefilter_cache");
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) return false;
+    char magic[4];
+    uint32_t header[2];  // Size of the first level, number of levels
+    file.read(magic, sizeof(magic));
+    file.read((char *)header, sizeof(header));
+    if (!file || !std::equal(magic, magic + 4, CACHE_MAGIC) ||
+        header[0] != uint32_t(settings.size) || header[1] != settings.specularPowers.size()) {
+        return false;
+    }
+
+    levels.assign(header[1], CubemapFaces());
+    for (uint32_t i = 0; i < header[1]; ++i) {
+        levels[i].size = std::max(1, settings.size >> i);
+        for (auto &face : levels[i].faces) {
+            face.resize(size_t(levels[i].size) * levels[i].size * 4);
+            file.read(&face[0], face.size());
+            scope.bytes += face.size();
+        }
+    }
+    return bool(file);
+}
+
+static void save_to_cache(const std::string &filename, const std::vector<CubemapFaces> &levels)
+{
+    LoadScope scope(LOAD_FILE_IO, "write_prefilter_cache");
+    std::ofstream file(filename, std::ios::binary);
+    const uint32_t header[2] = {uint32_t(levels.empty() ? 0 : levels[0].size),
+                                uint32_t(levels.size())};
+    file.write(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    file.write((const char *)header, sizeof(header));
+    for (const auto &level : levels) {
+        for (const auto &face : level.faces) {
+            file.write(&face[0], face.size());
+            scope.bytes += face.size();
+        }
+    }
+    if (!file) std::cerr << "Warning: could not write " << filename << std::endl;
+}
+
+bool load_prefiltered_levels(const std::string &dirname, const std::string &cacheDir,
+                             const PrefilterSettings &settings,
+                             std::vector<CubemapFaces> &levels)
+{
+    CubemapFaces source;
+    if (!load_cubemap_faces(dirname, source)) return false;
+
+    std::string filename;
+    if (!cacheDir.empty()) {
+#ifdef _WIN32
+        _mkdir(cacheDir.c_str());
+#else
+        mkdir(cacheDir.c_str(), 0755);
+#endif
+        filename = cache_filename(cacheDir, source, settings);
+        const bool hit = load_from_cache(filename, settings, levels);
+        count_cache_lookup(hit);
+        if (hit) return true;
+    }
+
+    {
+        LoadScope scope(LOAD_PREFILTER, "prefilter_cubemap");
+        prefilter_cubemap(source, settings, levels);
+        for (const auto &level : levels) scope.bytes += 6 * level.faces[0].size();
+    }
+    if (!filename.empty()) save_to_cache(filename, levels);
+    return true;
+}
+
+double benchmark_prefilter(int size, unsigned maxThreads)
+{
+    // Smooth sky gradient with a few small bright spots, so that both the
+    // sharp and the rough levels have something to filter
+    CubemapFaces source;
+    source.size = size;
+    for (int f = 0; f < 6; ++f) {
+        source.faces[f].resize(size_t(size) * size * 4);
+        for (int y = 0; y < size; ++y) {
+            for (int x = 0; x < size; ++x) {
+                float d[3];
+                face_direction(f, 2.0f * (x + 0.5f) / size - 1.0f,
+                               2.0f * (y + 0.5f) / size - 1.0f, d);
+                const float up = d[1] / std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+                const bool spot = ((x / 16) * 7 + (y / 16) * 13 + f) % 23 == 0;
+                uint8_t *texel = (uint8_t *)&source.faces[f][(size_t(y) * size + x) * 4];
+                texel[0] = spot ? 255 : uint8_t(96 + 64 * up);
+                texel[1] = spot ? 255 : uint8_t(128 + 64 * up);
+                texel[2] = spot ? 255 : uint8_t(192 + 48 * up);
+                texel[3] = 255;
+            }
+        }
+    }
+
+    PrefilterSettings settings;
+    settings.size = size;
+    std::vector<CubemapFaces> levels;
+    const auto start = std::chrono::steady_clock::now();
+    prefilter_cubemap(source, settings, levels, maxThreads);
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+}  // namespace cg
@@ -0,0 +1,64 @@
+// CPU prefiltering of environment cubemaps with the GGX distribution, for
+// glossy reflections where each mip level holds one roughness.
+//
+
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <string>
+#include <vector>
+
+namespace cg {
+
+// Six square sRGB faces, in the order of the GL cubemap targets (+X, -X, +Y,
+// -Y, +Z, -Z) and with the first row at t = 0. The faces are RGBA8, or blocks
+// of a BCn format of cg_bcn.h once compressed.
+struct CubemapFaces {
+    int size = 0;
+    int format = 0;  // 0 = RGBA8, else FORMAT_BC1 or FORMAT_BC7 (uploaded as sRGB)
+    std::vector<char> faces[6];
+};
+
+struct PrefilterSettings {
+    int size = 128;       // Size of the first level (each level halves it)
+    int numSamples = 64;  // Importance samples per texel
+    // One level per Blinn-Phong specular power, converted to GGX roughness
+    // with alpha = sqrt(2 / (power + 2)). These match the levels of the
+    // precomputed prefiltered/ directories.
+    std::vector<float> specularPowers = {2048.0f, 512.0f, 128.0f, 32.0f,
+                                         8.0f,    2.0f,   0.5f,   0.125f};
+};
+
+// Loads posx.png, negx.png, ... from a directory. Returns false (and prints
+// the reason) if a face is missing or the faces are not square and equal.
+bool load_cubemap_faces(const std::string &dirname, CubemapFaces &cubemap);
+
+// Convolves a cubemap with the GGX distribution of each roughness level
+// (assuming that the view direction equals the normal), with filtered
+// importance sampling from a mip chain of the source. Work is spread over
+// rows of all faces, using up to maxThreads threads (0 = all workers).
+void prefilter_cubemap(const CubemapFaces &source, const PrefilterSettings &settings,
+                       std::vector<CubemapFaces> &levels, unsigned maxThreads = 0);
+
+// Compresses the RGBA8 faces of all levels to a BCn format, one face and
+// level per job
+void compress_cubemap(std::vector<CubemapFaces> &levels, int format);
+
+// Creates an sRGB cubemap texture with the given levels as its mip chain
+GLuint create_cubemap(const std::vector<CubemapFaces> &levels);
+
+// Loads the base faces in a directory and prefilters them, or reads the
+// result from the cache directory if the same faces and settings have been
+// prefiltered before (an empty cacheDir disables the cache). Returns false if
+// the faces could not be loaded.
+bool load_prefiltered_levels(const std::string &dirname, const std::string &cacheDir,
+                             const PrefilterSettings &settings,
+                             std::vector<CubemapFaces> &levels);
+
+// Returns the seconds it takes to prefilter all levels of a synthetic
+// environment whose base faces have the given size, using up to maxThreads
+// threads
+double benchmark_prefilter(int size, unsigned maxThreads);
+
+}  // namespace cg
@@ -0,0 +1,344 @@
+// Frame profiler with nestable CPU scopes and GPU timer queries. Events go
+// into a lock-free ring buffer that can be exported as a Chrome trace
+// (chrome://tracing or Perfetto) or as CSV.
+//
+
+#include "cg_profiler.h"
+#include "cg_utils.h"
+
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <set>
+
+namespace cg {
+
+static const uint64_t SLOT_BUSY = ~uint64_t(0);
+
+static thread_local int scopeDepth = 0;
+
+// Returns a small id for the calling thread (1 for the first thread that
+// records an event, 2 for the next one, ...)
+static uint32_t thread_index()
+{
+    static std::atomic<uint32_t> nextIndex(1);
+    static thread_local uint32_t index = nextIndex++;
+    return index;
+}
+
+void init_profiler(Profiler &profiler, uint64_t capacity)
+{
+    uint64_t size = 1;
+    while (size < capacity) size *= 2;
+    profiler.ring.reset(new ProfileRing());
+    profiler.ring->slots.reset(new ProfileSlot[size]);
+    for (uint64_t i = 0; i < size; ++i) profiler.ring->slots[i].sequence.store(SLOT_BUSY);
+    profiler.ring->capacity = size;
+    thread_index();  // The thread that creates the profiler gets id 1 (main)
+    profiler.start = std::chrono::steady_clock::now();
+
+    profiler.gpuQueries.resize(PROFILER_FRAMES_IN_FLIGHT * PROFILER_MAX_GPU_SCOPES);
+    for (auto &query : profiler.gpuQueries) {
+        glGenQueries(1, &query.query);
+        query.pending = false;
+    }
+}
+
+void destroy_profiler(Profiler &profiler)
+{
+    for (auto &query : profiler.gpuQueries) glDeleteQueries(1, &query.query);
+    profiler.gpuQueries.clear();
+    profiler.ring.reset();
+}
+
+double profiler_time_ms(const Profiler &profiler)
+{
+    const auto elapsed = std::chrono::steady_clock::now() - profiler.start;
+    return std::chrono::duration<double, std::milli>(elapsed).count();
+}
+
+void record_event(Profiler &profiler, const ProfileEvent &event)
+{
+    if (!profiler.ring) return;
+    ProfileRing &ring = *profiler.ring;
+
+    // Claim a slot, and mark it as busy while it is written so that readers
+    // (which check the sequence before and after copying) skip it
+    const uint64_t index = ring.writeIndex.fetch_add(1, std::memory_order_relaxed);
+    ProfileSlot &slot = ring.slots[index & (ring.capacity - 1)];
+    slot.sequence.store(SLOT_BUSY, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.event = event;
+    slot.sequence.store(index, std::memory_order_release);
+}
+
+// Records the results of the GPU queries in a frame slot that are ready, and
+// frees the slot for reuse
+static void collect_gpu_queries(Profiler &profiler, int frameSlot)
+{
+    double gpuMs = 0.0;
+    bool hasResults = false;
+    for (int i = 0; i < PROFILER_MAX_GPU_SCOPES; ++i) {
+        GpuQuery &query = profiler.gpuQueries[frameSlot * PROFILER_MAX_GPU_SCOPES + i];
+        if (!query.pending) continue;
+        query.pending = false;
+
+        GLint available = 0;
+        glGetQueryObjectiv(query.query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            profiler.droppedGpuResults += 1;
+            continue;
+        }
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(query.query, GL_QUERY_RESULT, &nanoseconds);
+
+        ProfileEvent event;
+        event.name = query.name;
+        event.frame = query.frame;
+        event.startMs = query.startMs;
+        event.durationMs = nanoseconds * 1e-6;
+        event.thread = 0;
+        event.depth = 0;
+        event.gpu = true;
+        if (profiler.enabled) record_event(profiler, event);
+        gpuMs += event.durationMs;
+        hasResults = true;
+    }
+    if (hasResults) {
+        profiler.gpuFrameMs.erase(profiler.gpuFrameMs.begin());
+        profiler.gpuFrameMs.push_back(float(gpuMs));
+        profiler.newGpuFrameMs = true;
+    }
+}
+
+void begin_profiler_frame(Profiler &profiler)
+{
+    const double now = profiler_time_ms(profiler);
+    if (profiler.frame > 0) {
+        ProfileEvent event;
+        event.name = "frame";
+        event.frame = profiler.frame;
+        event.startMs = profiler.frameStartMs;
+        event.durationMs = now - profiler.frameStartMs;
+        event.thread = thread_index();
+        event.depth = 0;
+        event.gpu = false;
+        if (profiler.enabled) record_event(profiler, event);
+        profiler.cpuFrameMs.erase(profiler.cpuFrameMs.begin());
+        profiler.cpuFrameMs.push_back(float(event.durationMs));
+    }
+
+    profiler.frame += 1;
+    profiler.frameStartMs = now;
+    profiler.gpuScopesThisFrame = 0;
+    profiler.newGpuFrameMs = false;
+    if (!profiler.gpuQueries.empty()) {
+        collect_gpu_queries(profiler, int(profiler.frame % PROFILER_FRAMES_IN_FLIGHT));
+    }
+}
+
+void read_events(const Profiler &profiler, std::vector<ProfileEvent> &events)
+{
+    events.clear();
+    if (!profiler.ring) return;
+    const ProfileRing &ring = *profiler.ring;
+    const uint64_t end = ring.writeIndex.load(std::memory_order_acquire);
+    const uint64_t begin = end > ring.capacity ? end - ring.capacity : 0;
+    events.reserve(end - begin);
+    for (uint64_t index = begin; index < end; ++index) {
+        const ProfileSlot &slot = ring.slots[index & (ring.capacity - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != index) continue;
+        ProfileEvent event = slot.event;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) != index) continue;
+        events.push_back(event);
+    }
+}
+
+void profile_averages(const Profiler &profiler, int numFrames,
+                      std::vector<ProfileAverage> &averages)
+{
+    averages.clear();
+    if (!profiler.ring || profiler.frame == 0) return;
+
+    // GPU results arrive PROFILER_FRAMES_IN_FLIGHT frames late, so both are
+    // averaged over frames that have all their results
+    const uint64_t last = profiler.frame > uint64_t(PROFILER_FRAMES_IN_FLIGHT)
+                              ? profiler.frame - PROFILER_FRAMES_IN_FLIGHT
+                              : 0;
+    const uint64_t first = last > uint64_t(numFrames) ? last - numFrames + 1 : 1;
+    if (last < first) return;
+
+    std::vector<ProfileEvent> events;
+    read_events(profiler, events);
+    std::map<std::pair<std::string, bool>, size_t> indices;  // Into averages
+    for (const auto &event : events) {
+        if (event.frame < first || event.frame > last) continue;
+        const auto key = std::make_pair(std::string(event.name), event.gpu);
+        auto it = indices.find(key);
+        if (it == indices.end()) {
+            it = indices.insert(std::make_pair(key, averages.size())).first;
+            averages.push_back({event.name, event.gpu, 0.0});
+        }
+        averages[it->second].ms += event.durationMs;
+    }
+    for (auto &average : averages) average.ms /= double(last - first + 1);
+}
+
+static std::string escape_json(const char *text)
+{
+    std::string escaped;
+    for (const char *c = text; *c; ++c) {
+        if (*c == '"' || *c == '\\') escaped += '\\';
+        escaped += *c;
+    }
+    return escaped;
+}
+
+bool write_chrome_trace(const Profiler &profiler, const std::string &filename)
+{
+    std::vector<ProfileEvent> events;
+    read_events(profiler, events);
+
+    std::ofstream file(filename);
+    if (!file) return false;
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+            "\"args\":{\"name\":\"GPU\"}}";
+    std::set<uint32_t> threads;
+    for (const auto &event : events) threads.insert(event.thread);
+    for (uint32_t thread : threads) {
+        if (thread == 0) continue;
+        file << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread
+             << ",\"args\":{\"name\":\"" << (thread == 1 ? "Main" : "Worker") << " " << thread
+             << "\"}}";
+    }
+    char buffer[512];
+    for (const auto &event : events) {
+        // Timestamps are in microseconds
+        std::snprintf(buffer, sizeof(buffer),
+                      ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                      "\"pid\":1,\"tid\":%u,\"args\":{\"frame\":%llu,\"depth\":%d}}",
+                      escape_json(event.name).c_str(), event.gpu ? "gpu" : "cpu",
+                      1000.0 * event.startMs, 1000.0 * event.durationMs, event.thread,
+                      (unsigned long long)event.frame, event.depth);
+        file << buffer;
+    }
+    file << "\n]}\n";
+    return bool(file);
+}
+
+bool write_profile_csv(const Profiler &profiler, const std::string &filename)
+{
+    std::vector<ProfileEvent> events;
+    read_events(profiler, events);
+
+    std::ofstream file(filename);
+    if (!file) return false;
+    file << "frame,name,type,thread,depth,start_ms,duration_ms\n";
+    char buffer[512];
+    for (const auto &event : events) {
+        std::snprintf(buffer, sizeof(buffer), "%llu,%s,%s,%u,%d,%.4f,%.4f\n",
+                      (unsigned long long)event.frame, event.name, event.gpu ? "gpu" : "cpu",
+                      event.thread, event.depth, event.startMs, event.durationMs);
+        file << buffer;
+    }
+    return bool(file);
+}
+
+ProfileScope::ProfileScope(Profiler &profiler, const char *name)
+    : ProfileScope(&profiler, name)
+{
+}
+
+ProfileScope::ProfileScope(Profiler *profiler, const char *name)
+    : profiler(profiler), name(name), startMs(profiler ? profiler_time_ms(*profiler) : 0.0)
+{
+    scopeDepth += 1;
+}
+
+ProfileScope::~ProfileScope()
+{
+    scopeDepth -= 1;
+    if (!profiler || !profiler->enabled) return;
+
+    ProfileEvent event;
+    event.name = name;
+    event.frame = profiler->frame;
+    event.startMs = startMs;
+    event.durationMs = profiler_time_ms(*profiler) - startMs;
+    event.thread = thread_index();
+    event.depth = scopeDepth;
+    event.gpu = false;
+    record_event(*profiler, event);
+}
+
+void init_gpu_counter(GpuCounter &counter)
+{
+    counter = GpuCounter();
+    counter.invocations =
+        gl3wIsSupported(4, 6) || has_gl_extension("GL_ARB_pipeline_statistics_query");
+    counter.target = counter.invocations ? GL_FRAGMENT_SHADER_INVOCATIONS : GL_SAMPLES_PASSED;
+    glGenQueries(PROFILER_FRAMES_IN_FLIGHT, counter.queries);
+}
+
+void destroy_gpu_counter(GpuCounter &counter)
+{
+    glDeleteQueries(PROFILER_FRAMES_IN_FLIGHT, counter.queries);
+    counter = GpuCounter();
+}
+
+void begin_gpu_counter(GpuCounter &counter)
+{
+    if (!counter.target) return;
+    const int slot = int(counter.frame % PROFILER_FRAMES_IN_FLIGHT);
+    if (counter.pending[slot]) {
+        GLint available = 0;
+        glGetQueryObjectiv(counter.queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            GLuint64 value = 0;
+            glGetQueryObjectui64v(counter.queries[slot], GL_QUERY_RESULT, &value);
+            counter.value = value;
+        }
+        counter.pending[slot] = false;
+    }
+    glBeginQuery(counter.target, counter.queries[slot]);
+}
+
+void end_gpu_counter(GpuCounter &counter)
+{
+    if (!counter.target) return;
+    glEndQuery(counter.target);
+    counter.pending[counter.frame % PROFILER_FRAMES_IN_FLIGHT] = true;
+    counter.frame += 1;
+}
+
+GpuProfileScope::GpuProfileScope(Profiler &profiler, const char *name)
+    : profiler(profiler), active(false)
+{
+    if (profiler.gpuQueries.empty() || profiler.gpuScopeActive ||
+        profiler.gpuScopesThisFrame == PROFILER_MAX_GPU_SCOPES) {
+        return;
+    }
+
+    const int frameSlot = int(profiler.frame % PROFILER_FRAMES_IN_FLIGHT);
+    GpuQuery &query = profiler.gpuQueries[frameSlot * PROFILER_MAX_GPU_SCOPES +
+                                          profiler.gpuScopesThisFrame];
+    query.name = name;
+    query.frame = profiler.frame;
+    query.startMs = profiler_time_ms(profiler);
+    query.pending = true;
+    glBeginQuery(GL_TIME_ELAPSED, query.query);
+    profiler.gpuScopesThisFrame += 1;
+    profiler.gpuScopeActive = true;
+    active = true;
+}
+
+GpuProfileScope::~GpuProfileScope()
+{
+    if (!active) return;
+    glEndQuery(GL_TIME_ELAPSED);
+    profiler.gpuScopeActive = false;
+}
+
+}  // namespace cg
@@ -0,0 +1,160 @@
+// Frame profiler with nestable CPU scopes and GPU timer queries. Events go
+// into a lock-free ring buffer that can be exported as a Chrome trace
+// (chrome://tracing or Perfetto) or as CSV.
+//
+
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace cg {
+
+const int PROFILER_FRAMES_IN_FLIGHT = 3;   // GPU query results are read this many frames later
+const int PROFILER_MAX_GPU_SCOPES = 16;    // Per frame
+const int PROFILER_HISTORY = 240;          // Frames kept for the frame time graph
+
+struct ProfileEvent {
+    const char *name;     // Must outlive the profiler (string literals)
+    uint64_t frame;
+    double startMs;       // Since the profiler was created
+    double durationMs;
+    uint32_t thread;      // Small id of the recording thread (0 for GPU events)
+    int depth;            // Nesting level of CPU scopes on the same thread
+    bool gpu;
+};
+
+struct ProfileSlot {
+    std::atomic<uint64_t> sequence;  // Index of the event in the slot, or ~0 while written
+    ProfileEvent event;
+};
+
+struct GpuQuery {
+    GLuint query;
+    const char *name;
+    uint64_t frame;
+    double startMs;  // CPU time when the commands were issued
+    bool pending;
+};
+
+// Multi-producer ring buffer of events, overwriting the oldest ones
+struct ProfileRing {
+    std::unique_ptr<ProfileSlot[]> slots;
+    uint64_t capacity = 0;  // Power of two
+    std::atomic<uint64_t> writeIndex{0};
+};
+
+struct ProfileAverage {
+    const char *name;
+    bool gpu;
+    double ms;  // Average per frame
+};
+
+struct Profiler {
+    bool enabled = true;
+    std::unique_ptr<ProfileRing> ring;  // On the heap, so that the profiler can be moved
+    std::chrono::steady_clock::time_point start;
+
+    uint64_t frame = 0;
+    double frameStartMs = 0.0;
+    std::vector<GpuQuery> gpuQueries;  // PROFILER_MAX_GPU_SCOPES per frame in flight
+    int gpuScopesThisFrame = 0;
+    bool gpuScopeActive = false;
+    int droppedGpuResults = 0;  // Results that were not ready in time (never waited for)
+
+    // Frame times for the graph (oldest first). GPU times arrive late, and
+    // not every frame; newGpuFrameMs tells whether gpuFrameMs.back() arrived
+    // in the current frame.
+    std::vector<float> cpuFrameMs = std::vector<float>(PROFILER_HISTORY, 0.0f);
+    std::vector<float> gpuFrameMs = std::vector<float>(PROFILER_HISTORY, 0.0f);
+    bool newGpuFrameMs = false;
+};
+
+// Allocates the ring buffer (capacity is rounded up to a power of two) and
+// the GPU queries. Needs a current OpenGL context.
+void init_profiler(Profiler &profiler, uint64_t capacity = 1 << 16);
+
+void destroy_profiler(Profiler &profiler);
+
+// Returns the milliseconds since the profiler was created
+double profiler_time_ms(const Profiler &profiler);
+
+// Adds an event to the ring buffer. Safe to call from any thread.
+void record_event(Profiler &profiler, const ProfileEvent &event);
+
+// Starts a new frame: records the previous frame and collects the GPU query
+// results of the frame that was PROFILER_FRAMES_IN_FLIGHT frames ago.
+// Results that are still not available are dropped rather than waited for.
+// GPU scopes are timed also when recording is disabled, since the frame
+// times feed the graph and dynamic resolution.
+void begin_profiler_frame(Profiler &profiler);
+
+// Copies the events in the ring buffer, oldest first. Events that are being
+// overwritten while copying are skipped.
+void read_events(const Profiler &profiler, std::vector<ProfileEvent> &events);
+
+// Averages the duration of each named scope over the most recent frames
+void profile_averages(const Profiler &profiler, int numFrames,
+                      std::vector<ProfileAverage> &averages);
+
+// Writes the events as Chrome trace JSON (complete events, one track per
+// thread and one for the GPU)
+bool write_chrome_trace(const Profiler &profiler, const std::string &filename);
+
+bool write_profile_csv(const Profiler &profiler, const std::string &filename);
+
+// Counts the fragments of the GL commands between begin_gpu_counter() and
+// end_gpu_counter(), with a query per frame in flight that is read (never
+// waited for) when its slot comes around again. Counts fragment shader
+// invocations where pipeline statistics queries are supported, and otherwise
+// the samples that pass the depth test, which is the same for opaque geometry
+// that is depth tested before shading.
+struct GpuCounter {
+    GLenum target = 0;
+    GLuint queries[PROFILER_FRAMES_IN_FLIGHT] = {0};
+    bool pending[PROFILER_FRAMES_IN_FLIGHT] = {false};
+    uint64_t frame = 0;
+    uint64_t value = 0;  // Most recent result
+    bool invocations = false;  // Whether target counts fragment shader invocations
+};
+
+void init_gpu_counter(GpuCounter &counter);
+
+void destroy_gpu_counter(GpuCounter &counter);
+
+// Starts counting. Call at most once per frame, and only one counter at a
+// time (queries of the same target cannot nest).
+void begin_gpu_counter(GpuCounter &counter);
+
+void end_gpu_counter(GpuCounter &counter);
+
+// Times the enclosing block on the CPU. Scopes can nest, also on worker
+// threads. A null profiler makes the scope do nothing.
+struct ProfileScope {
+    Profiler *profiler;
+    const char *name;
+    double startMs;
+
+    ProfileScope(Profiler &profiler, const char *name);
+    ProfileScope(Profiler *profiler, const char *name);
+    ~ProfileScope();
+};
+
+// Times the GL commands of the enclosing block with a GL_TIME_ELAPSED query.
+// These cannot nest (only one such query can be active), so inner scopes are
+// ignored.
+struct GpuProfileScope {
+    Profiler &profiler;
+    bool active;
+
+    GpuProfileScope(Profiler &profiler, const char *name);
+    ~GpuProfileScope();
+};
+
+}  // namespace cg
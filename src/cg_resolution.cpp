@@ -0,0 +1,118 @@
+// Dynamic resolution scaling.
+//
+
+#include "cg_resolution.h"
+#include "cg_memory.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+namespace cg {
+
+// Sets the scale and starts measuring again. Returns whether it changed.
+static bool set_scale(DynamicResolution &resolution, float scale)
+{
+    if (scale == resolution.scale) return false;
+    resolution.scale = scale;
+    resolution.smoothedMs = 0.0f;
+    resolution.samples = 0;
+    return true;
+}
+
+bool update_dynamic_resolution(DynamicResolution &resolution, float gpuFrameMs,
+                               const ResolutionSettings &settings)
+{
+    const float minScale = std::min(settings.minScale, settings.maxScale);
+    if (!settings.enabled) return set_scale(resolution, settings.maxScale);
+    const float scale = std::min(std::max(resolution.scale, minScale), settings.maxScale);
+    if (set_scale(resolution, scale)) return true;  // The limits changed
+    if (gpuFrameMs <= 0.0f || settings.targetFps <= 0.0f) return false;
+
+    // Frames that were in flight when the scale changed are not measured, and
+    // the average needs a few frames to settle
+    resolution.samples += 1;
+    if (resolution.samples <= settings.settleFrames) return false;
+    const float average = resolution.smoothedMs;
+    resolution.smoothedMs = average > 0.0f ? average + 0.2f * (gpuFrameMs - average) : gpuFrameMs;
+    if (resolution.samples < settings.settleFrames + 4) return false;
+
+    const float targetMs = settings.headroom * 1000.0f / settings.targetFps;
+    const float error = resolution.smoothedMs / targetMs;
+    if (std::abs(error - 1.0f) <= settings.tolerance) return false;
+
+    // Not all of the cost goes with the pixel count (e.g., shadow maps), so
+    // the step is limited and the controller gets there over a few changes
+    const float step = std::min(std::max(1.0f / std::sqrt(error), 0.75f), 1.25f);
+    float next = std::min(std::max(scale * step, minScale), settings.maxScale);
+    next = std::round(next * 64.0f) / 64.0f;  // Avoids tiny changes
+    next = std::min(std::max(next, minScale), settings.maxScale);
+    return set_scale(resolution, next);
+}
+
+void resize_render_target(RenderTarget &target, int width, int height)
+{
+    width = std::max(width, 1);
+    height = std::max(height, 1);
+    if (target.framebuffer && target.width == width && target.height == height) return;
+    destroy_render_target(target);
+    target.width = width;
+    target.height = height;
+
+    glGenRenderbuffers(1, &target.color);
+    glBindRenderbuffer(GL_RENDERBUFFER, target.color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glGenRenderbuffers(1, &target.depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, target.depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenFramebuffers(1, &target.framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, target.color);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, target.depth);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cerr << "Error: framebuffer object not complete" << std::endl;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    const size_t pixels = size_t(width) * height;
+    track_gpu_object(MEMORY_FRAMEBUFFERS, GPU_RENDERBUFFER, target.color, pixels * 4,
+                     "scene color (dynamic resolution)");
+    track_gpu_object(MEMORY_FRAMEBUFFERS, GPU_RENDERBUFFER, target.depth, pixels * 4,
+                     "scene depth (dynamic resolution)");
+    track_gpu_object(MEMORY_FRAMEBUFFERS, GPU_FRAMEBUFFER, target.framebuffer, 0,
+                     "scene framebuffer (dynamic resolution)");
+}
+
+void destroy_render_target(RenderTarget &target)
+{
+    if (target.framebuffer) {
+        untrack_gpu_object(GPU_FRAMEBUFFER, target.framebuffer);
+        glDeleteFramebuffers(1, &target.framebuffer);
+    }
+    for (GLuint *renderbuffer : {&target.color, &target.depth}) {
+        if (!*renderbuffer) continue;
+        untrack_gpu_object(GPU_RENDERBUFFER, *renderbuffer);
+        glDeleteRenderbuffers(1, renderbuffer);
+    }
+    target = RenderTarget();
+}
+
+int scaled_size(int size, float scale)
+{
+    return std::max(1, int(std::lround(size * scale)));
+}
+
+void upscale_render_target(const RenderTarget &target, int width, int height, int windowWidth,
+                           int windowHeight)
+{
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, target.framebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    const bool native = width == windowWidth && height == windowHeight;
+    glBlitFramebuffer(0, 0, width, height, 0, 0, windowWidth, windowHeight, GL_COLOR_BUFFER_BIT,
+                      native ? GL_NEAREST : GL_LINEAR);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+}
+
+}  // namespace cg
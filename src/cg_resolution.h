@@ -0,0 +1,61 @@
+// Dynamic resolution scaling: the scene is rendered into an offscreen target
+// at a fraction of the window size, and upscaled to the window. A controller
+// adjusts the fraction from the measured GPU frame time, to hold a target
+// frame rate as the cost of the scene changes.
+//
+
+#pragma once
+
+#include <GL/gl3w.h>
+
+namespace cg {
+
+struct ResolutionSettings {
+    bool enabled = true;
+    float targetFps = 60.0f;
+    float minScale = 0.25f;  // Of the window width and height
+    float maxScale = 1.0f;
+    float headroom = 0.9f;      // Aims at this fraction of the frame time of the target
+    float tolerance = 0.1f;     // Relative error of the frame time that is left alone
+    int settleFrames = 8;       // Ignored after a change (GPU times arrive late)
+};
+
+struct DynamicResolution {
+    float scale = 1.0f;
+    float smoothedMs = 0.0f;  // Average GPU frame time at the current scale (0 = none yet)
+    int samples = 0;          // Since the last change
+};
+
+// Takes the GPU time of a frame whose result arrived since the last call (0
+// if none did, since an old result must not be counted again), and adjusts
+// the scale if the average at the current scale is off the target.
+// The pixel count, and roughly the cost, goes with the square of the scale.
+// Returns whether the scale changed.
+bool update_dynamic_resolution(DynamicResolution &resolution, float gpuFrameMs,
+                               const ResolutionSettings &settings);
+
+// Color and depth renderbuffers in a framebuffer, allocated at the window size
+// so that any smaller scale renders into its lower-left corner without
+// allocating again
+struct RenderTarget {
+    GLuint framebuffer = 0;
+    GLuint color = 0;
+    GLuint depth = 0;
+    int width = 0;
+    int height = 0;
+};
+
+// Allocates the target if its size changed
+void resize_render_target(RenderTarget &target, int width, int height);
+
+void destroy_render_target(RenderTarget &target);
+
+// Returns the size of a scaled rendering of a window dimension (at least 1)
+int scaled_size(int size, float scale);
+
+// Upscales the lower-left width x height of the target to the whole default
+// framebuffer (windowWidth x windowHeight) with bilinear filtering
+void upscale_render_target(const RenderTarget &target, int width, int height, int windowWidth,
+                           int windowHeight);
+
+}  // namespace cg
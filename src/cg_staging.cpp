@@ -0,0 +1,105 @@
+// Ring of staging memory in a GL buffer, for uploading large buffers and
+// textures in slices over several frames without stalling the GL thread.
+//
+
+#include "cg_staging.h"
+#include "cg_utils.h"
+
+#include <cstring>
+
+namespace cg {
+
+void init_staging_ring(StagingRing &ring, size_t size)
+{
+    destroy_staging_ring(ring);
+    ring.size = size;
+    glGenBuffers(1, &ring.buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, ring.buffer);
+    if (gl3wIsSupported(4, 4) || has_gl_extension("GL_ARB_buffer_storage")) {
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_COPY_WRITE_BUFFER, size, nullptr, flags);
+        ring.mapped = (char *)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size, flags);
+    } else {
+        glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    track_gpu_object(MEMORY_BUFFERS, GPU_BUFFER, ring.buffer, size, "staging ring");
+}
+
+void destroy_staging_ring(StagingRing &ring)
+{
+    for (const StagingFence &fence : ring.fences) {
+        glClientWaitSync(fence.sync, GL_SYNC_FLUSH_COMMANDS_BIT, GLuint64(1000000000));
+        glDeleteSync(fence.sync);
+    }
+    if (ring.mapped) {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, ring.buffer);
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+    if (ring.buffer) {
+        untrack_gpu_object(GPU_BUFFER, ring.buffer);
+        glDeleteBuffers(1, &ring.buffer);
+    }
+    ring = StagingRing();
+}
+
+// Frees the regions that the GPU has finished reading (without waiting)
+static void retire_fences(StagingRing &ring)
+{
+    while (!ring.fences.empty()) {
+        GLint status = GL_UNSIGNALED;
+        glGetSynciv(ring.fences.front().sync, GL_SYNC_STATUS, 1, nullptr, &status);
+        if (status != GL_SIGNALED) break;
+        glDeleteSync(ring.fences.front().sync);
+        ring.usedBytes -= ring.fences.front().bytes;
+        ring.fences.pop_front();
+    }
+    if (!ring.usedBytes) ring.head = 0;
+}
+
+bool stage_data(StagingRing &ring, const void *data, size_t size, size_t &offset,
+                size_t alignment)
+{
+    if (!ring.buffer || size > ring.size) return false;
+    retire_fences(ring);
+
+    // A slice that does not fit before the end of the ring starts over at
+    // the beginning, and the skipped bytes count as used until then
+    size_t padding = (alignment - ring.head % alignment) % alignment;
+    if (ring.head + padding + size > ring.size) padding = ring.size - ring.head;
+    if (ring.usedBytes + padding + size > ring.size) return false;
+    offset = (ring.head + padding) % ring.size;
+
+    if (ring.mapped) {
+        std::memcpy(ring.mapped + offset, data, size);
+    } else {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, ring.buffer);
+        const GLbitfield flags =
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
+        void *memory = glMapBufferRange(GL_COPY_WRITE_BUFFER, offset, size, flags);
+        if (!memory) {
+            glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+            return false;
+        }
+        std::memcpy(memory, data, size);
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+    ring.head = offset + size;
+    ring.usedBytes += padding + size;
+    ring.unfencedBytes += padding + size;
+    return true;
+}
+
+void fence_staged_data(StagingRing &ring)
+{
+    if (!ring.unfencedBytes) return;
+    StagingFence fence;
+    fence.sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    fence.bytes = ring.unfencedBytes;
+    ring.fences.push_back(fence);
+    ring.unfencedBytes = 0;
+}
+
+}  // namespace cg
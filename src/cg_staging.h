@@ -0,0 +1,52 @@
+// Ring of staging memory in a GL buffer, for uploading large buffers and
+// textures in slices over several frames without stalling the GL thread.
+//
+// Slices are copied into the ring on the CPU, and the GL copies them from
+// there to their destination (glCopyBufferSubData, or glTexSubImage2D with the
+// ring bound as GL_PIXEL_UNPACK_BUFFER). One fence per frame tells when the
+// GPU has read a region, so that it can be written again. With
+// ARB_buffer_storage the ring stays mapped; otherwise each slice is mapped
+// unsynchronized, which the fences make safe.
+//
+
+#pragma once
+
+#include <GL/gl3w.h>
+
+#include <cstddef>
+#include <deque>
+
+namespace cg {
+
+struct StagingFence {
+    GLsync sync;
+    size_t bytes;  // Of the ring (including padding), free again once signaled
+};
+
+struct StagingRing {
+    GLuint buffer = 0;
+    size_t size = 0;
+    size_t head = 0;           // Where the next slice is written
+    size_t usedBytes = 0;      // Not yet read by the GPU, including padding
+    size_t unfencedBytes = 0;  // Staged since the last fence
+    char *mapped = nullptr;    // Persistent mapping (null without ARB_buffer_storage)
+    std::deque<StagingFence> fences;  // Oldest first
+};
+
+void init_staging_ring(StagingRing &ring, size_t size);
+
+// Waits for the GPU to finish with the ring, and deletes it
+void destroy_staging_ring(StagingRing &ring);
+
+// Copies a slice into the ring and returns its offset in the ring buffer (a
+// multiple of alignment). Returns false without copying if there is no room
+// until the GPU has read earlier slices, or if the slice is larger than the
+// ring. Leaves no buffer bound to GL_COPY_WRITE_BUFFER.
+bool stage_data(StagingRing &ring, const void *data, size_t size, size_t &offset,
+                size_t alignment = 16);
+
+// Fences the slices staged since the last call. Call after issuing the copies
+// that read them, typically once per frame.
+void fence_staged_data(StagingRing &ring);
+
+}  // namespace cg
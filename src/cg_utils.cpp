@@ -4,10 +4,14 @@
 //
 
 #include "cg_utils.h"
+#include "cg_loadstats.h"
+#include "cg_mipmap.h"
+#include "cg_parallel.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
@@ -53,6 +57,30 @@ std::string get_env_var(const std::string &name)
     }
 }
 
+bool read_file(const std::string &filename, std::vector<char> &data)
+{
+    LoadScope scope(LOAD_FILE_IO, "read_file");
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) return false;
+    file.seekg(0, std::ios::end);
+    data.resize(size_t(file.tellg()));
+    file.seekg(0, std::ios::beg);
+    if (!data.empty()) file.read(&data[0], data.size());
+    scope.bytes = data.size();
+    return bool(file);
+}
+
+bool has_gl_extension(const std::string &name)
+{
+    GLint numExtensions = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &numExtensions);
+    for (GLint i = 0; i < numExtensions; ++i) {
+        const GLubyte *extension = glGetStringi(GL_EXTENSIONS, i);
+        if (extension && name.compare((const char *)extension) == 0) return true;
+    }
+    return false;
+}
+
 void reset_gl_render_state()
 {
     // See e.g. http://docs.gl for information about each state
@@ -86,39 +114,36 @@ void reset_gl_render_state()
     glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
 }
 
-GLuint load_shader_program(const std::string &vertexShaderFilename,
-                           const std::string &fragmentShaderFilename)
+// Loads and compiles one stage of a shader program. Returns 0 (and prints the
+// log) if it does not compile.
+static GLuint compile_shader(GLenum type, const std::string &filename, const char *stage,
+                             LoadScope &scope)
 {
-    // Load and compile vertex shader
-    GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    std::string vertexShaderSource = read_shader_source(vertexShaderFilename);
-    const char *vertexShaderSourcePtr = vertexShaderSource.c_str();
-    glShaderSource(vertexShader, 1, &vertexShaderSourcePtr, nullptr);
+    GLuint shader = glCreateShader(type);
+    std::string source = read_shader_source(filename);
+    scope.bytes += source.size();
+    const char *sourcePtr = source.c_str();
+    glShaderSource(shader, 1, &sourcePtr, nullptr);
 
-    glCompileShader(vertexShader);
+    glCompileShader(shader);
     GLint compiled = 0;
-    glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &compiled);
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
     if (!compiled) {
-        std::cerr << "Vertex shader compilation failed:" << std::endl;
-        show_shader_info_log(vertexShader);
-        glDeleteShader(vertexShader);
+        std::cerr << stage << " shader compilation failed:" << std::endl;
+        show_shader_info_log(shader);
+        glDeleteShader(shader);
         return 0;
     }
+    return shader;
+}
 
-    // Load and compile fragment shader
-    GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    std::string fragmentShaderSource = read_shader_source(fragmentShaderFilename);
-    const char *fragmentShaderSourcePtr = fragmentShaderSource.c_str();
-    glShaderSource(fragmentShader, 1, &fragmentShaderSourcePtr, nullptr);
-
-    glCompileShader(fragmentShader);
-    compiled = 0;
-    glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &compiled);
-    if (!compiled) {
-        std::cerr << "Fragment shader compilation failed:" << std::endl;
-        show_shader_info_log(fragmentShader);
-        glDeleteShader(vertexShader);
-        glDeleteShader(fragmentShader);
+// Links compiled shaders into a program, and deletes them. Returns 0 if any
+// of them is missing or linking fails.
+static GLuint link_shader_program(const GLuint *shaders, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        if (shaders[i]) continue;
+        for (int j = 0; j < count; ++j) glDeleteShader(shaders[j]);
         return 0;
     }
 
@@ -127,10 +152,10 @@ GLuint load_shader_program(const std::string &vertexShaderFilename,
 
     // Attach shaders to the program. Also flag the shaders for automatic
     // deletion after their shader program is destroyed.
-    glAttachShader(program, vertexShader);
-    glDeleteShader(vertexShader);
-    glAttachShader(program, fragmentShader);
-    glDeleteShader(fragmentShader);
+    for (int i = 0; i < count; ++i) {
+        glAttachShader(program, shaders[i]);
+        glDeleteShader(shaders[i]);
+    }
 
     // Link program
     glLinkProgram(program);
@@ -142,14 +167,44 @@ GLuint load_shader_program(const std::string &vertexShaderFilename,
         std::cerr << "Linking failed:" << std::endl;
         show_program_info_log(program);
         glDeleteProgram(program);
-        glDeleteShader(vertexShader);
-        glDeleteShader(fragmentShader);
         return 0;
     }
 
     return program;
 }
 
+GLuint load_shader_program(const std::string &vertexShaderFilename,
+                           const std::string &fragmentShaderFilename)
+{
+    // Reading the sources is counted as compilation, since the files are tiny
+    // and the checks below wait for the driver to finish compiling and linking
+    LoadScope scope(LOAD_SHADER_COMPILE, "load_shader_program");
+
+    GLuint shaders[2] = {compile_shader(GL_VERTEX_SHADER, vertexShaderFilename, "Vertex", scope),
+                         0};
+    if (shaders[0]) {
+        shaders[1] = compile_shader(GL_FRAGMENT_SHADER, fragmentShaderFilename, "Fragment", scope);
+    }
+    return link_shader_program(shaders, 2);
+}
+
+GLuint load_shader_program(const std::string &vertexShaderFilename,
+                           const std::string &geometryShaderFilename,
+                           const std::string &fragmentShaderFilename)
+{
+    LoadScope scope(LOAD_SHADER_COMPILE, "load_shader_program");
+
+    GLuint shaders[3] = {compile_shader(GL_VERTEX_SHADER, vertexShaderFilename, "Vertex", scope),
+                         0, 0};
+    if (shaders[0]) {
+        shaders[1] = compile_shader(GL_GEOMETRY_SHADER, geometryShaderFilename, "Geometry", scope);
+    }
+    if (shaders[1]) {
+        shaders[2] = compile_shader(GL_FRAGMENT_SHADER, fragmentShaderFilename, "Fragment", scope);
+    }
+    return link_shader_program(shaders, 3);
+}
+
 GLuint load_texture_2d(const std::string &filename)
 {
     // Load image file (as an RGBA image with four components)
@@ -176,82 +231,189 @@ GLuint load_texture_2d(const std::string &filename)
     return texture;
 }
 
-// Load cubemap texture and let OpenGL generate a mipmap chain
-GLuint load_cubemap(const std::string &dirname)
+// Load cubemap texture and generate its mipmap chain on the CPU
+GLuint load_cubemap(const std::string &dirname, int format)
 {
     const char *filenames[] = {"posx.png", "negx.png", "posy.png",
                                "negy.png", "posz.png", "negz.png"};
-    const GLenum targets[] = {GL_TEXTURE_CUBE_MAP_POSITIVE_X, GL_TEXTURE_CUBE_MAP_NEGATIVE_X,
-                              GL_TEXTURE_CUBE_MAP_POSITIVE_Y, GL_TEXTURE_CUBE_MAP_NEGATIVE_Y,
-                              GL_TEXTURE_CUBE_MAP_POSITIVE_Z, GL_TEXTURE_CUBE_MAP_NEGATIVE_Z};
     const unsigned nSides = 6;  // A cube always has six sides...
 
-    // Create texture object for the cubemap
-    GLuint texture;
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    for (unsigned i = 0; i < nSides; ++i) {
-        // Load image for current cube side
+    // Decode the images and build their mipmap chains on worker threads, one
+    // side per job, so that only the uploads are left for the GL thread. The
+    // images are sRGB, so they are filtered in linear space.
+    std::vector<std::vector<std::vector<char> > > chains(nSides);
+    std::vector<int> widths(nSides), heights(nSides);
+    std::vector<std::string> errors(nSides);
+    parallel_for(nSides, [&](int i) {
         std::string filename = dirname + "/" + filenames[i];
-        int width, height, comp;
-        uint8_t *image = stbi_load(filename.c_str(), &width, &height, &comp, 4);
+        int comp;
+        uint8_t *image = stbi_load(filename.c_str(), &widths[i], &heights[i], &comp, 4);
         if (image == nullptr) {
-            std::cerr << "Error: " << stbi_failure_reason() << std::endl;
-            std::exit(EXIT_FAILURE);
+            errors[i] = stbi_failure_reason();
+            return;
         }
-        glTexImage2D(targets[i], 0, GL_SRGB8_ALPHA8, width, height,
-                     0, GL_RGBA, GL_UNSIGNED_BYTE, image);
+        generate_mip_chain(image, widths[i], heights[i], MIP_FILTER_KAISER, MIP_CONTENT_SRGB,
+                           chains[i]);
         stbi_image_free(image);  // Clean up resources
+    });
+    for (unsigned i = 0; i < nSides; ++i) {
+        if (!errors[i].empty()) {
+            std::cerr << "Error: " << errors[i] << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        if (widths[i] != heights[i] || widths[i] != widths[0]) {
+            std::cerr << "Error: The faces in " << dirname << " are not square and equal"
+                      << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
     }
-    glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
 
-    return texture;
+    std::vector<CubemapFaces> levels(chains[0].size());
+    for (unsigned level = 0; level < levels.size(); ++level) {
+        levels[level].size = std::max(1, widths[0] >> level);
+        for (unsigned i = 0; i < nSides; ++i) levels[level].faces[i].swap(chains[i][level]);
+    }
+    if (format) compress_cubemap(levels, format);
+    return create_cubemap(levels);
 }
 
-// Load cubemap with pre-computed mipmap chain
-GLuint load_cubemap_prefiltered(const std::string &dirname)
+// Load cubemap with pre-computed mipmap chain. Each roughness level becomes a
+// mip level of the same cubemap, so that shaders can select roughness with
+// textureLod(). The prefiltered images are all stored at the same size, so
+// level i is downsampled to (size >> i) first; they are blurred enough by the
+// prefiltering that this loses little.
+void load_cubemap_prefiltered(const std::string &dirname, std::vector<CubemapFaces> &levels)
 {
-    const char *levels[] = {"2048", "512", "128", "32", "8", "2", "0.5", "0.125"};
+    const char *levelDirs[] = {"2048", "512", "128", "32", "8", "2", "0.5", "0.125"};
     const char *filenames[] = {"posx.png", "negx.png", "posy.png",
                                "negy.png", "posz.png", "negz.png"};
-    const GLenum targets[] = {GL_TEXTURE_CUBE_MAP_POSITIVE_X, GL_TEXTURE_CUBE_MAP_NEGATIVE_X,
-                              GL_TEXTURE_CUBE_MAP_POSITIVE_Y, GL_TEXTURE_CUBE_MAP_NEGATIVE_Y,
-                              GL_TEXTURE_CUBE_MAP_POSITIVE_Z, GL_TEXTURE_CUBE_MAP_NEGATIVE_Z};
-    const unsigned nLevels = sizeof(levels) / sizeof(levels[0]);
+    const unsigned nLevels = sizeof(levelDirs) / sizeof(levelDirs[0]);
     const unsigned nSides = 6;  // A cube always has six sides...
 
-    // Create texture object for the cubemap
-    GLuint texture;
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    for (unsigned i = 0; i < nLevels; ++i) {
-        for (unsigned j = 0; j < nSides; ++j) {
-            // Load image for current mip level and cube side
-            std::string filename = dirname + "/" + levels[i] + "/" + filenames[j];
-            int width, height, comp;
-            uint8_t *image = stbi_load(filename.c_str(), &width, &height, &comp, 4);
-            if (image == nullptr) {
-                std::cerr << "Error: " << stbi_failure_reason() << std::endl;
-                std::exit(EXIT_FAILURE);
+    // Read the files on this thread (so that file I/O and decoding are timed
+    // separately), then decode and downsample on worker threads, one image
+    // per job
+    std::vector<std::vector<char> > files(nLevels * nSides);
+    for (unsigned job = 0; job < nLevels * nSides; ++job) {
+        const unsigned i = job / nSides, j = job % nSides;
+        std::string filename = dirname + "/" + levelDirs[i] + "/" + filenames[j];
+        if (!read_file(filename, files[job])) {
+            std::cerr << "Error: Could not read " << filename << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::vector<std::vector<char> > images(nLevels * nSides);
+    std::vector<int> widths(nLevels * nSides), heights(nLevels * nSides);
+    std::vector<std::string> errors(nLevels * nSides);
+    LoadScope decodeScope(LOAD_IMAGE_DECODE, "decode_cubemap");
+    parallel_for(nLevels * nSides, [&](int job) {
+        const int i = job / nSides;
+        int comp;
+        uint8_t *image = stbi_load_from_memory((const stbi_uc *)files[job].data(),
+                                               int(files[job].size()), &widths[job],
+                                               &heights[job], &comp, 4);
+        if (image == nullptr) {
+            errors[job] = stbi_failure_reason();
+            return;
+        }
+        if (i == 0) {
+            images[job].assign((const char *)image,
+                               (const char *)image + size_t(widths[job]) * heights[job] * 4);
+        } else {
+            std::vector<std::vector<char> > chain;
+            generate_mip_chain(image, widths[job], heights[job], MIP_FILTER_KAISER,
+                               MIP_CONTENT_SRGB, chain);
+            const int level = std::min<int>(i, chain.size() - 1);
+            images[job].swap(chain[level]);
+            widths[job] = std::max(1, widths[job] >> level);
+            heights[job] = std::max(1, heights[job] >> level);
+        }
+        stbi_image_free(image);  // Clean up resources
+    });
+
+    levels.assign(nLevels, CubemapFaces());
+    for (unsigned job = 0; job < nLevels * nSides; ++job) {
+        const unsigned i = job / nSides, j = job % nSides;
+        if (!errors[job].empty()) {
+            std::cerr << "Error: " << errors[job] << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        if (widths[job] != heights[job] || widths[job] != widths[i * nSides]) {
+            std::cerr << "Error: The faces in " << dirname << "/" << levelDirs[i]
+                      << " are not square and equal" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        levels[i].size = widths[job];
+        levels[i].faces[j].swap(images[job]);
+        decodeScope.bytes += levels[i].faces[j].size();
+    }
+}
+
+size_t texture_memory_size(GLenum target, GLuint texture)
+{
+    const GLenum bindings[][2] = {{GL_TEXTURE_2D, GL_TEXTURE_BINDING_2D},
+                                  {GL_TEXTURE_CUBE_MAP, GL_TEXTURE_BINDING_CUBE_MAP}};
+    GLint previous = 0;
+    for (const auto &binding : bindings) {
+        if (binding[0] == target) glGetIntegerv(binding[1], &previous);
+    }
+
+    const GLenum cubeFaces[] = {GL_TEXTURE_CUBE_MAP_POSITIVE_X, GL_TEXTURE_CUBE_MAP_NEGATIVE_X,
+                                GL_TEXTURE_CUBE_MAP_POSITIVE_Y, GL_TEXTURE_CUBE_MAP_NEGATIVE_Y,
+                                GL_TEXTURE_CUBE_MAP_POSITIVE_Z, GL_TEXTURE_CUBE_MAP_NEGATIVE_Z};
+    const bool cube = target == GL_TEXTURE_CUBE_MAP;
+    size_t bytes = 0;
+    glBindTexture(target, texture);
+    for (int level = 0; level < 16; ++level) {
+        GLint width = 0, height = 0, compressed = 0;
+        const GLenum face = cube ? cubeFaces[0] : target;
+        glGetTexLevelParameteriv(face, level, GL_TEXTURE_WIDTH, &width);
+        glGetTexLevelParameteriv(face, level, GL_TEXTURE_HEIGHT, &height);
+        if (width == 0 || height == 0) continue;  // Released or never specified
+        glGetTexLevelParameteriv(face, level, GL_TEXTURE_COMPRESSED, &compressed);
+
+        size_t levelBytes = 0;
+        if (compressed) {
+            GLint size = 0;
+            glGetTexLevelParameteriv(face, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+            levelBytes = size;
+        } else {
+            const GLenum sizes[] = {GL_TEXTURE_RED_SIZE, GL_TEXTURE_GREEN_SIZE,
+                                    GL_TEXTURE_BLUE_SIZE, GL_TEXTURE_ALPHA_SIZE,
+                                    GL_TEXTURE_DEPTH_SIZE, GL_TEXTURE_STENCIL_SIZE};
+            GLint bits = 0;
+            for (GLenum size : sizes) {
+                GLint value = 0;
+                glGetTexLevelParameteriv(face, level, size, &value);
+                bits += value;
             }
-            glTexImage2D(targets[j], i, GL_SRGB8_ALPHA8, width, height, 0, GL_RGBA,
-                         GL_UNSIGNED_BYTE, image);
-            stbi_image_free(image);  // Clean up resources
+            levelBytes = size_t(width) * height * ((bits + 7) / 8);
         }
+        bytes += levelBytes * (cube ? 6 : 1);
     }
-    glGenerateMipmap(GL_TEXTURE_CUBE_MAP);  // Fix for mipmap completeness
-    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    glBindTexture(target, previous);
 
-    return texture;
+    return bytes;
+}
+
+void track_texture(MemoryCategory category, GLenum target, GLuint texture,
+                   const std::string &label)
+{
+    track_gpu_object(category, GPU_TEXTURE, texture, texture_memory_size(target, texture), label);
+}
+
+size_t available_gpu_memory()
+{
+    // Both extensions report kilobytes
+    static const bool hasNVX = has_gl_extension("GL_NVX_gpu_memory_info");
+    static const bool hasATI = has_gl_extension("GL_ATI_meminfo");
+    GLint values[4] = {0, 0, 0, 0};
+    if (hasNVX) {
+        glGetIntegerv(0x9049 /*GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX*/, values);
+    } else if (hasATI) {
+        glGetIntegerv(0x87FC /*GL_TEXTURE_FREE_MEMORY_ATI*/, values);
+    }
+    return size_t(std::max(values[0], 0)) << 10;
 }
 
 GLuint create_depth_texture(int width, int height)
@@ -270,6 +432,25 @@ GLuint create_depth_texture(int width, int height)
     return depthTexture;
 }
 
+GLuint create_depth_cubemap(int size)
+{
+    GLuint depthCubemap;
+    glGenTextures(1, &depthCubemap);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, depthCubemap);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    for (int face = 0; face < 6; ++face) {
+        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_DEPTH_COMPONENT, size, size,
+                     0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+    }
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+    return depthCubemap;
+}
+
 GLuint create_depth_framebuffer(GLuint depthTexture)
 {
     GLuint depthFramebuffer;
@@ -5,8 +5,12 @@
 
 #pragma once
 
+#include "cg_memory.h"
+#include "cg_prefilter.h"
+
 #include <GL/gl3w.h>
 
+#include <cstddef>
 #include <string>
 #include <vector>
 
@@ -15,6 +19,13 @@ namespace cg {
 // Helper function for loading values from environment variables
 std::string get_env_var(const std::string &name);
 
+// Reads a whole file (timed as file I/O in the active load report). Returns
+// false if the file could not be opened or read.
+bool read_file(const std::string &filename, std::vector<char> &data);
+
+// Returns true if the current OpenGL context supports an extension
+bool has_gl_extension(const std::string &name);
+
 // This function should be called at the beginning of each frame and whenever
 // we want to restore the OpenGL pipeline to its default state. Feel free to
 // change or extend this function if necessary!
@@ -23,14 +34,41 @@ void reset_gl_render_state();
 GLuint load_shader_program(const std::string &vertexShaderFilename,
                            const std::string &fragmentShaderFilename);
 
+// Same, with a geometry shader between the vertex and fragment shaders
+GLuint load_shader_program(const std::string &vertexShaderFilename,
+                           const std::string &geometryShaderFilename,
+                           const std::string &fragmentShaderFilename);
+
 GLuint load_texture_2d(const std::string &filename);
 
-GLuint load_cubemap(const std::string &filename);
+// Loads a cubemap and generates its mip chain on the CPU. With a BCn format
+// (FORMAT_BC1 or FORMAT_BC7), every level is compressed before the upload.
+GLuint load_cubemap(const std::string &filename, int format = 0);
+
+// Loads the precomputed roughness levels of a cubemap as the levels of its
+// mip chain (see create_cubemap)
+void load_cubemap_prefiltered(const std::string &filename, std::vector<CubemapFaces> &levels);
+
+// Returns the GPU memory used by the specified levels of a 2D or cubemap
+// texture, computed from the sizes and formats reported by the driver
+size_t texture_memory_size(GLenum target, GLuint texture);
 
-GLuint load_cubemap_prefiltered(const std::string &filename);
+// Records a texture in the memory registry, with the size returned by
+// texture_memory_size()
+void track_texture(MemoryCategory category, GLenum target, GLuint texture,
+                   const std::string &label);
+
+// Returns the free video memory reported by the driver (GL_NVX_gpu_memory_info
+// or GL_ATI_meminfo), or 0 if the driver does not report it
+size_t available_gpu_memory();
 
 GLuint create_depth_texture(int width=512, int height=512);
 
+// Depth cube map with six square faces (e.g., for point light shadows)
+GLuint create_depth_cubemap(int size=512);
+
+// Attaches all the layers of a texture (e.g., the faces of a depth cube map),
+// so that a geometry shader can pick the layer with gl_Layer
 GLuint create_depth_framebuffer(GLuint depth_texture);
 
 }  // namespace cg
@@ -0,0 +1,368 @@
+// Playback of glTF animations and skins.
+//
+
+#include "gltf_animation.h"
+#include "cg_memory.h"
+#include "cg_parallel.h"
+
+#include <glm/gtc/quaternion.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define GLTF_ANIMATION_SSE2 1
+#endif
+
+namespace gltf {
+
+static const int CHANNELS_PER_ITEM = 256;  // Of parallel work (sampling one channel is cheap)
+
+// Returns the number of components that a path needs
+static int path_components(AnimationPath path)
+{
+    return path == PATH_ROTATION ? 4 : 3;
+}
+
+static bool build_track(const GLTFAsset &asset, const AnimationSampler &sampler,
+                        KeyframeTrack &track)
+{
+    track.interpolation = sampler.interpolation;
+    if (!accessor_is_valid(asset, sampler.input) || !accessor_is_valid(asset, sampler.output)) {
+        return false;
+    }
+    const int numComps = num_components(asset.accessors[sampler.output].type);
+    const size_t valuesPerKey = sampler.interpolation == INTERPOLATION_CUBICSPLINE ? 3 : 1;
+    std::vector<float> data;
+    read_accessor(asset, sampler.input, track.times);
+    read_accessor(asset, sampler.output, data);
+    if (track.times.empty() || numComps < 1 || numComps > 4 ||
+        data.size() != track.times.size() * valuesPerKey * numComps) {
+        track.times.clear();
+        return false;
+    }
+    track.values.assign(data.size() / numComps, glm::vec4(0.0f));
+    for (size_t i = 0; i < track.values.size(); ++i) {
+        for (int c = 0; c < numComps; ++c) track.values[i][c] = data[i * numComps + c];
+    }
+    return true;
+}
+
+void build_animation_set(const GLTFAsset &asset, AnimationSet &set)
+{
+    set = AnimationSet();
+    const int numNodes = int(asset.nodes.size());
+    for (const Animation &animation : asset.animations) {
+        AnimationClip clip;
+        clip.name = animation.name;
+        clip.duration = 0.0f;
+        clip.tracks.resize(animation.samplers.size());
+        std::vector<int> components(animation.samplers.size(), 0);  // 0 = not usable
+        for (size_t i = 0; i < animation.samplers.size(); ++i) {
+            const AnimationSampler &sampler = animation.samplers[i];
+            if (!build_track(asset, sampler, clip.tracks[i])) continue;
+            components[i] = num_components(asset.accessors[sampler.output].type);
+            clip.duration = std::max(clip.duration, clip.tracks[i].times.back());
+        }
+        // Morph target weights are not supported (meshes have no targets)
+        for (const AnimationChannel &channel : animation.channels) {
+            if (channel.node < 0 || channel.node >= numNodes) continue;
+            if (channel.path == PATH_WEIGHTS) continue;
+            if (channel.sampler < 0 || channel.sampler >= int(components.size())) continue;
+            if (components[channel.sampler] != path_components(channel.path)) continue;
+            clip.channels.push_back(channel);
+        }
+        set.clips.push_back(clip);
+    }
+
+    for (const Skin &skin : asset.skins) {
+        SkinJoints joints;
+        joints.joints = skin.joints;
+        joints.inverseBindMatrices.assign(skin.joints.size(), glm::mat4(1.0f));
+        if (accessor_is_valid(asset, skin.inverseBindMatrices) &&
+            asset.accessors[skin.inverseBindMatrices].type == "MAT4") {
+            std::vector<float> data;
+            read_accessor(asset, skin.inverseBindMatrices, data);
+            const size_t count = std::min(joints.joints.size(), data.size() / 16);
+            for (size_t i = 0; i < count; ++i) {
+                std::copy(&data[i * 16], &data[i * 16] + 16, &joints.inverseBindMatrices[i][0][0]);
+            }
+        }
+        set.skins.push_back(joints);
+    }
+}
+
+// Returns the key k with times[k] <= time < times[k + 1], clamped to the
+// first and the second to last key. Time mostly moves forward by less than a
+// key per frame, so the key of the previous lookup, or the next one, is tried
+// before a binary search.
+static int find_key(const std::vector<float> &times, float time, int &cursor)
+{
+    const int last = int(times.size()) - 1;
+    const int k = cursor;
+    if (k >= 0 && k < last && times[k] <= time) {
+        if (time < times[k + 1]) return k;
+        if (k + 1 < last && time < times[k + 2]) return cursor = k + 1;
+    }
+    const int found = int(std::upper_bound(times.begin(), times.end(), time) - times.begin()) - 1;
+    cursor = std::max(std::min(found, last - 1), 0);
+    return cursor;
+}
+
+// Channels of a batch in structure of arrays layout: the two keys (a and b)
+// to interpolate between, the factor t, and a mask of the rotations
+struct ChannelBatch {
+    float ax[CHANNELS_PER_ITEM], ay[CHANNELS_PER_ITEM], az[CHANNELS_PER_ITEM];
+    float aw[CHANNELS_PER_ITEM];
+    float bx[CHANNELS_PER_ITEM], by[CHANNELS_PER_ITEM], bz[CHANNELS_PER_ITEM];
+    float bw[CHANNELS_PER_ITEM];
+    float t[CHANNELS_PER_ITEM];
+    uint32_t rotation[CHANNELS_PER_ITEM];  // All ones for rotations
+};
+
+static glm::vec4 cubic_spline(const KeyframeTrack &track, int key, float t, float dt)
+{
+    // Keys hold an in-tangent, a value and an out-tangent
+    const glm::vec4 &p0 = track.values[key * 3 + 1];
+    const glm::vec4 m0 = track.values[key * 3 + 2] * dt;
+    const glm::vec4 &p1 = track.values[key * 3 + 4];
+    const glm::vec4 m1 = track.values[key * 3 + 3] * dt;
+    const float t2 = t * t, t3 = t2 * t;
+    return (2.0f * t3 - 3.0f * t2 + 1.0f) * p0 + (t3 - 2.0f * t2 + t) * m0 +
+           (3.0f * t2 - 2.0f * t3) * p1 + (t3 - t2) * m1;
+}
+
+// Finds the keys of a channel and writes them to lane i of the batch. Step and
+// cubic spline interpolation are done here, and leave t = 0.
+static void gather_channel(const AnimationClip &clip, int channel, float time, int &cursor,
+                           ChannelBatch &batch, int i)
+{
+    const KeyframeTrack &track = clip.tracks[clip.channels[channel].sampler];
+    const int key = find_key(track.times, time, cursor);
+    const int last = int(track.times.size()) - 1;
+    float t = 0.0f, dt = 0.0f;
+    if (last > 0) {
+        dt = track.times[key + 1] - track.times[key];
+        t = dt > 0.0f ? std::min(std::max((time - track.times[key]) / dt, 0.0f), 1.0f) : 1.0f;
+    }
+
+    glm::vec4 a, b;
+    if (track.interpolation == INTERPOLATION_CUBICSPLINE) {
+        a = b = last > 0 ? cubic_spline(track, key, t, dt) : track.values[1];
+        t = 0.0f;
+    } else if (track.interpolation == INTERPOLATION_STEP) {
+        a = b = track.values[t >= 1.0f ? key + 1 : key];
+        t = 0.0f;
+    } else {
+        a = track.values[key];
+        b = track.values[std::min(key + 1, last)];
+    }
+    batch.ax[i] = a.x, batch.ay[i] = a.y, batch.az[i] = a.z, batch.aw[i] = a.w;
+    batch.bx[i] = b.x, batch.by[i] = b.y, batch.bz[i] = b.z, batch.bw[i] = b.w;
+    batch.t[i] = t;
+    batch.rotation[i] = clip.channels[channel].path == PATH_ROTATION ? 0xffffffffu : 0u;
+}
+
+// Interpolates four lanes of a batch, starting at i. Rotations take the
+// shorter way (b is negated if the quaternions are more than 90 degrees
+// apart), get a corrected lerp factor for the angle between them, and are
+// normalized, which makes them follow slerp closely without trigonometry.
+static void interpolate_lanes(const ChannelBatch &batch, int i, glm::vec4 *out)
+{
+#ifdef GLTF_ANIMATION_SSE2
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), half = _mm_set1_ps(0.5f);
+    const __m128 rotation = _mm_castsi128_ps(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(&batch.rotation[i])));
+    const __m128 ax = _mm_loadu_ps(&batch.ax[i]), ay = _mm_loadu_ps(&batch.ay[i]);
+    const __m128 az = _mm_loadu_ps(&batch.az[i]), aw = _mm_loadu_ps(&batch.aw[i]);
+    __m128 bx = _mm_loadu_ps(&batch.bx[i]), by = _mm_loadu_ps(&batch.by[i]);
+    __m128 bz = _mm_loadu_ps(&batch.bz[i]), bw = _mm_loadu_ps(&batch.bw[i]);
+    __m128 t = _mm_loadu_ps(&batch.t[i]);
+
+    __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)),
+                          _mm_add_ps(_mm_mul_ps(az, bz), _mm_mul_ps(aw, bw)));
+    const __m128 flip = _mm_and_ps(_mm_and_ps(_mm_cmplt_ps(d, zero), rotation),
+                                   _mm_set1_ps(-0.0f));
+    bx = _mm_xor_ps(bx, flip), by = _mm_xor_ps(by, flip);
+    bz = _mm_xor_ps(bz, flip), bw = _mm_xor_ps(bw, flip);
+    d = _mm_xor_ps(d, flip);
+
+    // t + t (t - 0.5) (t - 1) k, with k fitted to the angle (d = its cosine)
+    const __m128 ka = _mm_add_ps(_mm_set1_ps(1.0904f), _mm_mul_ps(d, _mm_add_ps(
+        _mm_set1_ps(-3.2452f), _mm_mul_ps(d, _mm_sub_ps(_mm_set1_ps(3.55645f),
+                                                        _mm_mul_ps(d, _mm_set1_ps(1.43519f)))))));
+    const __m128 kb = _mm_add_ps(_mm_set1_ps(0.848013f), _mm_mul_ps(d, _mm_add_ps(
+        _mm_set1_ps(-1.06021f), _mm_mul_ps(d, _mm_set1_ps(0.215638f)))));
+    const __m128 centered = _mm_sub_ps(t, half);
+    const __m128 k = _mm_add_ps(_mm_mul_ps(ka, _mm_mul_ps(centered, centered)), kb);
+    const __m128 corrected = _mm_add_ps(
+        t, _mm_mul_ps(_mm_mul_ps(t, centered), _mm_mul_ps(_mm_sub_ps(t, one), k)));
+    t = _mm_or_ps(_mm_and_ps(rotation, corrected), _mm_andnot_ps(rotation, t));
+
+    __m128 rx = _mm_add_ps(ax, _mm_mul_ps(t, _mm_sub_ps(bx, ax)));
+    __m128 ry = _mm_add_ps(ay, _mm_mul_ps(t, _mm_sub_ps(by, ay)));
+    __m128 rz = _mm_add_ps(az, _mm_mul_ps(t, _mm_sub_ps(bz, az)));
+    __m128 rw = _mm_add_ps(aw, _mm_mul_ps(t, _mm_sub_ps(bw, aw)));
+    const __m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(rx, rx), _mm_mul_ps(ry, ry)),
+                                      _mm_add_ps(_mm_mul_ps(rz, rz), _mm_mul_ps(rw, rw)));
+    const __m128 normalize = _mm_and_ps(rotation, _mm_cmpgt_ps(length2, zero));
+    const __m128 scale = _mm_or_ps(_mm_and_ps(normalize, _mm_div_ps(one, _mm_sqrt_ps(length2))),
+                                   _mm_andnot_ps(normalize, one));
+    rx = _mm_mul_ps(rx, scale), ry = _mm_mul_ps(ry, scale);
+    rz = _mm_mul_ps(rz, scale), rw = _mm_mul_ps(rw, scale);
+
+    // Back to one vec4 per channel
+    _MM_TRANSPOSE4_PS(rx, ry, rz, rw);
+    _mm_storeu_ps(&out[0][0], rx);
+    _mm_storeu_ps(&out[1][0], ry);
+    _mm_storeu_ps(&out[2][0], rz);
+    _mm_storeu_ps(&out[3][0], rw);
+#else
+    for (int lane = i; lane < i + 4; ++lane) {
+        const glm::vec4 a(batch.ax[lane], batch.ay[lane], batch.az[lane], batch.aw[lane]);
+        glm::vec4 b(batch.bx[lane], batch.by[lane], batch.bz[lane], batch.bw[lane]);
+        float t = batch.t[lane];
+        const bool rotation = batch.rotation[lane] != 0;
+        if (rotation) {
+            float d = glm::dot(a, b);
+            if (d < 0.0f) b = -b, d = -d;
+            const float ka = 1.0904f + d * (-3.2452f + d * (3.55645f - d * 1.43519f));
+            const float kb = 0.848013f + d * (-1.06021f + d * 0.215638f);
+            const float k = ka * (t - 0.5f) * (t - 0.5f) + kb;
+            t = t + t * (t - 0.5f) * (t - 1.0f) * k;
+        }
+        glm::vec4 result = a + t * (b - a);
+        const float length2 = glm::dot(result, result);
+        if (rotation && length2 > 0.0f) result /= std::sqrt(length2);
+        out[lane - i] = result;
+    }
+#endif
+}
+
+void sample_animation(const AnimationClip &clip, float time, AnimationCursor &cursor,
+                      std::vector<glm::vec4> &values, unsigned maxThreads)
+{
+    const int numChannels = int(clip.channels.size());
+    if (cursor.keys.size() != clip.channels.size()) cursor.keys.assign(numChannels, 0);
+    values.resize(numChannels);
+    const int numItems = (numChannels + CHANNELS_PER_ITEM - 1) / CHANNELS_PER_ITEM;
+    cg::parallel_for(numItems, [&](int item) {
+        ChannelBatch batch;
+        const int begin = item * CHANNELS_PER_ITEM;
+        const int count = std::min(numChannels - begin, CHANNELS_PER_ITEM);
+        for (int i = 0; i < count; ++i) {
+            gather_channel(clip, begin + i, time, cursor.keys[begin + i], batch, i);
+        }
+        // Whole groups of four go straight to the output, a partial one is
+        // padded with copies of its first lane
+        const int whole = count & ~3;
+        for (int i = 0; i < whole; i += 4) interpolate_lanes(batch, i, &values[begin + i]);
+        if (whole < count) {
+            for (int i = count; i < whole + 4; ++i) {
+                batch.ax[i] = batch.ax[whole], batch.ay[i] = batch.ay[whole];
+                batch.az[i] = batch.az[whole], batch.aw[i] = batch.aw[whole];
+                batch.bx[i] = batch.bx[whole], batch.by[i] = batch.by[whole];
+                batch.bz[i] = batch.bz[whole], batch.bw[i] = batch.bw[whole];
+                batch.t[i] = batch.t[whole], batch.rotation[i] = batch.rotation[whole];
+            }
+            glm::vec4 rest[4];
+            interpolate_lanes(batch, whole, rest);
+            std::copy(rest, rest + (count - whole), &values[begin + whole]);
+        }
+    }, maxThreads);
+}
+
+void apply_animation(const AnimationClip &clip, const std::vector<glm::vec4> &values,
+                     std::vector<Node> &nodes)
+{
+    for (size_t i = 0; i < clip.channels.size() && i < values.size(); ++i) {
+        const AnimationChannel &channel = clip.channels[i];
+        Node &node = nodes[channel.node];
+        const glm::vec4 &value = values[i];
+        if (channel.path == PATH_TRANSLATION) {
+            node.translation = glm::vec3(value);
+        } else if (channel.path == PATH_ROTATION) {
+            node.rotation = glm::quat(value.w, value.x, value.y, value.z);
+        } else if (channel.path == PATH_SCALE) {
+            node.scale = glm::vec3(value);
+        }
+    }
+}
+
+bool is_skinned_node(const GLTFAsset &asset, const AnimationSet &set, int node)
+{
+    const Node &n = asset.nodes[node];
+    if (n.skin < 0 || n.skin >= int(set.skins.size())) return false;
+    if (n.mesh < 0 || n.mesh >= int(asset.meshes.size())) return false;
+    for (const Primitive &primitive : asset.meshes[n.mesh].primitives) {
+        if (find_attribute(primitive, SEMANTIC_JOINTS_0) >= 0 &&
+            find_attribute(primitive, SEMANTIC_WEIGHTS_0) >= 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void compute_joint_matrices(const GLTFAsset &asset, const AnimationSet &set,
+                            const std::vector<glm::mat4> &worldMatrices,
+                            std::vector<glm::mat4> &jointMatrices, std::vector<int> &offsets,
+                            unsigned maxThreads)
+{
+    const int numNodes = int(asset.nodes.size());
+    offsets.assign(numNodes, -1);
+    std::vector<int> skinned;
+    int numJoints = 0;
+    for (int i = 0; i < numNodes; ++i) {
+        if (!is_skinned_node(asset, set, i)) continue;
+        offsets[i] = numJoints;
+        numJoints += int(set.skins[asset.nodes[i].skin].joints.size());
+        skinned.push_back(i);
+    }
+    jointMatrices.resize(numJoints);
+
+    cg::parallel_for(int(skinned.size()), [&](int item) {
+        const int node = skinned[item];
+        const SkinJoints &skin = set.skins[asset.nodes[node].skin];
+        const glm::mat4 inverseNode = glm::inverse(worldMatrices[node]);
+        glm::mat4 *out = &jointMatrices[offsets[node]];
+        for (size_t j = 0; j < skin.joints.size(); ++j) {
+            const int joint = skin.joints[j];
+            out[j] = joint >= 0 && joint < numNodes ?
+                         inverseNode * worldMatrices[joint] * skin.inverseBindMatrices[j] :
+                         glm::mat4(1.0f);
+        }
+    }, maxThreads);
+}
+
+void upload_joint_matrices(JointBuffer &buffer, const std::vector<glm::mat4> &jointMatrices)
+{
+    if (!buffer.buffer) {
+        glGenBuffers(1, &buffer.buffer);
+        glGenTextures(1, &buffer.texture);
+    }
+    // Never empty, since the texture needs storage
+    const size_t bytes = jointMatrices.size() * sizeof(glm::mat4);
+    glBindBuffer(GL_TEXTURE_BUFFER, buffer.buffer);
+    glBufferData(GL_TEXTURE_BUFFER, std::max(bytes, size_t(16)), nullptr, GL_STREAM_DRAW);
+    if (bytes) glBufferSubData(GL_TEXTURE_BUFFER, 0, bytes, jointMatrices.data());
+    glBindTexture(GL_TEXTURE_BUFFER, buffer.texture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, buffer.buffer);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    cg::track_gpu_object(cg::MEMORY_BUFFERS, cg::GPU_BUFFER, buffer.buffer,
+                         std::max(bytes, size_t(16)), "joint matrices");
+}
+
+void destroy_joint_buffer(JointBuffer &buffer)
+{
+    if (buffer.buffer) {
+        cg::untrack_gpu_object(cg::GPU_BUFFER, buffer.buffer);
+        glDeleteBuffers(1, &buffer.buffer);
+    }
+    if (buffer.texture) glDeleteTextures(1, &buffer.texture);
+    buffer = JointBuffer();
+}
+
+}  // namespace gltf
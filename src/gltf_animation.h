@@ -0,0 +1,94 @@
+// Playback of glTF animations and skins. Keyframes are decoded once into
+// tracks of 4-component values, so that sampling a channel is a key lookup
+// (from the key found the frame before, or by binary search) and one
+// interpolation. Channels are sampled in parallel, in batches that are
+// interpolated four channels at a time. Skinned meshes are deformed on the
+// GPU by a palette of joint matrices in a texture buffer.
+//
+
+#pragma once
+
+#include "gltf_scene.h"
+
+#include <GL/gl3w.h>
+#include <glm/glm.hpp>
+
+#include <string>
+#include <vector>
+
+namespace gltf {
+
+// Keyframes of an animation sampler
+struct KeyframeTrack {
+    Interpolation interpolation;
+    std::vector<float> times;
+    std::vector<glm::vec4> values;  // Padded to 4 components (3 per key for cubic splines)
+};
+
+struct AnimationClip {
+    std::string name;
+    float duration;  // End of the longest track
+    std::vector<KeyframeTrack> tracks;       // One per sampler of the animation
+    std::vector<AnimationChannel> channels;  // Translation, rotation and scale of nodes
+};
+
+struct SkinJoints {
+    std::vector<int> joints;  // Nodes
+    std::vector<glm::mat4> inverseBindMatrices;
+};
+
+// The animations and skins of an asset, decoded for playback (the CPU copies
+// of the buffers can be released afterwards)
+struct AnimationSet {
+    std::vector<AnimationClip> clips;
+    std::vector<SkinJoints> skins;
+};
+
+// Key that each channel of a clip found the last time it was sampled, where
+// the next lookup starts
+struct AnimationCursor {
+    std::vector<int> keys;
+};
+
+// Texture buffer with the joint matrices of all skinned nodes
+struct JointBuffer {
+    GLuint buffer = 0;
+    GLuint texture = 0;
+};
+
+// Decodes the animations and skins of an asset. Channels and skins whose
+// accessors are invalid (or whose data is not loaded) are left out.
+void build_animation_set(const GLTFAsset &asset, AnimationSet &set);
+
+// Samples every channel of a clip at a time, which is clamped to the keys of
+// each track. Values are translations or scales (xyz) or rotations (xyzw
+// quaternions), one per channel. Rotations are interpolated by normalized
+// lerp, with a correction of the lerp factor that keeps them within a
+// twentieth of a degree of slerp.
+void sample_animation(const AnimationClip &clip, float time, AnimationCursor &cursor,
+                      std::vector<glm::vec4> &values, unsigned maxThreads = 0);
+
+// Writes sampled values to the translation, rotation and scale of the nodes
+void apply_animation(const AnimationClip &clip, const std::vector<glm::vec4> &values,
+                     std::vector<Node> &nodes);
+
+// Returns true if a node has a skin and a mesh with joints and weights
+bool is_skinned_node(const GLTFAsset &asset, const AnimationSet &set, int node);
+
+// Computes the joint matrices of all skinned nodes, which take the vertices
+// of a mesh to where the pose puts them in the space of its node (so that
+// they are drawn with the world matrix of the node, as other meshes):
+// inverse(node) * joint * inverse bind matrix. The matrices of each node
+// start at offsets[node], which is -1 for nodes without skinning.
+void compute_joint_matrices(const GLTFAsset &asset, const AnimationSet &set,
+                            const std::vector<glm::mat4> &worldMatrices,
+                            std::vector<glm::mat4> &jointMatrices, std::vector<int> &offsets,
+                            unsigned maxThreads = 0);
+
+// Uploads the joint matrices (4 RGBA32F texels each), and creates the buffer
+// on first use
+void upload_joint_matrices(JointBuffer &buffer, const std::vector<glm::mat4> &jointMatrices);
+
+void destroy_joint_buffer(JointBuffer &buffer);
+
+}  // namespace gltf
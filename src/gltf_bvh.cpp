@@ -0,0 +1,518 @@
+// Bounding volume hierarchies over glTF meshes, used for ray picking.
+//
+
+#include "gltf_bvh.h"
+#include "cg_parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <random>
+
+namespace gltf {
+
+namespace {
+
+const int NUM_BINS = 16;
+const int MAX_LEAF_SIZE = 8;
+const float TRAVERSAL_COST = 1.0f;      // Relative to one item intersection
+const int PARALLEL_BUILD_THRESHOLD = 65536;  // Items before subtrees are built in parallel
+
+// Bounds and centroid of an item (triangle or instance) during building
+struct BuildItem {
+    AABB bounds;
+    glm::vec3 centroid;
+};
+
+AABB empty_aabb()
+{
+    const float inf = std::numeric_limits<float>::infinity();
+    AABB aabb = {glm::vec3(inf), glm::vec3(-inf)};
+    return aabb;
+}
+
+void grow(AABB &aabb, const AABB &other)
+{
+    aabb.min = glm::min(aabb.min, other.min);
+    aabb.max = glm::max(aabb.max, other.max);
+}
+
+void grow(AABB &aabb, const glm::vec3 &point)
+{
+    aabb.min = glm::min(aabb.min, point);
+    aabb.max = glm::max(aabb.max, point);
+}
+
+float half_area(const AABB &aabb)
+{
+    const glm::vec3 d = aabb.max - aabb.min;
+    return (d.x < 0.0f) ? 0.0f : d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+// Builds a BVH over items, reordering the item index array so that every
+// leaf references a contiguous range
+class Builder {
+  public:
+    Builder(const std::vector<BuildItem> &items, std::vector<uint32_t> &order)
+        : items_(items), order_(order)
+    {
+    }
+
+    void build(std::vector<BVHNode> &nodes, bool parallel)
+    {
+        nodes.clear();
+        if (order_.empty()) return;
+        if (!parallel || order_.size() < size_t(PARALLEL_BUILD_THRESHOLD)) {
+            build_recursive(nodes, 0, int(order_.size()));
+            return;
+        }
+
+        // Split the top of the tree serially until there are enough subtrees
+        // to keep all threads busy, then build those subtrees in parallel
+        // and splice them into the final depth-first node array
+        std::vector<TopNode> top;
+        const int numTasks = int(4 * cg::num_worker_threads());
+        split_top(top, 0, int(order_.size()), numTasks);
+
+        std::vector<int> tasks;
+        for (unsigned i = 0; i < top.size(); ++i) {
+            if (top[i].left < 0) tasks.push_back(i);
+        }
+        std::vector<std::vector<BVHNode> > subtrees(top.size());
+        cg::parallel_for(int(tasks.size()), [&](int i) {
+            const TopNode &task = top[tasks[i]];
+            build_recursive(subtrees[tasks[i]], task.begin, task.end);
+        });
+        emit_top(nodes, top, subtrees, 0);
+    }
+
+  private:
+    // Node in the serially built top part of the tree. Nodes without
+    // children are roots of subtrees that are built in parallel.
+    struct TopNode {
+        AABB bounds;
+        int begin, end;
+        int left, right;
+    };
+
+    const std::vector<BuildItem> &items_;
+    std::vector<uint32_t> &order_;
+
+    AABB compute_bounds(int begin, int end, AABB &centroidBounds) const
+    {
+        AABB bounds = empty_aabb();
+        centroidBounds = empty_aabb();
+        for (int i = begin; i < end; ++i) {
+            grow(bounds, items_[order_[i]].bounds);
+            grow(centroidBounds, items_[order_[i]].centroid);
+        }
+        return bounds;
+    }
+
+    // Partitions the range [begin, end) along the binned split with the
+    // lowest SAH cost. Returns false if the range should become a leaf.
+    bool split(int begin, int end, const AABB &bounds, const AABB &centroidBounds, int &mid)
+    {
+        const int count = end - begin;
+        if (count <= 1) return false;
+
+        float bestCost = std::numeric_limits<float>::infinity();
+        int bestAxis = -1, bestSplit = 0;
+        for (int axis = 0; axis < 3; ++axis) {
+            const float cmin = centroidBounds.min[axis];
+            const float extent = centroidBounds.max[axis] - cmin;
+            if (!(extent > 0.0f)) continue;
+            const float scale = NUM_BINS / extent;
+
+            AABB binBounds[NUM_BINS];
+            int binCounts[NUM_BINS] = {0};
+            for (int i = 0; i < NUM_BINS; ++i) binBounds[i] = empty_aabb();
+            for (int i = begin; i < end; ++i) {
+                const BuildItem &item = items_[order_[i]];
+                int bin = std::min(int((item.centroid[axis] - cmin) * scale), NUM_BINS - 1);
+                binCounts[bin]++;
+                grow(binBounds[bin], item.bounds);
+            }
+
+            // Sweep from the right to get the cost of every right side, then
+            // from the left to evaluate all split planes
+            float rightArea[NUM_BINS];
+            int rightCount[NUM_BINS];
+            AABB accum = empty_aabb();
+            int accumCount = 0;
+            for (int i = NUM_BINS - 1; i > 0; --i) {
+                grow(accum, binBounds[i]);
+                accumCount += binCounts[i];
+                rightArea[i] = half_area(accum);
+                rightCount[i] = accumCount;
+            }
+            accum = empty_aabb();
+            accumCount = 0;
+            for (int i = 1; i < NUM_BINS; ++i) {
+                grow(accum, binBounds[i - 1]);
+                accumCount += binCounts[i - 1];
+                if (accumCount == 0 || rightCount[i] == 0) continue;
+                const float cost = half_area(accum) * accumCount + rightArea[i] * rightCount[i];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = i;
+                }
+            }
+        }
+
+        const float area = half_area(bounds);
+        const float leafCost = float(count);
+        const float splitCost = TRAVERSAL_COST + (area > 0.0f ? bestCost / area : 0.0f);
+        if (bestAxis < 0 || (splitCost >= leafCost && count <= MAX_LEAF_SIZE)) {
+            if (count <= MAX_LEAF_SIZE) return false;
+
+            // All centroids coincide, so fall back to splitting in the middle
+            mid = begin + count / 2;
+            return true;
+        }
+
+        const float cmin = centroidBounds.min[bestAxis];
+        const float scale = NUM_BINS / (centroidBounds.max[bestAxis] - cmin);
+        const BuildItem *items = &items_[0];
+        uint32_t *pivot = std::partition(&order_[begin], &order_[0] + end, [&](uint32_t i) {
+            int bin = std::min(int((items[i].centroid[bestAxis] - cmin) * scale), NUM_BINS - 1);
+            return bin < bestSplit;
+        });
+        mid = int(pivot - &order_[0]);
+        return true;
+    }
+
+    void build_recursive(std::vector<BVHNode> &nodes, int begin, int end)
+    {
+        AABB centroidBounds;
+        const int index = int(nodes.size());
+        nodes.push_back(BVHNode());
+        nodes[index].bounds = compute_bounds(begin, end, centroidBounds);
+
+        int mid = 0;
+        if (split(begin, end, nodes[index].bounds, centroidBounds, mid)) {
+            nodes[index].first = 0;
+            nodes[index].count = 0;
+            build_recursive(nodes, begin, mid);
+            build_recursive(nodes, mid, end);
+        } else {
+            nodes[index].first = begin;
+            nodes[index].count = end - begin;
+        }
+        nodes[index].skip = int(nodes.size());
+    }
+
+    int split_top(std::vector<TopNode> &top, int begin, int end, int numTasks)
+    {
+        AABB centroidBounds;
+        const int index = int(top.size());
+        TopNode node = {compute_bounds(begin, end, centroidBounds), begin, end, -1, -1};
+        top.push_back(node);
+
+        int mid = 0;
+        if (numTasks > 1 && end - begin > PARALLEL_BUILD_THRESHOLD / 16 &&
+            split(begin, end, node.bounds, centroidBounds, mid)) {
+            const int left = split_top(top, begin, mid, numTasks / 2);
+            const int right = split_top(top, mid, end, numTasks - numTasks / 2);
+            top[index].left = left;
+            top[index].right = right;
+        }
+        return index;
+    }
+
+    void emit_top(std::vector<BVHNode> &nodes, const std::vector<TopNode> &top,
+                  const std::vector<std::vector<BVHNode> > &subtrees, int index)
+    {
+        const TopNode &node = top[index];
+        if (node.left < 0) {
+            // Subtree indices are relative to its own array
+            const int offset = int(nodes.size());
+            for (BVHNode subtreeNode : subtrees[index]) {
+                subtreeNode.skip += offset;
+                nodes.push_back(subtreeNode);
+            }
+            return;
+        }
+
+        const int nodeIndex = int(nodes.size());
+        BVHNode inner = {node.bounds, 0, 0, 0};
+        nodes.push_back(inner);
+        emit_top(nodes, top, subtrees, node.left);
+        emit_top(nodes, top, subtrees, node.right);
+        nodes[nodeIndex].skip = int(nodes.size());
+    }
+};
+
+void build_mesh_bvh(MeshBVH &bvh, const GLTFAsset &asset, const Mesh &mesh, bool parallel)
+{
+    std::vector<BVHTriangle> triangles;
+    for (unsigned i = 0; i < mesh.primitives.size(); ++i) {
+        const Primitive &primitive = mesh.primitives[i];
+        const int position = find_attribute(primitive, SEMANTIC_POSITION);
+        if (!accessor_is_valid(asset, position) || !accessor_is_valid(asset, primitive.indices)) {
+            continue;
+        }
+
+        std::vector<float> positions;
+        std::vector<uint32_t> indices;
+        read_accessor(asset, position, positions);
+        read_indices(asset, primitive.indices, indices);
+        const size_t numVertices = positions.size() / 3;
+        for (size_t j = 0; j + 2 < indices.size(); j += 3) {
+            glm::vec3 v[3];
+            bool valid = true;
+            for (int k = 0; k < 3; ++k) {
+                const uint32_t index = indices[j + k];
+                valid = valid && index < numVertices;
+                if (valid) v[k] = glm::vec3(positions[3 * index], positions[3 * index + 1],
+                                            positions[3 * index + 2]);
+            }
+            if (!valid) continue;
+            BVHTriangle triangle = {v[0], v[1] - v[0], v[2] - v[0], int32_t(i), int32_t(j / 3)};
+            triangles.push_back(triangle);
+        }
+    }
+
+    std::vector<BuildItem> items(triangles.size());
+    std::vector<uint32_t> order(triangles.size());
+    for (size_t i = 0; i < triangles.size(); ++i) {
+        const BVHTriangle &t = triangles[i];
+        AABB bounds = {t.v0, t.v0};
+        grow(bounds, t.v0 + t.e1);
+        grow(bounds, t.v0 + t.e2);
+        items[i].bounds = bounds;
+        items[i].centroid = 0.5f * (bounds.min + bounds.max);
+        order[i] = uint32_t(i);
+    }
+
+    Builder(items, order).build(bvh.nodes, parallel);
+
+    // Store triangles in leaf order, so leaves reference contiguous ranges
+    bvh.triangles.resize(triangles.size());
+    for (size_t i = 0; i < order.size(); ++i) bvh.triangles[i] = triangles[order[i]];
+}
+
+// Slab test against a node's bounds. Returns true if the box is entered
+// before tmax.
+inline bool intersect_aabb(const AABB &aabb, const glm::vec3 &origin, const glm::vec3 &invDir,
+                           float tmax)
+{
+    const glm::vec3 t0 = (aabb.min - origin) * invDir;
+    const glm::vec3 t1 = (aabb.max - origin) * invDir;
+    const glm::vec3 tnear = glm::min(t0, t1), tfar = glm::max(t0, t1);
+    const float enter = std::max(std::max(tnear.x, tnear.y), std::max(tnear.z, 0.0f));
+    const float exit = std::min(std::min(tfar.x, tfar.y), std::min(tfar.z, tmax));
+    return enter <= exit;
+}
+
+// Moller-Trumbore ray/triangle intersection
+inline bool intersect_triangle(const BVHTriangle &tri, const glm::vec3 &origin,
+                               const glm::vec3 &dir, float &t, float &u, float &v)
+{
+    const glm::vec3 p = glm::cross(dir, tri.e2);
+    const float det = glm::dot(tri.e1, p);
+    if (std::abs(det) < 1e-20f) return false;
+    const float invDet = 1.0f / det;
+    const glm::vec3 s = origin - tri.v0;
+    u = glm::dot(s, p) * invDet;
+    if (u < 0.0f || u > 1.0f) return false;
+    const glm::vec3 q = glm::cross(s, tri.e1);
+    v = glm::dot(dir, q) * invDet;
+    if (v < 0.0f || u + v > 1.0f) return false;
+    t = glm::dot(tri.e2, q) * invDet;
+    return t > 0.0f;
+}
+
+glm::vec3 safe_inverse(const glm::vec3 &dir)
+{
+    const float inf = std::numeric_limits<float>::infinity();
+    return glm::vec3(dir.x != 0.0f ? 1.0f / dir.x : inf, dir.y != 0.0f ? 1.0f / dir.y : inf,
+                     dir.z != 0.0f ? 1.0f / dir.z : inf);
+}
+
+// Stackless traversal of a mesh BVH. Updates tmax and the hit data when a
+// closer hit is found.
+bool traverse_mesh(const MeshBVH &bvh, const glm::vec3 &origin, const glm::vec3 &dir, float &tmax,
+                   int &primitive, int &triangle, glm::vec2 &barycentrics)
+{
+    const glm::vec3 invDir = safe_inverse(dir);
+    const int numNodes = int(bvh.nodes.size());
+    bool hit = false;
+    for (int i = 0; i < numNodes;) {
+        const BVHNode &node = bvh.nodes[i];
+        if (!intersect_aabb(node.bounds, origin, invDir, tmax)) {
+            i = node.skip;
+            continue;
+        }
+        if (node.count == 0) {
+            ++i;  // Descend to the first child
+            continue;
+        }
+        for (int j = node.first; j < node.first + node.count; ++j) {
+            float t, u, v;
+            if (intersect_triangle(bvh.triangles[j], origin, dir, t, u, v) && t < tmax) {
+                tmax = t;
+                primitive = bvh.triangles[j].primitive;
+                triangle = bvh.triangles[j].triangle;
+                barycentrics = glm::vec2(u, v);
+                hit = true;
+            }
+        }
+        i = node.skip;
+    }
+    return hit;
+}
+
+AABB transform_aabb(const AABB &aabb, const glm::mat4 &matrix)
+{
+    AABB result = empty_aabb();
+    for (int i = 0; i < 8; ++i) {
+        const glm::vec3 corner((i & 1) ? aabb.max.x : aabb.min.x,
+                               (i & 2) ? aabb.max.y : aabb.min.y,
+                               (i & 4) ? aabb.max.z : aabb.min.z);
+        grow(result, glm::vec3(matrix * glm::vec4(corner, 1.0f)));
+    }
+    return result;
+}
+
+}  // namespace
+
+void build_mesh_bvhs(SceneBVH &bvh, const GLTFAsset &asset)
+{
+    bvh.meshes.clear();
+    bvh.meshes.resize(asset.meshes.size());
+
+    // Small meshes are built in parallel with each other, while large meshes
+    // are built one at a time with their subtrees built in parallel
+    std::vector<int> small, large;
+    for (unsigned i = 0; i < asset.meshes.size(); ++i) {
+        size_t numIndices = 0;
+        for (const auto &primitive : asset.meshes[i].primitives) {
+            if (accessor_is_valid(asset, primitive.indices)) {
+                numIndices += asset.accessors[primitive.indices].count;
+            }
+        }
+        (numIndices / 3 < size_t(PARALLEL_BUILD_THRESHOLD) ? small : large).push_back(i);
+    }
+    cg::parallel_for(int(small.size()), [&](int i) {
+        build_mesh_bvh(bvh.meshes[small[i]], asset, asset.meshes[small[i]], false);
+    });
+    for (int i : large) build_mesh_bvh(bvh.meshes[i], asset, asset.meshes[i], true);
+}
+
+void build_instance_bvh(SceneBVH &bvh, const GLTFAsset &asset,
+                        const std::vector<glm::mat4> &worldMatrices)
+{
+    std::vector<BuildItem> items;
+    std::vector<int> instances;
+    bvh.worldToObject.resize(asset.nodes.size());
+    for (unsigned i = 0; i < asset.nodes.size(); ++i) {
+        bvh.worldToObject[i] = glm::inverse(worldMatrices[i]);
+        const int mesh = asset.nodes[i].mesh;
+        if (mesh < 0 || mesh >= int(bvh.meshes.size()) || bvh.meshes[mesh].nodes.empty()) {
+            continue;
+        }
+
+        BuildItem item;
+        item.bounds = transform_aabb(bvh.meshes[mesh].nodes[0].bounds, worldMatrices[i]);
+        item.centroid = 0.5f * (item.bounds.min + item.bounds.max);
+        items.push_back(item);
+        instances.push_back(i);
+    }
+
+    std::vector<uint32_t> order(items.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = uint32_t(i);
+    Builder(items, order).build(bvh.nodes, false);
+
+    bvh.instances.resize(order.size());
+    bvh.instanceMeshes.resize(order.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        bvh.instances[i] = instances[order[i]];
+        bvh.instanceMeshes[i] = asset.nodes[bvh.instances[i]].mesh;
+    }
+}
+
+bool pick(const SceneBVH &bvh, const glm::vec3 &origin, const glm::vec3 &direction,
+          PickResult &result)
+{
+    const glm::vec3 invDir = safe_inverse(direction);
+    const int numNodes = int(bvh.nodes.size());
+    float tmax = std::numeric_limits<float>::infinity();
+    bool hit = false;
+    for (int i = 0; i < numNodes;) {
+        const BVHNode &node = bvh.nodes[i];
+        if (!intersect_aabb(node.bounds, origin, invDir, tmax)) {
+            i = node.skip;
+            continue;
+        }
+        if (node.count == 0) {
+            ++i;
+            continue;
+        }
+        for (int j = node.first; j < node.first + node.count; ++j) {
+            // The object-space direction is not renormalized, so that hit
+            // distances stay comparable between instances
+            const int instance = bvh.instances[j];
+            const glm::mat4 &worldToObject = bvh.worldToObject[instance];
+            const glm::vec3 objOrigin = glm::vec3(worldToObject * glm::vec4(origin, 1.0f));
+            const glm::vec3 objDir = glm::vec3(worldToObject * glm::vec4(direction, 0.0f));
+            const int mesh = bvh.instanceMeshes[j];
+            if (traverse_mesh(bvh.meshes[mesh], objOrigin, objDir, tmax, result.primitive,
+                              result.triangle, result.barycentrics)) {
+                result.node = instance;
+                result.mesh = mesh;
+                hit = true;
+            }
+        }
+        i = node.skip;
+    }
+
+    if (hit) {
+        result.distance = tmax;
+        result.position = origin + tmax * direction;
+    }
+    return hit;
+}
+
+double benchmark_picking(const SceneBVH &bvh, int numRays, unsigned numThreads)
+{
+    if (bvh.nodes.empty() || numRays <= 0) return 0.0;
+
+    // Rays start on a sphere around the scene and aim at random points inside
+    // the scene bounds, so that most of them hit something
+    const AABB &bounds = bvh.nodes[0].bounds;
+    const glm::vec3 center = 0.5f * (bounds.min + bounds.max);
+    const float radius = glm::length(bounds.max - bounds.min);
+    std::vector<glm::vec3> origins(numRays), directions(numRays);
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    for (int i = 0; i < numRays; ++i) {
+        const float z = 2.0f * uniform(rng) - 1.0f, phi = 6.2831853f * uniform(rng);
+        const float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+        origins[i] = center + radius * glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+        const glm::vec3 target = glm::mix(bounds.min, bounds.max,
+                                          glm::vec3(uniform(rng), uniform(rng), uniform(rng)));
+        directions[i] = glm::normalize(target - origins[i]);
+    }
+
+    const int chunkSize = 1024;
+    const int numChunks = (numRays + chunkSize - 1) / chunkSize;
+    std::atomic<int> numHits(0);  // Also keeps the compiler from dropping the work
+    const auto start = std::chrono::steady_clock::now();
+    cg::parallel_for(numChunks, [&](int chunk) {
+        const int end = std::min(numRays, (chunk + 1) * chunkSize);
+        int hits = 0;
+        for (int i = chunk * chunkSize; i < end; ++i) {
+            PickResult result;
+            hits += pick(bvh, origins[i], directions[i], result) ? 1 : 0;
+        }
+        numHits += hits;
+    }, numThreads);
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return numRays / std::max(elapsed.count(), 1e-9);
+}
+
+}  // namespace gltf
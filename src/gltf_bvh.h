@@ -0,0 +1,79 @@
+// Bounding volume hierarchies over glTF meshes, used for ray picking.
+//
+
+#pragma once
+
+#include "gltf_scene.h"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace gltf {
+
+// Flattened BVH node. Nodes are stored in depth-first order, so the first
+// child of an inner node is always the next node in the array, and skip is
+// the index of the first node after the subtree. This makes it possible to
+// traverse the tree without a stack.
+struct BVHNode {
+    AABB bounds;
+    int32_t skip;   // Node to continue with when the subtree is done or missed
+    int32_t first;  // First item of a leaf node
+    int32_t count;  // Number of items in a leaf node (0 for inner nodes)
+};
+
+// Triangle stored in BVH leaf order, in a form suited for ray intersection
+struct BVHTriangle {
+    glm::vec3 v0;
+    glm::vec3 e1;  // v1 - v0
+    glm::vec3 e2;  // v2 - v0
+    int32_t primitive;
+    int32_t triangle;
+};
+
+struct MeshBVH {
+    std::vector<BVHNode> nodes;
+    std::vector<BVHTriangle> triangles;
+};
+
+// Two-level hierarchy, with one BVH per mesh (in object space) and a
+// top-level BVH over the nodes that reference meshes (in world space)
+struct SceneBVH {
+    std::vector<MeshBVH> meshes;
+    std::vector<BVHNode> nodes;            // Top-level hierarchy
+    std::vector<int> instances;            // Scene node index per top-level item
+    std::vector<int> instanceMeshes;       // Mesh index per top-level item
+    std::vector<glm::mat4> worldToObject;  // Inverse world matrix per scene node
+};
+
+struct PickResult {
+    int node;                // Scene node that was hit
+    int mesh;
+    int primitive;
+    int triangle;            // Triangle index within the primitive
+    glm::vec2 barycentrics;  // Weights of the second and third vertex
+    float distance;          // Ray parameter of the hit
+    glm::vec3 position;      // World-space hit position
+};
+
+// Builds one BVH per mesh with a binned SAH builder. Meshes are built in
+// parallel, and large meshes also build their subtrees in parallel.
+void build_mesh_bvhs(SceneBVH &bvh, const GLTFAsset &asset);
+
+// (Re)builds the top-level BVH from the world matrices of the scene nodes
+// (one matrix per node). This is cheap and should be done whenever the node
+// transforms have changed.
+void build_instance_bvh(SceneBVH &bvh, const GLTFAsset &asset,
+                        const std::vector<glm::mat4> &worldMatrices);
+
+// Finds the closest triangle hit by a world-space ray. Returns false if
+// nothing was hit.
+bool pick(const SceneBVH &bvh, const glm::vec3 &origin, const glm::vec3 &direction,
+          PickResult &result);
+
+// Traces random rays through the scene bounds, and returns the number of
+// rays per second using the given number of threads
+double benchmark_picking(const SceneBVH &bvh, int numRays, unsigned numThreads);
+
+}  // namespace gltf
@@ -0,0 +1,96 @@
+// Recently used scenes, kept with their CPU data and GL objects after the
+// viewer switches to another asset, so that switching back is instant.
+//
+
+#include "gltf_cache.h"
+#include "cg_memory.h"
+
+namespace gltf {
+
+size_t scene_memory_bytes(const CachedScene &scene)
+{
+    const GLTFAsset &asset = scene.asset;
+    size_t bytes = 0;
+    for (const auto &buffer : asset.buffers) bytes += buffer.data.size();
+    for (const auto &image : asset.images) {
+        bytes += image.data.size();
+        for (const auto &level : image.levels) bytes += level.size();
+    }
+    for (const auto &mesh : scene.cullingMeshes) {
+        bytes += mesh.positions.size() * sizeof(glm::vec3) + mesh.indices.size() * sizeof(uint32_t);
+    }
+    for (const auto &mesh : scene.bvh.meshes) {
+        bytes += mesh.nodes.size() * sizeof(BVHNode) + mesh.triangles.size() * sizeof(BVHTriangle);
+    }
+
+    if (!scene.drawables.empty()) {
+        bytes += cg::gpu_object_bytes(cg::GPU_BUFFER, scene.drawables[0].buffer);
+    }
+    for (GLuint texture : scene.textures) bytes += cg::gpu_object_bytes(cg::GPU_TEXTURE, texture);
+    return bytes;
+}
+
+static void destroy_scene(CachedScene &scene)
+{
+    destroy_drawables(scene.drawables);
+    destroy_textures(scene.textures);
+    untrack_asset_memory(scene.asset);
+}
+
+void cache_scene(SceneCache &cache, CachedScene &scene)
+{
+    scene.bytes = scene_memory_bytes(scene);
+    if (scene.bytes > cache.budgetBytes) {
+        destroy_scene(scene);
+        cache.evictions += 1;
+        return;
+    }
+    cache.scenes.push_front(std::move(scene));
+    cache.bytes += cache.scenes.front().bytes;
+    // The CPU copies are reported at their new address
+    track_asset_memory(cache.scenes.front().asset);
+    trim_scene_cache(cache);
+}
+
+bool take_cached_scene(SceneCache &cache, const std::string &filename, CachedScene &scene)
+{
+    for (auto it = cache.scenes.begin(); it != cache.scenes.end(); ++it) {
+        if (it->filename != filename) continue;
+        untrack_asset_memory(it->asset);
+        cache.bytes -= it->bytes;
+        scene = std::move(*it);
+        cache.scenes.erase(it);
+        cache.hits += 1;
+        return true;
+    }
+    cache.misses += 1;
+    return false;
+}
+
+bool is_scene_cached(const SceneCache &cache, const std::string &filename)
+{
+    for (const auto &scene : cache.scenes) {
+        if (scene.filename == filename) return true;
+    }
+    return false;
+}
+
+void trim_scene_cache(SceneCache &cache)
+{
+    while (cache.bytes > cache.budgetBytes && !cache.scenes.empty()) {
+        CachedScene &scene = cache.scenes.back();
+        cache.bytes -= scene.bytes;
+        destroy_scene(scene);
+        cache.scenes.pop_back();
+        cache.evictions += 1;
+    }
+}
+
+void clear_scene_cache(SceneCache &cache)
+{
+    for (auto &scene : cache.scenes) destroy_scene(scene);
+    cache.scenes.clear();
+    cache.bytes = 0;
+}
+
+}  // namespace gltf
@@ -0,0 +1,58 @@
+// Recently used scenes, kept with their CPU data and GL objects after the
+// viewer switches to another asset, so that switching back is instant. The
+// least recently used scenes are evicted when the cache exceeds its budget.
+//
+
+#pragma once
+
+#include "gltf_bvh.h"
+#include "gltf_culling.h"
+#include "gltf_residency.h"
+
+#include <cstddef>
+#include <list>
+#include <string>
+#include <vector>
+
+namespace gltf {
+
+struct CachedScene {
+    std::string filename;
+    GLTFAsset asset;
+    DrawableList drawables;
+    TextureList textures;
+    TextureResidency residency;
+    std::vector<CullingMesh> cullingMeshes;
+    SceneBVH bvh;
+    size_t bytes = 0;  // CPU and GPU memory (computed when cached)
+};
+
+struct SceneCache {
+    size_t budgetBytes = size_t(512) << 20;
+    std::list<CachedScene> scenes;  // Most recently used first
+    size_t bytes = 0;
+    int hits = 0;
+    int misses = 0;
+    int evictions = 0;
+};
+
+// Returns the CPU and GPU memory held by a scene
+size_t scene_memory_bytes(const CachedScene &scene);
+
+// Moves a scene into the cache, which takes over its GL objects, and evicts
+// the least recently used scenes until the cache fits its budget. A scene
+// larger than the whole budget is destroyed right away.
+void cache_scene(SceneCache &cache, CachedScene &scene);
+
+// Moves the scene of a file out of the cache. Returns false (and counts a
+// miss) if it is not cached.
+bool take_cached_scene(SceneCache &cache, const std::string &filename, CachedScene &scene);
+
+bool is_scene_cached(const SceneCache &cache, const std::string &filename);
+
+// Evicts scenes until the cache fits its budget (e.g., after it was lowered)
+void trim_scene_cache(SceneCache &cache);
+
+void clear_scene_cache(SceneCache &cache);
+
+}  // namespace gltf
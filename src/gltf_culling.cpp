@@ -0,0 +1,423 @@
+// Frustum and occlusion culling of scene nodes, using a small depth buffer
+// that is rasterized on the CPU from a set of occluders.
+//
+
+#include "gltf_culling.h"
+#include "cg_parallel.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define GLTF_CULLING_SSE2 1
+#endif
+
+namespace gltf {
+
+static const int HIZ_BLOCK_SIZE = 8;  // Pixels per side of a hierarchical depth block
+
+// Screen-space triangle, with x/y in pixels and z in [0, 1]
+struct RasterTriangle {
+    glm::vec3 v[3];
+};
+
+void create_culling_meshes(std::vector<CullingMesh> &meshes, const GLTFAsset &asset)
+{
+    meshes.clear();
+    meshes.resize(asset.meshes.size());
+    cg::parallel_for(int(asset.meshes.size()), [&](int i) {
+        CullingMesh &mesh = meshes[i];
+        const float inf = std::numeric_limits<float>::infinity();
+        mesh.bounds.min = glm::vec3(inf);
+        mesh.bounds.max = glm::vec3(-inf);
+
+        for (const auto &primitive : asset.meshes[i].primitives) {
+            const int position = find_attribute(primitive, SEMANTIC_POSITION);
+            if (!accessor_is_valid(asset, position) ||
+                !accessor_is_valid(asset, primitive.indices)) {
+                continue;
+            }
+            std::vector<float> positions;
+            std::vector<uint32_t> indices;
+            read_accessor(asset, position, positions);
+            read_indices(asset, primitive.indices, indices);
+
+            const uint32_t base = uint32_t(mesh.positions.size());
+            const size_t numVertices = positions.size() / 3;
+            for (size_t j = 0; j < numVertices; ++j) {
+                glm::vec3 p(positions[3 * j], positions[3 * j + 1], positions[3 * j + 2]);
+                mesh.positions.push_back(p);
+                mesh.bounds.min = glm::min(mesh.bounds.min, p);
+                mesh.bounds.max = glm::max(mesh.bounds.max, p);
+            }
+            for (size_t j = 0; j + 2 < indices.size(); j += 3) {
+                if (indices[j] >= numVertices || indices[j + 1] >= numVertices ||
+                    indices[j + 2] >= numVertices) {
+                    continue;
+                }
+                for (int k = 0; k < 3; ++k) mesh.indices.push_back(base + indices[j + k]);
+            }
+        }
+        if (mesh.positions.empty()) mesh.bounds.min = mesh.bounds.max = glm::vec3(0.0f);
+    });
+}
+
+void init_occlusion_buffer(OcclusionBuffer &buffer, int width, int height, int tileWidth,
+                           int tileHeight)
+{
+    assert(width % 4 == 0 && tileWidth % 4 == 0);
+    assert(tileWidth % HIZ_BLOCK_SIZE == 0 && tileHeight % HIZ_BLOCK_SIZE == 0);
+    buffer.width = width;
+    buffer.height = height;
+    buffer.tileWidth = tileWidth;
+    buffer.tileHeight = tileHeight;
+    buffer.hizWidth = (width + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE;
+    buffer.hizHeight = (height + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE;
+    buffer.depth.assign(size_t(width) * height, 1.0f);
+    buffer.hiz.assign(size_t(buffer.hizWidth) * buffer.hizHeight, 1.0f);
+}
+
+// Clips a clip-space triangle against the near plane (z >= -w) and appends
+// the resulting screen-space triangles (zero, one or two)
+static void clip_and_project(const glm::vec4 clip[3], int width, int height,
+                             std::vector<RasterTriangle> &out)
+{
+    glm::vec4 poly[4];
+    int count = 0;
+    for (int i = 0; i < 3; ++i) {
+        const glm::vec4 &a = clip[i], &b = clip[(i + 1) % 3];
+        const float da = a.z + a.w, db = b.z + b.w;
+        if (da >= 0.0f) poly[count++] = a;
+        if ((da >= 0.0f) != (db >= 0.0f)) poly[count++] = glm::mix(a, b, da / (da - db));
+    }
+    if (count < 3) return;
+
+    glm::vec3 screen[4];
+    for (int i = 0; i < count; ++i) {
+        const float w = std::max(poly[i].w, 1e-6f);
+        const glm::vec3 ndc = glm::vec3(poly[i]) / w;
+        screen[i] = glm::vec3((ndc.x * 0.5f + 0.5f) * width, (ndc.y * 0.5f + 0.5f) * height,
+                              ndc.z * 0.5f + 0.5f);
+    }
+    for (int i = 1; i + 1 < count; ++i) {
+        RasterTriangle triangle = {{screen[0], screen[i], screen[i + 1]}};
+        const glm::vec3 bmin = glm::min(triangle.v[0], glm::min(triangle.v[1], triangle.v[2]));
+        const glm::vec3 bmax = glm::max(triangle.v[0], glm::max(triangle.v[1], triangle.v[2]));
+        if (bmax.x < 0.0f || bmax.y < 0.0f || bmin.x > width || bmin.y > height) continue;
+        if (bmin.z > 1.0f) continue;  // Beyond the far plane
+        out.push_back(triangle);
+    }
+}
+
+// Rasterizes a triangle into the part of the depth buffer covered by a tile,
+// keeping the nearest depth. Pixels are sampled at their centers.
+static void rasterize_triangle(OcclusionBuffer &buffer, const RasterTriangle &tri, int x0, int y0,
+                               int x1, int y1)
+{
+    glm::vec3 a = tri.v[0], b = tri.v[1], c = tri.v[2];
+    float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+    if (area == 0.0f) return;
+    if (area < 0.0f) {  // Occluders are treated as double-sided
+        std::swap(b, c);
+        area = -area;
+    }
+
+    // Edge functions E(x, y) = A * x + B * y + C, positive inside
+    const glm::vec3 p[3] = {a, b, c};
+    float A[3], B[3], C[3];
+    for (int i = 0; i < 3; ++i) {
+        const glm::vec3 &u = p[i], &v = p[(i + 1) % 3];
+        A[i] = u.y - v.y;
+        B[i] = v.x - u.x;
+        C[i] = -(A[i] * u.x + B[i] * u.y);
+    }
+
+    // Depth plane z(x, y) = zA * x + zB * y + zC. The barycentric weight of
+    // b is given by edge 2 (c->a), and the weight of c by edge 0 (a->b).
+    const float invArea = 1.0f / area;
+    const float zA = (A[2] * (b.z - a.z) + A[0] * (c.z - a.z)) * invArea;
+    const float zB = (B[2] * (b.z - a.z) + B[0] * (c.z - a.z)) * invArea;
+    const float zC = a.z - zA * a.x - zB * a.y;
+
+    // Spans are processed four pixels at a time. Tile bounds are multiples
+    // of four, so groups never reach into a neighbouring tile.
+    const glm::vec3 bmin = glm::min(a, glm::min(b, c)), bmax = glm::max(a, glm::max(b, c));
+    const int xmin = std::max(x0, int(std::floor(bmin.x))) & ~3;
+    const int xmax = std::min(x1, int(std::ceil(bmax.x)));
+    const int ymin = std::max(y0, int(std::floor(bmin.y)));
+    const int ymax = std::min(y1, int(std::ceil(bmax.y)));
+
+    for (int y = ymin; y < ymax; ++y) {
+        const float py = y + 0.5f;
+        float *row = &buffer.depth[size_t(y) * buffer.width];
+#ifdef GLTF_CULLING_SSE2
+        const __m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 rowE0 = _mm_set1_ps(B[0] * py + C[0]);
+        const __m128 rowE1 = _mm_set1_ps(B[1] * py + C[1]);
+        const __m128 rowE2 = _mm_set1_ps(B[2] * py + C[2]);
+        const __m128 rowZ = _mm_set1_ps(zB * py + zC);
+        const __m128 a0 = _mm_set1_ps(A[0]), a1 = _mm_set1_ps(A[1]), a2 = _mm_set1_ps(A[2]);
+        const __m128 za = _mm_set1_ps(zA);
+        for (int x = xmin; x < xmax; x += 4) {
+            const __m128 px = _mm_add_ps(_mm_set1_ps(float(x)), offsets);
+            const __m128 e0 = _mm_add_ps(_mm_mul_ps(a0, px), rowE0);
+            const __m128 e1 = _mm_add_ps(_mm_mul_ps(a1, px), rowE1);
+            const __m128 e2 = _mm_add_ps(_mm_mul_ps(a2, px), rowE2);
+            const __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero),
+                                                        _mm_cmpge_ps(e1, zero)),
+                                             _mm_cmpge_ps(e2, zero));
+            if (_mm_movemask_ps(inside) == 0) continue;
+
+            const __m128 z = _mm_add_ps(_mm_mul_ps(za, px), rowZ);
+            const __m128 old = _mm_loadu_ps(row + x);
+            const __m128 nearest = _mm_min_ps(old, z);
+            _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest),
+                                             _mm_andnot_ps(inside, old)));
+        }
+#else
+        for (int x = xmin; x < xmax; ++x) {
+            const float px = x + 0.5f;
+            if (A[0] * px + B[0] * py + C[0] < 0.0f || A[1] * px + B[1] * py + C[1] < 0.0f ||
+                A[2] * px + B[2] * py + C[2] < 0.0f) {
+                continue;
+            }
+            row[x] = std::min(row[x], zA * px + zB * py + zC);
+        }
+#endif
+    }
+}
+
+// Clears, rasterizes and builds the hierarchical depth of all tiles
+static void rasterize_occluders(OcclusionBuffer &buffer,
+                                const std::vector<RasterTriangle> &triangles)
+{
+    const int tilesX = (buffer.width + buffer.tileWidth - 1) / buffer.tileWidth;
+    const int tilesY = (buffer.height + buffer.tileHeight - 1) / buffer.tileHeight;
+
+    // Bin triangles into the tiles that their bounding boxes overlap
+    std::vector<std::vector<uint32_t> > bins(size_t(tilesX) * tilesY);
+    for (size_t i = 0; i < triangles.size(); ++i) {
+        const RasterTriangle &t = triangles[i];
+        const glm::vec3 bmin = glm::min(t.v[0], glm::min(t.v[1], t.v[2]));
+        const glm::vec3 bmax = glm::max(t.v[0], glm::max(t.v[1], t.v[2]));
+        const int tx0 = std::max(0, int(bmin.x) / buffer.tileWidth);
+        const int ty0 = std::max(0, int(bmin.y) / buffer.tileHeight);
+        const int tx1 = std::min(tilesX - 1, int(bmax.x) / buffer.tileWidth);
+        const int ty1 = std::min(tilesY - 1, int(bmax.y) / buffer.tileHeight);
+        for (int ty = ty0; ty <= ty1; ++ty) {
+            for (int tx = tx0; tx <= tx1; ++tx) bins[ty * tilesX + tx].push_back(uint32_t(i));
+        }
+    }
+
+    // Tiles do not overlap, so they can be processed by different threads
+    cg::parallel_for(tilesX * tilesY, [&](int tile) {
+        const int x0 = (tile % tilesX) * buffer.tileWidth;
+        const int y0 = (tile / tilesX) * buffer.tileHeight;
+        const int x1 = std::min(buffer.width, x0 + buffer.tileWidth);
+        const int y1 = std::min(buffer.height, y0 + buffer.tileHeight);
+        for (int y = y0; y < y1; ++y) {
+            std::fill(&buffer.depth[size_t(y) * buffer.width + x0],
+                      &buffer.depth[size_t(y) * buffer.width] + x1, 1.0f);
+        }
+        for (uint32_t i : bins[tile]) rasterize_triangle(buffer, triangles[i], x0, y0, x1, y1);
+
+        for (int by = y0 / HIZ_BLOCK_SIZE; by * HIZ_BLOCK_SIZE < y1; ++by) {
+            for (int bx = x0 / HIZ_BLOCK_SIZE; bx * HIZ_BLOCK_SIZE < x1; ++bx) {
+                float farthest = 0.0f;
+                const int yend = std::min(y1, (by + 1) * HIZ_BLOCK_SIZE);
+                const int xend = std::min(x1, (bx + 1) * HIZ_BLOCK_SIZE);
+                for (int y = by * HIZ_BLOCK_SIZE; y < yend; ++y) {
+                    for (int x = bx * HIZ_BLOCK_SIZE; x < xend; ++x) {
+                        farthest = std::max(farthest, buffer.depth[size_t(y) * buffer.width + x]);
+                    }
+                }
+                buffer.hiz[size_t(by) * buffer.hizWidth + bx] = farthest;
+            }
+        }
+    });
+}
+
+bool is_aabb_visible(const OcclusionBuffer &buffer, const AABB &aabb, const glm::mat4 &viewProj,
+                     bool frustumCulling, bool occlusionCulling, bool &outsideFrustum)
+{
+    outsideFrustum = false;
+    glm::vec3 ndcMin(std::numeric_limits<float>::infinity());
+    glm::vec3 ndcMax(-std::numeric_limits<float>::infinity());
+    int outside[6] = {0};  // Corners outside each clip plane
+    bool crossesNear = false;
+    for (int i = 0; i < 8; ++i) {
+        const glm::vec4 corner((i & 1) ? aabb.max.x : aabb.min.x,
+                               (i & 2) ? aabb.max.y : aabb.min.y,
+                               (i & 4) ? aabb.max.z : aabb.min.z, 1.0f);
+        const glm::vec4 clip = viewProj * corner;
+        outside[0] += clip.x < -clip.w;
+        outside[1] += clip.x > clip.w;
+        outside[2] += clip.y < -clip.w;
+        outside[3] += clip.y > clip.w;
+        outside[4] += clip.z < -clip.w;
+        outside[5] += clip.z > clip.w;
+        if (clip.z < -clip.w || clip.w <= 0.0f) {
+            crossesNear = true;
+            continue;
+        }
+        const glm::vec3 ndc = glm::vec3(clip) / clip.w;
+        ndcMin = glm::min(ndcMin, ndc);
+        ndcMax = glm::max(ndcMax, ndc);
+    }
+
+    if (frustumCulling) {
+        for (int i = 0; i < 6; ++i) {
+            if (outside[i] == 8) {
+                outsideFrustum = true;
+                return false;
+            }
+        }
+    }
+    // Boxes that reach behind the near plane cannot be projected safely
+    if (!occlusionCulling || crossesNear || buffer.depth.empty()) return true;
+
+    const float zmin = ndcMin.z * 0.5f + 0.5f;
+    const int px0 = std::max(0, int(std::floor((ndcMin.x * 0.5f + 0.5f) * buffer.width)));
+    const int py0 = std::max(0, int(std::floor((ndcMin.y * 0.5f + 0.5f) * buffer.height)));
+    const int px1 = std::min(buffer.width, int(std::ceil((ndcMax.x * 0.5f + 0.5f) * buffer.width)));
+    const int py1 = std::min(buffer.height,
+                             int(std::ceil((ndcMax.y * 0.5f + 0.5f) * buffer.height)));
+    if (px0 >= px1 || py0 >= py1) return true;
+
+    // Test the coarse blocks first, and only look at individual pixels in
+    // blocks whose farthest depth is behind the nearest point of the box
+    for (int by = py0 / HIZ_BLOCK_SIZE; by * HIZ_BLOCK_SIZE < py1; ++by) {
+        for (int bx = px0 / HIZ_BLOCK_SIZE; bx * HIZ_BLOCK_SIZE < px1; ++bx) {
+            if (buffer.hiz[size_t(by) * buffer.hizWidth + bx] < zmin) continue;
+            const int y0 = std::max(py0, by * HIZ_BLOCK_SIZE);
+            const int y1 = std::min(py1, (by + 1) * HIZ_BLOCK_SIZE);
+            const int x0 = std::max(px0, bx * HIZ_BLOCK_SIZE);
+            const int x1 = std::min(px1, (bx + 1) * HIZ_BLOCK_SIZE);
+            for (int y = y0; y < y1; ++y) {
+                for (int x = x0; x < x1; ++x) {
+                    if (buffer.depth[size_t(y) * buffer.width + x] >= zmin) return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+// Returns the fraction of the screen covered by the projected bounds of a
+// box, or 0 if the box is behind the camera
+static float projected_area(const AABB &aabb, const glm::mat4 &mvp)
+{
+    glm::vec2 ndcMin(std::numeric_limits<float>::infinity());
+    glm::vec2 ndcMax(-std::numeric_limits<float>::infinity());
+    for (int i = 0; i < 8; ++i) {
+        const glm::vec4 corner((i & 1) ? aabb.max.x : aabb.min.x,
+                               (i & 2) ? aabb.max.y : aabb.min.y,
+                               (i & 4) ? aabb.max.z : aabb.min.z, 1.0f);
+        const glm::vec4 clip = mvp * corner;
+        if (clip.w <= 0.0f) return 1.0f;  // Camera is inside or close to the box
+        ndcMin = glm::min(ndcMin, glm::vec2(clip) / clip.w);
+        ndcMax = glm::max(ndcMax, glm::vec2(clip) / clip.w);
+    }
+    ndcMin = glm::clamp(ndcMin, -1.0f, 1.0f);
+    ndcMax = glm::clamp(ndcMax, -1.0f, 1.0f);
+    const glm::vec2 size = glm::max(ndcMax - ndcMin, 0.0f);
+    return 0.25f * size.x * size.y;
+}
+
+static AABB transform_aabb(const AABB &aabb, const glm::mat4 &matrix)
+{
+    const float inf = std::numeric_limits<float>::infinity();
+    AABB result = {glm::vec3(inf), glm::vec3(-inf)};
+    for (int i = 0; i < 8; ++i) {
+        const glm::vec3 corner((i & 1) ? aabb.max.x : aabb.min.x,
+                               (i & 2) ? aabb.max.y : aabb.min.y,
+                               (i & 4) ? aabb.max.z : aabb.min.z);
+        const glm::vec3 p = glm::vec3(matrix * glm::vec4(corner, 1.0f));
+        result.min = glm::min(result.min, p);
+        result.max = glm::max(result.max, p);
+    }
+    return result;
+}
+
+void cull_nodes(const GLTFAsset &asset, const std::vector<CullingMesh> &meshes,
+                const std::vector<glm::mat4> &worldMatrices, const glm::mat4 &viewProj,
+                const CullingSettings &settings, OcclusionBuffer &buffer,
+                std::vector<char> &visible, CullingStats &stats)
+{
+    stats = CullingStats();
+    visible.assign(asset.nodes.size(), 1);
+
+    std::vector<RasterTriangle> triangles;
+    if (settings.occlusionCulling && !buffer.depth.empty()) {
+        // Select occluders: tagged nodes if there are any, otherwise the
+        // nodes with the largest projected area
+        std::vector<std::pair<float, int> > candidates;
+        bool hasTagged = false;
+        for (const auto &node : asset.nodes) hasTagged = hasTagged || node.isOccluder;
+        for (unsigned i = 0; i < asset.nodes.size(); ++i) {
+            const int mesh = asset.nodes[i].mesh;
+            if (mesh < 0 || mesh >= int(meshes.size()) || meshes[mesh].indices.empty()) continue;
+            if (hasTagged && !asset.nodes[i].isOccluder) continue;
+            const float area = projected_area(meshes[mesh].bounds, viewProj * worldMatrices[i]);
+            if (!hasTagged && area < settings.minOccluderArea) continue;
+            candidates.push_back(std::make_pair(area, int(i)));
+        }
+        std::sort(candidates.begin(), candidates.end(),
+                  [](const std::pair<float, int> &a, const std::pair<float, int> &b) {
+                      return a.first > b.first;
+                  });
+
+        std::vector<int> occluders;
+        for (const auto &candidate : candidates) {
+            if (!hasTagged && int(occluders.size()) >= settings.maxOccluders) break;
+            const CullingMesh &mesh = meshes[asset.nodes[candidate.second].mesh];
+            const int numTriangles = int(mesh.indices.size() / 3);
+            if (stats.occluderTriangles + numTriangles > settings.maxOccluderTriangles) continue;
+            stats.occluderTriangles += numTriangles;
+            occluders.push_back(candidate.second);
+        }
+        stats.occluders = int(occluders.size());
+
+        // Transform and clip the occluder triangles in parallel
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<std::vector<RasterTriangle> > perOccluder(occluders.size());
+        cg::parallel_for(int(occluders.size()), [&](int i) {
+            const CullingMesh &mesh = meshes[asset.nodes[occluders[i]].mesh];
+            const glm::mat4 mvp = viewProj * worldMatrices[occluders[i]];
+            std::vector<glm::vec4> clip(mesh.positions.size());
+            for (size_t j = 0; j < clip.size(); ++j) {
+                clip[j] = mvp * glm::vec4(mesh.positions[j], 1.0f);
+            }
+            for (size_t j = 0; j + 2 < mesh.indices.size(); j += 3) {
+                const glm::vec4 tri[3] = {clip[mesh.indices[j]], clip[mesh.indices[j + 1]],
+                                          clip[mesh.indices[j + 2]]};
+                clip_and_project(tri, buffer.width, buffer.height, perOccluder[i]);
+            }
+        });
+        for (const auto &it : perOccluder) triangles.insert(triangles.end(), it.begin(), it.end());
+        rasterize_occluders(buffer, triangles);
+        const std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        stats.rasterMs = elapsed.count();
+    }
+
+    for (unsigned i = 0; i < asset.nodes.size(); ++i) {
+        const int mesh = asset.nodes[i].mesh;
+        if (mesh < 0 || mesh >= int(meshes.size())) continue;
+        stats.tested++;
+        bool outsideFrustum = false;
+        const AABB bounds = transform_aabb(meshes[mesh].bounds, worldMatrices[i]);
+        if (!is_aabb_visible(buffer, bounds, viewProj, settings.frustumCulling,
+                             settings.occlusionCulling && !triangles.empty(), outsideFrustum)) {
+            visible[i] = 0;
+            (outsideFrustum ? stats.frustumCulled : stats.occlusionCulled)++;
+        }
+    }
+}
+
+}  // namespace gltf
@@ -0,0 +1,76 @@
+// Frustum and occlusion culling of scene nodes, using a small depth buffer
+// that is rasterized on the CPU from a set of occluders.
+//
+
+#pragma once
+
+#include "gltf_scene.h"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace gltf {
+
+// CPU copy of the geometry of a mesh (all primitives), used for occluders
+struct CullingMesh {
+    AABB bounds;
+    std::vector<glm::vec3> positions;
+    std::vector<uint32_t> indices;
+};
+
+// Low-resolution depth buffer. Depth is stored in [0, 1] with 1 at the far
+// plane, rows from bottom to top (like OpenGL), and the buffer is split into
+// tiles that are rasterized in parallel. The hierarchical level stores the
+// farthest depth of each block of pixels.
+struct OcclusionBuffer {
+    int width = 0;
+    int height = 0;
+    int tileWidth = 0;
+    int tileHeight = 0;
+    int hizWidth = 0;
+    int hizHeight = 0;
+    std::vector<float> depth;
+    std::vector<float> hiz;
+};
+
+struct CullingSettings {
+    bool frustumCulling = true;
+    bool occlusionCulling = true;
+    int maxOccluders = 8;              // Only used when no node is tagged
+    int maxOccluderTriangles = 200000;
+    float minOccluderArea = 0.02f;     // Fraction of the screen
+};
+
+struct CullingStats {
+    int tested = 0;            // Number of nodes tested
+    int frustumCulled = 0;
+    int occlusionCulled = 0;
+    int occluders = 0;
+    int occluderTriangles = 0;
+    double rasterMs = 0.0;     // Time spent rasterizing occluders
+};
+
+// Creates CPU copies of the geometry and bounds of every mesh in the asset
+void create_culling_meshes(std::vector<CullingMesh> &meshes, const GLTFAsset &asset);
+
+// Allocates an occlusion buffer. The width must be a multiple of 4 (the
+// SIMD width) and both sizes should be multiples of the tile size.
+void init_occlusion_buffer(OcclusionBuffer &buffer, int width, int height, int tileWidth = 64,
+                           int tileHeight = 32);
+
+// Determines which nodes to draw from the current camera. Occluders are the
+// nodes tagged as occluders, or else the largest nodes on screen. The
+// result has one flag per node, which is 0 for nodes that can be skipped.
+void cull_nodes(const GLTFAsset &asset, const std::vector<CullingMesh> &meshes,
+                const std::vector<glm::mat4> &worldMatrices, const glm::mat4 &viewProj,
+                const CullingSettings &settings, OcclusionBuffer &buffer,
+                std::vector<char> &visible, CullingStats &stats);
+
+// Returns false if a world-space box is outside the view frustum or hidden
+// behind the occluders in the buffer
+bool is_aabb_visible(const OcclusionBuffer &buffer, const AABB &aabb, const glm::mat4 &viewProj,
+                     bool frustumCulling, bool occlusionCulling, bool &outsideFrustum);
+
+}  // namespace gltf
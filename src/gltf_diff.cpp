@@ -0,0 +1,124 @@
+// Differences between two versions of an asset, so that an asset that is
+// loaded again after an edit can be applied by uploading only what changed.
+//
+
+#include "gltf_diff.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace gltf {
+
+static bool same_accessor(const Accessor &a, const Accessor &b)
+{
+    return a.bufferView == b.bufferView && a.componentType == b.componentType &&
+           a.count == b.count && a.byteOffset == b.byteOffset && a.type == b.type &&
+           a.normalized == b.normalized;
+}
+
+static bool same_buffer_view(const BufferView &a, const BufferView &b)
+{
+    return a.buffer == b.buffer && a.byteLength == b.byteLength &&
+           a.byteOffset == b.byteOffset && a.byteStride == b.byteStride;
+}
+
+static bool same_primitive(const Primitive &a, const Primitive &b)
+{
+    if (a.indices != b.indices || a.lods != b.lods) return false;
+    if (a.attributes.size() != b.attributes.size()) return false;
+    for (size_t i = 0; i < a.attributes.size(); ++i) {
+        if (a.attributes[i].name != b.attributes[i].name ||
+            a.attributes[i].index != b.attributes[i].index) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Returns true if the drawables of one asset can draw the other after the
+// buffer contents have been updated
+static bool same_layout(const GLTFAsset &a, const GLTFAsset &b)
+{
+    if (a.buffers.size() != b.buffers.size() || a.bufferViews.size() != b.bufferViews.size() ||
+        a.accessors.size() != b.accessors.size() || a.meshes.size() != b.meshes.size() ||
+        a.textures.size() != b.textures.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.buffers.size(); ++i) {
+        if (a.buffers[i].byteLength != b.buffers[i].byteLength) return false;
+    }
+    for (size_t i = 0; i < a.bufferViews.size(); ++i) {
+        if (!same_buffer_view(a.bufferViews[i], b.bufferViews[i])) return false;
+    }
+    for (size_t i = 0; i < a.accessors.size(); ++i) {
+        if (!same_accessor(a.accessors[i], b.accessors[i])) return false;
+    }
+    for (size_t i = 0; i < a.meshes.size(); ++i) {
+        const Mesh &meshA = a.meshes[i], &meshB = b.meshes[i];
+        if (meshA.primitives.size() != meshB.primitives.size()) return false;
+        for (size_t j = 0; j < meshA.primitives.size(); ++j) {
+            if (!same_primitive(meshA.primitives[j], meshB.primitives[j])) return false;
+        }
+    }
+    return true;
+}
+
+bool same_image(const Image &a, const Image &b)
+{
+    return a.width == b.width && a.height == b.height && a.channels == b.channels &&
+           a.srgb == b.srgb && a.swizzle == b.swizzle &&
+           a.compressedFormat == b.compressedFormat && a.data == b.data && a.levels == b.levels;
+}
+
+static bool same_sampler(const GLTFAsset &a, const Texture &textureA, const GLTFAsset &b,
+                         const Texture &textureB)
+{
+    if (textureA.hasSampler != textureB.hasSampler) return false;
+    if (!textureA.hasSampler) return true;
+    const Sampler &samplerA = a.samplers[textureA.sampler];
+    const Sampler &samplerB = b.samplers[textureB.sampler];
+    return samplerA.magFilter == samplerB.magFilter && samplerA.minFilter == samplerB.minFilter &&
+           samplerA.wrapS == samplerB.wrapS && samplerA.wrapT == samplerB.wrapT;
+}
+
+AssetDiff diff_assets(const GLTFAsset &current, const GLTFAsset &updated, size_t blockSize)
+{
+    AssetDiff diff;
+    diff.layoutChanged = !same_layout(current, updated);
+
+    if (!diff.layoutChanged && !updated.buffers.empty()) {
+        const std::vector<char> &a = current.buffers[0].data, &b = updated.buffers[0].data;
+        const size_t size = b.size();
+        const bool released = a.size() != size;
+        for (size_t offset = 0; offset < size; offset += blockSize) {
+            const size_t n = std::min(blockSize, size - offset);
+            if (!released && std::memcmp(&a[offset], &b[offset], n) == 0) continue;
+            if (!diff.bufferRanges.empty()) {
+                ByteRange &last = diff.bufferRanges.back();
+                if (last.offset + last.size == offset) {
+                    last.size += n;
+                    continue;
+                }
+            }
+            diff.bufferRanges.push_back({offset, n});
+        }
+    }
+
+    const size_t numTextures = std::min(current.textures.size(), updated.textures.size());
+    for (size_t i = 0; i < updated.textures.size(); ++i) {
+        if (i >= numTextures) {
+            diff.textures.push_back(int(i));
+            continue;
+        }
+        const Texture &a = current.textures[i], &b = updated.textures[i];
+        bool changed = a.source != b.source || !same_sampler(current, a, updated, b);
+        if (!changed && b.source >= 0) {
+            const Image &imageA = current.images[a.source], &imageB = updated.images[b.source];
+            changed = !same_image(imageA, imageB);  // Also if A has been released
+        }
+        if (changed) diff.textures.push_back(int(i));
+    }
+    return diff;
+}
+
+}  // namespace gltf
@@ -0,0 +1,37 @@
+// Differences between two versions of an asset, so that an asset that is
+// loaded again after an edit can be applied by uploading only what changed.
+//
+
+#pragma once
+
+#include "gltf_scene.h"
+
+#include <cstddef>
+#include <vector>
+
+namespace gltf {
+
+struct ByteRange {
+    size_t offset;
+    size_t size;
+};
+
+struct AssetDiff {
+    // Meshes, accessors or buffers differ in layout, so the drawables must be
+    // created again instead of updated
+    bool layoutChanged = false;
+    std::vector<ByteRange> bufferRanges;  // Changed bytes of the first buffer (sorted)
+    std::vector<int> textures;            // Textures whose image or sampler changed
+};
+
+// Compares two versions of an asset. The buffer is compared in blocks of
+// blockSize bytes, and adjacent changed blocks are merged into one range.
+// Buffers and images whose CPU copies have been released in the current
+// version count as changed.
+AssetDiff diff_assets(const GLTFAsset &current, const GLTFAsset &updated,
+                      size_t blockSize = 65536);
+
+// Returns true if two images have the same pixels, format and mip levels
+bool same_image(const Image &a, const Image &b);
+
+}  // namespace gltf
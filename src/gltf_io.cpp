@@ -4,56 +4,109 @@
 //
 
 #include "gltf_io.h"
+#include "gltf_mesh.h"
+#include "gltf_texture.h"
+#include "cg_loadstats.h"
+#include "cg_utils.h"
 
 #include <rapidjson/rapidjson.h>
 #include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
 
 // #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fstream>
 #include <iostream>
 #include <vector>
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <dirent.h>
+#endif
+
 namespace json = rapidjson;  // Use shorter alias for namespace
 
 namespace gltf {
 
+// Reproduces the finite differences (4.0 * 0.001 texcoord offset) that
+// mesh.frag used to take on grayscale bump maps
+static const float BUMP_MAP_STRENGTH = 0.004f;
+
 static bool load_file_to_bytebuffer(const std::string &filename, std::vector<char> &buffer)
 {
-    FILE *stream = std::fopen(filename.c_str(), "rb+");
-    if (!stream) {
+    if (!cg::read_file(filename, buffer)) {
         std::cerr << "Error: Could not open " << filename << std::endl;
         return false;
     }
-
-    std::fseek(stream, 0, SEEK_END);
-    const uint32_t numBytes = std::ftell(stream) + 1;
-    std::rewind(stream);
-
-    buffer.resize(numBytes);
-    buffer.resize(std::fread(&buffer[0], sizeof(char), numBytes, stream));
-    std::fclose(stream);
     return true;
 }
 
-static bool load_image_to_bytebuffer(const std::string &filename, std::vector<char> &buffer,
-                                     int &width, int &height)
+static bool decode_image_to_bytebuffer(const std::vector<char> &file, Image &image)
 {
-    // Load image file (ask for RGBA format with four components)
+    // Decode the image with its own number of components. Grayscale (with or
+    // without alpha) is kept as one or two channels and swizzled to gray when
+    // sampled, while RGB is padded to RGBA since the GL pads it anyway.
+    cg::LoadScope scope(cg::LOAD_IMAGE_DECODE, "decode_image");
     int w, h, c;
-    uint8_t *image = stbi_load(filename.c_str(), &w, &h, &c, 4);
-    if (image == nullptr) {
+    uint8_t *pixels =
+        stbi_load_from_memory((const stbi_uc *)file.data(), int(file.size()), &w, &h, &c, 0);
+    if (pixels == nullptr) {
         std::cerr << "Error: " << stbi_failure_reason() << std::endl;
         return false;
     }
 
-    width = w, height = h;
-    buffer.resize(width * height * 4);
-    std::memcpy(&buffer[0], image, width * height * 4);
-    stbi_image_free(image);  // Clean up resources
+    image.width = w, image.height = h;
+    image.channels = c == 3 ? 4 : c;
+    image.swizzle = c == 1 ? "rrr1" : (c == 2 ? "rrrg" : "");
+    image.data.resize(size_t(w) * h * image.channels);
+    if (c == 3) {
+        for (size_t i = 0; i < size_t(w) * h; ++i) {
+            std::memcpy(&image.data[4 * i], &pixels[3 * i], 3);
+            image.data[4 * i + 3] = char(255);
+        }
+    } else {
+        std::memcpy(&image.data[0], pixels, image.data.size());
+    }
+    stbi_image_free(pixels);  // Clean up resources
+    scope.bytes = image.data.size();
+    return true;
+}
+
+static bool load_image_to_bytebuffer(const std::string &filename, Image &image)
+{
+    std::vector<char> file;
+    if (!load_file_to_bytebuffer(filename, file)) return false;
+    return decode_image_to_bytebuffer(file, image);
+}
+
+// Loads an image stored in a buffer view (of a GLB file), as KTX2 or as a
+// format that stb_image reads
+static bool load_image_from_buffer_view(const GLTFAsset &asset, Image &image)
+{
+    if (image.bufferView < 0 || image.bufferView >= int(asset.bufferViews.size())) return false;
+    const BufferView &bufferView = asset.bufferViews[image.bufferView];
+    const std::vector<char> &data = asset.buffers[bufferView.buffer].data;
+    if (size_t(bufferView.byteOffset) + bufferView.byteLength > data.size()) {
+        std::cerr << "Error: Image data is outside its buffer" << std::endl;
+        return false;
+    }
+    const std::vector<char> file(data.begin() + bufferView.byteOffset,
+                                 data.begin() + bufferView.byteOffset + bufferView.byteLength);
+    if (!is_ktx2_image(image)) return decode_image_to_bytebuffer(file, image);
+
+    cg::LoadScope scope(cg::LOAD_IMAGE_DECODE, "decode_ktx2_image", file.size());
+    const std::string swizzle = image.swizzle;
+    if (!decode_ktx2_image(file, "embedded image", image)) return false;
+    if (!swizzle.empty()) image.swizzle = swizzle;
     return true;
 }
 
@@ -81,7 +134,8 @@ static std::vector<Node> create_nodes_from_json(const json::Value &value)
 {
     std::vector<Node> nodes(value.Size());
     for (unsigned i = 0; i < value.Size(); ++i) {
-        nodes[i].mesh = value[i]["mesh"].GetInt();
+        // Nodes without a mesh hold lights or only group their children
+        nodes[i].mesh = value[i].HasMember("mesh") ? value[i]["mesh"].GetInt() : -1;
 
         if (value[i].HasMember("name")) {
             // Note: this attribute seems to be optional
@@ -134,10 +188,114 @@ static std::vector<Node> create_nodes_from_json(const json::Value &value)
         } else {
             nodes[i].matrix = glm::mat4(1.0f);
         }
+
+        nodes[i].skin = value[i].HasMember("skin") ? value[i]["skin"].GetInt() : -1;
+
+        nodes[i].light = -1;
+        if (value[i].HasMember("extensions") &&
+            value[i]["extensions"].HasMember("KHR_lights_punctual")) {
+            nodes[i].light = value[i]["extensions"]["KHR_lights_punctual"]["light"].GetInt();
+        }
+
+        nodes[i].isOccluder = false;
+        if (value[i].HasMember("extras") && value[i]["extras"].IsObject()) {
+            const json::Value &extras = value[i]["extras"];
+            if (extras.HasMember("occluder") && extras["occluder"].IsBool()) {
+                nodes[i].isOccluder = extras["occluder"].GetBool();
+            }
+        }
     }
     return nodes;
 }
 
+static std::vector<Light> create_lights_from_json(const json::Value &value)
+{
+    std::vector<Light> lights(value.Size());
+    for (unsigned i = 0; i < value.Size(); ++i) {
+        Light &light = lights[i];
+        if (value[i].HasMember("name")) light.name = value[i]["name"].GetString();
+
+        const std::string type = value[i]["type"].GetString();
+        light.type = type == "spot" ? LIGHT_SPOT
+                                    : (type == "directional" ? LIGHT_DIRECTIONAL : LIGHT_POINT);
+        light.color = glm::vec3(1.0f);
+        if (value[i].HasMember("color")) {
+            const json::Value &tmp = value[i]["color"];
+            for (unsigned j = 0; j < tmp.Size() && j < 3; ++j) {
+                light.color[j] = float(tmp[j].GetDouble());
+            }
+        }
+        light.intensity =
+            value[i].HasMember("intensity") ? float(value[i]["intensity"].GetDouble()) : 1.0f;
+        light.range = value[i].HasMember("range") ? float(value[i]["range"].GetDouble()) : 0.0f;
+
+        light.innerConeAngle = 0.0f;
+        light.outerConeAngle = glm::radians(45.0f);
+        if (value[i].HasMember("spot")) {
+            const json::Value &spot = value[i]["spot"];
+            if (spot.HasMember("innerConeAngle")) {
+                light.innerConeAngle = float(spot["innerConeAngle"].GetDouble());
+            }
+            if (spot.HasMember("outerConeAngle")) {
+                light.outerConeAngle = float(spot["outerConeAngle"].GetDouble());
+            }
+        }
+    }
+    return lights;
+}
+
+static std::vector<Skin> create_skins_from_json(const json::Value &value)
+{
+    std::vector<Skin> skins(value.Size());
+    for (unsigned i = 0; i < value.Size(); ++i) {
+        Skin &skin = skins[i];
+        if (value[i].HasMember("name")) skin.name = value[i]["name"].GetString();
+        for (const auto &joint : value[i]["joints"].GetArray()) {
+            skin.joints.push_back(joint.GetInt());
+        }
+        skin.inverseBindMatrices = value[i].HasMember("inverseBindMatrices")
+                                       ? value[i]["inverseBindMatrices"].GetInt()
+                                       : -1;
+        skin.skeleton = value[i].HasMember("skeleton") ? value[i]["skeleton"].GetInt() : -1;
+    }
+    return skins;
+}
+
+static std::vector<Animation> create_animations_from_json(const json::Value &value)
+{
+    std::vector<Animation> animations(value.Size());
+    for (unsigned i = 0; i < value.Size(); ++i) {
+        Animation &animation = animations[i];
+        if (value[i].HasMember("name")) animation.name = value[i]["name"].GetString();
+        for (const auto &it : value[i]["samplers"].GetArray()) {
+            AnimationSampler sampler = {it["input"].GetInt(), it["output"].GetInt(),
+                                        INTERPOLATION_LINEAR};
+            if (it.HasMember("interpolation")) {
+                const std::string interpolation = it["interpolation"].GetString();
+                if (interpolation == "STEP") sampler.interpolation = INTERPOLATION_STEP;
+                if (interpolation == "CUBICSPLINE") {
+                    sampler.interpolation = INTERPOLATION_CUBICSPLINE;
+                }
+            }
+            animation.samplers.push_back(sampler);
+        }
+        for (const auto &it : value[i]["channels"].GetArray()) {
+            const json::Value &target = it["target"];
+            const std::string path = target["path"].GetString();
+            AnimationChannel channel;
+            channel.sampler = it["sampler"].GetInt();
+            // Channels without a node target something in an extension
+            channel.node = target.HasMember("node") ? target["node"].GetInt() : -1;
+            channel.path = path == "rotation" ? PATH_ROTATION
+                         : path == "scale"    ? PATH_SCALE
+                         : path == "weights"  ? PATH_WEIGHTS
+                                              : PATH_TRANSLATION;
+            animation.channels.push_back(channel);
+        }
+    }
+    return animations;
+}
+
 static MaterialTexture create_material_texture_from_json(const json::Value &value)
 {
     MaterialTexture materialTexture;
@@ -243,7 +401,17 @@ static std::vector<Texture> create_textures_from_json(const json::Value &value)
 {
     std::vector<Texture> textures(value.Size());
     for (unsigned i = 0; i < value.Size(); ++i) {
-        textures[i].source = value[i]["source"].GetInt();
+        textures[i].source = value[i].HasMember("source") ? value[i]["source"].GetInt() : -1;
+        textures[i].fallbackSource = -1;
+        if (value[i].HasMember("extensions")) {
+            // Prefer KTX2 images when present, but keep the regular image as
+            // a fallback in case the KTX2 payload cannot be decoded
+            const json::Value &extensions = value[i]["extensions"];
+            if (extensions.HasMember("KHR_texture_basisu")) {
+                textures[i].fallbackSource = textures[i].source;
+                textures[i].source = extensions["KHR_texture_basisu"]["source"].GetInt();
+            }
+        }
 
         if (value[i].HasMember("sampler")) {
             textures[i].sampler = value[i]["sampler"].GetInt();
@@ -260,6 +428,20 @@ static std::vector<Image> create_images_from_json(const json::Value &value)
     std::vector<Image> images(value.Size());
     for (unsigned i = 0; i < value.Size(); ++i) {
         if (value[i].HasMember("uri")) { images[i].uri = value[i]["uri"].GetString(); }
+        if (value[i].HasMember("mimeType")) {
+            images[i].mimeType = value[i]["mimeType"].GetString();
+        }
+        images[i].bufferView =
+            value[i].HasMember("bufferView") ? value[i]["bufferView"].GetInt() : -1;
+
+        // Channel mapping of images whose channels were reduced offline (see
+        // choose_texture_formats), which their KTX2 files cannot express
+        if (value[i].HasMember("extras") && value[i]["extras"].IsObject()) {
+            const json::Value &extras = value[i]["extras"];
+            if (extras.HasMember("swizzle") && extras["swizzle"].IsString()) {
+                images[i].swizzle = extras["swizzle"].GetString();
+            }
+        }
     }
     return images;
 }
@@ -300,7 +482,8 @@ static std::vector<Primitive> create_primitives_from_json(const json::Value &val
     std::vector<Primitive> primitives(value.Size());
     for (unsigned i = 0; i < value.Size(); ++i) {
         for (const auto &it : value[i]["attributes"].GetObject()) {
-            Attribute attribute = {it.name.GetString(), it.value.GetInt()};
+            const std::string name = it.name.GetString();
+            Attribute attribute = {name, it.value.GetInt(), attribute_semantic(name)};
             primitives[i].attributes.push_back(attribute);
         }
         primitives[i].indices = value[i]["indices"].GetInt();
@@ -311,6 +494,15 @@ static std::vector<Primitive> create_primitives_from_json(const json::Value &val
         } else {
             primitives[i].hasMaterial = false;
         }
+
+        if (value[i].HasMember("extras") && value[i]["extras"].IsObject()) {
+            const json::Value &extras = value[i]["extras"];
+            if (extras.HasMember("lods") && extras["lods"].IsArray()) {
+                for (const auto &lod : extras["lods"].GetArray()) {
+                    primitives[i].lods.push_back(lod.GetInt());
+                }
+            }
+        }
     }
     return primitives;
 }
@@ -342,6 +534,12 @@ static std::vector<Accessor> create_accessors_from_json(const json::Value &value
         } else {
             accessors[i].byteOffset = 0;
         }
+
+        if (value[i].HasMember("normalized")) {
+            accessors[i].normalized = value[i]["normalized"].GetBool();
+        } else {
+            accessors[i].normalized = false;
+        }
     }
     return accessors;
 }
@@ -368,21 +566,17 @@ static std::vector<Buffer> create_buffers_from_json(const json::Value &value)
     std::vector<Buffer> buffers(value.Size());
     for (unsigned i = 0; i < value.Size(); ++i) {
         buffers[i].byteLength = value[i]["byteLength"].GetInt();
-        buffers[i].uri = value[i]["uri"].GetString();
+        if (value[i].HasMember("uri")) {
+            // Note: the first buffer of a GLB file has no URI
+            buffers[i].uri = value[i]["uri"].GetString();
+        }
     }
     return buffers;
 }
 
-bool load_gltf_asset(const std::string &filename, const std::string &filedir, GLTFAsset &asset)
+// Converts the parsed JSON into an asset, without the image and buffer data
+static void create_asset_from_json(const json::Value &root, GLTFAsset &asset)
 {
-    json::Document root;
-    std::vector<char> buffer;
-    if (!load_file_to_bytebuffer(filedir + filename, buffer)) {
-        std::cerr << "Error: Could not open " << filename << std::endl;
-        return false;
-    }
-    root.Parse(&buffer[0]);
-
     asset = GLTFAsset();
 
     if (root.HasMember("scenes")) {
@@ -407,11 +601,6 @@ bool load_gltf_asset(const std::string &filename, const std::string &filedir, GL
 
     if (root.HasMember("images")) {
         auto images = create_images_from_json(root["images"]);
-        // Now also load the actual image data (from image files)
-        for (unsigned i = 0; i < images.size(); ++i) {
-            load_image_to_bytebuffer(filedir + images[i].uri, images[i].data, images[i].width,
-                                     images[i].height);
-        }
         asset.images = images;
     }
 
@@ -437,13 +626,764 @@ bool load_gltf_asset(const std::string &filename, const std::string &filedir, GL
 
     if (root.HasMember("buffers")) {
         auto buffers = create_buffers_from_json(root["buffers"]);
-        // Now also load the actual buffer data (from .bin files)
-        for (unsigned i = 0; i < buffers.size(); ++i) {
-            load_file_to_bytebuffer(filedir + buffers[i].uri, buffers[i].data);
-        }
         asset.buffers = buffers;
     }
 
+    if (root.HasMember("skins")) asset.skins = create_skins_from_json(root["skins"]);
+
+    if (root.HasMember("animations")) {
+        asset.animations = create_animations_from_json(root["animations"]);
+    }
+
+    if (root.HasMember("extensions") && root["extensions"].HasMember("KHR_lights_punctual")) {
+        const json::Value &extension = root["extensions"]["KHR_lights_punctual"];
+        if (extension.HasMember("lights")) {
+            asset.lights = create_lights_from_json(extension["lights"]);
+        }
+    }
+}
+
+static const uint32_t GLB_MAGIC = 0x46546c67;       // "glTF"
+static const uint32_t GLB_CHUNK_JSON = 0x4e4f534a;  // "JSON"
+static const uint32_t GLB_CHUNK_BIN = 0x004e4942;   // "BIN\0"
+
+// Finds the JSON and binary chunks of a GLB file. Returns false if the file
+// is not a valid GLB file.
+static bool split_glb_chunks(const std::vector<char> &file, size_t &jsonOffset,
+                             size_t &jsonLength, size_t &binOffset, size_t &binLength)
+{
+    uint32_t header[3];
+    if (file.size() < sizeof(header)) return false;
+    std::memcpy(header, file.data(), sizeof(header));
+    if (header[0] != GLB_MAGIC || header[1] != 2 || header[2] > file.size()) return false;
+
+    jsonLength = binLength = 0;
+    for (size_t offset = sizeof(header); offset + 8 <= header[2];) {
+        uint32_t chunk[2];
+        std::memcpy(chunk, &file[offset], sizeof(chunk));
+        offset += sizeof(chunk);
+        if (offset + chunk[0] > header[2]) return false;
+        if (chunk[1] == GLB_CHUNK_JSON && !jsonLength) jsonOffset = offset, jsonLength = chunk[0];
+        if (chunk[1] == GLB_CHUNK_BIN && !binLength) binOffset = offset, binLength = chunk[0];
+        offset += chunk[0];
+    }
+    return jsonLength > 0;
+}
+
+static bool is_glb_file(const std::vector<char> &file)
+{
+    uint32_t magic = 0;
+    if (file.size() >= sizeof(magic)) std::memcpy(&magic, file.data(), sizeof(magic));
+    return magic == GLB_MAGIC;
+}
+
+// Loads the pixels of an image from its file or buffer view
+static bool load_image_data(const GLTFAsset &asset, const std::string &filedir, Image &image)
+{
+    if (image.bufferView >= 0) return load_image_from_buffer_view(asset, image);
+    if (!is_ktx2_image(image)) return load_image_to_bytebuffer(filedir + image.uri, image);
+
+    cg::LoadScope scope(cg::LOAD_FILE_IO, "load_ktx2_image");
+    const std::string swizzle = image.swizzle;
+    const bool ok = load_ktx2_image(filedir + image.uri, image);
+    if (!swizzle.empty()) image.swizzle = swizzle;
+    for (const auto &level : image.levels) scope.bytes += level.size();
+    return ok;
+}
+
+bool load_gltf_asset(const std::string &filename, const std::string &filedir, GLTFAsset &asset)
+{
+    json::Document root;
+    std::vector<char> buffer;
+    if (!load_file_to_bytebuffer(filedir + filename, buffer)) {
+        std::cerr << "Error: Could not open " << filename << std::endl;
+        return false;
+    }
+
+    // GLB files hold the JSON and the first buffer in one file
+    size_t jsonOffset = 0, jsonLength = buffer.size(), binOffset = 0, binLength = 0;
+    const bool isGLB = is_glb_file(buffer);
+    if (isGLB && !split_glb_chunks(buffer, jsonOffset, jsonLength, binOffset, binLength)) {
+        std::cerr << "Error: " << filename << " is not a valid GLB file" << std::endl;
+        return false;
+    }
+    {
+        cg::LoadScope scope(cg::LOAD_JSON_PARSE, "parse_gltf", jsonLength);
+        root.Parse(buffer.data() + jsonOffset, jsonLength);
+        create_asset_from_json(root, asset);
+    }
+
+    // Load the actual buffer data (from .bin files, or the binary chunk)...
+    for (size_t i = 0; i < asset.buffers.size(); ++i) {
+        Buffer &bin = asset.buffers[i];
+        if (i == 0 && isGLB && bin.uri.empty()) {
+            bin.data.assign(buffer.begin() + binOffset, buffer.begin() + binOffset + binLength);
+            bin.data.resize(bin.byteLength);  // The chunk can have up to 3 bytes of padding
+        } else {
+            load_file_to_bytebuffer(filedir + bin.uri, bin.data);
+        }
+    }
+
+    // ...and then the actual image data (from image files or buffer views)
+    for (auto &image : asset.images) load_image_data(asset, filedir, image);
+    for (auto &texture : asset.textures) {
+        if (texture.fallbackSource < 0 || texture.source < 0) continue;
+        const Image &image = asset.images[texture.source];
+        if (image.data.empty() && image.levels.empty()) texture.source = texture.fallbackSource;
+    }
+
+    // Precompute data the shaders would otherwise derive per fragment
+    convert_bump_maps_to_normal_maps(asset, BUMP_MAP_STRENGTH);
+    {
+        cg::LoadScope scope(cg::LOAD_MESH_PROCESSING, "generate_tangents");
+        generate_tangents(asset);
+    }
+
+    return true;
+}
+
+bool reload_image(const std::string &filedir, GLTFAsset &asset, int index)
+{
+    // Forget everything that was derived from the old pixels
+    Image &image = asset.images[index];
+    std::vector<char>().swap(image.data);
+    std::vector<std::vector<char> >().swap(image.levels);
+    image.compressedFormat = 0;
+    image.srgb = false;
+    image.swizzle.clear();
+    if (!load_image_data(asset, filedir, image)) return false;
+
+    // Bump maps are converted to normal maps as when the asset was loaded
+    // (images that have been processed are left alone)
+    convert_bump_maps_to_normal_maps(asset, BUMP_MAP_STRENGTH);
+    return true;
+}
+
+typedef json::Writer<json::StringBuffer> JSONWriter;
+
+static void write_floats(JSONWriter &writer, const char *key, const float *values, int count)
+{
+    writer.Key(key);
+    writer.StartArray();
+    for (int i = 0; i < count; ++i) writer.Double(values[i]);
+    writer.EndArray();
+}
+
+static void write_material_texture(JSONWriter &writer, const char *key,
+                                   const MaterialTexture &texture)
+{
+    writer.Key(key);
+    writer.StartObject();
+    writer.Key("index");
+    writer.Int(texture.index);
+    if (texture.texCoord) {
+        writer.Key("texCoord");
+        writer.Int(texture.texCoord);
+    }
+    if (texture.scale != 1.0f) {
+        writer.Key("scale");
+        writer.Double(texture.scale);
+    }
+    if (texture.strength != 1.0f) {
+        writer.Key("strength");
+        writer.Double(texture.strength);
+    }
+    writer.EndObject();
+}
+
+static void write_nodes(JSONWriter &writer, const GLTFAsset &asset)
+{
+    writer.Key("nodes");
+    writer.StartArray();
+    for (const auto &node : asset.nodes) {
+        writer.StartObject();
+        writer.Key("name");
+        writer.String(node.name.c_str());
+        if (node.mesh >= 0) {
+            writer.Key("mesh");
+            writer.Int(node.mesh);
+        }
+        if (node.skin >= 0) {
+            writer.Key("skin");
+            writer.Int(node.skin);
+        }
+        if (!node.children.empty()) {
+            writer.Key("children");
+            writer.StartArray();
+            for (int child : node.children) writer.Int(child);
+            writer.EndArray();
+        }
+        if (node.hasMatrix) {
+            write_floats(writer, "matrix", &node.matrix[0][0], 16);
+        } else {
+            write_floats(writer, "translation", &node.translation[0], 3);
+            write_floats(writer, "rotation", &node.rotation[0], 4);
+            write_floats(writer, "scale", &node.scale[0], 3);
+        }
+        if (node.light >= 0) {
+            writer.Key("extensions");
+            writer.StartObject();
+            writer.Key("KHR_lights_punctual");
+            writer.StartObject();
+            writer.Key("light");
+            writer.Int(node.light);
+            writer.EndObject();
+            writer.EndObject();
+        }
+        if (node.isOccluder) {
+            writer.Key("extras");
+            writer.StartObject();
+            writer.Key("occluder");
+            writer.Bool(true);
+            writer.EndObject();
+        }
+        writer.EndObject();
+    }
+    writer.EndArray();
+}
+
+static void write_skins(JSONWriter &writer, const GLTFAsset &asset)
+{
+    if (asset.skins.empty()) return;
+    writer.Key("skins");
+    writer.StartArray();
+    for (const auto &skin : asset.skins) {
+        writer.StartObject();
+        if (!skin.name.empty()) {
+            writer.Key("name");
+            writer.String(skin.name.c_str());
+        }
+        writer.Key("joints");
+        writer.StartArray();
+        for (int joint : skin.joints) writer.Int(joint);
+        writer.EndArray();
+        if (skin.inverseBindMatrices >= 0) {
+            writer.Key("inverseBindMatrices");
+            writer.Int(skin.inverseBindMatrices);
+        }
+        if (skin.skeleton >= 0) {
+            writer.Key("skeleton");
+            writer.Int(skin.skeleton);
+        }
+        writer.EndObject();
+    }
+    writer.EndArray();
+}
+
+static void write_animations(JSONWriter &writer, const GLTFAsset &asset)
+{
+    if (asset.animations.empty()) return;
+    static const char *paths[] = {"translation", "rotation", "scale", "weights"};
+    static const char *interpolations[] = {"LINEAR", "STEP", "CUBICSPLINE"};
+    writer.Key("animations");
+    writer.StartArray();
+    for (const auto &animation : asset.animations) {
+        writer.StartObject();
+        if (!animation.name.empty()) {
+            writer.Key("name");
+            writer.String(animation.name.c_str());
+        }
+        writer.Key("channels");
+        writer.StartArray();
+        for (const auto &channel : animation.channels) {
+            writer.StartObject();
+            writer.Key("sampler");
+            writer.Int(channel.sampler);
+            writer.Key("target");
+            writer.StartObject();
+            if (channel.node >= 0) {
+                writer.Key("node");
+                writer.Int(channel.node);
+            }
+            writer.Key("path");
+            writer.String(paths[channel.path]);
+            writer.EndObject();
+            writer.EndObject();
+        }
+        writer.EndArray();
+        writer.Key("samplers");
+        writer.StartArray();
+        for (const auto &sampler : animation.samplers) {
+            writer.StartObject();
+            writer.Key("input");
+            writer.Int(sampler.input);
+            writer.Key("output");
+            writer.Int(sampler.output);
+            writer.Key("interpolation");
+            writer.String(interpolations[sampler.interpolation]);
+            writer.EndObject();
+        }
+        writer.EndArray();
+        writer.EndObject();
+    }
+    writer.EndArray();
+}
+
+static void write_lights(JSONWriter &writer, const GLTFAsset &asset)
+{
+    if (asset.lights.empty()) return;
+    static const char *types[] = {"directional", "point", "spot"};
+    writer.Key("extensions");
+    writer.StartObject();
+    writer.Key("KHR_lights_punctual");
+    writer.StartObject();
+    writer.Key("lights");
+    writer.StartArray();
+    for (const auto &light : asset.lights) {
+        writer.StartObject();
+        if (!light.name.empty()) {
+            writer.Key("name");
+            writer.String(light.name.c_str());
+        }
+        writer.Key("type");
+        writer.String(types[light.type]);
+        write_floats(writer, "color", &light.color[0], 3);
+        writer.Key("intensity");
+        writer.Double(light.intensity);
+        if (light.range > 0.0f) {
+            writer.Key("range");
+            writer.Double(light.range);
+        }
+        if (light.type == LIGHT_SPOT) {
+            writer.Key("spot");
+            writer.StartObject();
+            writer.Key("innerConeAngle");
+            writer.Double(light.innerConeAngle);
+            writer.Key("outerConeAngle");
+            writer.Double(light.outerConeAngle);
+            writer.EndObject();
+        }
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+    writer.EndObject();
+}
+
+static void write_materials(JSONWriter &writer, const GLTFAsset &asset)
+{
+    writer.Key("materials");
+    writer.StartArray();
+    for (const auto &material : asset.materials) {
+        writer.StartObject();
+        writer.Key("name");
+        writer.String(material.name.c_str());
+        if (material.type == PBR_METALLIC_ROUGHNESS) {
+            const PBRMetallicRoughness &pbr = material.pbrMetallicRoughness;
+            writer.Key("pbrMetallicRoughness");
+            writer.StartObject();
+            write_floats(writer, "baseColorFactor", &pbr.baseColorFactor[0], 4);
+            writer.Key("metallicFactor");
+            writer.Double(pbr.metallicFactor);
+            writer.Key("roughnessFactor");
+            writer.Double(pbr.roughnessFactor);
+            if (pbr.hasBaseColorTexture) {
+                write_material_texture(writer, "baseColorTexture", pbr.baseColorTexture);
+            }
+            if (pbr.hasMetallicRoughnessTexture) {
+                write_material_texture(writer, "metallicRoughnessTexture",
+                                       pbr.metallicRoughnessTexture);
+            }
+            writer.EndObject();
+        }
+        if (material.hasNormalTexture) {
+            write_material_texture(writer, "normalTexture", material.normalTexture);
+        }
+        if (material.hasOcclusionTexture) {
+            write_material_texture(writer, "occlusionTexture", material.occlusionTexture);
+        }
+        writer.EndObject();
+    }
+    writer.EndArray();
+}
+
+static void write_textures_and_images(JSONWriter &writer, const GLTFAsset &asset)
+{
+    writer.Key("textures");
+    writer.StartArray();
+    for (const auto &texture : asset.textures) {
+        writer.StartObject();
+        // KTX2 sources are written back as the KHR_texture_basisu extension,
+        // with the image they replaced (if any) as the core source
+        const bool basisu = texture.source >= 0 && is_ktx2_image(asset.images[texture.source]) &&
+                            texture.source != texture.fallbackSource;
+        const int source = basisu ? texture.fallbackSource : texture.source;
+        if (source >= 0) {
+            writer.Key("source");
+            writer.Int(source);
+        }
+        if (basisu) {
+            writer.Key("extensions");
+            writer.StartObject();
+            writer.Key("KHR_texture_basisu");
+            writer.StartObject();
+            writer.Key("source");
+            writer.Int(texture.source);
+            writer.EndObject();
+            writer.EndObject();
+        }
+        if (texture.hasSampler) {
+            writer.Key("sampler");
+            writer.Int(texture.sampler);
+        }
+        writer.EndObject();
+    }
+    writer.EndArray();
+
+    writer.Key("images");
+    writer.StartArray();
+    for (const auto &image : asset.images) {
+        writer.StartObject();
+        if (image.bufferView >= 0) {
+            writer.Key("bufferView");
+            writer.Int(image.bufferView);
+        } else {
+            writer.Key("uri");
+            writer.String(image.uri.c_str());
+        }
+        if (!image.mimeType.empty()) {
+            writer.Key("mimeType");
+            writer.String(image.mimeType.c_str());
+        }
+        if (!image.swizzle.empty()) {
+            writer.Key("extras");
+            writer.StartObject();
+            writer.Key("swizzle");
+            writer.String(image.swizzle.c_str());
+            writer.EndObject();
+        }
+        writer.EndObject();
+    }
+    writer.EndArray();
+
+    writer.Key("samplers");
+    writer.StartArray();
+    for (const auto &sampler : asset.samplers) {
+        writer.StartObject();
+        writer.Key("magFilter");
+        writer.Int(sampler.magFilter);
+        writer.Key("minFilter");
+        writer.Int(sampler.minFilter);
+        writer.Key("wrapS");
+        writer.Int(sampler.wrapS);
+        writer.Key("wrapT");
+        writer.Int(sampler.wrapT);
+        writer.EndObject();
+    }
+    writer.EndArray();
+}
+
+static void write_meshes(JSONWriter &writer, const GLTFAsset &asset)
+{
+    writer.Key("meshes");
+    writer.StartArray();
+    for (const auto &mesh : asset.meshes) {
+        writer.StartObject();
+        writer.Key("name");
+        writer.String(mesh.name.c_str());
+        writer.Key("primitives");
+        writer.StartArray();
+        for (const auto &primitive : mesh.primitives) {
+            writer.StartObject();
+            writer.Key("attributes");
+            writer.StartObject();
+            for (const auto &attribute : primitive.attributes) {
+                writer.Key(attribute.name.c_str());
+                writer.Int(attribute.index);
+            }
+            writer.EndObject();
+            writer.Key("indices");
+            writer.Int(primitive.indices);
+            if (primitive.hasMaterial) {
+                writer.Key("material");
+                writer.Int(primitive.material);
+            }
+            if (!primitive.lods.empty()) {
+                writer.Key("extras");
+                writer.StartObject();
+                writer.Key("lods");
+                writer.StartArray();
+                for (int lod : primitive.lods) writer.Int(lod);
+                writer.EndArray();
+                writer.EndObject();
+            }
+            writer.EndObject();
+        }
+        writer.EndArray();
+        writer.EndObject();
+    }
+    writer.EndArray();
+}
+
+static void write_accessors_and_buffers(JSONWriter &writer, const GLTFAsset &asset,
+                                        const std::vector<std::string> &bufferURIs)
+{
+    // Position accessors and animation inputs must have bounds
+    std::vector<char> isPosition(asset.accessors.size(), 0);
+    for (const auto &mesh : asset.meshes) {
+        for (const auto &primitive : mesh.primitives) {
+            const int position = find_attribute(primitive, SEMANTIC_POSITION);
+            if (position >= 0 && position < int(isPosition.size())) isPosition[position] = 1;
+        }
+    }
+    for (const auto &animation : asset.animations) {
+        for (const auto &sampler : animation.samplers) {
+            if (sampler.input >= 0 && sampler.input < int(isPosition.size())) {
+                isPosition[sampler.input] = 1;
+            }
+        }
+    }
+
+    writer.Key("accessors");
+    writer.StartArray();
+    std::vector<float> data;
+    for (size_t i = 0; i < asset.accessors.size(); ++i) {
+        const Accessor &accessor = asset.accessors[i];
+        writer.StartObject();
+        writer.Key("bufferView");
+        writer.Int(accessor.bufferView);
+        writer.Key("byteOffset");
+        writer.Int(accessor.byteOffset);
+        writer.Key("componentType");
+        writer.Int(accessor.componentType);
+        writer.Key("count");
+        writer.Int(accessor.count);
+        writer.Key("type");
+        writer.String(accessor.type.c_str());
+        if (accessor.normalized) {
+            writer.Key("normalized");
+            writer.Bool(true);
+        }
+        if (isPosition[i] && accessor.count > 0 && accessor_is_valid(asset, int(i))) {
+            read_accessor(asset, int(i), data);
+            const int n = num_components(accessor.type);
+            std::vector<float> min(data.begin(), data.begin() + n), max = min;
+            for (size_t j = 0; j < data.size(); ++j) {
+                min[j % n] = std::min(min[j % n], data[j]);
+                max[j % n] = std::max(max[j % n], data[j]);
+            }
+            write_floats(writer, "min", min.data(), n);
+            write_floats(writer, "max", max.data(), n);
+        }
+        writer.EndObject();
+    }
+    writer.EndArray();
+
+    writer.Key("bufferViews");
+    writer.StartArray();
+    for (const auto &bufferView : asset.bufferViews) {
+        writer.StartObject();
+        writer.Key("buffer");
+        writer.Int(bufferView.buffer);
+        writer.Key("byteLength");
+        writer.Int(bufferView.byteLength);
+        writer.Key("byteOffset");
+        writer.Int(bufferView.byteOffset);
+        if (bufferView.byteStride) {
+            writer.Key("byteStride");
+            writer.Int(bufferView.byteStride);
+        }
+        writer.EndObject();
+    }
+    writer.EndArray();
+
+    writer.Key("buffers");
+    writer.StartArray();
+    for (size_t i = 0; i < asset.buffers.size(); ++i) {
+        writer.StartObject();
+        writer.Key("byteLength");
+        writer.Int(int(asset.buffers[i].data.size()));
+        if (!bufferURIs[i].empty()) {
+            writer.Key("uri");
+            writer.String(bufferURIs[i].c_str());
+        }
+        writer.EndObject();
+    }
+    writer.EndArray();
+}
+
+// Writes the extensions that the asset needs: KHR_mesh_quantization for
+// integer vertex attributes, KHR_texture_basisu for KTX2 images, and
+// KHR_lights_punctual for lights
+static void write_extensions(JSONWriter &writer, const GLTFAsset &asset)
+{
+    bool quantized = false;
+    for (const auto &mesh : asset.meshes) {
+        for (const auto &primitive : mesh.primitives) {
+            for (const auto &it : primitive.attributes) {
+                // Integer joints and normalized weights are core glTF
+                const Accessor &accessor = asset.accessors[it.index];
+                if (it.semantic == SEMANTIC_JOINTS_0) continue;
+                if (it.semantic == SEMANTIC_WEIGHTS_0 && accessor.normalized) continue;
+                quantized = quantized || accessor.componentType != 0x1406;
+            }
+        }
+    }
+    bool basisu = false, basisuRequired = false;
+    for (const auto &texture : asset.textures) {
+        if (texture.source < 0 || !is_ktx2_image(asset.images[texture.source])) continue;
+        basisu = true;
+        basisuRequired = basisuRequired || texture.fallbackSource < 0;
+    }
+    const bool lights = !asset.lights.empty();
+    if (!quantized && !basisu && !lights) return;
+
+    writer.Key("extensionsUsed");
+    writer.StartArray();
+    if (quantized) writer.String("KHR_mesh_quantization");
+    if (basisu) writer.String("KHR_texture_basisu");
+    if (lights) writer.String("KHR_lights_punctual");
+    writer.EndArray();
+    if (!quantized && !basisuRequired) return;
+    writer.Key("extensionsRequired");
+    writer.StartArray();
+    if (quantized) writer.String("KHR_mesh_quantization");
+    if (basisuRequired) writer.String("KHR_texture_basisu");
+    writer.EndArray();
+}
+
+static void write_asset_json(JSONWriter &writer, const GLTFAsset &asset,
+                             const std::vector<std::string> &bufferURIs)
+{
+    writer.StartObject();
+    writer.Key("asset");
+    writer.StartObject();
+    writer.Key("version");
+    writer.String("2.0");
+    writer.EndObject();
+    write_extensions(writer, asset);
+
+    writer.Key("scenes");
+    writer.StartArray();
+    for (const auto &scene : asset.scenes) {
+        writer.StartObject();
+        writer.Key("name");
+        writer.String(scene.name.c_str());
+        writer.Key("nodes");
+        writer.StartArray();
+        for (int node : scene.nodes) writer.Int(node);
+        writer.EndArray();
+        writer.EndObject();
+    }
+    writer.EndArray();
+
+    write_nodes(writer, asset);
+    write_materials(writer, asset);
+    write_textures_and_images(writer, asset);
+    write_meshes(writer, asset);
+    write_skins(writer, asset);
+    write_animations(writer, asset);
+    write_accessors_and_buffers(writer, asset, bufferURIs);
+    write_lights(writer, asset);
+    writer.EndObject();
+}
+
+bool save_gltf_asset(const std::string &filename, const std::string &filedir,
+                     const GLTFAsset &asset)
+{
+    std::vector<std::string> bufferURIs(asset.buffers.size());
+    for (size_t i = 0; i < asset.buffers.size(); ++i) {
+        bufferURIs[i] = asset.buffers[i].uri;
+        if (bufferURIs[i].empty()) {
+            const std::string stem = filename.substr(0, filename.rfind('.'));
+            bufferURIs[i] = stem + (i ? std::to_string(i) : std::string()) + ".bin";
+        }
+    }
+
+    json::StringBuffer text;
+    JSONWriter writer(text);
+    write_asset_json(writer, asset, bufferURIs);
+
+    std::ofstream file(filedir + filename, std::ios::binary);
+    file.write(text.GetString(), text.GetSize());
+    if (!file) {
+        std::cerr << "Error: Could not write " << filedir + filename << std::endl;
+        return false;
+    }
+    for (size_t i = 0; i < asset.buffers.size(); ++i) {
+        const std::vector<char> &data = asset.buffers[i].data;
+        std::ofstream bin(filedir + bufferURIs[i], std::ios::binary);
+        if (!data.empty()) bin.write(&data[0], data.size());
+        if (!bin) {
+            std::cerr << "Error: Could not write " << filedir + bufferURIs[i] << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool save_glb_asset(const std::string &filename, const std::string &filedir,
+                    const GLTFAsset &asset)
+{
+    if (asset.buffers.size() > 1) {
+        std::cerr << "Error: " << filename << " can only hold one buffer" << std::endl;
+        return false;
+    }
+
+    json::StringBuffer text;
+    JSONWriter writer(text);
+    write_asset_json(writer, asset, std::vector<std::string>(asset.buffers.size()));
+
+    // Chunks are padded to four bytes: the JSON with spaces and the binary
+    // data with zeros
+    std::string json(text.GetString(), text.GetSize());
+    json.resize((json.size() + 3) & ~size_t(3), ' ');
+    std::vector<char> bin;
+    if (!asset.buffers.empty()) bin = asset.buffers[0].data;
+    bin.resize((bin.size() + 3) & ~size_t(3), 0);
+
+    const uint32_t totalLength =
+        uint32_t(12 + 8 + json.size() + (bin.empty() ? 0 : 8 + bin.size()));
+    const uint32_t header[5] = {GLB_MAGIC, 2, totalLength, uint32_t(json.size()), GLB_CHUNK_JSON};
+    std::ofstream file(filedir + filename, std::ios::binary);
+    file.write((const char *)header, sizeof(header));
+    file.write(json.data(), json.size());
+    if (!bin.empty()) {
+        const uint32_t chunk[2] = {uint32_t(bin.size()), GLB_CHUNK_BIN};
+        file.write((const char *)chunk, sizeof(chunk));
+        file.write(bin.data(), bin.size());
+    }
+    if (!file) {
+        std::cerr << "Error: Could not write " << filedir + filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool has_extension(const std::string &filename, const std::string &extension)
+{
+    if (filename.size() < extension.size()) return false;
+    std::string end = filename.substr(filename.size() - extension.size());
+    std::transform(end.begin(), end.end(), end.begin(), ::tolower);
+    return end == extension;
+}
+
+bool is_gltf_file(const std::string &filename)
+{
+    return has_extension(filename, ".gltf") || has_extension(filename, ".glb");
+}
+
+bool list_gltf_files(const std::string &dir, std::vector<std::string> &names)
+{
+    std::vector<std::string> found;
+#ifdef _WIN32
+    _finddata_t entry;
+    const intptr_t handle = _findfirst((dir + "/*").c_str(), &entry);
+    if (handle == -1) return false;
+    do {
+        if (!(entry.attrib & _A_SUBDIR) && is_gltf_file(entry.name)) found.push_back(entry.name);
+    } while (_findnext(handle, &entry) == 0);
+    _findclose(handle);
+#else
+    DIR *handle = opendir(dir.c_str());
+    if (!handle) return false;
+    while (const dirent *entry = readdir(handle)) {
+        if (is_gltf_file(entry->d_name)) found.push_back(entry->d_name);
+    }
+    closedir(handle);
+#endif
+    std::sort(found.begin(), found.end());
+    names.insert(names.end(), found.begin(), found.end());
     return true;
 }
 
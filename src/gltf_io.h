@@ -8,9 +8,38 @@
 #include "gltf_scene.h"
 
 #include <string>
+#include <vector>
 
 namespace gltf {
 
+// Loads a .gltf file (with its buffers and images), or a .glb file, which
+// can also hold them (as its binary chunk and as buffer views)
 bool load_gltf_asset(const std::string &filename, const std::string &filedir, GLTFAsset &asset);
 
+// Loads the pixels of one image of an asset again (e.g., after its file was
+// edited), as load_gltf_asset() would. Mip levels, compression and the other
+// data derived from the old pixels are cleared.
+bool reload_image(const std::string &filedir, GLTFAsset &asset, int index);
+
+// Returns true if a filename ends with .gltf or .glb (in any case)
+bool is_gltf_file(const std::string &filename);
+
+// Appends the names of the .gltf and .glb files of a directory (not of its
+// subdirectories) to names, in alphabetical order. Returns false if it is not
+// a directory.
+bool list_gltf_files(const std::string &dir, std::vector<std::string> &names);
+
+// Writes an asset as a .gltf file, and its buffers to their URIs (or to
+// <filename>.bin if a buffer has none). Image files are not written. Returns
+// false if a file could not be written.
+bool save_gltf_asset(const std::string &filename, const std::string &filedir,
+                     const GLTFAsset &asset);
+
+// Writes an asset as a single .glb file, with its only buffer as the binary
+// chunk. Images are written only if they are stored in buffer views (see
+// embed_ktx2_images). Returns false if the asset has more than one buffer or
+// the file could not be written.
+bool save_glb_asset(const std::string &filename, const std::string &filedir,
+                    const GLTFAsset &asset);
+
 }  // namespace gltf
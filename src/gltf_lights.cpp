@@ -0,0 +1,384 @@
+// Clustered forward lighting for many punctual lights (KHR_lights_punctual).
+//
+
+#include "gltf_lights.h"
+#include "cg_memory.h"
+#include "cg_parallel.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <random>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define GLTF_LIGHTS_SSE2 1
+#endif
+
+namespace gltf {
+
+float light_range(const Light &light, float minIntensity)
+{
+    if (light.range > 0.0f) return light.range;
+    const float brightest = light.intensity * std::max(light.color.r,
+                                                       std::max(light.color.g, light.color.b));
+    return std::sqrt(std::max(brightest, 0.0f) / std::max(minIntensity, 1e-6f));
+}
+
+void collect_punctual_lights(const GLTFAsset &asset, const std::vector<glm::mat4> &worldMatrices,
+                             float minIntensity, std::vector<PunctualLight> &lights)
+{
+    for (size_t i = 0; i < asset.nodes.size() && i < worldMatrices.size(); ++i) {
+        const int index = asset.nodes[i].light;
+        if (index < 0 || index >= int(asset.lights.size())) continue;
+        const Light &light = asset.lights[index];
+        if (light.type == LIGHT_DIRECTIONAL) continue;
+
+        const glm::mat4 &world = worldMatrices[i];
+        PunctualLight punctual;
+        punctual.type = light.type;
+        punctual.position = glm::vec3(world[3]);
+        punctual.direction = glm::normalize(glm::mat3(world) * glm::vec3(0.0f, 0.0f, -1.0f));
+        punctual.color = light.color * light.intensity;
+        punctual.range = light_range(light, minIntensity);
+        punctual.innerConeAngle = light.innerConeAngle;
+        punctual.outerConeAngle = light.outerConeAngle;
+        lights.push_back(punctual);
+    }
+}
+
+void collect_directional_lights(const GLTFAsset &asset,
+                                const std::vector<glm::mat4> &worldMatrices,
+                                std::vector<DirectionalLight> &lights)
+{
+    for (size_t i = 0; i < asset.nodes.size() && i < worldMatrices.size(); ++i) {
+        if (int(lights.size()) == MAX_DIRECTIONAL_LIGHTS) break;
+        const int index = asset.nodes[i].light;
+        if (index < 0 || index >= int(asset.lights.size())) continue;
+        const Light &light = asset.lights[index];
+        if (light.type != LIGHT_DIRECTIONAL) continue;
+
+        const glm::mat4 &world = worldMatrices[i];
+        DirectionalLight directional;
+        directional.direction = glm::normalize(glm::mat3(world) * glm::vec3(0.0f, 0.0f, -1.0f));
+        directional.color = light.color * light.intensity;
+        lights.push_back(directional);
+    }
+}
+
+void generate_test_lights(const AABB &bounds, int count, float range,
+                          std::vector<PunctualLight> &lights)
+{
+    std::mt19937 random(1234);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    for (int i = 0; i < count; ++i) {
+        PunctualLight light;
+        light.type = LIGHT_POINT;
+        light.position = glm::mix(bounds.min, bounds.max,
+                                  glm::vec3(unit(random), unit(random), unit(random)));
+        light.direction = glm::vec3(0.0f, 0.0f, -1.0f);
+        const glm::vec3 color(unit(random), unit(random), unit(random));
+        light.color = color / std::max(color.r, std::max(color.g, color.b)) * 0.25f * range * range;
+        light.range = range;
+        light.innerConeAngle = 0.0f;
+        light.outerConeAngle = 0.0f;
+        lights.push_back(light);
+    }
+}
+
+glm::mat4 spot_light_view_proj(const PunctualLight &light)
+{
+    // Any up vector that is not parallel to the direction
+    const glm::vec3 up = std::abs(light.direction.y) < 0.99f ? glm::vec3(0.0f, 1.0f, 0.0f)
+                                                              : glm::vec3(1.0f, 0.0f, 0.0f);
+    const glm::mat4 view = glm::lookAt(light.position, light.position + light.direction, up);
+    const float fovy = glm::clamp(2.0f * light.outerConeAngle, 0.01f, glm::radians(170.0f));
+    return glm::perspective(fovy, 1.0f, 0.01f * light.range, light.range) * view;
+}
+
+// Returns the view-space depth (distance along -Z) where a slice starts
+static float slice_depth(const ClusterGrid &grid, int slice)
+{
+    const float t = float(slice) / grid.slices;
+    return grid.logDepth ? grid.nearDepth * std::pow(grid.farDepth / grid.nearDepth, t)
+                         : grid.nearDepth + (grid.farDepth - grid.nearDepth) * t;
+}
+
+void update_cluster_grid(ClusterGrid &grid, const glm::mat4 &projection,
+                         const ClusterSettings &settings)
+{
+    if (grid.projection == projection && grid.tilesX == settings.tilesX &&
+        grid.tilesY == settings.tilesY && grid.slices == settings.slices) {
+        return;
+    }
+    grid.tilesX = std::max(1, settings.tilesX);
+    grid.tilesY = std::max(1, settings.tilesY);
+    grid.slices = std::max(1, settings.slices);
+    grid.projection = projection;
+
+    // Near and far depth from the projection matrix (as built by
+    // glm::perspective or glm::ortho)
+    const float a = projection[2][2], b = projection[3][2];
+    grid.logDepth = projection[2][3] != 0.0f;
+    if (grid.logDepth) {
+        grid.nearDepth = b / (a - 1.0f);
+        grid.farDepth = b / (a + 1.0f);
+        const float scale = grid.slices / std::log(grid.farDepth / grid.nearDepth);
+        grid.depthScaleBias = glm::vec2(scale, -std::log(grid.nearDepth) * scale);
+    } else {
+        grid.nearDepth = (b + 1.0f) / a;
+        grid.farDepth = (b - 1.0f) / a;
+        const float scale = grid.slices / (grid.farDepth - grid.nearDepth);
+        grid.depthScaleBias = glm::vec2(scale, -grid.nearDepth * scale);
+    }
+
+    // View-space points on the near and far planes through each tile corner
+    const glm::mat4 inverse = glm::inverse(projection);
+    const int cornersX = grid.tilesX + 1, cornersY = grid.tilesY + 1;
+    std::vector<glm::vec3> nearPoints(cornersX * cornersY), farPoints(cornersX * cornersY);
+    for (int y = 0; y < cornersY; ++y) {
+        for (int x = 0; x < cornersX; ++x) {
+            const float ndcX = -1.0f + 2.0f * x / grid.tilesX;
+            const float ndcY = -1.0f + 2.0f * y / grid.tilesY;
+            const glm::vec4 p0 = inverse * glm::vec4(ndcX, ndcY, -1.0f, 1.0f);
+            const glm::vec4 p1 = inverse * glm::vec4(ndcX, ndcY, 1.0f, 1.0f);
+            nearPoints[y * cornersX + x] = glm::vec3(p0) / p0.w;
+            farPoints[y * cornersX + x] = glm::vec3(p1) / p1.w;
+        }
+    }
+
+    // Padding tiles get empty bounds, so that nothing intersects them
+    const int tiles = grid.tilesX * grid.tilesY;
+    grid.tileStride = (tiles + 3) & ~3;
+    const size_t size = size_t(grid.tileStride) * grid.slices;
+    grid.minX.assign(size, FLT_MAX), grid.minY.assign(size, FLT_MAX);
+    grid.minZ.assign(size, FLT_MAX);
+    grid.maxX.assign(size, -FLT_MAX), grid.maxY.assign(size, -FLT_MAX);
+    grid.maxZ.assign(size, -FLT_MAX);
+    for (int slice = 0; slice < grid.slices; ++slice) {
+        const float depths[2] = {slice_depth(grid, slice), slice_depth(grid, slice + 1)};
+        for (int tile = 0; tile < tiles; ++tile) {
+            const int tx = tile % grid.tilesX, ty = tile / grid.tilesX;
+            glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+            for (int corner = 0; corner < 4; ++corner) {
+                const int c = (ty + corner / 2) * cornersX + tx + corner % 2;
+                const glm::vec3 &p0 = nearPoints[c], &p1 = farPoints[c];
+                for (float depth : depths) {
+                    const float t = (depth + p0.z) / (p0.z - p1.z);
+                    const glm::vec3 p = p0 + t * (p1 - p0);
+                    lo = glm::min(lo, p);
+                    hi = glm::max(hi, p);
+                }
+            }
+            const size_t i = size_t(slice) * grid.tileStride + tile;
+            grid.minX[i] = lo.x, grid.minY[i] = lo.y, grid.minZ[i] = lo.z;
+            grid.maxX[i] = hi.x, grid.maxY[i] = hi.y, grid.maxZ[i] = hi.z;
+        }
+    }
+}
+
+// Tests a light sphere against 4 clusters. Returns a bit per cluster that it
+// intersects.
+static int sphere_cluster_mask(const ClusterGrid &grid, size_t i, const glm::vec4 &sphere)
+{
+#ifdef GLTF_LIGHTS_SSE2
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 cx = _mm_set1_ps(sphere.x), cy = _mm_set1_ps(sphere.y);
+    const __m128 cz = _mm_set1_ps(sphere.z);
+    // Distance from the center to the box along each axis (0 inside)
+    const __m128 dx = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&grid.minX[i]), cx), zero),
+                                 _mm_max_ps(_mm_sub_ps(cx, _mm_loadu_ps(&grid.maxX[i])), zero));
+    const __m128 dy = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&grid.minY[i]), cy), zero),
+                                 _mm_max_ps(_mm_sub_ps(cy, _mm_loadu_ps(&grid.maxY[i])), zero));
+    const __m128 dz = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&grid.minZ[i]), cz), zero),
+                                 _mm_max_ps(_mm_sub_ps(cz, _mm_loadu_ps(&grid.maxZ[i])), zero));
+    const __m128 distance2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)),
+                                        _mm_mul_ps(dz, dz));
+    return _mm_movemask_ps(_mm_cmple_ps(distance2, _mm_set1_ps(sphere.w * sphere.w)));
+#else
+    int mask = 0;
+    for (int k = 0; k < 4; ++k) {
+        const float dx = std::max(grid.minX[i + k] - sphere.x, 0.0f) +
+                         std::max(sphere.x - grid.maxX[i + k], 0.0f);
+        const float dy = std::max(grid.minY[i + k] - sphere.y, 0.0f) +
+                         std::max(sphere.y - grid.maxY[i + k], 0.0f);
+        const float dz = std::max(grid.minZ[i + k] - sphere.z, 0.0f) +
+                         std::max(sphere.z - grid.maxZ[i + k], 0.0f);
+        if (dx * dx + dy * dy + dz * dz <= sphere.w * sphere.w) mask |= 1 << k;
+    }
+    return mask;
+#endif
+}
+
+// Bins the lights into the clusters of one depth slice. The output holds the
+// number of lights of each tile, followed by their indices tile by tile.
+static void bin_slice(const LightClusters &clusters, int slice, int maxLightsPerCluster,
+                      std::vector<uint32_t> &out, int &dropped)
+{
+    const ClusterGrid &grid = clusters.grid;
+    const int tiles = grid.tilesX * grid.tilesY;
+    const float depth0 = slice_depth(grid, slice), depth1 = slice_depth(grid, slice + 1);
+    static thread_local std::vector<uint64_t> hits;
+    hits.clear();
+    out.assign(tiles, 0);
+
+    const uint32_t numLights = uint32_t(clusters.lights.size() / 4);
+    for (uint32_t light = 0; light < numLights; ++light) {
+        const glm::vec4 &sphere = clusters.lights[4 * light];
+        if (-sphere.z + sphere.w < depth0 || -sphere.z - sphere.w > depth1) continue;
+        const size_t first = size_t(slice) * grid.tileStride;
+        for (int tile = 0; tile < tiles; tile += 4) {
+            int mask = sphere_cluster_mask(grid, first + tile, sphere);
+            while (mask) {
+                const int k = tile + (mask & 1 ? 0 : mask & 2 ? 1 : mask & 4 ? 2 : 3);
+                mask &= mask - 1;
+                if (out[k] == uint32_t(maxLightsPerCluster)) {
+                    dropped += 1;
+                    continue;
+                }
+                out[k] += 1;
+                hits.push_back((uint64_t(k) << 32) | light);
+            }
+        }
+    }
+
+    // Group by tile (the hits of a tile stay in light order)
+    std::vector<uint32_t> offsets(tiles + 1, tiles);
+    for (int tile = 0; tile < tiles; ++tile) offsets[tile + 1] = offsets[tile] + out[tile];
+    out.resize(tiles + hits.size());
+    for (uint64_t hit : hits) out[offsets[hit >> 32]++] = uint32_t(hit);
+}
+
+void bin_lights(LightClusters &clusters, const std::vector<PunctualLight> &lights,
+                const glm::mat4 &view, const glm::mat4 &projection,
+                const ClusterSettings &settings)
+{
+    const auto start = std::chrono::steady_clock::now();
+    update_cluster_grid(clusters.grid, projection, settings);
+    const ClusterGrid &grid = clusters.grid;
+    clusters.stats = LightClusterStats();
+
+    // Four texels per light: view-space position and range, color and the
+    // offset and scale of the spot cone falloff, view-space direction, and
+    // the index of its shadow (-1 if none) and depth bias. Each shadow is the
+    // view-to-light-clip matrix and the tile of the atlas.
+    clusters.lights.resize(4 * lights.size());
+    clusters.shadows.clear();
+    const glm::mat3 rotation(view);
+    const glm::mat4 inverseView = glm::inverse(view);
+    for (size_t i = 0; i < lights.size(); ++i) {
+        const PunctualLight &light = lights[i];
+        float scale = 0.0f, offset = 1.0f;
+        if (light.type == LIGHT_SPOT) {
+            const float cosOuter = std::cos(light.outerConeAngle);
+            const float cosInner = std::cos(light.innerConeAngle);
+            scale = 1.0f / std::max(0.001f, cosInner - cosOuter);
+            offset = -cosOuter * scale;
+        }
+        const glm::vec3 position(view * glm::vec4(light.position, 1.0f));
+        clusters.lights[4 * i + 0] = glm::vec4(position, light.range);
+        clusters.lights[4 * i + 1] = glm::vec4(light.color, offset);
+        clusters.lights[4 * i + 2] = glm::vec4(rotation * light.direction, scale);
+        clusters.lights[4 * i + 3] = glm::vec4(-1.0f, light.shadowBias, 0.0f, 0.0f);
+        if (light.castsShadow) {
+            clusters.lights[4 * i + 3].x = float(clusters.shadows.size() / 5);
+            const glm::mat4 shadowFromView = light.shadowMatrix * inverseView;
+            for (int column = 0; column < 4; ++column) {
+                clusters.shadows.push_back(shadowFromView[column]);
+            }
+            clusters.shadows.push_back(light.shadowRect);
+        }
+    }
+    clusters.stats.lights = int(lights.size());
+
+    std::atomic<int> dropped(0);
+    clusters.sliceIndices.resize(grid.slices);
+    cg::parallel_for(grid.slices, [&](int slice) {
+        int sliceDropped = 0;
+        bin_slice(clusters, slice, std::max(1, settings.maxLightsPerCluster),
+                  clusters.sliceIndices[slice], sliceDropped);
+        dropped += sliceDropped;
+    });
+
+    // Concatenate the slices into one list of offsets and counts per cluster
+    const int tiles = grid.tilesX * grid.tilesY;
+    clusters.clusters.resize(2 * size_t(tiles) * grid.slices);
+    clusters.indices.clear();
+    int droppedIndices = 0;
+    for (int slice = 0; slice < grid.slices; ++slice) {
+        const std::vector<uint32_t> &binned = clusters.sliceIndices[slice];
+        size_t next = tiles;
+        for (int tile = 0; tile < tiles; ++tile) {
+            const uint32_t count = binned[tile];
+            const size_t room = size_t(std::max(settings.maxIndices, 0)) - clusters.indices.size();
+            const uint32_t kept = uint32_t(std::min(size_t(count), room));
+            const size_t cluster = size_t(slice) * tiles + tile;
+            clusters.clusters[2 * cluster + 0] = uint32_t(clusters.indices.size());
+            clusters.clusters[2 * cluster + 1] = kept;
+            clusters.indices.insert(clusters.indices.end(), binned.begin() + next,
+                                    binned.begin() + next + kept);
+            clusters.stats.maxPerCluster = std::max(clusters.stats.maxPerCluster, int(kept));
+            droppedIndices += int(count - kept);
+            next += count;
+        }
+    }
+    clusters.stats.indices = int(clusters.indices.size());
+    clusters.stats.dropped = dropped + droppedIndices;
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    clusters.stats.binMs = std::chrono::duration<double, std::milli>(elapsed).count();
+}
+
+// Replaces the contents of a texture buffer, creating it on first use
+static void upload_texture_buffer(GLuint &buffer, GLuint &texture, GLenum format,
+                                  const void *data, size_t bytes, const char *label)
+{
+    if (!buffer) {
+        glGenBuffers(1, &buffer);
+        glGenTextures(1, &texture);
+    }
+    // Never empty, since the texture needs storage
+    glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+    glBufferData(GL_TEXTURE_BUFFER, std::max(bytes, size_t(16)), nullptr, GL_STREAM_DRAW);
+    if (bytes) glBufferSubData(GL_TEXTURE_BUFFER, 0, bytes, data);
+    glBindTexture(GL_TEXTURE_BUFFER, texture);
+    glTexBuffer(GL_TEXTURE_BUFFER, format, buffer);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    cg::track_gpu_object(cg::MEMORY_BUFFERS, cg::GPU_BUFFER, buffer, std::max(bytes, size_t(16)),
+                         label);
+}
+
+void upload_light_clusters(LightBuffers &buffers, const LightClusters &clusters)
+{
+    upload_texture_buffer(buffers.lightBuffer, buffers.lightTexture, GL_RGBA32F,
+                          clusters.lights.data(), clusters.lights.size() * sizeof(glm::vec4),
+                          "clustered lights");
+    upload_texture_buffer(buffers.clusterBuffer, buffers.clusterTexture, GL_RG32UI,
+                          clusters.clusters.data(), clusters.clusters.size() * sizeof(uint32_t),
+                          "light clusters");
+    upload_texture_buffer(buffers.indexBuffer, buffers.indexTexture, GL_R32UI,
+                          clusters.indices.data(), clusters.indices.size() * sizeof(uint32_t),
+                          "light cluster indices");
+    upload_texture_buffer(buffers.shadowBuffer, buffers.shadowTexture, GL_RGBA32F,
+                          clusters.shadows.data(), clusters.shadows.size() * sizeof(glm::vec4),
+                          "clustered light shadows");
+}
+
+void destroy_light_buffers(LightBuffers &buffers)
+{
+    for (GLuint buffer : {buffers.lightBuffer, buffers.clusterBuffer, buffers.indexBuffer,
+                          buffers.shadowBuffer}) {
+        cg::untrack_gpu_object(cg::GPU_BUFFER, buffer);
+        glDeleteBuffers(1, &buffer);
+    }
+    const GLuint textures[] = {buffers.lightTexture, buffers.clusterTexture, buffers.indexTexture,
+                               buffers.shadowTexture};
+    glDeleteTextures(4, textures);
+    buffers = LightBuffers();
+}
+
+}  // namespace gltf
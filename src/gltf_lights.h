@@ -0,0 +1,139 @@
+// Clustered forward lighting for many punctual lights (KHR_lights_punctual).
+// The view frustum is split into a grid of clusters (screen tiles times depth
+// slices, exponential in depth for perspective projections), the lights are
+// binned into the clusters they touch on the CPU, and the fragment shader only
+// loops over the lights of its cluster.
+//
+
+#pragma once
+
+#include "gltf_scene.h"
+
+#include <GL/gl3w.h>
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace gltf {
+
+// A light placed in the world by the node that holds it
+struct PunctualLight {
+    LightType type;
+    glm::vec3 position;
+    glm::vec3 direction;  // Spot lights only
+    glm::vec3 color;      // Times intensity
+    float range;          // Radius of influence (never infinite)
+    float innerConeAngle;
+    float outerConeAngle;
+    // Tile of the shadow atlas (see gltf_shadows.h), if the light has one
+    bool castsShadow = false;
+    glm::mat4 shadowMatrix;  // World to light clip space
+    glm::vec4 shadowRect;    // Scale and offset of the tile in the atlas
+    float shadowBias = 0.0f;
+};
+
+const int MAX_DIRECTIONAL_LIGHTS = 4;  // Size of the uniform arrays in mesh.frag
+
+// A directional light, which reaches every fragment and so is shaded in a
+// plain loop rather than clustered (and casts no shadows)
+struct DirectionalLight {
+    glm::vec3 direction;  // The way the light shines (-Z of its node)
+    glm::vec3 color;      // Times intensity
+};
+
+struct ClusterSettings {
+    int tilesX = 16;
+    int tilesY = 9;
+    int slices = 24;
+    float minIntensity = 0.01f;     // Cuts off lights without a range at this intensity
+    int maxLightsPerCluster = 128;  // Lights beyond this are dropped (and counted)
+    int maxIndices = 1 << 20;       // Limited by GL_MAX_TEXTURE_BUFFER_SIZE
+};
+
+// Bounds of the clusters of a projection, rebuilt when it changes
+struct ClusterGrid {
+    int tilesX = 0;
+    int tilesY = 0;
+    int slices = 0;
+    glm::mat4 projection = glm::mat4(0.0f);
+    bool logDepth = false;  // Exponential slices (perspective projections)
+    float nearDepth = 0.0f;
+    float farDepth = 0.0f;
+    glm::vec2 depthScaleBias;  // slice = f(depth) * scale + bias, f = log if logDepth
+    // View-space bounds of the clusters, slice by slice, as structure of
+    // arrays with the tiles of each slice padded to a multiple of 4
+    int tileStride = 0;
+    std::vector<float> minX, minY, minZ, maxX, maxY, maxZ;
+};
+
+struct LightClusterStats {
+    int lights = 0;        // Binned (point and spot lights)
+    int indices = 0;       // Light references in all clusters
+    int maxPerCluster = 0;
+    int dropped = 0;       // References beyond maxLightsPerCluster or maxIndices
+    double binMs = 0.0;
+};
+
+struct LightClusters {
+    ClusterGrid grid;
+    std::vector<glm::vec4> lights;     // 4 per light in view space (see mesh.frag)
+    std::vector<glm::vec4> shadows;    // 5 per shadow-casting light (see mesh.frag)
+    std::vector<uint32_t> clusters;    // Offset and count per cluster
+    std::vector<uint32_t> indices;     // Light indices, grouped by cluster
+    std::vector<std::vector<uint32_t> > sliceIndices;  // Per slice, while binning
+    LightClusterStats stats;
+};
+
+// Texture buffers with the clusters for the fragment shader
+struct LightBuffers {
+    GLuint lightBuffer = 0;
+    GLuint lightTexture = 0;
+    GLuint clusterBuffer = 0;
+    GLuint clusterTexture = 0;
+    GLuint indexBuffer = 0;
+    GLuint indexTexture = 0;
+    GLuint shadowBuffer = 0;
+    GLuint shadowTexture = 0;
+};
+
+// Returns the distance at which a light of this color and intensity falls
+// below minIntensity, or its range if it has one
+float light_range(const Light &light, float minIntensity);
+
+// Appends the point and spot lights of the asset, placed by the world
+// matrices of their nodes. Directional lights are not local, so they are not
+// clustered.
+void collect_punctual_lights(const GLTFAsset &asset, const std::vector<glm::mat4> &worldMatrices,
+                             float minIntensity, std::vector<PunctualLight> &lights);
+
+// Appends the directional lights of the asset, up to MAX_DIRECTIONAL_LIGHTS
+// in all (the rest are ignored)
+void collect_directional_lights(const GLTFAsset &asset,
+                                const std::vector<glm::mat4> &worldMatrices,
+                                std::vector<DirectionalLight> &lights);
+
+// Scatters point lights of random colors in a box (for testing and
+// benchmarks). Each light reaches range, and has unit intensity at half of it.
+void generate_test_lights(const AABB &bounds, int count, float range,
+                          std::vector<PunctualLight> &lights);
+
+// Returns the camera of a spot light for its shadow map, which covers its
+// outer cone up to its range
+glm::mat4 spot_light_view_proj(const PunctualLight &light);
+
+// Computes the cluster bounds for a projection, if it or the grid size changed
+void update_cluster_grid(ClusterGrid &grid, const glm::mat4 &projection,
+                         const ClusterSettings &settings);
+
+// Bins the lights into the clusters of the view, in parallel over depth slices
+void bin_lights(LightClusters &clusters, const std::vector<PunctualLight> &lights,
+                const glm::mat4 &view, const glm::mat4 &projection,
+                const ClusterSettings &settings);
+
+// Uploads the binned lights (and creates the buffers on first use)
+void upload_light_clusters(LightBuffers &buffers, const LightClusters &clusters);
+
+void destroy_light_buffers(LightBuffers &buffers);
+
+}  // namespace gltf
@@ -0,0 +1,896 @@
+// Processing of glTF mesh data (tangents, etc.) done at import time.
+//
+
+#include "gltf_mesh.h"
+#include "cg_parallel.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <set>
+#include <vector>
+
+namespace gltf {
+
+// Returns the angle between two edge vectors meeting at a triangle corner
+static float corner_angle(const glm::vec3 &e1, const glm::vec3 &e2)
+{
+    const float denom = glm::length(e1) * glm::length(e2);
+    if (denom <= 0.0f) return 0.0f;
+    return std::acos(glm::clamp(glm::dot(e1, e2) / denom, -1.0f, 1.0f));
+}
+
+// Returns an arbitrary unit vector perpendicular to n
+static glm::vec3 any_perpendicular(const glm::vec3 &n)
+{
+    const glm::vec3 axis = std::abs(n.x) < 0.9f ? glm::vec3(1, 0, 0) : glm::vec3(0, 1, 0);
+    return glm::normalize(glm::cross(n, axis));
+}
+
+static void compute_tangents(const std::vector<float> &positions,
+                             const std::vector<float> &normals,
+                             const std::vector<float> &texcoords,
+                             const std::vector<uint32_t> &indices, std::vector<glm::vec4> &tangents)
+{
+    const size_t numVertices = positions.size() / 3;
+    std::vector<glm::vec3> sdirs(numVertices, glm::vec3(0.0f));
+    std::vector<glm::vec3> tdirs(numVertices, glm::vec3(0.0f));
+
+    // Accumulate per-face tangent directions, weighted by the corner angle
+    // like MikkTSpace does, so that the result does not depend on how the
+    // surface around a vertex happens to be triangulated
+    for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+        uint32_t v[3] = {indices[i], indices[i + 1], indices[i + 2]};
+        if (v[0] >= numVertices || v[1] >= numVertices || v[2] >= numVertices) continue;
+
+        glm::vec3 p[3];
+        glm::vec2 uv[3];
+        for (int k = 0; k < 3; ++k) {
+            p[k] = glm::vec3(positions[3 * v[k]], positions[3 * v[k] + 1], positions[3 * v[k] + 2]);
+            uv[k] = glm::vec2(texcoords[2 * v[k]], texcoords[2 * v[k] + 1]);
+        }
+
+        const glm::vec3 e1 = p[1] - p[0], e2 = p[2] - p[0];
+        const glm::vec2 d1 = uv[1] - uv[0], d2 = uv[2] - uv[0];
+        const float det = d1.x * d2.y - d2.x * d1.y;
+        if (std::abs(det) < 1e-12f) continue;  // Degenerate texture mapping
+
+        const glm::vec3 sdir = (e1 * d2.y - e2 * d1.y) / det;
+        const glm::vec3 tdir = (e2 * d1.x - e1 * d2.x) / det;
+        for (int k = 0; k < 3; ++k) {
+            const float angle = corner_angle(p[(k + 1) % 3] - p[k], p[(k + 2) % 3] - p[k]);
+            sdirs[v[k]] += sdir * angle;
+            tdirs[v[k]] += tdir * angle;
+        }
+    }
+
+    // Orthogonalize against the normal (Gram-Schmidt) and store handedness
+    tangents.resize(numVertices);
+    for (size_t i = 0; i < numVertices; ++i) {
+        glm::vec3 n(normals[3 * i], normals[3 * i + 1], normals[3 * i + 2]);
+        n = glm::length(n) > 0.0f ? glm::normalize(n) : glm::vec3(0.0f, 0.0f, 1.0f);
+
+        glm::vec3 t = sdirs[i] - n * glm::dot(n, sdirs[i]);
+        t = glm::length(t) > 1e-12f ? glm::normalize(t) : any_perpendicular(n);
+        const float w = glm::dot(glm::cross(n, t), tdirs[i]) < 0.0f ? -1.0f : 1.0f;
+        tangents[i] = glm::vec4(t, w);
+    }
+}
+
+int generate_tangents(GLTFAsset &asset)
+{
+    struct Job {
+        int mesh;
+        int primitive;
+        std::vector<glm::vec4> tangents;
+    };
+
+    std::vector<Job> jobs;
+    for (unsigned i = 0; i < asset.meshes.size(); ++i) {
+        for (unsigned j = 0; j < asset.meshes[i].primitives.size(); ++j) {
+            const Primitive &primitive = asset.meshes[i].primitives[j];
+            // Use provided tangents
+            if (find_attribute(primitive, SEMANTIC_TANGENT) >= 0) continue;
+            if (find_attribute(primitive, SEMANTIC_POSITION) < 0 ||
+                find_attribute(primitive, SEMANTIC_NORMAL) < 0 ||
+                find_attribute(primitive, SEMANTIC_TEXCOORD_0) < 0) {
+                continue;
+            }
+            if (!accessor_is_valid(asset, find_attribute(primitive, SEMANTIC_POSITION)) ||
+                !accessor_is_valid(asset, find_attribute(primitive, SEMANTIC_NORMAL)) ||
+                !accessor_is_valid(asset, find_attribute(primitive, SEMANTIC_TEXCOORD_0)) ||
+                !accessor_is_valid(asset, primitive.indices)) {
+                continue;
+            }
+            Job job = {int(i), int(j), std::vector<glm::vec4>()};
+            jobs.push_back(job);
+        }
+    }
+
+    // The primitives are independent, so compute their tangents in parallel
+    cg::parallel_for(int(jobs.size()), [&](int i) {
+        const Primitive &primitive = asset.meshes[jobs[i].mesh].primitives[jobs[i].primitive];
+        std::vector<float> positions, normals, texcoords;
+        std::vector<uint32_t> indices;
+        read_accessor(asset, find_attribute(primitive, SEMANTIC_POSITION), positions);
+        read_accessor(asset, find_attribute(primitive, SEMANTIC_NORMAL), normals);
+        read_accessor(asset, find_attribute(primitive, SEMANTIC_TEXCOORD_0), texcoords);
+        read_indices(asset, primitive.indices, indices);
+        compute_tangents(positions, normals, texcoords, indices, jobs[i].tangents);
+    });
+
+    // Appending to the buffer modifies the asset, so this part is serial
+    for (auto &job : jobs) {
+        if (job.tangents.empty()) continue;
+        int accessor = append_accessor(asset, &job.tangents[0], 0x1406 /*GL_FLOAT*/,
+                                       int(job.tangents.size()), "VEC4");
+        Attribute attribute = {"TANGENT", accessor, SEMANTIC_TANGENT};
+        asset.meshes[job.mesh].primitives[job.primitive].attributes.push_back(attribute);
+    }
+    return int(jobs.size());
+}
+
+// Gray images decode to one or two channels (see decode_image_to_bytebuffer)
+// whose swizzle replicates red, while normal maps that were already
+// converted keep X and Y in red and green
+static bool is_grayscale(const Image &image)
+{
+    if (image.channels != 4) return image.swizzle.compare(0, 3, "rrr") == 0;
+    for (size_t i = 0; i + 3 < image.data.size(); i += 4) {
+        if (image.data[i] != image.data[i + 1] || image.data[i] != image.data[i + 2]) return false;
+    }
+    return true;
+}
+
+// Replaces the heights (the first channel) with the X and Y of the normals
+// in a two-channel image, since the shaders reconstruct Z
+static void bump_to_normal_map(Image &image, float strength)
+{
+    const int w = image.width, h = image.height, channels = image.channels;
+    std::vector<float> heights(size_t(w) * h);
+    for (size_t i = 0; i < heights.size(); ++i) {
+        heights[i] = uint8_t(image.data[channels * i]) / 255.0f;
+    }
+
+    // Central differences, with wrap-around at the image borders. The scale
+    // converts differences between texels into slopes per unit texcoord.
+    const float scaleX = 0.5f * strength * w, scaleY = 0.5f * strength * h;
+    std::vector<char> normals(heights.size() * 2);
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            const float left = heights[size_t(y) * w + (x + w - 1) % w];
+            const float right = heights[size_t(y) * w + (x + 1) % w];
+            const float down = heights[size_t((y + h - 1) % h) * w + x];
+            const float up = heights[size_t((y + 1) % h) * w + x];
+            glm::vec3 n((left - right) * scaleX, (down - up) * scaleY, 1.0f);
+            n = glm::normalize(n);
+
+            char *texel = &normals[2 * (size_t(y) * w + x)];
+            texel[0] = char(uint8_t(std::lround((n.x * 0.5f + 0.5f) * 255.0f)));
+            texel[1] = char(uint8_t(std::lround((n.y * 0.5f + 0.5f) * 255.0f)));
+        }
+    }
+    image.data.swap(normals);
+    image.channels = 2;
+    image.swizzle = "rg01";
+}
+
+int convert_bump_maps_to_normal_maps(GLTFAsset &asset, float strength)
+{
+    std::set<int> sources;
+    for (const auto &material : asset.materials) {
+        if (!material.hasNormalTexture) continue;
+        if (material.normalTexture.index >= int(asset.textures.size())) continue;
+        const int source = asset.textures[material.normalTexture.index].source;
+        if (source >= 0) sources.insert(source);
+    }
+
+    std::vector<int> bumpMaps;
+    for (int source : sources) {
+        const Image &image = asset.images[source];
+        if (image.data.empty() || !is_grayscale(image)) continue;
+        bumpMaps.push_back(source);
+    }
+
+    cg::parallel_for(int(bumpMaps.size()), [&](int i) {
+        bump_to_normal_map(asset.images[bumpMaps[i]], strength);
+    });
+    return int(bumpMaps.size());
+}
+
+// Returns the quantized keys (one per attribute component) of all vertices
+static void quantize_vertices(const std::vector<std::vector<float> > &attributes,
+                              const std::vector<int> &numComps, size_t numVertices,
+                              float epsilon, std::vector<uint32_t> &keys, int &keySize)
+{
+    keySize = 0;
+    for (int n : numComps) keySize += n;
+    keys.resize(numVertices * keySize);
+
+    for (size_t i = 0; i < numVertices; ++i) {
+        uint32_t *key = &keys[i * keySize];
+        for (size_t j = 0; j < attributes.size(); ++j) {
+            for (int k = 0; k < numComps[j]; ++k) {
+                float value = attributes[j][i * numComps[j] + k];
+                if (epsilon > 0.0f) {
+                    // Values outside of the 32-bit range are clamped
+                    double q = std::floor(double(value) / epsilon + 0.5);
+                    q = std::max(std::min(q, double(INT_MAX)), double(INT_MIN));
+                    *key++ = uint32_t(int32_t(q));
+                } else {
+                    if (value == 0.0f) value = 0.0f;  // Treat -0 and +0 as equal
+                    std::memcpy(key++, &value, sizeof(value));
+                }
+            }
+        }
+    }
+}
+
+static uint32_t hash_key(const uint32_t *key, int keySize)
+{
+    // FNV-1a over 32-bit words, followed by a final avalanche step
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < keySize; ++i) hash = (hash ^ key[i]) * 16777619u;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+// Computes a remapping from old to new vertex indices, where new vertices
+// are numbered in order of first occurrence. Returns the new vertex count.
+static size_t build_weld_remap(const std::vector<uint32_t> &keys, int keySize,
+                               size_t numVertices, std::vector<uint32_t> &remap)
+{
+    // Open addressing with linear probing, in a table that is kept at most
+    // half full so that probe sequences stay short
+    size_t tableSize = 1;
+    while (tableSize < 2 * numVertices) tableSize *= 2;
+    std::vector<uint32_t> table(tableSize, UINT32_MAX);
+
+    remap.resize(numVertices);
+    size_t numUnique = 0;
+    for (size_t i = 0; i < numVertices; ++i) {
+        const uint32_t *key = &keys[i * keySize];
+        size_t slot = hash_key(key, keySize) & (tableSize - 1);
+        while (true) {
+            const uint32_t other = table[slot];
+            if (other == UINT32_MAX) {
+                table[slot] = uint32_t(i);
+                remap[i] = uint32_t(numUnique++);
+                break;
+            }
+            if (std::memcmp(key, &keys[size_t(other) * keySize], keySize * 4) == 0) {
+                remap[i] = remap[other];
+                break;
+            }
+            slot = (slot + 1) & (tableSize - 1);
+        }
+    }
+    return numUnique;
+}
+
+// Returns a pointer to the first element of an accessor in the (mutable)
+// buffer, and the distance in bytes between consecutive elements
+static char *accessor_data(GLTFAsset &asset, const Accessor &accessor, int &stride)
+{
+    const BufferView &bufferView = asset.bufferViews[accessor.bufferView];
+    Buffer &buffer = asset.buffers[bufferView.buffer];
+    const int elementSize = num_components(accessor.type) * component_size(accessor.componentType);
+    stride = bufferView.byteStride ? bufferView.byteStride : elementSize;
+    return &buffer.data[0] + bufferView.byteOffset + accessor.byteOffset;
+}
+
+// Overwrites the elements of an index accessor, keeping its component type
+static void write_indices(GLTFAsset &asset, int index, const std::vector<uint32_t> &indices)
+{
+    const Accessor &accessor = asset.accessors[index];
+    int stride = 0;
+    char *data = accessor_data(asset, accessor, stride);
+    for (size_t i = 0; i < indices.size(); ++i) {
+        char *ptr = data + i * stride;
+        if (accessor.componentType == 0x1401 /*GL_UNSIGNED_BYTE*/) {
+            *ptr = char(uint8_t(indices[i]));
+        } else if (accessor.componentType == 0x1403 /*GL_UNSIGNED_SHORT*/) {
+            uint16_t value = uint16_t(indices[i]);
+            std::memcpy(ptr, &value, sizeof(value));
+        } else {
+            std::memcpy(ptr, &indices[i], sizeof(uint32_t));
+        }
+    }
+}
+
+// Maps the vertex indices of an index accessor through a remapping table
+static void remap_indices(GLTFAsset &asset, int index, const std::vector<uint32_t> &remap)
+{
+    std::vector<uint32_t> indices;
+    read_indices(asset, index, indices);
+    for (auto &i : indices) {
+        if (i < remap.size()) i = remap[i];
+    }
+    write_indices(asset, index, indices);
+}
+
+// Welds a single primitive in place. Returns the new vertex count.
+static size_t weld_primitive(GLTFAsset &asset, const Primitive &primitive, float epsilon)
+{
+    std::vector<std::vector<float> > attributes(primitive.attributes.size());
+    std::vector<int> numComps(primitive.attributes.size());
+    const size_t numVertices = asset.accessors[primitive.attributes[0].index].count;
+    for (size_t i = 0; i < primitive.attributes.size(); ++i) {
+        read_accessor(asset, primitive.attributes[i].index, attributes[i]);
+        numComps[i] = num_components(asset.accessors[primitive.attributes[i].index].type);
+    }
+
+    std::vector<uint32_t> keys, remap;
+    int keySize = 0;
+    quantize_vertices(attributes, numComps, numVertices, epsilon, keys, keySize);
+    const size_t numUnique = build_weld_remap(keys, keySize, numVertices, remap);
+    if (numUnique == numVertices) return numVertices;
+
+    // Compact each attribute in place. New indices never exceed old ones, so
+    // moving elements in increasing order does not overwrite unread data.
+    for (const auto &it : primitive.attributes) {
+        Accessor &accessor = asset.accessors[it.index];
+        const int elementSize =
+            num_components(accessor.type) * component_size(accessor.componentType);
+        int stride = 0;
+        char *data = accessor_data(asset, accessor, stride);
+        for (size_t i = 0, next = 0; i < numVertices; ++i) {
+            if (remap[i] != next) continue;  // Not the first occurrence
+            if (next != i) std::memmove(data + next * stride, data + i * stride, elementSize);
+            ++next;
+        }
+        accessor.count = int(numUnique);
+    }
+
+    // Rewrite the index buffers (also those of the levels of detail) with the
+    // same component type, which is always wide enough since the vertex count
+    // can only shrink
+    remap_indices(asset, primitive.indices, remap);
+    for (int lod : primitive.lods) remap_indices(asset, lod, remap);
+    return numUnique;
+}
+
+// Returns the primitives whose data can be rewritten in place: their
+// accessors are valid, have the same vertex count and are not shared
+static std::vector<const Primitive *> find_exclusive_primitives(const GLTFAsset &asset)
+{
+    // Count accessor references, since shared accessors cannot be rewritten
+    // for one primitive without breaking the others
+    std::map<int, int> references;
+    for (const auto &mesh : asset.meshes) {
+        for (const auto &primitive : mesh.primitives) {
+            for (const auto &it : primitive.attributes) references[it.index]++;
+            for (int lod : primitive.lods) references[lod]++;
+            references[primitive.indices]++;
+        }
+    }
+
+    std::vector<const Primitive *> primitives;
+    for (const auto &mesh : asset.meshes) {
+        for (const auto &primitive : mesh.primitives) {
+            if (primitive.attributes.empty()) continue;
+            bool exclusive = references[primitive.indices] == 1;
+            exclusive = exclusive && accessor_is_valid(asset, primitive.indices);
+            for (int lod : primitive.lods) {
+                exclusive = exclusive && references[lod] == 1 && accessor_is_valid(asset, lod);
+            }
+            const int count = asset.accessors[primitive.attributes[0].index].count;
+            for (const auto &it : primitive.attributes) {
+                exclusive = exclusive && references[it.index] == 1;
+                exclusive = exclusive && accessor_is_valid(asset, it.index);
+                exclusive = exclusive && asset.accessors[it.index].count == count;
+            }
+            if (exclusive) primitives.push_back(&primitive);
+        }
+    }
+    return primitives;
+}
+
+WeldStats weld_vertices(GLTFAsset &asset, float epsilon)
+{
+    const std::vector<const Primitive *> primitives = find_exclusive_primitives(asset);
+
+    // Primitives touch disjoint parts of the buffer, so they can be welded
+    // in parallel
+    std::atomic<size_t> verticesBefore(0), verticesAfter(0);
+    cg::parallel_for(int(primitives.size()), [&](int i) {
+        verticesBefore += asset.accessors[primitives[i]->attributes[0].index].count;
+        verticesAfter += weld_primitive(asset, *primitives[i], epsilon);
+    });
+
+    WeldStats stats;
+    stats.primitives = int(primitives.size());
+    stats.verticesBefore = verticesBefore;
+    stats.verticesAfter = verticesAfter;
+    return stats;
+}
+
+static const uint32_t VERTEX_CACHE_SIZE = 16;
+
+// Returns the average number of vertex cache misses per triangle, for a FIFO
+// cache of VERTEX_CACHE_SIZE vertices
+static double simulate_acmr(const std::vector<uint32_t> &indices, size_t numVertices)
+{
+    if (indices.size() < 3) return 0.0;
+    std::vector<uint32_t> entered(numVertices, 0);  // When each vertex entered the cache
+    uint32_t time = VERTEX_CACHE_SIZE + 1;
+    size_t misses = 0;
+    for (uint32_t index : indices) {
+        if (time - entered[index] <= VERTEX_CACHE_SIZE) continue;
+        entered[index] = time++;
+        misses += 1;
+    }
+    return double(misses) / double(indices.size() / 3);
+}
+
+// Orders triangles for the vertex cache with Tipsify (Sander et al. 2007):
+// fan out from one vertex at a time, and move on to the neighbor that stays
+// in the cache longest. Where the walk reaches a dead end and jumps to an
+// unrelated part of the mesh, a new cluster starts (clusters holds the first
+// triangle of each).
+static void tipsify(const std::vector<uint32_t> &indices, size_t numVertices,
+                    std::vector<uint32_t> &out, std::vector<size_t> &clusters)
+{
+    // Triangles around each vertex, in compressed rows
+    const size_t numTriangles = indices.size() / 3;
+    std::vector<uint32_t> offsets(numVertices + 1, 0);
+    for (uint32_t index : indices) offsets[index + 1] += 1;
+    for (size_t v = 0; v < numVertices; ++v) offsets[v + 1] += offsets[v];
+    std::vector<uint32_t> adjacency(indices.size()), fill(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < indices.size(); ++i) adjacency[fill[indices[i]]++] = uint32_t(i / 3);
+
+    std::vector<uint32_t> live(numVertices), entered(numVertices, 0);
+    for (size_t v = 0; v < numVertices; ++v) live[v] = offsets[v + 1] - offsets[v];
+    std::vector<char> emitted(numTriangles, 0);
+    std::vector<uint32_t> deadEnds, candidates;
+    uint32_t time = VERTEX_CACHE_SIZE + 1;
+    size_t cursor = 0;  // Next vertex to try when the dead-end stack is empty
+
+    out.clear();
+    out.reserve(indices.size());
+    clusters.assign(1, 0);
+    while (cursor < numVertices && !live[cursor]) ++cursor;
+    int64_t fan = cursor < numVertices ? int64_t(cursor) : -1;
+    while (fan >= 0) {
+        candidates.clear();
+        for (uint32_t k = offsets[fan]; k < offsets[fan + 1]; ++k) {
+            const uint32_t t = adjacency[k];
+            if (emitted[t]) continue;
+            emitted[t] = 1;
+            for (int j = 0; j < 3; ++j) {
+                const uint32_t v = indices[3 * t + j];
+                out.push_back(v);
+                deadEnds.push_back(v);
+                candidates.push_back(v);
+                live[v] -= 1;
+                if (time - entered[v] > VERTEX_CACHE_SIZE) entered[v] = time++;
+            }
+        }
+
+        // Prefer the candidate that will still be in the cache after its
+        // remaining triangles are emitted, and among those the oldest one
+        int64_t next = -1;
+        int priority = -1;
+        for (uint32_t v : candidates) {
+            if (!live[v]) continue;
+            int p = 0;
+            if (time - entered[v] + 2 * live[v] <= VERTEX_CACHE_SIZE) p = int(time - entered[v]);
+            if (p > priority) next = v, priority = p;
+        }
+        if (next < 0) {
+            while (!deadEnds.empty() && next < 0) {
+                const uint32_t v = deadEnds.back();
+                deadEnds.pop_back();
+                if (live[v]) next = v;
+            }
+            while (next < 0 && cursor < numVertices) {
+                if (live[cursor]) next = int64_t(cursor);
+                else ++cursor;
+            }
+            if (next >= 0 && out.size() / 3 > clusters.back()) clusters.push_back(out.size() / 3);
+        }
+        fan = next;
+    }
+}
+
+// Sorts clusters of triangles so that those facing away from the center of
+// the mesh are drawn first, since they tend to occlude the others (the
+// overdraw ordering of Sander et al. 2007). Each cluster keeps its triangle
+// order, and with it most of its vertex cache efficiency.
+static void order_clusters_for_overdraw(const std::vector<float> &positions,
+                                        std::vector<uint32_t> &indices,
+                                        const std::vector<size_t> &clusters)
+{
+    if (clusters.size() < 2) return;
+    const size_t numTriangles = indices.size() / 3;
+    auto position = [&](uint32_t v) {
+        return glm::vec3(positions[3 * v], positions[3 * v + 1], positions[3 * v + 2]);
+    };
+
+    glm::vec3 center(0.0f);
+    for (uint32_t index : indices) center += position(index);
+    center /= float(indices.size());
+
+    struct Cluster {
+        float key;
+        size_t begin, end;
+    };
+    std::vector<Cluster> order(clusters.size());
+    for (size_t c = 0; c < clusters.size(); ++c) {
+        const size_t begin = clusters[c];
+        const size_t end = c + 1 < clusters.size() ? clusters[c + 1] : numTriangles;
+        glm::vec3 centroid(0.0f), normal(0.0f);
+        float area = 0.0f;
+        for (size_t t = begin; t < end; ++t) {
+            const glm::vec3 p0 = position(indices[3 * t]), p1 = position(indices[3 * t + 1]),
+                            p2 = position(indices[3 * t + 2]);
+            const glm::vec3 n = glm::cross(p1 - p0, p2 - p0);  // Twice the area
+            const float a = glm::length(n);
+            centroid += a * (p0 + p1 + p2) / 3.0f;
+            normal += n;
+            area += a;
+        }
+        const float length = glm::length(normal);
+        order[c].key = area > 0.0f && length > 0.0f
+                           ? glm::dot(centroid / area - center, normal / length)
+                           : -FLT_MAX;
+        order[c].begin = begin, order[c].end = end;
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [](const Cluster &a, const Cluster &b) { return a.key > b.key; });
+
+    std::vector<uint32_t> sorted;
+    sorted.reserve(indices.size());
+    for (const auto &cluster : order) {
+        sorted.insert(sorted.end(), indices.begin() + 3 * cluster.begin,
+                      indices.begin() + 3 * cluster.end);
+    }
+    indices.swap(sorted);
+}
+
+// Renumbers vertices in the order the indices first use them (unused
+// vertices go last), and returns the mapping from old to new numbers
+static void build_fetch_remap(const std::vector<uint32_t> &indices, size_t numVertices,
+                              std::vector<uint32_t> &remap)
+{
+    remap.assign(numVertices, UINT32_MAX);
+    uint32_t next = 0;
+    for (uint32_t index : indices) {
+        if (remap[index] == UINT32_MAX) remap[index] = next++;
+    }
+    for (auto &value : remap) {
+        if (value == UINT32_MAX) value = next++;
+    }
+}
+
+// Optimizes a single primitive in place. Returns false if its indices refer
+// to missing vertices.
+static bool optimize_primitive(GLTFAsset &asset, const Primitive &primitive, double &acmrBefore,
+                               double &acmrAfter)
+{
+    const size_t numVertices = asset.accessors[primitive.attributes[0].index].count;
+    std::vector<uint32_t> indices;
+    read_indices(asset, primitive.indices, indices);
+    indices.resize(indices.size() / 3 * 3);
+    for (uint32_t index : indices) {
+        if (index >= numVertices) return false;
+    }
+    acmrBefore = simulate_acmr(indices, numVertices);
+
+    std::vector<uint32_t> ordered;
+    std::vector<size_t> clusters;
+    tipsify(indices, numVertices, ordered, clusters);
+    const int position = find_attribute(primitive, SEMANTIC_POSITION);
+    if (position >= 0) {
+        std::vector<float> positions;
+        read_accessor(asset, position, positions);
+        order_clusters_for_overdraw(positions, ordered, clusters);
+    }
+
+    std::vector<uint32_t> remap;
+    build_fetch_remap(ordered, numVertices, remap);
+    for (auto &index : ordered) index = remap[index];
+    acmrAfter = simulate_acmr(ordered, numVertices);
+    write_indices(asset, primitive.indices, ordered);
+    for (int lod : primitive.lods) remap_indices(asset, lod, remap);
+
+    // Move the vertices to their new places
+    std::vector<char> copy;
+    for (const auto &it : primitive.attributes) {
+        const Accessor &accessor = asset.accessors[it.index];
+        const int elementSize =
+            num_components(accessor.type) * component_size(accessor.componentType);
+        int stride = 0;
+        char *data = accessor_data(asset, accessor, stride);
+        copy.resize(numVertices * elementSize);
+        for (size_t i = 0; i < numVertices; ++i) {
+            std::memcpy(&copy[i * elementSize], data + i * stride, elementSize);
+        }
+        for (size_t i = 0; i < numVertices; ++i) {
+            std::memcpy(data + remap[i] * stride, &copy[i * elementSize], elementSize);
+        }
+    }
+    return true;
+}
+
+VertexCacheStats optimize_vertex_cache(GLTFAsset &asset)
+{
+    const std::vector<const Primitive *> primitives = find_exclusive_primitives(asset);
+    std::vector<double> acmrBefore(primitives.size(), 0.0), acmrAfter(primitives.size(), 0.0);
+    std::vector<char> optimized(primitives.size(), 0);
+    cg::parallel_for(int(primitives.size()), [&](int i) {
+        optimized[i] = optimize_primitive(asset, *primitives[i], acmrBefore[i], acmrAfter[i]);
+    });
+
+    VertexCacheStats stats;
+    for (size_t i = 0; i < primitives.size(); ++i) {
+        if (!optimized[i]) continue;
+        const size_t triangles = asset.accessors[primitives[i]->indices].count / 3;
+        stats.primitives += 1;
+        stats.triangles += triangles;
+        stats.acmrBefore += acmrBefore[i] * triangles;
+        stats.acmrAfter += acmrAfter[i] * triangles;
+    }
+    if (stats.triangles) {
+        stats.acmrBefore /= stats.triangles;
+        stats.acmrAfter /= stats.triangles;
+    }
+    return stats;
+}
+
+// Simplifies a triangle list by vertex clustering: the vertices in each cell
+// of a grid with gridSize cells along the longest side of the bounds are
+// merged into the one nearest their average, and triangles that collapse or
+// become duplicates are removed
+static void cluster_vertices(const std::vector<float> &positions,
+                             const std::vector<uint32_t> &indices, const AABB &bounds,
+                             int gridSize, std::vector<uint32_t> &out)
+{
+    const glm::vec3 extent = bounds.max - bounds.min;
+    const float cellSize = std::max(extent.x, std::max(extent.y, extent.z)) / gridSize;
+    auto position = [&](uint32_t v) {
+        return glm::vec3(positions[3 * v], positions[3 * v + 1], positions[3 * v + 2]);
+    };
+
+    // Group the used vertices by cell (21 bits per cell coordinate)
+    std::vector<std::pair<uint64_t, uint32_t> > cells;
+    std::vector<char> used(positions.size() / 3, 0);
+    for (uint32_t index : indices) {
+        if (used[index]) continue;
+        used[index] = 1;
+        const glm::vec3 cell = glm::floor((position(index) - bounds.min) / cellSize);
+        const uint64_t x = uint64_t(glm::clamp(cell.x, 0.0f, float(gridSize)));
+        const uint64_t y = uint64_t(glm::clamp(cell.y, 0.0f, float(gridSize)));
+        const uint64_t z = uint64_t(glm::clamp(cell.z, 0.0f, float(gridSize)));
+        cells.push_back(std::make_pair((x << 42) | (y << 21) | z, index));
+    }
+    std::sort(cells.begin(), cells.end());
+
+    std::vector<uint32_t> representative(used.size(), UINT32_MAX);
+    for (size_t begin = 0, end = 0; begin < cells.size(); begin = end) {
+        glm::vec3 average(0.0f);
+        for (end = begin; end < cells.size() && cells[end].first == cells[begin].first; ++end) {
+            average += position(cells[end].second);
+        }
+        average /= float(end - begin);
+        uint32_t nearest = cells[begin].second;
+        float nearestDistance = FLT_MAX;
+        for (size_t i = begin; i < end; ++i) {
+            const glm::vec3 d = position(cells[i].second) - average;
+            if (glm::dot(d, d) < nearestDistance) {
+                nearest = cells[i].second, nearestDistance = glm::dot(d, d);
+            }
+        }
+        for (size_t i = begin; i < end; ++i) representative[cells[i].second] = nearest;
+    }
+
+    // Triangles are rotated to start at their smallest index (which keeps
+    // the winding), so that duplicates compare equal
+    std::vector<std::array<uint32_t, 3> > triangles;
+    for (size_t t = 0; t + 2 < indices.size(); t += 3) {
+        std::array<uint32_t, 3> triangle = {{representative[indices[t]],
+                                             representative[indices[t + 1]],
+                                             representative[indices[t + 2]]}};
+        if (triangle[0] == triangle[1] || triangle[1] == triangle[2] ||
+            triangle[0] == triangle[2]) {
+            continue;
+        }
+        while (triangle[0] > triangle[1] || triangle[0] > triangle[2]) {
+            triangle = {{triangle[1], triangle[2], triangle[0]}};
+        }
+        triangles.push_back(triangle);
+    }
+    std::sort(triangles.begin(), triangles.end());
+    triangles.erase(std::unique(triangles.begin(), triangles.end()), triangles.end());
+
+    out.clear();
+    for (const auto &triangle : triangles) out.insert(out.end(), triangle.begin(), triangle.end());
+}
+
+// Builds the index lists of the levels of detail of one primitive
+static void build_lods(const GLTFAsset &asset, const Primitive &primitive, int numLevels,
+                       float ratio, std::vector<std::vector<uint32_t> > &lods)
+{
+    lods.clear();
+    const int position = find_attribute(primitive, SEMANTIC_POSITION);
+    if (position < 0 || !accessor_is_valid(asset, position) ||
+        !accessor_is_valid(asset, primitive.indices)) {
+        return;
+    }
+    std::vector<float> positions;
+    std::vector<uint32_t> indices;
+    read_accessor(asset, position, positions);
+    read_indices(asset, primitive.indices, indices);
+    const size_t numVertices = positions.size() / 3;
+    indices.resize(indices.size() / 3 * 3);
+    if (indices.empty()) return;
+    AABB bounds = {glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX)};
+    for (uint32_t index : indices) {
+        if (index >= numVertices) return;
+        const glm::vec3 p(positions[3 * index], positions[3 * index + 1], positions[3 * index + 2]);
+        bounds.min = glm::min(bounds.min, p);
+        bounds.max = glm::max(bounds.max, p);
+    }
+    const glm::vec3 extent = bounds.max - bounds.min;
+    if (std::max(extent.x, std::max(extent.y, extent.z)) <= 0.0f) return;
+
+    // The triangle count grows with the grid size, so each level searches
+    // for the finest grid that stays within its budget (and no finer than
+    // the grid of the previous level)
+    std::vector<uint32_t> simplified, best, clusters;
+    std::vector<size_t> unused;
+    size_t previous = indices.size() / 3;
+    int maxGridSize = 1 << 20;
+    for (int level = 1; level <= numLevels; ++level) {
+        const size_t target = size_t(double(indices.size() / 3) * std::pow(ratio, level));
+        best.clear();
+        for (int lo = 1, hi = maxGridSize; lo <= hi;) {
+            const int gridSize = lo + (hi - lo) / 2;
+            cluster_vertices(positions, indices, bounds, gridSize, simplified);
+            if (simplified.size() / 3 <= target) {
+                best.swap(simplified);
+                maxGridSize = gridSize;
+                lo = gridSize + 1;
+            } else {
+                hi = gridSize - 1;
+            }
+        }
+        if (best.empty() || best.size() / 3 >= previous) break;
+        previous = best.size() / 3;
+        tipsify(best, numVertices, clusters, unused);
+        lods.push_back(clusters);
+    }
+}
+
+LodStats generate_lods(GLTFAsset &asset, int numLevels, float ratio)
+{
+    std::vector<Primitive *> primitives;
+    for (auto &mesh : asset.meshes) {
+        for (auto &primitive : mesh.primitives) {
+            if (primitive.lods.empty()) primitives.push_back(&primitive);
+        }
+    }
+    std::vector<std::vector<std::vector<uint32_t> > > lods(primitives.size());
+    cg::parallel_for(int(primitives.size()), [&](int i) {
+        build_lods(asset, *primitives[i], numLevels, ratio, lods[i]);
+    });
+
+    // The levels reuse the vertices of the primitive, so the base level's
+    // index type is always wide enough
+    LodStats stats;
+    for (size_t i = 0; i < primitives.size(); ++i) {
+        if (lods[i].empty()) continue;
+        const int componentType = asset.accessors[primitives[i]->indices].componentType;
+        for (const auto &indices : lods[i]) {
+            std::vector<char> data(indices.size() * component_size(componentType));
+            for (size_t j = 0; j < indices.size(); ++j) {
+                if (componentType == 0x1401 /*GL_UNSIGNED_BYTE*/) {
+                    data[j] = char(uint8_t(indices[j]));
+                } else if (componentType == 0x1403 /*GL_UNSIGNED_SHORT*/) {
+                    const uint16_t value = uint16_t(indices[j]);
+                    std::memcpy(&data[2 * j], &value, sizeof(value));
+                } else {
+                    std::memcpy(&data[4 * j], &indices[j], sizeof(uint32_t));
+                }
+            }
+            primitives[i]->lods.push_back(append_accessor(asset, data.data(), componentType,
+                                                          int(indices.size()), "SCALAR"));
+            stats.trianglesAfter += indices.size() / 3;
+        }
+        stats.primitives += 1;
+        stats.levels += int(lods[i].size());
+        stats.trianglesBefore += asset.accessors[primitives[i]->indices].count / 3;
+    }
+    return stats;
+}
+
+// Returns true if all values are within [lo, hi]
+static bool in_range(const std::vector<float> &values, float lo, float hi)
+{
+    for (float value : values) {
+        if (!(value >= lo && value <= hi)) return false;
+    }
+    return true;
+}
+
+// Converts a float attribute to normalized integers if its semantic allows
+// it without visible loss. Returns the new accessor, or -1.
+static int quantize_attribute(GLTFAsset &asset, int index, const std::string &name)
+{
+    const Accessor accessor = asset.accessors[index];
+    if (accessor.componentType != 0x1406 /*GL_FLOAT*/ || !accessor_is_valid(asset, index)) {
+        return -1;
+    }
+    const int n = num_components(accessor.type);
+    std::vector<float> values;
+    read_accessor(asset, index, values);
+
+    int componentType = 0;
+    float scale = 0.0f;
+    if ((name == "NORMAL" && n == 3) || (name == "TANGENT" && n == 4)) {
+        componentType = 0x1400, scale = 127.0f;  // GL_BYTE
+    } else if (name.compare(0, 9, "TEXCOORD_") == 0 && in_range(values, 0.0f, 1.0f)) {
+        componentType = 0x1403, scale = 65535.0f;  // GL_UNSIGNED_SHORT
+    } else if (name.compare(0, 6, "COLOR_") == 0 && n == 4 && in_range(values, 0.0f, 1.0f)) {
+        componentType = 0x1401, scale = 255.0f;  // GL_UNSIGNED_BYTE
+    } else {
+        return -1;
+    }
+
+    const int size = component_size(componentType);
+    std::vector<char> data(values.size() * size);
+    for (size_t i = 0; i < values.size(); ++i) {
+        const float value = glm::clamp(values[i], -1.0f, 1.0f) * scale;
+        const int32_t q = int32_t(std::floor(value + 0.5f));
+        if (size == 1) {
+            data[i] = char(q);
+        } else {
+            const uint16_t value16 = uint16_t(q);
+            std::memcpy(&data[2 * i], &value16, sizeof(value16));
+        }
+    }
+    const int quantized = append_accessor(asset, data.data(), componentType, accessor.count,
+                                          accessor.type);
+    asset.accessors[quantized].normalized = true;
+    return quantized;
+}
+
+QuantizationStats quantize_attributes(GLTFAsset &asset)
+{
+    // Accessors shared by several primitives are converted once
+    QuantizationStats stats;
+    std::map<int, int> converted;
+    for (auto &mesh : asset.meshes) {
+        for (auto &primitive : mesh.primitives) {
+            for (auto &it : primitive.attributes) {
+                auto found = converted.find(it.index);
+                if (found == converted.end()) {
+                    const int quantized = quantize_attribute(asset, it.index, it.name);
+                    found = converted.insert(std::make_pair(it.index, quantized)).first;
+                    if (quantized >= 0) {
+                        const Accessor &before = asset.accessors[it.index];
+                        const Accessor &after = asset.accessors[quantized];
+                        const int n = num_components(before.type);
+                        stats.accessors += 1;
+                        stats.bytesBefore += size_t(before.count) * n * 4;
+                        stats.bytesAfter += size_t(after.count) *
+                                            ((n * component_size(after.componentType) + 3) & ~3);
+                    }
+                }
+                if (found->second >= 0) it.index = found->second;
+            }
+        }
+    }
+    return stats;
+}
+
+}  // namespace gltf
@@ -0,0 +1,86 @@
+// Processing of glTF mesh data (tangents, etc.) done at import time.
+//
+
+#pragma once
+
+#include "gltf_scene.h"
+
+namespace gltf {
+
+// Generates per-vertex tangents for every primitive that has positions,
+// normals and texture coordinates but no TANGENT attribute. Tangents are
+// computed in the MikkTSpace convention (xyz = tangent, w = handedness of the
+// bitangent) and appended to the asset as new TANGENT attributes. Primitives
+// are processed in parallel. Returns the number of primitives processed.
+int generate_tangents(GLTFAsset &asset);
+
+// Converts grayscale bump (height) maps that are referenced as normal
+// textures into tangent-space normal maps, so that shaders only need a single
+// texture fetch. The strength is the change in height per unit texture
+// coordinate. Returns the number of images converted.
+int convert_bump_maps_to_normal_maps(GLTFAsset &asset, float strength);
+
+// Statistics reported by weld_vertices()
+struct WeldStats {
+    int primitives;           // Number of primitives that were welded
+    size_t verticesBefore;    // Total vertex count of those primitives before
+    size_t verticesAfter;     // ...and after welding
+};
+
+// Merges duplicate vertices of each primitive, comparing all attributes
+// after quantizing them to a grid with spacing epsilon (0 means that only
+// bit-identical vertices are merged). Attribute data is compacted in place
+// and the index buffer is rewritten to match. Primitives whose accessors are
+// shared with other primitives are left untouched. Runs in linear time.
+WeldStats weld_vertices(GLTFAsset &asset, float epsilon);
+
+// Statistics reported by optimize_vertex_cache()
+struct VertexCacheStats {
+    int primitives = 0;       // Number of primitives that were reordered
+    size_t triangles = 0;     // Total triangle count of those primitives
+    double acmrBefore = 0.0;  // Average cache misses per triangle (16-entry FIFO cache)
+    double acmrAfter = 0.0;   // ...before and after reordering
+};
+
+// Reorders the triangles of each primitive for the post-transform vertex
+// cache (Tipsify), then orders the clusters that this leaves so that those
+// facing outwards are drawn first (less overdraw), and finally renumbers the
+// vertices in the order that triangles first use them, so that vertex
+// fetches are sequential. Data is rewritten in place, with the same rules
+// for shared accessors as weld_vertices().
+VertexCacheStats optimize_vertex_cache(GLTFAsset &asset);
+
+// Statistics reported by generate_lods()
+struct LodStats {
+    int primitives = 0;          // Number of primitives that got levels of detail
+    int levels = 0;              // Total number of levels generated
+    size_t trianglesBefore = 0;  // Triangle count of those primitives
+    size_t trianglesAfter = 0;   // ...and of all their generated levels together
+};
+
+// Generates up to numLevels coarser versions of each primitive by vertex
+// clustering: the vertices in each cell of a grid are merged into one of
+// them, and triangles that collapse are removed. Level k has at most
+// ratio^k of the original triangles, and stops early when a level would not
+// get smaller. Levels reuse the vertices of their primitive, so each one only
+// adds an index accessor (Primitive::lods). Primitives that already have
+// levels of detail are skipped.
+LodStats generate_lods(GLTFAsset &asset, int numLevels, float ratio);
+
+// Statistics reported by quantize_attributes()
+struct QuantizationStats {
+    int accessors = 0;       // Number of accessors converted
+    size_t bytesBefore = 0;  // Size of their data before
+    size_t bytesAfter = 0;   // ...and after conversion
+};
+
+// Stores float vertex attributes as normalized integers (as allowed by
+// KHR_mesh_quantization): normals and tangents as 8-bit signed, and texture
+// coordinates and colors within [0, 1] as 16-bit and 8-bit unsigned.
+// Positions stay float, since quantizing them would need a dequantizing
+// transform on every node that uses the mesh. The converted data is appended
+// to the buffer, so compact_buffers() should be called afterwards to drop
+// the old data.
+QuantizationStats quantize_attributes(GLTFAsset &asset);
+
+}  // namespace gltf
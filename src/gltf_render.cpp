@@ -4,6 +4,10 @@
 //
 
 #include "gltf_render.h"
+#include "cg_bcn.h"
+#include "cg_utils.h"
+
+#include <algorithm>
 
 namespace gltf {
 
@@ -19,12 +23,20 @@ void create_drawables_from_gltf_asset(DrawableList &drawables, const GLTFAsset &
     assert(asset.buffers.size() == 1);
     glBufferData(GL_COPY_WRITE_BUFFER, asset.buffers[0].byteLength, &asset.buffers[0].data[0],
                  GL_STATIC_DRAW);
+    cg::track_gpu_object(cg::MEMORY_BUFFERS, cg::GPU_BUFFER, buffer, asset.buffers[0].byteLength,
+                         "vertex and index buffer");
+    create_drawables_with_buffer(drawables, asset, buffer);
+}
 
+void create_drawables_with_buffer(DrawableList &drawables, const GLTFAsset &asset, GLuint buffer)
+{
     // Create one vertex array object per mesh/drawable
     drawables.resize(asset.meshes.size());
     for (unsigned i = 0; i < asset.meshes.size(); ++i) {
         assert(asset.meshes[i].primitives.size() == 1);
         drawables[i].buffer = buffer;
+        drawables[i].hasTangents = false;
+        drawables[i].hasJoints = false;
 
         glGenVertexArrays(1, &drawables[i].vao);
         glBindVertexArray(drawables[i].vao);
@@ -38,27 +50,55 @@ void create_drawables_from_gltf_asset(DrawableList &drawables, const GLTFAsset &
 
             // Note: must add accessor's byte offset to buffer-view's
             int byteOffset = bufferView.byteOffset + accessor.byteOffset;
+            // Integer attributes (KHR_mesh_quantization) are read as [0, 1] or
+            // [-1, 1] when normalized
+            const GLboolean normalized = accessor.normalized ? GL_TRUE : GL_FALSE;
 
-            if (it.name.compare("POSITION") == 0) {
+            switch (it.semantic) {
+            case SEMANTIC_POSITION:
                 glEnableVertexAttribArray(POSITION);
                 // Note: we often declare the position attribute as vec4 in the
                 // vertex shader, even if the actual type in the buffer is
                 // vec3. This is valid and will give us a homogenous coordinate
                 // with the last component assigned the value 1.
-                glVertexAttribPointer(POSITION, 3 /*VEC3*/, accessor.componentType, GL_FALSE,
+                glVertexAttribPointer(POSITION, 3 /*VEC3*/, accessor.componentType, normalized,
                                       bufferView.byteStride, (GLvoid *)(intptr_t)byteOffset);
-            } else if (it.name.compare("COLOR_0") == 0) {
+                break;
+            case SEMANTIC_COLOR_0:
                 glEnableVertexAttribArray(COLOR_0);
-                glVertexAttribPointer(COLOR_0, 4 /*VEC4*/, accessor.componentType, GL_FALSE,
+                glVertexAttribPointer(COLOR_0, 4 /*VEC4*/, accessor.componentType, normalized,
                                       bufferView.byteStride, (GLvoid *)(intptr_t)byteOffset);
-            } else if (it.name.compare("NORMAL") == 0) {
+                break;
+            case SEMANTIC_NORMAL:
                 glEnableVertexAttribArray(NORMAL);
-                glVertexAttribPointer(NORMAL, 3 /*VEC3*/, accessor.componentType, GL_FALSE,
+                glVertexAttribPointer(NORMAL, 3 /*VEC3*/, accessor.componentType, normalized,
                                       bufferView.byteStride, (GLvoid *)(intptr_t)byteOffset);
-            } else if (it.name.compare("TEXCOORD_0") == 0) {
+                break;
+            case SEMANTIC_TEXCOORD_0:
                 glEnableVertexAttribArray(TEXCOORD_0);
-                glVertexAttribPointer(TEXCOORD_0, 2 /*VEC2*/, accessor.componentType, GL_FALSE,
+                glVertexAttribPointer(TEXCOORD_0, 2 /*VEC2*/, accessor.componentType, normalized,
+                                      bufferView.byteStride, (GLvoid *)(intptr_t)byteOffset);
+                break;
+            case SEMANTIC_TANGENT:
+                glEnableVertexAttribArray(TANGENT);
+                glVertexAttribPointer(TANGENT, 4 /*VEC4*/, accessor.componentType, normalized,
+                                      bufferView.byteStride, (GLvoid *)(intptr_t)byteOffset);
+                drawables[i].hasTangents = true;
+                break;
+            case SEMANTIC_JOINTS_0:
+                // Indices into the joint matrices, read as integers
+                glEnableVertexAttribArray(JOINTS_0);
+                glVertexAttribIPointer(JOINTS_0, 4 /*VEC4*/, accessor.componentType,
+                                       bufferView.byteStride, (GLvoid *)(intptr_t)byteOffset);
+                drawables[i].hasJoints = find_attribute(primitive, SEMANTIC_WEIGHTS_0) >= 0;
+                break;
+            case SEMANTIC_WEIGHTS_0:
+                glEnableVertexAttribArray(WEIGHTS_0);
+                glVertexAttribPointer(WEIGHTS_0, 4 /*VEC4*/, accessor.componentType, normalized,
                                       bufferView.byteStride, (GLvoid *)(intptr_t)byteOffset);
+                break;
+            default:
+                break;
             }
             // You can add support for more named attributes here...
         }
@@ -77,12 +117,193 @@ void create_drawables_from_gltf_asset(DrawableList &drawables, const GLTFAsset &
 void destroy_drawables(DrawableList &drawables)
 {
     for (unsigned i = 0; i < drawables.size(); ++i) {
+        cg::untrack_gpu_object(cg::GPU_BUFFER, drawables[i].buffer);
         glDeleteBuffers(1, &drawables[i].buffer);
         glDeleteVertexArrays(1, &drawables[i].vao);
     }
     drawables.clear();
 }
 
+size_t update_drawables(const DrawableList &drawables, const GLTFAsset &asset,
+                        const std::vector<ByteRange> &ranges)
+{
+    if (drawables.empty() || asset.buffers.empty()) return 0;
+    const std::vector<char> &data = asset.buffers[0].data;
+    size_t bytes = 0;
+    glBindBuffer(GL_COPY_WRITE_BUFFER, drawables[0].buffer);
+    for (const ByteRange &range : ranges) {
+        if (range.offset + range.size > data.size()) continue;
+        glBufferSubData(GL_COPY_WRITE_BUFFER, range.offset, range.size, &data[range.offset]);
+        bytes += range.size;
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    return bytes;
+}
+
+void build_draw_list(const GLTFAsset &asset, const std::vector<char> &visible,
+                     DrawList &drawList)
+{
+    drawList.clear();
+    drawList.reserve(asset.nodes.size());
+    for (unsigned i = 0; i < asset.nodes.size(); ++i) {
+        if (i < visible.size() && !visible[i]) continue;  // Culled
+        const int mesh = asset.nodes[i].mesh;
+        if (mesh < 0) continue;  // Light or group node
+        const Primitive &primitive = asset.meshes[mesh].primitives[0];
+        const int material = primitive.hasMaterial ? primitive.material : -1;
+        DrawItem item;
+        item.key = (uint64_t(uint32_t(material + 1)) << 32) | uint32_t(mesh);
+        item.node = int(i);
+        item.mesh = mesh;
+        item.material = material;
+        drawList.push_back(item);
+    }
+    // Stable, so that nodes with the same mesh keep the order of the asset
+    std::stable_sort(drawList.begin(), drawList.end(),
+                     [](const DrawItem &a, const DrawItem &b) { return a.key < b.key; });
+}
+
+void apply_texture_sampler(const GLTFAsset &asset, const Texture &texture)
+{
+    if (texture.hasSampler) {
+        const Sampler &sampler = asset.samplers[texture.sampler];
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, sampler.wrapS);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, sampler.wrapT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, sampler.minFilter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, sampler.magFilter);
+    } else {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+}
+
+void apply_image_swizzle(const Image &image)
+{
+    if (image.swizzle.size() != 4) return;
+    GLint swizzle[4];
+    for (int c = 0; c < 4; ++c) {
+        switch (image.swizzle[c]) {
+        case 'r': swizzle[c] = GL_RED; break;
+        case 'g': swizzle[c] = GL_GREEN; break;
+        case 'b': swizzle[c] = GL_BLUE; break;
+        case 'a': swizzle[c] = GL_ALPHA; break;
+        case '1': swizzle[c] = GL_ONE; break;
+        default: swizzle[c] = GL_ZERO; break;
+        }
+    }
+    glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+}
+
+// Returns the internal format and pixel format that match the channels of an
+// uncompressed image
+static void pixel_formats(const Image &image, GLenum &internalFormat, GLenum &format)
+{
+    internalFormat = image.srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8, format = GL_RGBA;
+    if (image.channels == 1) internalFormat = GL_R8, format = GL_RED;
+    if (image.channels == 2) internalFormat = GL_RG8, format = GL_RG;
+}
+
+static GLenum block_format(const Image &image)
+{
+    return image.srgb ? cg::srgb_block_format(image.compressedFormat) : image.compressedFormat;
+}
+
+// Uploads uncompressed pixels with the internal format that matches their
+// channels (the rows of R8 and RG8 images are not 4-byte aligned)
+static void upload_pixels(const Image &image, int level, int w, int h, const char *pixels)
+{
+    GLenum internalFormat, format;
+    pixel_formats(image, internalFormat, format);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, level, internalFormat, w, h, 0, format, GL_UNSIGNED_BYTE, pixels);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+void upload_texture_level(const Image &image, int level)
+{
+    const int w = std::max(1, image.width >> level);
+    const int h = std::max(1, image.height >> level);
+    const std::vector<char> &data = image.levels[level];
+    if (image.compressedFormat) {
+        glCompressedTexImage2D(GL_TEXTURE_2D, level, block_format(image), w, h, 0, data.size(),
+                               &data[0]);
+    } else {
+        upload_pixels(image, level, w, h, &data[0]);
+    }
+}
+
+void allocate_texture_level(const Image &image, int level)
+{
+    const int w = std::max(1, image.width >> level);
+    const int h = std::max(1, image.height >> level);
+    if (image.compressedFormat) {
+        glCompressedTexImage2D(GL_TEXTURE_2D, level, block_format(image), w, h, 0,
+                               image.levels[level].size(), nullptr);
+    } else {
+        upload_pixels(image, level, w, h, nullptr);
+    }
+}
+
+int texture_level_rows(const Image &image, int level)
+{
+    const int h = std::max(1, image.height >> level);
+    return image.compressedFormat ? (h + 3) / 4 : h;
+}
+
+size_t texture_row_bytes(const Image &image, int level)
+{
+    const int w = std::max(1, image.width >> level);
+    if (image.compressedFormat) return size_t((w + 3) / 4) * cg::block_size(image.compressedFormat);
+    return size_t(w) * image.channels;
+}
+
+void upload_texture_rows(const Image &image, int level, int row, int rows, const char *pixels)
+{
+    const int w = std::max(1, image.width >> level);
+    const int h = std::max(1, image.height >> level);
+    if (image.compressedFormat) {
+        // Rows of blocks, where the last one can be cut off by the level
+        const int y = 4 * row;
+        glCompressedTexSubImage2D(GL_TEXTURE_2D, level, 0, y, w, std::min(4 * rows, h - y),
+                                  block_format(image), rows * texture_row_bytes(image, level),
+                                  pixels);
+    } else {
+        GLenum internalFormat, format;
+        pixel_formats(image, internalFormat, format);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexSubImage2D(GL_TEXTURE_2D, level, 0, row, w, rows, format, GL_UNSIGNED_BYTE, pixels);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    }
+}
+
+void upload_texture_image(const GLTFAsset &asset, int source)
+{
+    if (source >= 0 && !asset.images[source].levels.empty()) {
+        // Upload the mip chain built on the CPU, either as compressed blocks
+        // or as 8-bit channels
+        const Image &image = asset.images[source];
+        apply_image_swizzle(image);
+        for (unsigned level = 0; level < image.levels.size(); ++level) {
+            upload_texture_level(image, level);
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, image.levels.size() - 1);
+    } else if (source >= 0 && !asset.images[source].data.empty()) {
+        const Image &image = asset.images[source];
+        apply_image_swizzle(image);
+        upload_pixels(image, 0, image.width, image.height, &(image.data[0]));
+        // We also need to create a mipmap chain in case GL_TEXTURE_MIN_FILTER
+        // is set to something else than GL_NEAREST or GL_LINEAR
+        glGenerateMipmap(GL_TEXTURE_2D);
+    } else {
+        // Use a white texel for images that could not be loaded
+        const uint8_t white[4] = {255, 255, 255, 255};
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, white);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    }
+}
+
 void create_textures_from_gltf_asset(TextureList &textures, const GLTFAsset &asset)
 {
     // First clean up existing OpenGL resources
@@ -91,34 +312,27 @@ void create_textures_from_gltf_asset(TextureList &textures, const GLTFAsset &ass
     // Create one texture object per texture in the asset
     textures.resize(asset.textures.size());
     for (unsigned i = 0; i < asset.textures.size(); ++i) {
-        const Image &image = asset.images[asset.textures[i].source];
-
         glGenTextures(1, &textures[i]);
         glBindTexture(GL_TEXTURE_2D, textures[i]);
-        if (asset.textures[i].hasSampler) {
-            const Sampler &sampler = asset.samplers[asset.textures[i].sampler];
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, sampler.wrapS);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, sampler.wrapT);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, sampler.minFilter);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, sampler.magFilter);
-        } else {
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        }
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, image.width, image.height, 0, GL_RGBA,
-                     GL_UNSIGNED_BYTE, &(image.data[0]));
-        // We also need to create a mipmap chain in case GL_TEXTURE_MIN_FILTER
-        // is set to something else than GL_NEAREST or GL_LINEAR
-        glGenerateMipmap(GL_TEXTURE_2D);
+        apply_texture_sampler(asset, asset.textures[i]);
+        upload_texture_image(asset, asset.textures[i].source);
+        cg::track_texture(cg::MEMORY_TEXTURES, GL_TEXTURE_2D, textures[i],
+                          texture_label(asset, i));
     }
     glBindTexture(GL_TEXTURE_2D, 0);
 }
 
+std::string texture_label(const GLTFAsset &asset, int texture)
+{
+    const int source = asset.textures[texture].source;
+    if (source >= 0 && !asset.images[source].uri.empty()) return asset.images[source].uri;
+    return "texture " + std::to_string(texture);
+}
+
 void destroy_textures(TextureList &textures)
 {
     if (!textures.size()) return;
+    for (GLuint texture : textures) cg::untrack_gpu_object(cg::GPU_TEXTURE, texture);
     glDeleteTextures(textures.size(), &textures[0]);
     textures.clear();
 }
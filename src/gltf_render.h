@@ -5,14 +5,27 @@
 
 #pragma once
 
+#include "gltf_diff.h"
 #include "gltf_scene.h"
 
 #include <GL/gl3w.h>
 
+#include <cstdint>
+#include <string>
+#include <vector>
+
 namespace gltf {
 
 // Attribute locations we will use in vertex shaders
-enum AttributeLocation { POSITION = 0, COLOR_0 = 1, NORMAL = 2, TEXCOORD_0 = 3 };
+enum AttributeLocation {
+    POSITION = 0,
+    COLOR_0 = 1,
+    NORMAL = 2,
+    TEXCOORD_0 = 3,
+    TANGENT = 4,
+    JOINTS_0 = 5,
+    WEIGHTS_0 = 6
+};
 
 struct Drawable {
     GLuint vao;
@@ -20,17 +33,75 @@ struct Drawable {
     GLenum indexType;
     int indexCount;
     int indexByteOffset;
+    bool hasTangents;
+    bool hasJoints;  // JOINTS_0 and WEIGHTS_0, for skinning
 };
 
 typedef std::vector<Drawable> DrawableList;
 typedef std::vector<GLuint> TextureList;
 
+// A node to draw. Sorting by key groups the nodes by material and then by
+// mesh, so that consecutive draws can share textures and vertex arrays.
+struct DrawItem {
+    uint64_t key;
+    int node;
+    int mesh;
+    int material;  // -1 if the mesh has no material
+};
+
+typedef std::vector<DrawItem> DrawList;
+
 void create_drawables_from_gltf_asset(DrawableList &drawables, const GLTFAsset &asset);
 
+// Creates the vertex arrays of the drawables of an asset for a buffer that
+// holds (or will hold) the first buffer of the asset. The drawables take over
+// the buffer.
+void create_drawables_with_buffer(DrawableList &drawables, const GLTFAsset &asset, GLuint buffer);
+
 void destroy_drawables(DrawableList &drawables);
 
+// Uploads changed ranges of the first buffer of the asset to the buffer of
+// the drawables (which must have been created from an asset with the same
+// layout). Returns the number of bytes uploaded.
+size_t update_drawables(const DrawableList &drawables, const GLTFAsset &asset,
+                        const std::vector<ByteRange> &ranges);
+
+// Collects the nodes to draw in draw order. Nodes with a zero flag in visible
+// are skipped (an empty or short visible list keeps the remaining nodes).
+void build_draw_list(const GLTFAsset &asset, const std::vector<char> &visible,
+                     DrawList &drawList);
+
 void create_textures_from_gltf_asset(TextureList &textures, const GLTFAsset &asset);
 
+// Sets the wrap and filter modes of the bound GL_TEXTURE_2D from a glTF texture
+void apply_texture_sampler(const GLTFAsset &asset, const Texture &texture);
+
+// Sets GL_TEXTURE_SWIZZLE_RGBA of the bound GL_TEXTURE_2D from Image::swizzle
+void apply_image_swizzle(const Image &image);
+
+// Uploads one level of the mip chain of an image to the bound GL_TEXTURE_2D
+void upload_texture_level(const Image &image, int level);
+
+// Allocates one level of the mip chain of an image in the bound GL_TEXTURE_2D,
+// without uploading any pixels
+void allocate_texture_level(const Image &image, int level);
+
+// Returns the number of rows in a level of the mip chain of an image, and the
+// size of a row in bytes. Rows of compressed images are rows of 4x4 blocks.
+int texture_level_rows(const Image &image, int level);
+size_t texture_row_bytes(const Image &image, int level);
+
+// Uploads some rows of an allocated level to the bound GL_TEXTURE_2D. If a
+// buffer is bound to GL_PIXEL_UNPACK_BUFFER, pixels is an offset into it.
+void upload_texture_rows(const Image &image, int level, int row, int rows, const char *pixels);
+
+// Uploads an image (all mip levels) to the bound GL_TEXTURE_2D, or a white
+// texel if the image is missing
+void upload_texture_image(const GLTFAsset &asset, int source);
+
+// Returns a name for a texture in memory reports (the image uri if it has one)
+std::string texture_label(const GLTFAsset &asset, int texture);
+
 void destroy_textures(TextureList &textures);
 
 }  // namespace gltf
@@ -0,0 +1,355 @@
+// Budgeted GPU residency of texture mip levels. The coarsest levels of each
+// texture stay resident, and finer levels are streamed in from the CPU mip
+// chains when the camera needs them.
+//
+
+#include "gltf_residency.h"
+#include "cg_utils.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+namespace gltf {
+
+static MeshTexelDensity compute_texel_density(const GLTFAsset &asset, const Mesh &mesh)
+{
+    MeshTexelDensity density = {0.0f, glm::vec3(0.0f), 0.0f};
+    glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+    double area = 0.0, uvArea = 0.0;
+    std::vector<float> positions, texcoords;
+    std::vector<uint32_t> indices;
+    for (const auto &primitive : mesh.primitives) {
+        const int position = find_attribute(primitive, SEMANTIC_POSITION);
+        if (!accessor_is_valid(asset, position)) continue;
+        read_accessor(asset, position, positions);
+        for (size_t i = 0; i + 2 < positions.size(); i += 3) {
+            const glm::vec3 p(positions[i], positions[i + 1], positions[i + 2]);
+            lo = glm::min(lo, p), hi = glm::max(hi, p);
+        }
+
+        const int texcoord = find_attribute(primitive, SEMANTIC_TEXCOORD_0);
+        if (!accessor_is_valid(asset, texcoord) || !accessor_is_valid(asset, primitive.indices)) {
+            continue;
+        }
+        read_accessor(asset, texcoord, texcoords);
+        read_indices(asset, primitive.indices, indices);
+        const size_t numVertices = std::min(positions.size() / 3, texcoords.size() / 2);
+        for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+            const uint32_t a = indices[i], b = indices[i + 1], c = indices[i + 2];
+            if (a >= numVertices || b >= numVertices || c >= numVertices) continue;
+            const glm::vec3 pa(positions[3 * a], positions[3 * a + 1], positions[3 * a + 2]);
+            const glm::vec3 pb(positions[3 * b], positions[3 * b + 1], positions[3 * b + 2]);
+            const glm::vec3 pc(positions[3 * c], positions[3 * c + 1], positions[3 * c + 2]);
+            const glm::vec2 ta(texcoords[2 * a], texcoords[2 * a + 1]);
+            const glm::vec2 tb(texcoords[2 * b], texcoords[2 * b + 1]);
+            const glm::vec2 tc(texcoords[2 * c], texcoords[2 * c + 1]);
+            const glm::vec2 e1 = tb - ta, e2 = tc - ta;
+            area += 0.5 * glm::length(glm::cross(pb - pa, pc - pa));
+            uvArea += 0.5 * std::abs(e1.x * e2.y - e1.y * e2.x);
+        }
+    }
+
+    if (lo.x <= hi.x) {
+        density.center = 0.5f * (lo + hi);
+        density.radius = 0.5f * glm::length(hi - lo);
+    }
+    if (area > 0.0) density.uvPerUnit = float(std::sqrt(uvArea / area));
+    return density;
+}
+
+static size_t level_bytes(const GLTFAsset &asset, int texture, int level)
+{
+    return asset.images[asset.textures[texture].source].levels[level].size();
+}
+
+// Records the resident levels of a streamed texture in the memory registry
+static void track_resident_levels(const TextureResidency &residency, const TextureList &textures,
+                                  const GLTFAsset &asset, int texture)
+{
+    const StreamedTexture &streamed = residency.textures[texture];
+    size_t bytes = 0;
+    for (int level = streamed.baseLevel; level < streamed.numLevels; ++level) {
+        bytes += level_bytes(asset, texture, level);
+    }
+    cg::track_gpu_object(cg::MEMORY_TEXTURES, cg::GPU_TEXTURE, textures[texture], bytes,
+                         texture_label(asset, texture));
+}
+
+void update_texel_densities(TextureResidency &residency, const GLTFAsset &asset)
+{
+    residency.meshes.resize(asset.meshes.size());
+    for (size_t i = 0; i < asset.meshes.size(); ++i) {
+        residency.meshes[i] = compute_texel_density(asset, asset.meshes[i]);
+    }
+}
+
+// Creates the texture object of one texture, with only the tail of its mip
+// chain resident. Unless uploadTail is set, the tail is left for the caller
+// to upload, and the texture is not usable before finish_streamed_texture().
+static void create_streamed_texture(TextureResidency &residency, TextureList &textures,
+                                    const GLTFAsset &asset, int i, bool uploadTail)
+{
+    glGenTextures(1, &textures[i]);
+    glBindTexture(GL_TEXTURE_2D, textures[i]);
+    apply_texture_sampler(asset, asset.textures[i]);
+
+    StreamedTexture &streamed = residency.textures[i];
+    streamed = StreamedTexture();
+    streamed.lastUsedFrame = 0;
+
+    const int source = asset.textures[i].source;
+    if (source < 0 || asset.images[source].levels.empty()) {
+        // Without a CPU mip chain there is nothing to stream from
+        upload_texture_image(asset, source);
+        cg::track_texture(cg::MEMORY_TEXTURES, GL_TEXTURE_2D, textures[i], texture_label(asset, i));
+        residency.residentBytes += cg::gpu_object_bytes(cg::GPU_TEXTURE, textures[i]);
+        return;
+    }
+
+    const Image &image = asset.images[source];
+    apply_image_swizzle(image);
+    streamed.numLevels = int(image.levels.size());
+    streamed.size = std::max(image.width, image.height);
+    streamed.tailLevel = streamed.numLevels - 1;
+    while (streamed.tailLevel > 0 &&
+           (streamed.size >> (streamed.tailLevel - 1)) <= residency.settings.tailSize) {
+        streamed.tailLevel -= 1;
+    }
+    if (!uploadTail) return;
+    for (int level = streamed.tailLevel; level < streamed.numLevels; ++level) {
+        upload_texture_level(image, level);
+    }
+    finish_streamed_texture(residency, textures, asset, i);
+}
+
+void finish_streamed_texture(TextureResidency &residency, TextureList &textures,
+                             const GLTFAsset &asset, int texture)
+{
+    StreamedTexture &streamed = residency.textures[texture];
+    if (streamed.numLevels == 0) return;
+    glBindTexture(GL_TEXTURE_2D, textures[texture]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, streamed.tailLevel);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, streamed.numLevels - 1);
+    for (int level = streamed.tailLevel; level < streamed.numLevels; ++level) {
+        residency.residentBytes += level_bytes(asset, texture, level);
+    }
+    streamed.baseLevel = streamed.tailLevel;
+    streamed.requestedLevel = streamed.numLevels;
+    streamed.wantedLevel = streamed.tailLevel;
+    track_resident_levels(residency, textures, asset, texture);
+}
+
+static void create_all_streamed_textures(TextureResidency &residency, TextureList &textures,
+                                         const GLTFAsset &asset, bool uploadTails)
+{
+    destroy_textures(textures);
+    update_texel_densities(residency, asset);
+
+    residency.textures.resize(asset.textures.size());
+    residency.residentBytes = 0;
+    textures.resize(asset.textures.size());
+    for (unsigned i = 0; i < asset.textures.size(); ++i) {
+        create_streamed_texture(residency, textures, asset, i, uploadTails);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void create_streamed_textures(TextureResidency &residency, TextureList &textures,
+                              const GLTFAsset &asset)
+{
+    create_all_streamed_textures(residency, textures, asset, true);
+}
+
+void begin_streamed_textures(TextureResidency &residency, TextureList &textures,
+                             const GLTFAsset &asset)
+{
+    create_all_streamed_textures(residency, textures, asset, false);
+}
+
+void reload_streamed_texture(TextureResidency &residency, TextureList &textures,
+                             const GLTFAsset &asset, int texture)
+{
+    residency.residentBytes -= cg::gpu_object_bytes(cg::GPU_TEXTURE, textures[texture]);
+    cg::untrack_gpu_object(cg::GPU_TEXTURE, textures[texture]);
+    glDeleteTextures(1, &textures[texture]);
+    create_streamed_texture(residency, textures, asset, texture, true);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void request_texture(TextureResidency &residency, int texture, int mesh,
+                     const glm::mat4 &modelView, const glm::mat4 &projection, int viewportHeight)
+{
+    if (texture < 0 || texture >= int(residency.textures.size())) return;
+    StreamedTexture &streamed = residency.textures[texture];
+    streamed.lastUsedFrame = residency.frame;
+    if (streamed.numLevels == 0) return;
+    if (mesh < 0 || mesh >= int(residency.meshes.size())) return;
+
+    // Without a known texel density, ask for everything
+    const MeshTexelDensity &density = residency.meshes[mesh];
+    if (density.uvPerUnit <= 0.0f) {
+        streamed.requestedLevel = 0;
+        return;
+    }
+
+    // Size of a pixel in view space, at the nearest point of the bounds
+    const float scale = std::max(glm::length(glm::vec3(modelView[0])),
+                                 std::max(glm::length(glm::vec3(modelView[1])),
+                                          glm::length(glm::vec3(modelView[2]))));
+    const glm::vec3 center = glm::vec3(modelView * glm::vec4(density.center, 1.0f));
+    const bool perspective = projection[2][3] != 0.0f;
+    const float distance = std::max(-center.z - density.radius * scale, 1e-3f);
+    const float unitsPerPixel =
+        2.0f / (projection[1][1] * viewportHeight) * (perspective ? distance : 1.0f);
+
+    const float texelsPerPixel = density.uvPerUnit / scale * streamed.size * unitsPerPixel;
+    int level = texelsPerPixel > 1.0f ? int(std::floor(std::log2(texelsPerPixel))) : 0;
+    level = std::min(level, streamed.numLevels - 1);
+    streamed.requestedLevel = std::min(streamed.requestedLevel, level);
+}
+
+// Releases the finest resident levels of textures that have more levels than
+// they want, least recently used first, until the given number of bytes fits
+// in the budget. Returns false if not enough could be released.
+static bool evict_levels(TextureResidency &residency, const TextureList &textures,
+                         const GLTFAsset &asset, size_t bytes, int exclude)
+{
+    while (residency.residentBytes + bytes > residency.settings.budgetBytes) {
+        int victim = -1;
+        for (int i = 0; i < int(residency.textures.size()); ++i) {
+            const StreamedTexture &streamed = residency.textures[i];
+            if (i == exclude || streamed.numLevels == 0) continue;
+            if (streamed.baseLevel >= streamed.wantedLevel) continue;
+            if (victim < 0) {
+                victim = i;
+                continue;
+            }
+            const StreamedTexture &best = residency.textures[victim];
+            if (streamed.lastUsedFrame < best.lastUsedFrame ||
+                (streamed.lastUsedFrame == best.lastUsedFrame &&
+                 streamed.baseLevel < best.baseLevel)) {
+                victim = i;
+            }
+        }
+        if (victim < 0) return false;
+
+        StreamedTexture &streamed = residency.textures[victim];
+        glBindTexture(GL_TEXTURE_2D, textures[victim]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, streamed.baseLevel + 1);
+        // Respecify the level as empty to release its memory (levels below the
+        // base level do not affect texture completeness)
+        glTexImage2D(GL_TEXTURE_2D, streamed.baseLevel, GL_RGBA8, 0, 0, 0, GL_RGBA,
+                     GL_UNSIGNED_BYTE, nullptr);
+        residency.residentBytes -= level_bytes(asset, victim, streamed.baseLevel);
+        streamed.baseLevel += 1;
+        residency.evictedLevels += 1;
+        track_resident_levels(residency, textures, asset, victim);
+    }
+    return true;
+}
+
+void update_residency(TextureResidency &residency, const TextureList &textures,
+                      const GLTFAsset &asset)
+{
+    residency.requestedBytes = 0;
+    residency.uploadedBytes = 0;
+    residency.evictedLevels = 0;
+
+    // Textures that were not drawn in this frame only want their tail, and
+    // anything above it can be released when space is needed
+    std::vector<int> order;
+    for (int i = 0; i < int(residency.textures.size()); ++i) {
+        StreamedTexture &streamed = residency.textures[i];
+        if (streamed.numLevels == 0) continue;
+        const bool used = streamed.lastUsedFrame == residency.frame;
+        streamed.wantedLevel =
+            used ? std::min(streamed.requestedLevel, streamed.tailLevel) : streamed.tailLevel;
+        for (int level = streamed.wantedLevel; level < streamed.numLevels; ++level) {
+            residency.requestedBytes += level_bytes(asset, i, level);
+        }
+        if (streamed.wantedLevel < streamed.baseLevel) order.push_back(i);
+    }
+
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        const StreamedTexture &ta = residency.textures[a], &tb = residency.textures[b];
+        return ta.baseLevel - ta.wantedLevel > tb.baseLevel - tb.wantedLevel;
+    });
+    for (int i : order) {
+        StreamedTexture &streamed = residency.textures[i];
+        const Image &image = asset.images[asset.textures[i].source];
+        while (streamed.baseLevel > streamed.wantedLevel &&
+               residency.uploadedBytes < residency.settings.uploadBytesPerFrame) {
+            const int level = streamed.baseLevel - 1;
+            const size_t bytes = image.levels[level].size();
+            if (residency.residentBytes + bytes > residency.settings.budgetBytes &&
+                !evict_levels(residency, textures, asset, bytes, i)) {
+                break;
+            }
+            glBindTexture(GL_TEXTURE_2D, textures[i]);
+            upload_texture_level(image, level);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+            streamed.baseLevel = level;
+            residency.residentBytes += bytes;
+            residency.uploadedBytes += bytes;
+        }
+        track_resident_levels(residency, textures, asset, i);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    for (auto &streamed : residency.textures) streamed.requestedLevel = streamed.numLevels;
+    residency.frame += 1;
+}
+
+void track_asset_memory(const GLTFAsset &asset)
+{
+    size_t bufferBytes = 0, imageBytes = 0;
+    for (const auto &buffer : asset.buffers) bufferBytes += buffer.data.size();
+    for (const auto &image : asset.images) {
+        imageBytes += image.data.size();
+        for (const auto &level : image.levels) imageBytes += level.size();
+    }
+    cg::track_cpu_memory(cg::MEMORY_BUFFERS, &asset, bufferBytes);
+    cg::track_cpu_memory(cg::MEMORY_TEXTURES, &asset, imageBytes);
+}
+
+void untrack_asset_memory(const GLTFAsset &asset)
+{
+    cg::track_cpu_memory(cg::MEMORY_BUFFERS, &asset, 0);
+    cg::track_cpu_memory(cg::MEMORY_TEXTURES, &asset, 0);
+}
+
+ReleaseStats release_cpu_copies(GLTFAsset &asset, TextureResidency &residency)
+{
+    ReleaseStats stats;
+
+    // Textures whose whole mip chain is in the resident tail are never
+    // streamed, so they no longer need their CPU levels either
+    std::vector<char> streamedImages(asset.images.size(), 0);
+    for (size_t i = 0; i < residency.textures.size(); ++i) {
+        StreamedTexture &streamed = residency.textures[i];
+        if (streamed.numLevels && streamed.tailLevel == 0) streamed.numLevels = 0;
+        const int source = asset.textures[i].source;
+        if (streamed.numLevels && source >= 0) streamedImages[source] = 1;
+    }
+
+    for (size_t i = 0; i < asset.images.size(); ++i) {
+        Image &image = asset.images[i];
+        if (streamedImages[i]) {
+            stats.imagesKept += 1;
+            continue;
+        }
+        stats.imageBytes += image.data.size();
+        for (const auto &level : image.levels) stats.imageBytes += level.size();
+        std::vector<char>().swap(image.data);
+        std::vector<std::vector<char> >().swap(image.levels);
+    }
+    for (auto &buffer : asset.buffers) {
+        stats.bufferBytes += buffer.data.size();
+        std::vector<char>().swap(buffer.data);
+    }
+    track_asset_memory(asset);
+    return stats;
+}
+
+}  // namespace gltf
@@ -0,0 +1,110 @@
+// Budgeted GPU residency of texture mip levels. The coarsest levels of each
+// texture stay resident, and finer levels are streamed in from the CPU mip
+// chains when the camera needs them.
+//
+
+#pragma once
+
+#include "gltf_render.h"
+
+#include <glm/glm.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace gltf {
+
+struct ResidencySettings {
+    size_t budgetBytes = size_t(128) << 20;        // GPU memory for streamed levels
+    size_t uploadBytesPerFrame = size_t(16) << 20; // Limits the time spent uploading
+    int tailSize = 128;  // Levels of this size (in texels) and smaller are always resident
+};
+
+struct StreamedTexture {
+    int numLevels;           // Levels in the CPU mip chain (0 if not streamed)
+    int size;                // Largest side of level 0 (in texels)
+    int tailLevel;           // First level of the always resident tail
+    int baseLevel;           // Finest resident level (GL_TEXTURE_BASE_LEVEL)
+    int requestedLevel;      // Finest level requested this frame (numLevels if none)
+    int wantedLevel;         // Level that streaming is heading for
+    uint64_t lastUsedFrame;
+};
+
+// How texture coordinates are spread over a mesh, for estimating how many
+// texels of a texture end up in each pixel
+struct MeshTexelDensity {
+    float uvPerUnit;   // Texture coordinate units per object-space unit (0 if unknown)
+    glm::vec3 center;  // Bounding sphere in object space
+    float radius;
+};
+
+struct TextureResidency {
+    ResidencySettings settings;
+    std::vector<StreamedTexture> textures;  // One per texture in the asset
+    std::vector<MeshTexelDensity> meshes;   // One per mesh in the asset
+    uint64_t frame = 1;
+    size_t residentBytes = 0;   // Of all textures, including those not streamed
+    size_t requestedBytes = 0;  // What the last frame asked for
+    size_t uploadedBytes = 0;   // During the last update
+    int evictedLevels = 0;      // During the last update
+};
+
+// Computes the texel density of every mesh of the asset again (e.g., after
+// its vertex data changed)
+void update_texel_densities(TextureResidency &residency, const GLTFAsset &asset);
+
+// Creates one texture object per texture in the asset, with only the tail of
+// each mip chain resident. Images without CPU mip chains are uploaded whole.
+void create_streamed_textures(TextureResidency &residency, TextureList &textures,
+                              const GLTFAsset &asset);
+
+// Creates the texture objects like create_streamed_textures(), but leaves the
+// levels of the resident tails (tailLevel to numLevels - 1) unset, so that
+// they can be uploaded in slices over several frames. Each streamed texture
+// must then be finished with finish_streamed_texture() before it is used.
+void begin_streamed_textures(TextureResidency &residency, TextureList &textures,
+                             const GLTFAsset &asset);
+
+void finish_streamed_texture(TextureResidency &residency, TextureList &textures,
+                             const GLTFAsset &asset, int texture);
+
+// Creates the texture object of one texture again, after its image or sampler
+// has changed (e.g., when the asset was reloaded). Its resident levels start
+// over from the tail.
+void reload_streamed_texture(TextureResidency &residency, TextureList &textures,
+                             const GLTFAsset &asset, int texture);
+
+// Records that a texture is drawn on a mesh in this frame. The finest mip
+// level it needs comes from the texel density of the mesh and the projected
+// size of a texel at the nearest point of the mesh bounds.
+void request_texture(TextureResidency &residency, int texture, int mesh,
+                     const glm::mat4 &modelView, const glm::mat4 &projection, int viewportHeight);
+
+// Streams in requested levels (finest first for the textures that lack the
+// most) and releases least recently used surplus levels when the budget is
+// exceeded. Call once per frame, after drawing.
+void update_residency(TextureResidency &residency, const TextureList &textures,
+                      const GLTFAsset &asset);
+
+// Reports the CPU copies of buffers and images held by an asset to the memory
+// registry. Call again whenever they change.
+void track_asset_memory(const GLTFAsset &asset);
+
+// Removes the CPU copies of an asset from the memory registry (e.g., before
+// the asset is moved or destroyed)
+void untrack_asset_memory(const GLTFAsset &asset);
+
+struct ReleaseStats {
+    size_t bufferBytes = 0;
+    size_t imageBytes = 0;
+    int imagesKept = 0;  // Still needed for streaming
+};
+
+// Frees the CPU copies that are no longer needed once the asset has been
+// uploaded: all buffers, and the images of textures that are not streamed.
+// Anything that reads accessors (culling meshes, BVHs, ...) must have been
+// built before this is called.
+ReleaseStats release_cpu_copies(GLTFAsset &asset, TextureResidency &residency);
+
+}  // namespace gltf
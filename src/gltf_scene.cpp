@@ -5,6 +5,351 @@
 
 #include "gltf_scene.h"
 
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cstring>
+
 namespace gltf {
 
+glm::mat4 node_model_matrix(const Node &node)
+{
+    // T * R * S as in the glTF spec, so that the scale does not affect the
+    // translation
+    glm::mat4 model = glm::mat4(1.0f);
+    model = glm::translate(model, node.translation);
+    model = glm::rotate(model, node.rotationX, glm::vec3(1, 0, 0));
+    model = glm::rotate(model, node.rotationY, glm::vec3(0, 1, 0));
+    model = glm::rotate(model, node.rotationZ, glm::vec3(0, 0, 1));
+    model = model * glm::mat4_cast(node.rotation);
+    model = glm::scale(model, node.scale);
+    return model;
+}
+
+void compute_world_matrices(const GLTFAsset &asset, std::vector<glm::mat4> &matrices)
+{
+    const int numNodes = int(asset.nodes.size());
+    std::vector<int> parents(numNodes, -1);
+    for (int i = 0; i < numNodes; ++i) {
+        for (int child : asset.nodes[i].children) {
+            if (child >= 0 && child < numNodes && child != i) parents[child] = i;
+        }
+    }
+
+    // Visit parents before their children (depth first, with an explicit
+    // stack). Nodes in a cycle are never reached from a root, and only get
+    // their own model matrix.
+    matrices.resize(numNodes);
+    std::vector<char> visited(numNodes, 0);
+    std::vector<int> stack;
+    for (int i = 0; i < numNodes; ++i) {
+        if (parents[i] < 0) stack.push_back(i);
+    }
+    while (!stack.empty()) {
+        const int i = stack.back();
+        stack.pop_back();
+        if (visited[i]) continue;
+        visited[i] = 1;
+        const glm::mat4 model = node_model_matrix(asset.nodes[i]);
+        matrices[i] = parents[i] >= 0 ? matrices[parents[i]] * model : model;
+        for (int child : asset.nodes[i].children) {
+            if (child >= 0 && child < numNodes && parents[child] == i) stack.push_back(child);
+        }
+    }
+    for (int i = 0; i < numNodes; ++i) {
+        if (!visited[i]) matrices[i] = node_model_matrix(asset.nodes[i]);
+    }
+}
+
+int num_components(const std::string &type)
+{
+    if (type == "SCALAR") return 1;
+    if (type == "VEC2") return 2;
+    if (type == "VEC3") return 3;
+    if (type == "VEC4") return 4;
+    if (type == "MAT2") return 4;
+    if (type == "MAT3") return 9;
+    if (type == "MAT4") return 16;
+    return 0;
+}
+
+int component_size(int componentType)
+{
+    switch (componentType) {
+    case 0x1400:  // GL_BYTE
+    case 0x1401:  // GL_UNSIGNED_BYTE
+        return 1;
+    case 0x1402:  // GL_SHORT
+    case 0x1403:  // GL_UNSIGNED_SHORT
+        return 2;
+    case 0x1405:  // GL_UNSIGNED_INT
+    case 0x1406:  // GL_FLOAT
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+AttributeSemantic attribute_semantic(const std::string &name)
+{
+    const char *names[] = {"",           "POSITION",   "NORMAL",   "TANGENT",  "TEXCOORD_0",
+                           "TEXCOORD_1", "COLOR_0",    "JOINTS_0", "WEIGHTS_0"};
+    static_assert(sizeof(names) / sizeof(names[0]) == NUM_SEMANTICS, "Missing semantic name");
+    for (int i = 1; i < NUM_SEMANTICS; ++i) {
+        if (name == names[i]) return AttributeSemantic(i);
+    }
+    return SEMANTIC_OTHER;
+}
+
+int find_attribute(const Primitive &primitive, AttributeSemantic semantic)
+{
+    for (const auto &it : primitive.attributes) {
+        if (it.semantic == semantic) return it.index;
+    }
+    return -1;
+}
+
+int find_attribute(const Primitive &primitive, const std::string &name)
+{
+    for (const auto &it : primitive.attributes) {
+        if (it.name == name) return it.index;
+    }
+    return -1;
+}
+
+// Returns a pointer to the first element of an accessor, and the distance in
+// bytes between consecutive elements
+static const char *accessor_data(const GLTFAsset &asset, const Accessor &accessor, int &stride)
+{
+    const BufferView &bufferView = asset.bufferViews[accessor.bufferView];
+    const Buffer &buffer = asset.buffers[bufferView.buffer];
+    const int elementSize = num_components(accessor.type) * component_size(accessor.componentType);
+    stride = bufferView.byteStride ? bufferView.byteStride : elementSize;
+    return &buffer.data[0] + bufferView.byteOffset + accessor.byteOffset;
+}
+
+bool accessor_is_valid(const GLTFAsset &asset, int accessor)
+{
+    if (accessor < 0 || accessor >= int(asset.accessors.size())) return false;
+    const Accessor &acc = asset.accessors[accessor];
+    if (acc.bufferView < 0 || acc.bufferView >= int(asset.bufferViews.size())) return false;
+    const BufferView &bufferView = asset.bufferViews[acc.bufferView];
+    if (bufferView.buffer < 0 || bufferView.buffer >= int(asset.buffers.size())) return false;
+    if (acc.count == 0) return true;
+
+    const int elementSize = num_components(acc.type) * component_size(acc.componentType);
+    const int stride = bufferView.byteStride ? bufferView.byteStride : elementSize;
+    const size_t end = size_t(bufferView.byteOffset) + acc.byteOffset +
+                       size_t(acc.count - 1) * stride + elementSize;
+    return elementSize > 0 && end <= asset.buffers[bufferView.buffer].data.size();
+}
+
+template <typename T>
+static float component_to_float(const char *ptr, bool normalized, float maxValue)
+{
+    T value;
+    std::memcpy(&value, ptr, sizeof(T));
+    return normalized ? std::max(float(value) / maxValue, -1.0f) : float(value);
+}
+
+void read_accessor(const GLTFAsset &asset, int accessor, std::vector<float> &data)
+{
+    const Accessor &acc = asset.accessors[accessor];
+    const int numComps = num_components(acc.type);
+    const int compSize = component_size(acc.componentType);
+    int stride = 0;
+    const char *src = accessor_data(asset, acc, stride);
+
+    data.resize(size_t(acc.count) * numComps);
+    if (acc.componentType == 0x1406 /*GL_FLOAT*/ && stride == numComps * 4) {
+        std::memcpy(&data[0], src, data.size() * sizeof(float));
+        return;
+    }
+
+    for (int i = 0; i < acc.count; ++i) {
+        const char *element = src + size_t(i) * stride;
+        for (int j = 0; j < numComps; ++j) {
+            const char *ptr = element + j * compSize;
+            float value = 0.0f;
+            switch (acc.componentType) {
+            case 0x1400: value = component_to_float<int8_t>(ptr, acc.normalized, 127.0f); break;
+            case 0x1401: value = component_to_float<uint8_t>(ptr, acc.normalized, 255.0f); break;
+            case 0x1402: value = component_to_float<int16_t>(ptr, acc.normalized, 32767.0f); break;
+            case 0x1403:
+                value = component_to_float<uint16_t>(ptr, acc.normalized, 65535.0f);
+                break;
+            case 0x1405:
+                value = component_to_float<uint32_t>(ptr, acc.normalized, 4294967295.0f);
+                break;
+            case 0x1406: value = component_to_float<float>(ptr, false, 1.0f); break;
+            }
+            data[size_t(i) * numComps + j] = value;
+        }
+    }
+}
+
+void read_indices(const GLTFAsset &asset, int accessor, std::vector<uint32_t> &indices)
+{
+    const Accessor &acc = asset.accessors[accessor];
+    int stride = 0;
+    const char *src = accessor_data(asset, acc, stride);
+
+    indices.resize(acc.count);
+    for (int i = 0; i < acc.count; ++i) {
+        const char *ptr = src + size_t(i) * stride;
+        if (acc.componentType == 0x1401 /*GL_UNSIGNED_BYTE*/) {
+            indices[i] = uint8_t(*ptr);
+        } else if (acc.componentType == 0x1403 /*GL_UNSIGNED_SHORT*/) {
+            uint16_t value;
+            std::memcpy(&value, ptr, sizeof(value));
+            indices[i] = value;
+        } else {
+            std::memcpy(&indices[i], ptr, sizeof(uint32_t));
+        }
+    }
+}
+
+int append_buffer_view(GLTFAsset &asset, const void *data, int byteLength)
+{
+    if (asset.buffers.empty()) asset.buffers.push_back(Buffer());
+    Buffer &buffer = asset.buffers[0];
+
+    // Keep the new buffer view aligned to four bytes, as required for float
+    // and 32-bit integer components
+    const int byteOffset = (int(buffer.data.size()) + 3) & ~3;
+    buffer.data.resize(byteOffset + byteLength);
+    if (byteLength) std::memcpy(&buffer.data[byteOffset], data, byteLength);
+    buffer.byteLength = int(buffer.data.size());
+
+    BufferView bufferView;
+    bufferView.buffer = 0;
+    bufferView.byteLength = byteLength;
+    bufferView.byteOffset = byteOffset;
+    bufferView.byteStride = 0;
+    asset.bufferViews.push_back(bufferView);
+    return int(asset.bufferViews.size()) - 1;
+}
+
+int append_accessor(GLTFAsset &asset, const void *data, int componentType, int count,
+                    const std::string &type)
+{
+    const int byteLength = count * num_components(type) * component_size(componentType);
+    Accessor accessor;
+    accessor.bufferView = append_buffer_view(asset, data, byteLength);
+    accessor.componentType = componentType;
+    accessor.count = count;
+    accessor.byteOffset = 0;
+    accessor.type = type;
+    accessor.normalized = false;
+    asset.accessors.push_back(accessor);
+    return int(asset.accessors.size()) - 1;
+}
+
+// Copies the elements of an accessor to the end of a new buffer, as a buffer
+// view of its own. Vertex attributes are padded to a multiple of four bytes
+// per element (e.g., normals stored as three bytes), as glTF requires.
+static void copy_accessor(const GLTFAsset &asset, int index, bool isAttribute, GLTFAsset &out)
+{
+    const Accessor &accessor = asset.accessors[index];
+    const BufferView &bufferView = asset.bufferViews[accessor.bufferView];
+    const int elementSize = num_components(accessor.type) * component_size(accessor.componentType);
+    const int srcStride = bufferView.byteStride ? bufferView.byteStride : elementSize;
+    const int dstStride = isAttribute ? (elementSize + 3) & ~3 : elementSize;
+    const char *src = asset.buffers[bufferView.buffer].data.data() + bufferView.byteOffset +
+                      accessor.byteOffset;
+
+    std::vector<char> data(size_t(accessor.count) * dstStride, 0);
+    for (int i = 0; i < accessor.count; ++i) {
+        std::memcpy(&data[size_t(i) * dstStride], src + size_t(i) * srcStride, elementSize);
+    }
+    const int view = append_buffer_view(out, data.data(), int(data.size()));
+    if (dstStride != elementSize) out.bufferViews[view].byteStride = dstStride;
+
+    Accessor copy = accessor;
+    copy.bufferView = view;
+    copy.byteOffset = 0;
+    out.accessors.push_back(copy);
+}
+
+bool compact_buffers(GLTFAsset &asset)
+{
+    for (const auto &mesh : asset.meshes) {
+        for (const auto &primitive : mesh.primitives) {
+            if (!accessor_is_valid(asset, primitive.indices)) return false;
+            for (int lod : primitive.lods) {
+                if (!accessor_is_valid(asset, lod)) return false;
+            }
+            for (const auto &it : primitive.attributes) {
+                if (!accessor_is_valid(asset, it.index)) return false;
+            }
+        }
+    }
+    for (const auto &skin : asset.skins) {
+        if (skin.inverseBindMatrices >= 0 && !accessor_is_valid(asset, skin.inverseBindMatrices)) {
+            return false;
+        }
+    }
+    for (const auto &animation : asset.animations) {
+        for (const auto &sampler : animation.samplers) {
+            if (!accessor_is_valid(asset, sampler.input) ||
+                !accessor_is_valid(asset, sampler.output)) {
+                return false;
+            }
+        }
+    }
+    for (const auto &image : asset.images) {
+        if (image.bufferView < 0) continue;
+        if (image.bufferView >= int(asset.bufferViews.size())) return false;
+        const BufferView &bufferView = asset.bufferViews[image.bufferView];
+        if (bufferView.buffer < 0 || bufferView.buffer >= int(asset.buffers.size()) ||
+            size_t(bufferView.byteOffset) + bufferView.byteLength >
+                asset.buffers[bufferView.buffer].data.size()) {
+            return false;
+        }
+    }
+
+    // Accessors shared by several primitives are copied once, where they are
+    // first used
+    GLTFAsset out;
+    std::vector<int> remap(asset.accessors.size(), -1);
+    auto copy = [&](int index, bool isAttribute) {
+        if (remap[index] < 0) {
+            copy_accessor(asset, index, isAttribute, out);
+            remap[index] = int(out.accessors.size()) - 1;
+        }
+        return remap[index];
+    };
+    for (auto &mesh : asset.meshes) {
+        for (auto &primitive : mesh.primitives) {
+            std::sort(primitive.attributes.begin(), primitive.attributes.end(),
+                      [](const Attribute &a, const Attribute &b) { return a.name < b.name; });
+            primitive.indices = copy(primitive.indices, false);
+            for (int &lod : primitive.lods) lod = copy(lod, false);
+            for (auto &it : primitive.attributes) it.index = copy(it.index, true);
+        }
+    }
+    for (auto &skin : asset.skins) {
+        if (skin.inverseBindMatrices >= 0) {
+            skin.inverseBindMatrices = copy(skin.inverseBindMatrices, false);
+        }
+    }
+    for (auto &animation : asset.animations) {
+        for (auto &sampler : animation.samplers) {
+            sampler.input = copy(sampler.input, false);
+            sampler.output = copy(sampler.output, false);
+        }
+    }
+    for (auto &image : asset.images) {
+        if (image.bufferView < 0) continue;
+        const BufferView &bufferView = asset.bufferViews[image.bufferView];
+        const char *data = asset.buffers[bufferView.buffer].data.data() + bufferView.byteOffset;
+        image.bufferView = append_buffer_view(out, data, bufferView.byteLength);
+    }
+
+    asset.accessors.swap(out.accessors);
+    asset.bufferViews.swap(out.bufferViews);
+    asset.buffers.swap(out.buffers);
+    return true;
+}
+
 }  // namespace gltf
@@ -8,6 +8,7 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/quaternion.hpp>
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -15,13 +16,30 @@ namespace gltf {
 
 enum MaterialType { DEFAULT_MATERIAL = 0, PBR_METALLIC_ROUGHNESS = 1 };
 
+// Meaning of a primitive attribute, so that attributes can be found without
+// comparing names. Attributes with other names are SEMANTIC_OTHER.
+enum AttributeSemantic {
+    SEMANTIC_OTHER = 0,
+    SEMANTIC_POSITION,
+    SEMANTIC_NORMAL,
+    SEMANTIC_TANGENT,
+    SEMANTIC_TEXCOORD_0,
+    SEMANTIC_TEXCOORD_1,
+    SEMANTIC_COLOR_0,
+    SEMANTIC_JOINTS_0,
+    SEMANTIC_WEIGHTS_0,
+    NUM_SEMANTICS
+};
+
 struct Scene {
     std::string name;
     std::vector<int> nodes;
 };
 
 struct Node {
-    int mesh;
+    int mesh;   // -1 if none
+    int light;  // KHR_lights_punctual light, or -1
+    int skin;   // -1 if none
     std::string name;
     std::vector<int> children;
     glm::vec3 translation;
@@ -32,6 +50,54 @@ struct Node {
     glm::vec3 scale;
     glm::mat4 matrix;
     bool hasMatrix;
+    bool isOccluder;  // Tagged with "extras": {"occluder": true}
+};
+
+enum LightType { LIGHT_DIRECTIONAL = 0, LIGHT_POINT = 1, LIGHT_SPOT = 2 };
+
+// Light from the KHR_lights_punctual extension. Lights shine down the -Z axis
+// of their node.
+struct Light {
+    std::string name;
+    LightType type;
+    glm::vec3 color;
+    float intensity;       // Candela (point and spot lights) or lux (directional)
+    float range;           // Distance where the light ends (0 = infinite)
+    float innerConeAngle;  // Spot lights only (radians)
+    float outerConeAngle;
+};
+
+// Joints that deform the vertices of a mesh (by their JOINTS_0 and WEIGHTS_0
+// attributes)
+struct Skin {
+    std::string name;
+    std::vector<int> joints;   // Nodes
+    int inverseBindMatrices;  // MAT4 accessor with a matrix per joint, or -1 (identity)
+    int skeleton;             // Common root of the joints, or -1
+};
+
+enum AnimationPath { PATH_TRANSLATION = 0, PATH_ROTATION, PATH_SCALE, PATH_WEIGHTS };
+
+enum Interpolation { INTERPOLATION_LINEAR = 0, INTERPOLATION_STEP, INTERPOLATION_CUBICSPLINE };
+
+// Keyframes: times (input) and values (output). Cubic splines store an
+// in-tangent, a value and an out-tangent per key.
+struct AnimationSampler {
+    int input;
+    int output;
+    Interpolation interpolation;
+};
+
+struct AnimationChannel {
+    int sampler;  // In the same animation
+    int node;     // Target, or -1
+    AnimationPath path;
+};
+
+struct Animation {
+    std::string name;
+    std::vector<AnimationChannel> channels;
+    std::vector<AnimationSampler> samplers;
 };
 
 struct MaterialTexture {
@@ -65,13 +131,23 @@ struct Texture {
     int source;
     int sampler;
     bool hasSampler;
+    int fallbackSource;  // Source to use if a KHR_texture_basisu image fails (or -1)
 };
 
 struct Image {
     std::string uri;
+    std::string mimeType;
+    int bufferView;          // Buffer view with the encoded image (in GLB files), or -1
     int width;               // Image width (in pixels)
     int height;              // Image height (in pixels)
-    std::vector<char> data;  // Pixel data in RGBA8 format
+    int channels;            // Channels per pixel of uncompressed data and levels (1, 2 or 4)
+    bool srgb;               // Color that the GL should decode from sRGB to linear
+    std::string swizzle;     // Source of the sampled r, g, b and a: a stored channel (r, g,
+                             // b or a) or a constant (0 or 1), e.g. "rrr1" for grayscale.
+                             // Empty if sampled as stored.
+    std::vector<char> data;  // Pixel data, 8 bits per channel (moved to levels by mip generation)
+    int compressedFormat;    // OpenGL format of compressed levels (0 if uncompressed)
+    std::vector<std::vector<char> > levels;  // Mip chain (compressed or 8-bit), level 0 first
 };
 
 struct Sampler {
@@ -84,6 +160,7 @@ struct Sampler {
 struct Attribute {
     std::string name;
     int index;
+    AttributeSemantic semantic;  // From the name (see attribute_semantic())
 };
 
 struct Primitive {
@@ -91,6 +168,7 @@ struct Primitive {
     int indices;
     int material;
     bool hasMaterial;
+    std::vector<int> lods;  // Index accessors of coarser levels of detail, finest first
 };
 
 struct Mesh {
@@ -104,6 +182,7 @@ struct Accessor {
     int count;
     int byteOffset;
     std::string type;
+    bool normalized;
 };
 
 struct BufferView {
@@ -130,6 +209,74 @@ struct GLTFAsset {
     std::vector<Accessor> accessors;
     std::vector<BufferView> bufferViews;
     std::vector<Buffer> buffers;
+    std::vector<Light> lights;
+    std::vector<Skin> skins;
+    std::vector<Animation> animations;
+};
+
+// Axis-aligned bounding box
+struct AABB {
+    glm::vec3 min;
+    glm::vec3 max;
 };
 
+// Returns the model matrix of a node: its translation, then the rotation
+// angles (rotationX/Y/Z) as edited in the viewer, then its rotation (which
+// animations drive), then its scale, i.e., T * Rx * Ry * Rz * R * S
+glm::mat4 node_model_matrix(const Node &node);
+
+// Computes the world matrix of every node, i.e., its model matrix multiplied
+// by those of its ancestors. Nodes that are nobody's child are roots, and
+// hierarchies of any depth are handled without recursion.
+void compute_world_matrices(const GLTFAsset &asset, std::vector<glm::mat4> &matrices);
+
+// Returns the number of components for an accessor type, e.g., 3 for "VEC3"
+int num_components(const std::string &type);
+
+// Returns the size in bytes of one component of the given component type
+int component_size(int componentType);
+
+// Returns the semantic of an attribute name, e.g., SEMANTIC_NORMAL for "NORMAL"
+AttributeSemantic attribute_semantic(const std::string &name);
+
+// Returns the accessor index of a named primitive attribute, or -1 if the
+// primitive does not have the attribute
+int find_attribute(const Primitive &primitive, const std::string &name);
+
+// Returns the accessor index of the attribute with a semantic (other than
+// SEMANTIC_OTHER), or -1 if the primitive does not have one
+int find_attribute(const Primitive &primitive, AttributeSemantic semantic);
+
+// Returns true if the accessor refers to buffer data that is loaded and large
+// enough to hold all of its elements
+bool accessor_is_valid(const GLTFAsset &asset, int accessor);
+
+// Reads the elements of an accessor into a tightly packed float array.
+// Integer components are converted, and also normalized if the accessor is
+// marked as normalized.
+void read_accessor(const GLTFAsset &asset, int accessor, std::vector<float> &data);
+
+// Reads the elements of an index accessor as 32-bit unsigned integers
+void read_indices(const GLTFAsset &asset, int accessor, std::vector<uint32_t> &indices);
+
+// Appends tightly packed element data to the first buffer of the asset (as a
+// new buffer view) and creates an accessor for it. Returns the new accessor
+// index.
+int append_accessor(GLTFAsset &asset, const void *data, int componentType, int count,
+                    const std::string &type);
+
+// Appends raw data (e.g., an encoded image) to the first buffer of the asset,
+// aligned to four bytes. Returns the new buffer view index.
+int append_buffer_view(GLTFAsset &asset, const void *data, int byteLength);
+
+// Rewrites the buffers of the asset as a single buffer that holds only the
+// data still referenced by meshes, skins, animations and images, in a fixed
+// order: for each primitive of each mesh its indices, its levels of detail
+// and its attributes (sorted by name), then the inverse bind matrices of the
+// skins, the keyframes of the animations, and finally the images. Each
+// accessor gets its own buffer view, and vertex attributes are padded to four
+// bytes per element. Unused accessors are removed. Returns false (and leaves
+// the asset unchanged) if an accessor refers to data that is not loaded.
+bool compact_buffers(GLTFAsset &asset);
+
 }  // namespace gltf
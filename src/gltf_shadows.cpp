@@ -0,0 +1,470 @@
+// Shadow atlas shared by all shadow-casting lights, and the scheduler that
+// decides which of its tiles to render each frame.
+//
+
+#include "gltf_shadows.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <unordered_map>
+
+namespace gltf {
+
+void init_shadow_atlas(ShadowAtlas &atlas, const ShadowSettings &settings)
+{
+    atlas = ShadowAtlas();
+    atlas.size = std::max(settings.atlasSize, 1);
+    atlas.minTileSize = std::max(std::min(settings.minTileSize, atlas.size), 1);
+    int levels = 1;
+    while ((atlas.size >> levels) >= atlas.minTileSize) levels += 1;
+    atlas.freeBlocks.resize(levels);
+    atlas.freeBlocks[0].insert(std::make_pair(0, 0));
+}
+
+// Returns the quadtree level of the largest block that fits a tile size
+static int tile_level(const ShadowAtlas &atlas, int size)
+{
+    int level = 0;
+    while (level + 1 < int(atlas.freeBlocks.size()) && (atlas.size >> (level + 1)) >= size) {
+        level += 1;
+    }
+    return level;
+}
+
+// Takes a free block of a level, splitting a larger block if there is none.
+// Returns false if the atlas has no room for it.
+static bool allocate_block(ShadowAtlas &atlas, int level, glm::ivec2 &offset)
+{
+    int from = level;
+    while (from >= 0 && atlas.freeBlocks[from].empty()) from -= 1;
+    if (from < 0) return false;
+    std::pair<int, int> block = *atlas.freeBlocks[from].begin();
+    atlas.freeBlocks[from].erase(atlas.freeBlocks[from].begin());
+    for (; from < level; ++from) {
+        // Keep the first quarter, and free the other three
+        const int half = atlas.size >> (from + 1);
+        atlas.freeBlocks[from + 1].insert(std::make_pair(block.first + half, block.second));
+        atlas.freeBlocks[from + 1].insert(std::make_pair(block.first, block.second + half));
+        atlas.freeBlocks[from + 1].insert(std::make_pair(block.first + half, block.second + half));
+    }
+    offset = glm::ivec2(block.first, block.second);
+    return true;
+}
+
+// Returns a block to its level, merging it with its siblings when all four
+// are free
+static void free_block(ShadowAtlas &atlas, int level, glm::ivec2 offset)
+{
+    for (; level > 0; --level) {
+        const int size = atlas.size >> level;
+        const int x = offset.x & ~(2 * size - 1), y = offset.y & ~(2 * size - 1);
+        std::set<std::pair<int, int> > &blocks = atlas.freeBlocks[level];
+        const std::pair<int, int> siblings[4] = {std::make_pair(x, y), std::make_pair(x + size, y),
+                                                 std::make_pair(x, y + size),
+                                                 std::make_pair(x + size, y + size)};
+        bool merge = true;
+        for (const auto &sibling : siblings) {
+            if (sibling != std::make_pair(offset.x, offset.y) && !blocks.count(sibling)) {
+                merge = false;
+            }
+        }
+        if (!merge) break;
+        for (const auto &sibling : siblings) blocks.erase(sibling);
+        offset = glm::ivec2(x, y);
+    }
+    atlas.freeBlocks[level].insert(std::make_pair(offset.x, offset.y));
+}
+
+float light_importance(const glm::vec3 &position, float range, const glm::mat4 &view,
+                       const glm::mat4 &projection)
+{
+    const glm::vec3 center(view * glm::vec4(position, 1.0f));
+    const float distance = glm::length(center);
+    if (distance <= range) return 1.0f;
+    if (center.z > range) return 0.0f;
+    // Radius on screen in NDC (2 is the full height), for a perspective or
+    // orthographic projection
+    const float depth = std::max(-center.z, 1e-4f);
+    const bool perspective = projection[3][3] == 0.0f;
+    const float radius = range * projection[1][1] / (perspective ? depth : 1.0f);
+    return std::min(radius, 1.0f);
+}
+
+// Returns the tile size for an importance (the size of a quadtree level)
+static int tile_size(const ShadowAtlas &atlas, const ShadowSettings &settings, float importance)
+{
+    const float maxSize = float(std::min(settings.maxTileSize, atlas.size));
+    int level = int(atlas.freeBlocks.size()) - 1;
+    while (level > 0 && (atlas.size >> level) < importance * maxSize) level -= 1;
+    return atlas.size >> level;
+}
+
+// Returns true if a block of a level can be allocated
+static bool can_allocate(const ShadowAtlas &atlas, int level)
+{
+    for (int i = level; i >= 0; --i) {
+        if (!atlas.freeBlocks[i].empty()) return true;
+    }
+    return false;
+}
+
+static AABB transform_aabb(const AABB &aabb, const glm::mat4 &matrix)
+{
+    const float inf = std::numeric_limits<float>::infinity();
+    AABB result = {glm::vec3(inf), glm::vec3(-inf)};
+    for (int i = 0; i < 8; ++i) {
+        const glm::vec3 corner((i & 1) ? aabb.max.x : aabb.min.x,
+                               (i & 2) ? aabb.max.y : aabb.min.y,
+                               (i & 4) ? aabb.max.z : aabb.min.z);
+        const glm::vec3 p(matrix * glm::vec4(corner, 1.0f));
+        result.min = glm::min(result.min, p);
+        result.max = glm::max(result.max, p);
+    }
+    return result;
+}
+
+// Returns false if a world-space box is outside one of the clip planes of a
+// light (conservative, like the frustum test of is_aabb_visible())
+static bool aabb_in_frustum(const AABB &aabb, const glm::mat4 &viewProj)
+{
+    int outside[6] = {0};
+    for (int i = 0; i < 8; ++i) {
+        const glm::vec4 corner((i & 1) ? aabb.max.x : aabb.min.x,
+                               (i & 2) ? aabb.max.y : aabb.min.y,
+                               (i & 4) ? aabb.max.z : aabb.min.z, 1.0f);
+        const glm::vec4 clip = viewProj * corner;
+        outside[0] += clip.x < -clip.w;
+        outside[1] += clip.x > clip.w;
+        outside[2] += clip.y < -clip.w;
+        outside[3] += clip.y > clip.w;
+        outside[4] += clip.z < -clip.w;
+        outside[5] += clip.z > clip.w;
+    }
+    for (int i = 0; i < 6; ++i) {
+        if (outside[i] == 8) return false;
+    }
+    return true;
+}
+
+// Returns the world bounds of the frustum of a light camera
+static AABB frustum_bounds(const glm::mat4 &viewProj)
+{
+    const glm::mat4 inverse = glm::inverse(viewProj);
+    const float inf = std::numeric_limits<float>::infinity();
+    AABB result = {glm::vec3(inf), glm::vec3(-inf)};
+    for (int i = 0; i < 8; ++i) {
+        const glm::vec4 corner = inverse * glm::vec4((i & 1) ? 1.0f : -1.0f,
+                                                     (i & 2) ? 1.0f : -1.0f,
+                                                     (i & 4) ? 1.0f : -1.0f, 1.0f);
+        const glm::vec3 p = glm::vec3(corner) / corner.w;
+        result.min = glm::min(result.min, p);
+        result.max = glm::max(result.max, p);
+    }
+    return result;
+}
+
+static bool aabb_overlap(const AABB &a, const AABB &b)
+{
+    return a.min.x <= b.max.x && b.min.x <= a.max.x && a.min.y <= b.max.y &&
+           b.min.y <= a.max.y && a.min.z <= b.max.z && b.min.z <= a.max.z;
+}
+
+// Returns the bounds of the bind-pose mesh around the posed joints of a skin,
+// i.e., the box of the joint positions grown by the size of the bind-pose
+// box, which covers the mesh as long as no vertex is farther from its joints
+// than that
+static AABB skinned_caster_bounds(const GLTFAsset &asset, const AABB &bindBounds,
+                                  const std::vector<glm::mat4> &worldMatrices, int node)
+{
+    AABB result = bindBounds;
+    const int skin = asset.nodes[node].skin;
+    if (skin < 0 || skin >= int(asset.skins.size())) return result;
+    const float pad = glm::length(bindBounds.max - bindBounds.min);
+    for (int joint : asset.skins[skin].joints) {
+        if (joint < 0 || joint >= int(worldMatrices.size())) continue;
+        const glm::vec3 position = glm::vec3(worldMatrices[joint][3]);
+        result.min = glm::min(result.min, position - pad);
+        result.max = glm::max(result.max, position + pad);
+    }
+    return result;
+}
+
+static ShadowCaster make_caster(const GLTFAsset &asset, const std::vector<CullingMesh> &meshes,
+                                const std::vector<glm::mat4> &worldMatrices, int node)
+{
+    const CullingMesh &mesh = meshes[asset.nodes[node].mesh];
+    ShadowCaster caster;
+    caster.node = node;
+    caster.bounds = transform_aabb(mesh.bounds, worldMatrices[node]);
+    caster.triangles = int64_t(mesh.indices.size() / 3);
+    caster.skinned = asset.nodes[node].skin >= 0;
+    if (caster.skinned) {
+        caster.bounds = skinned_caster_bounds(asset, caster.bounds, worldMatrices, node);
+    }
+    return caster;
+}
+
+static void find_casters(const std::vector<ShadowCaster> &casters, const glm::mat4 &viewProj,
+                         ShadowUpdate &update)
+{
+    update.casters.clear();
+    update.triangles = 0;
+    // The box around the frustum rejects most nodes before the exact test
+    const AABB frustum = frustum_bounds(viewProj);
+    for (const ShadowCaster &caster : casters) {
+        if (!caster.skinned && (!aabb_overlap(caster.bounds, frustum) ||
+                                !aabb_in_frustum(caster.bounds, viewProj))) {
+            continue;
+        }
+        update.casters.push_back(caster.node);
+        update.triangles += caster.triangles;
+    }
+}
+
+void schedule_shadow_updates(ShadowAtlas &atlas, const std::vector<ShadowLight> &lights,
+                             const GLTFAsset &asset, const std::vector<CullingMesh> &meshes,
+                             const std::vector<glm::mat4> &worldMatrices,
+                             const ShadowSettings &settings, std::vector<ShadowUpdate> &updates)
+{
+    updates.clear();
+    atlas.frame += 1;
+    atlas.stats = ShadowStats();
+    atlas.stats.lights = int(lights.size());
+
+    // A different scene (or the first frame) invalidates every tile. The
+    // bounds of the casters are only computed again for nodes that moved,
+    // and the moved nodes are kept with their bounds before and after.
+    std::vector<AABB> moved;
+    if (atlas.previousMatrices.size() != worldMatrices.size()) {
+        for (ShadowTile &tile : atlas.tiles) tile.rendered = false;
+        atlas.casters.clear();
+        for (size_t i = 0; i < asset.nodes.size() && i < worldMatrices.size(); ++i) {
+            const int mesh = asset.nodes[i].mesh;
+            if (mesh < 0 || mesh >= int(meshes.size())) continue;
+            atlas.casters.push_back(make_caster(asset, meshes, worldMatrices, int(i)));
+        }
+        atlas.previousMatrices = worldMatrices;
+    }
+    for (ShadowCaster &caster : atlas.casters) {
+        glm::mat4 &previous = atlas.previousMatrices[caster.node];
+        const glm::mat4 &world = worldMatrices[caster.node];
+        if (!std::memcmp(&previous, &world, sizeof(glm::mat4))) continue;
+        moved.push_back(caster.bounds);
+        caster = make_caster(asset, meshes, worldMatrices, caster.node);
+        moved.push_back(caster.bounds);
+        previous = world;
+    }
+
+    // The most important lights get tiles, in order of importance
+    std::vector<int> order;
+    for (size_t i = 0; i < lights.size(); ++i) {
+        if (lights[i].importance > 0.0f) order.push_back(int(i));
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return lights[a].importance > lights[b].importance;
+    });
+    if (int(order.size()) > std::max(settings.maxLights, 0)) {
+        order.resize(std::max(settings.maxLights, 0));
+    }
+    std::unordered_map<uint64_t, int> wanted;  // Light id -> tile size
+    int64_t area = 0;
+    for (int i : order) {
+        const int size = tile_size(atlas, settings, lights[i].importance);
+        wanted[lights[i].id] = size;
+        area += int64_t(size) * size;
+    }
+    // Halve the tiles while they do not fit, so that more lights keep their
+    // shadows in a crowded atlas (the smallest ones are dropped last)
+    while (area > int64_t(atlas.size) * atlas.size) {
+        int64_t smaller = 0;
+        for (auto &it : wanted) {
+            if (it.second > atlas.minTileSize) it.second /= 2;
+            smaller += int64_t(it.second) * it.second;
+        }
+        if (smaller == area) break;
+        area = smaller;
+    }
+
+    // Free the tiles of lights that are gone or need another size. Tiles
+    // that got less than their size because the atlas was full only grow
+    // when there is room.
+    size_t kept = 0;
+    for (size_t i = 0; i < atlas.tiles.size(); ++i) {
+        const ShadowTile &tile = atlas.tiles[i];
+        auto it = wanted.find(tile.id);
+        if (it == wanted.end() || it->second < tile.size ||
+            (it->second > tile.size && can_allocate(atlas, tile_level(atlas, it->second)))) {
+            free_block(atlas, tile_level(atlas, tile.size), tile.offset);
+            continue;
+        }
+        atlas.tiles[kept++] = tile;
+    }
+    atlas.tiles.resize(kept);
+    std::unordered_map<uint64_t, int> tiles;  // Light id -> index in atlas.tiles
+    for (size_t i = 0; i < atlas.tiles.size(); ++i) tiles[atlas.tiles[i].id] = int(i);
+
+    for (int i : order) {
+        const ShadowLight &light = lights[i];
+        auto it = tiles.find(light.id);
+        if (it == tiles.end()) {
+            // A new tile, or a smaller one if the atlas is too full
+            ShadowTile tile = ShadowTile();
+            tile.id = light.id;
+            int level = tile_level(atlas, wanted[light.id]);
+            while (level < int(atlas.freeBlocks.size()) &&
+                   !allocate_block(atlas, level, tile.offset)) {
+                level += 1;
+            }
+            if (level == int(atlas.freeBlocks.size())) {
+                atlas.stats.dropped += 1;
+                continue;
+            }
+            tile.size = atlas.size >> level;
+            tile.viewProj = light.viewProj;
+            tiles[light.id] = int(atlas.tiles.size());
+            atlas.tiles.push_back(tile);
+            it = tiles.find(light.id);
+        }
+        ShadowTile &tile = atlas.tiles[it->second];
+        tile.lightViewProj = light.viewProj;
+        tile.importance = light.importance;
+        if (!tile.dirty && std::memcmp(&tile.viewProj, &light.viewProj, sizeof(glm::mat4))) {
+            tile.dirty = true;
+            tile.dirtyFrame = atlas.frame;
+        }
+    }
+    atlas.stats.dropped += int(lights.size() - order.size());
+    atlas.stats.tiles = int(atlas.tiles.size());
+
+    // Tiles that must be rendered: new ones, and those where a caster moved
+    // into, out of or within the light view they were rendered with
+    std::vector<int> waiting;
+    for (size_t i = 0; i < atlas.tiles.size(); ++i) {
+        const ShadowTile &tile = atlas.tiles[i];
+        bool forced = !tile.rendered;
+        if (!forced && !moved.empty()) {
+            const AABB before = frustum_bounds(tile.viewProj);
+            const AABB after = frustum_bounds(tile.lightViewProj);
+            for (size_t j = 0; j < moved.size() && !forced; ++j) {
+                forced = (aabb_overlap(moved[j], before) &&
+                          aabb_in_frustum(moved[j], tile.viewProj)) ||
+                         (aabb_overlap(moved[j], after) &&
+                          aabb_in_frustum(moved[j], tile.lightViewProj));
+            }
+        }
+        if (forced) {
+            ShadowUpdate update;
+            update.tile = int(i);
+            update.forced = true;
+            find_casters(atlas.casters, tile.lightViewProj, update);
+            atlas.stats.triangles += update.triangles;
+            updates.push_back(update);
+        } else if (tile.dirty) {
+            waiting.push_back(int(i));
+        }
+    }
+    atlas.stats.forced = int(updates.size());
+
+    // Then the tiles whose light moved, by importance and how long they have
+    // waited, within the budget
+    std::sort(waiting.begin(), waiting.end(), [&](int a, int b) {
+        const ShadowTile &ta = atlas.tiles[a], &tb = atlas.tiles[b];
+        const float pa = ta.importance * float(atlas.frame - ta.dirtyFrame + 1);
+        const float pb = tb.importance * float(atlas.frame - tb.dirtyFrame + 1);
+        return pa > pb;
+    });
+    for (int i : waiting) {
+        ShadowUpdate update;
+        update.tile = i;
+        update.forced = false;
+        find_casters(atlas.casters, atlas.tiles[i].lightViewProj, update);
+        if (!updates.empty() &&
+            atlas.stats.triangles + update.triangles > settings.triangleBudget) {
+            atlas.stats.deferred += 1;
+            continue;
+        }
+        atlas.stats.triangles += update.triangles;
+        updates.push_back(update);
+    }
+    atlas.stats.rendered = int(updates.size());
+
+    int64_t texels = 0;
+    for (const ShadowTile &tile : atlas.tiles) texels += int64_t(tile.size) * tile.size;
+    atlas.stats.usedTexels = int(texels * 100 / (int64_t(atlas.size) * atlas.size));
+}
+
+void finish_shadow_update(ShadowAtlas &atlas, const ShadowUpdate &update)
+{
+    ShadowTile &tile = atlas.tiles[update.tile];
+    tile.viewProj = tile.lightViewProj;
+    tile.rendered = true;
+    tile.dirty = false;
+}
+
+int find_shadow_tile(const ShadowAtlas &atlas, uint64_t id)
+{
+    for (size_t i = 0; i < atlas.tiles.size(); ++i) {
+        if (atlas.tiles[i].id == id) return int(i);
+    }
+    return -1;
+}
+
+glm::mat4 cube_face_view_proj(const glm::vec3 &position, int face, float nearDepth,
+                              float farDepth)
+{
+    // Directions and up vectors of the faces, as they are laid out in GL
+    static const glm::vec3 directions[6] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0},
+                                            {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+    static const glm::vec3 ups[6] = {{0, -1, 0}, {0, -1, 0}, {0, 0, 1},
+                                     {0, 0, -1}, {0, -1, 0}, {0, -1, 0}};
+    const glm::mat4 view = glm::lookAt(position, position + directions[face], ups[face]);
+    return glm::perspective(glm::radians(90.0f), 1.0f, nearDepth, farDepth) * view;
+}
+
+int cull_cube_shadow_casters(const std::vector<ShadowCaster> &casters, const glm::vec3 &position,
+                             float nearDepth, float farDepth,
+                             std::vector<CubeShadowCaster> &result)
+{
+    result.clear();
+    glm::mat4 faces[6];
+    for (int face = 0; face < 6; ++face) {
+        faces[face] = cube_face_view_proj(position, face, nearDepth, farDepth);
+    }
+    int faceDraws = 0;
+    for (const ShadowCaster &caster : casters) {
+        if (caster.skinned) {
+            const CubeShadowCaster cubeCaster = {caster.node, 0x3f};
+            result.push_back(cubeCaster);
+            faceDraws += 6;
+            continue;
+        }
+
+        // Only the boxes that reach the sphere of the light are tested
+        // against the faces
+        const glm::vec3 closest = glm::clamp(position, caster.bounds.min, caster.bounds.max);
+        const glm::vec3 offset = closest - position;
+        if (glm::dot(offset, offset) > farDepth * farDepth) continue;
+        int mask = 0;
+        for (int face = 0; face < 6; ++face) {
+            if (aabb_in_frustum(caster.bounds, faces[face])) mask |= 1 << face;
+        }
+        if (!mask) continue;
+        const CubeShadowCaster cubeCaster = {caster.node, mask};
+        result.push_back(cubeCaster);
+        for (int face = 0; face < 6; ++face) faceDraws += (mask >> face) & 1;
+    }
+    return faceDraws;
+}
+
+glm::vec4 shadow_tile_rect(const ShadowAtlas &atlas, const ShadowTile &tile)
+{
+    const float scale = float(tile.size) / atlas.size;
+    return glm::vec4(scale, scale, float(tile.offset.x) / atlas.size,
+                     float(tile.offset.y) / atlas.size);
+}
+
+}  // namespace gltf
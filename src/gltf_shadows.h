@@ -0,0 +1,142 @@
+// Shadow atlas: one large depth texture shared by all shadow-casting lights.
+// Each light gets a square tile whose size follows how much of the screen it
+// can reach. Tiles are power-of-two blocks of a quadtree (buddy allocation),
+// so they can be allocated and freed without moving the others. A scheduler
+// decides which tiles to render each frame, so that the cost of shadows stays
+// bounded as the number of lights grows.
+//
+
+#pragma once
+
+#include "gltf_culling.h"
+#include "gltf_scene.h"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <set>
+#include <utility>
+#include <vector>
+
+namespace gltf {
+
+struct ShadowSettings {
+    int atlasSize = 4096;
+    int minTileSize = 128;
+    int maxTileSize = 2048;
+    int maxLights = 64;                // The most important ones get tiles
+    int64_t triangleBudget = 1000000;  // Per frame, for tiles that may wait
+};
+
+// A light that casts shadows this frame
+struct ShadowLight {
+    uint64_t id;         // Identifies the light across frames
+    glm::mat4 viewProj;  // Light camera
+    float importance;    // Fraction of the screen that the light can reach (0-1)
+};
+
+struct ShadowTile {
+    uint64_t id;
+    int size;
+    glm::ivec2 offset;          // In texels
+    glm::mat4 viewProj;         // Of the light when the tile was last rendered
+    glm::mat4 lightViewProj;    // Of the light this frame
+    float importance;
+    bool rendered;              // False until it is rendered the first time
+    bool dirty;                 // The light moved since the tile was rendered
+    uint64_t dirtyFrame;        // Frame when it became dirty
+};
+
+// A tile to render this frame, and the nodes that can cast shadows into it
+struct ShadowUpdate {
+    int tile;  // Index in ShadowAtlas::tiles
+    std::vector<int> casters;
+    int64_t triangles;
+    bool forced;  // New tile, or casters moved (rendered regardless of the budget)
+};
+
+struct ShadowStats {
+    int lights = 0;
+    int tiles = 0;
+    int dropped = 0;     // Lights without a tile (atlas full or over maxLights)
+    int rendered = 0;    // Tiles rendered this frame
+    int forced = 0;
+    int deferred = 0;    // Dirty tiles that wait for a later frame
+    int64_t triangles = 0;
+    int usedTexels = 0;  // Percent of the atlas
+};
+
+// A node that can cast shadows (it has geometry), with its world bounds.
+// Skinned nodes reach every tile and cube face, since their joints can move
+// them out of any box. Their bounds only estimate the posed mesh (the
+// bind-pose box around the posed joints), e.g., for the range of a cube
+// shadow map.
+struct ShadowCaster {
+    int node;
+    AABB bounds;
+    int64_t triangles;
+    bool skinned;
+};
+
+struct ShadowAtlas {
+    int size = 0;
+    int minTileSize = 0;
+    std::vector<std::set<std::pair<int, int> > > freeBlocks;  // Per level (0 = whole atlas)
+    std::vector<ShadowTile> tiles;
+    // World matrices of the previous frame, and the casters with bounds from
+    // them (cleared when the scene changes, to start over)
+    std::vector<glm::mat4> previousMatrices;
+    std::vector<ShadowCaster> casters;
+    uint64_t frame = 0;
+    ShadowStats stats;
+};
+
+void init_shadow_atlas(ShadowAtlas &atlas, const ShadowSettings &settings);
+
+// Returns the fraction of the screen height that a sphere can cover (1 if the
+// camera is inside it, 0 if it is behind the camera)
+float light_importance(const glm::vec3 &position, float range, const glm::mat4 &view,
+                       const glm::mat4 &projection);
+
+// Assigns tiles to the most important lights, keeping the tiles of lights
+// whose tile size did not change, and returns the tiles to render this frame.
+// New tiles and tiles whose casters moved are always rendered. Tiles whose
+// light moved are rendered by importance and how long they have waited, as
+// long as the triangle budget lasts (but at least one per frame). Tiles where
+// nothing changed are not rendered again.
+void schedule_shadow_updates(ShadowAtlas &atlas, const std::vector<ShadowLight> &lights,
+                             const GLTFAsset &asset, const std::vector<CullingMesh> &meshes,
+                             const std::vector<glm::mat4> &worldMatrices,
+                             const ShadowSettings &settings, std::vector<ShadowUpdate> &updates);
+
+// Marks a scheduled tile as rendered with the light camera of this frame
+void finish_shadow_update(ShadowAtlas &atlas, const ShadowUpdate &update);
+
+// Returns the index of the tile of a light, or -1 if it has none
+int find_shadow_tile(const ShadowAtlas &atlas, uint64_t id);
+
+// Cube shadow map of a point light: six 90 degree faces, in the order of the
+// GL cube map faces (+X, -X, +Y, -Y, +Z, -Z)
+
+// A caster of a cube shadow map, with a bit per face that it reaches
+struct CubeShadowCaster {
+    int node;
+    int faces;
+};
+
+// Returns the camera of a face of the cube shadow map of a point light
+glm::mat4 cube_face_view_proj(const glm::vec3 &position, int face, float nearDepth,
+                              float farDepth);
+
+// Finds the casters (e.g., ShadowAtlas::casters, which are up to date after
+// schedule_shadow_updates()) that reach the faces of a cube shadow map.
+// Returns the number of faces reached, i.e., the draws of six separate passes.
+int cull_cube_shadow_casters(const std::vector<ShadowCaster> &casters, const glm::vec3 &position,
+                             float nearDepth, float farDepth,
+                             std::vector<CubeShadowCaster> &result);
+
+// Returns the scale (xy) and offset (zw) that map texture coordinates of a
+// light, i.e., NDC * 0.5 + 0.5, to its tile of the atlas
+glm::vec4 shadow_tile_rect(const ShadowAtlas &atlas, const ShadowTile &tile);
+
+}  // namespace gltf
@@ -0,0 +1,924 @@
+// Texture compression and KTX2 images for glTF assets.
+//
+
+#include "gltf_texture.h"
+#include "cg_bcn.h"
+#include "cg_loadstats.h"
+#include "cg_parallel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+namespace gltf {
+
+// Change this when the encoder output changes, so that old cache entries are
+// not used
+static const uint32_t ENCODER_VERSION = 3;
+
+static const uint8_t KTX2_IDENTIFIER[12] = {0xab, 'K', 'T', 'X', ' ', '2',
+                                            '0',  0xbb, '\r', '\n', 0x1a, '\n'};
+
+// Supported formats of KTX2 files, as Vulkan formats and the OpenGL format
+// we upload them with (0 for uncompressed data with the given number of
+// channels). sRGB variants are read like their UNORM counterparts, since
+// whether an image is sRGB follows from how materials use it, and UNORM comes
+// first for writing.
+struct KTX2Format {
+    uint32_t vkFormat;
+    int glFormat;
+    int channels;
+};
+
+static const KTX2Format KTX2_FORMATS[] = {
+    {37, 0, 4},                       // VK_FORMAT_R8G8B8A8_UNORM
+    {43, 0, 4},                       // VK_FORMAT_R8G8B8A8_SRGB
+    {23, 0, 3},                       // VK_FORMAT_R8G8B8_UNORM
+    {29, 0, 3},                       // VK_FORMAT_R8G8B8_SRGB
+    {16, 0, 2},                       // VK_FORMAT_R8G8_UNORM
+    {22, 0, 2},                       // VK_FORMAT_R8G8_SRGB
+    {9, 0, 1},                        // VK_FORMAT_R8_UNORM
+    {15, 0, 1},                       // VK_FORMAT_R8_SRGB
+    {131, cg::FORMAT_BC1, 0},         // VK_FORMAT_BC1_RGB_UNORM_BLOCK
+    {132, cg::FORMAT_BC1, 0},         // VK_FORMAT_BC1_RGB_SRGB_BLOCK
+    {133, cg::FORMAT_BC1_ALPHA, 0},   // VK_FORMAT_BC1_RGBA_UNORM_BLOCK
+    {134, cg::FORMAT_BC1_ALPHA, 0},   // VK_FORMAT_BC1_RGBA_SRGB_BLOCK
+    {137, cg::FORMAT_BC3, 0},         // VK_FORMAT_BC3_UNORM_BLOCK
+    {138, cg::FORMAT_BC3, 0},         // VK_FORMAT_BC3_SRGB_BLOCK
+    {139, cg::FORMAT_BC4, 0},         // VK_FORMAT_BC4_UNORM_BLOCK
+    {141, cg::FORMAT_BC5, 0},         // VK_FORMAT_BC5_UNORM_BLOCK
+    {145, cg::FORMAT_BC7, 0},         // VK_FORMAT_BC7_UNORM_BLOCK
+    {146, cg::FORMAT_BC7, 0},         // VK_FORMAT_BC7_SRGB_BLOCK
+};
+
+static const KTX2Format *find_vk_format(uint32_t vkFormat)
+{
+    for (const auto &format : KTX2_FORMATS) {
+        if (format.vkFormat == vkFormat) return &format;
+    }
+    return nullptr;
+}
+
+static const KTX2Format *find_gl_format(int glFormat, int channels)
+{
+    for (const auto &format : KTX2_FORMATS) {
+        if (format.glFormat == glFormat && format.channels == channels) return &format;
+    }
+    return nullptr;
+}
+
+static uint32_t read_u32(const std::vector<char> &bytes, size_t offset)
+{
+    uint32_t value;
+    std::memcpy(&value, &bytes[offset], sizeof(value));
+    return value;
+}
+
+static uint64_t read_u64(const std::vector<char> &bytes, size_t offset)
+{
+    uint64_t value;
+    std::memcpy(&value, &bytes[offset], sizeof(value));
+    return value;
+}
+
+static void write_u32(std::vector<char> &bytes, size_t offset, uint32_t value)
+{
+    std::memcpy(&bytes[offset], &value, sizeof(value));
+}
+
+static void write_u64(std::vector<char> &bytes, size_t offset, uint64_t value)
+{
+    std::memcpy(&bytes[offset], &value, sizeof(value));
+}
+
+bool is_ktx2_image(const Image &image)
+{
+    if (image.mimeType == "image/ktx2") return true;
+    const size_t n = image.uri.size();
+    return n >= 5 && image.uri.compare(n - 5, 5, ".ktx2") == 0;
+}
+
+bool load_ktx2_image(const std::string &filename, Image &image)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) {
+        std::cerr << "Error: could not open " << filename << std::endl;
+        return false;
+    }
+    std::vector<char> bytes((std::istreambuf_iterator<char>(file)),
+                            std::istreambuf_iterator<char>());
+    return decode_ktx2_image(bytes, filename, image);
+}
+
+bool decode_ktx2_image(const std::vector<char> &bytes, const std::string &filename, Image &image)
+{
+    if (bytes.size() < 80 || std::memcmp(&bytes[0], KTX2_IDENTIFIER, 12) != 0) {
+        std::cerr << "Error: " << filename << " is not a KTX2 file" << std::endl;
+        return false;
+    }
+    const uint32_t vkFormat = read_u32(bytes, 12);
+    const uint32_t width = read_u32(bytes, 20);
+    const uint32_t height = read_u32(bytes, 24);
+    const uint32_t depth = read_u32(bytes, 28);
+    const uint32_t numLayers = read_u32(bytes, 32);
+    const uint32_t numFaces = read_u32(bytes, 36);
+    const uint32_t numLevels = std::max(1u, read_u32(bytes, 40));
+    const uint32_t supercompression = read_u32(bytes, 44);
+
+    if (vkFormat == 0 || supercompression != 0) {
+        std::cerr << "Error: " << filename
+                  << " uses Basis Universal or supercompression, which is not supported"
+                  << std::endl;
+        return false;
+    }
+    const KTX2Format *format = find_vk_format(vkFormat);
+    if (!format) {
+        std::cerr << "Error: " << filename << " has unsupported format " << vkFormat << std::endl;
+        return false;
+    }
+    if (depth > 0 || numLayers > 1 || numFaces != 1 || width == 0 || height == 0 ||
+        bytes.size() < 80 + 24 * size_t(numLevels)) {
+        std::cerr << "Error: " << filename << " is not a valid 2D texture" << std::endl;
+        return false;
+    }
+
+    image.width = int(width);
+    image.height = int(height);
+    image.data.clear();
+    image.levels.clear();
+    image.compressedFormat = format->glFormat;
+    for (uint32_t level = 0; level < numLevels; ++level) {
+        const uint64_t offset = read_u64(bytes, 80 + 24 * level);
+        const uint64_t length = read_u64(bytes, 80 + 24 * level + 8);
+        const int w = std::max(1u, width >> level), h = std::max(1u, height >> level);
+        const size_t expected = format->glFormat
+                                    ? cg::compressed_image_size(format->glFormat, w, h)
+                                    : size_t(w) * h * format->channels;
+        if (length != expected || offset + length > bytes.size()) {
+            std::cerr << "Error: " << filename << " has a corrupt mip level" << std::endl;
+            image.levels.clear();
+            return false;
+        }
+
+        const char *src = &bytes[offset];
+        if (format->glFormat) {
+            image.levels.push_back(std::vector<char>(src, src + length));
+        } else if (level == 0) {
+            // Uncompressed data keeps its channels (RGB is padded to RGBA, like
+            // other images), and the mip chain is generated again later
+            const int n = format->channels;
+            image.channels = n == 3 ? 4 : n;
+            image.swizzle = n == 1 ? "rrr1" : (n == 2 ? "rg01" : "");
+            image.data.resize(size_t(w) * h * image.channels);
+            for (size_t i = 0; i < size_t(w) * h; ++i) {
+                for (int c = 0; c < image.channels; ++c) {
+                    image.data[image.channels * i + c] = c < n ? src[n * i + c] : char(255);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Builds a data format descriptor with one basic descriptor block
+static std::vector<char> create_dfd(int glFormat, int channels)
+{
+    struct Sample {
+        uint32_t bitOffset;
+        uint32_t bitLength;  // Length minus one
+        uint32_t channel;
+        uint32_t upper;
+    };
+
+    static const Sample BC_COLOR[] = {{0, 63, 0, ~0u}};
+    static const Sample BC1_ALPHA[] = {{0, 63, 1, ~0u}};
+    static const Sample BC3_ALPHA_COLOR[] = {{0, 63, 15, ~0u}, {64, 63, 0, ~0u}};
+    static const Sample BC5_RED_GREEN[] = {{0, 63, 0, ~0u}, {64, 63, 1, ~0u}};
+    static const Sample BC7_COLOR[] = {{0, 127, 0, ~0u}};
+    static const Sample RGBA8[] = {{0, 7, 0, 255}, {8, 7, 1, 255}, {16, 7, 2, 255},
+                                   {24, 7, 15, 255}};
+
+    // Uncompressed data uses the first samples of RGBA8 (R8 and RG8 are the
+    // only other layouts)
+    uint32_t model = 1, blockDim = 0, bytesPlane = uint32_t(channels);  // KHR_DF_MODEL_RGBSDA
+    const Sample *samples = RGBA8;
+    uint32_t numSamples = uint32_t(channels);
+    switch (glFormat) {
+    case cg::FORMAT_BC1:
+        model = 128, blockDim = 0x0303, bytesPlane = 8;
+        samples = BC_COLOR, numSamples = 1;
+        break;
+    case cg::FORMAT_BC1_ALPHA:
+        model = 128, blockDim = 0x0303, bytesPlane = 8;
+        samples = BC1_ALPHA, numSamples = 1;
+        break;
+    case cg::FORMAT_BC3:
+        model = 130, blockDim = 0x0303, bytesPlane = 16;
+        samples = BC3_ALPHA_COLOR, numSamples = 2;
+        break;
+    case cg::FORMAT_BC4:
+        model = 131, blockDim = 0x0303, bytesPlane = 8;
+        samples = BC_COLOR, numSamples = 1;
+        break;
+    case cg::FORMAT_BC5:
+        model = 132, blockDim = 0x0303, bytesPlane = 16;
+        samples = BC5_RED_GREEN, numSamples = 2;
+        break;
+    case cg::FORMAT_BC7:
+        model = 134, blockDim = 0x0303, bytesPlane = 16;
+        samples = BC7_COLOR, numSamples = 1;
+        break;
+    }
+
+    const uint32_t blockSize = 24 + 16 * numSamples;
+    std::vector<char> dfd(4 + blockSize, 0);
+    write_u32(dfd, 0, uint32_t(dfd.size()));
+    write_u32(dfd, 4, 0);                              // Khronos vendor, basic descriptor
+    write_u32(dfd, 8, 2 | (blockSize << 16));          // Version 2
+    write_u32(dfd, 12, model | (1 << 8) | (1 << 16));  // BT.709 primaries, linear transfer
+    write_u32(dfd, 16, blockDim);
+    write_u32(dfd, 20, bytesPlane);
+    for (uint32_t i = 0; i < numSamples; ++i) {
+        const size_t offset = 28 + 16 * i;
+        write_u32(dfd, offset, samples[i].bitOffset | (samples[i].bitLength << 16) |
+                                   (samples[i].channel << 24));
+        write_u32(dfd, offset + 12, samples[i].upper);
+    }
+    return dfd;
+}
+
+bool encode_ktx2_image(const Image &image, std::vector<char> &bytes)
+{
+    const bool compressed = image.compressedFormat != 0;
+    const bool hasLevels = !image.levels.empty();
+    const KTX2Format *format =
+        find_gl_format(image.compressedFormat, compressed ? 0 : image.channels);
+    const uint32_t numLevels = hasLevels ? uint32_t(image.levels.size()) : 1;
+    if (!format || (compressed && !hasLevels) || (!hasLevels && image.data.empty())) return false;
+
+    const std::vector<char> dfd = create_dfd(image.compressedFormat, image.channels);
+    const size_t dfdOffset = 80 + 24 * size_t(numLevels);
+    const size_t alignment = compressed ? cg::block_size(image.compressedFormat) : 4;
+
+    // Mip levels are stored from the smallest to the largest
+    std::vector<size_t> levelOffsets(numLevels);
+    size_t fileSize = dfdOffset + dfd.size();
+    for (int level = int(numLevels) - 1; level >= 0; --level) {
+        fileSize = (fileSize + alignment - 1) / alignment * alignment;
+        levelOffsets[level] = fileSize;
+        fileSize += hasLevels ? image.levels[level].size() : image.data.size();
+    }
+
+    bytes.assign(fileSize, 0);
+    std::memcpy(&bytes[0], KTX2_IDENTIFIER, 12);
+    write_u32(bytes, 12, format->vkFormat);
+    write_u32(bytes, 16, 1);  // typeSize
+    write_u32(bytes, 20, uint32_t(image.width));
+    write_u32(bytes, 24, uint32_t(image.height));
+    write_u32(bytes, 36, 1);  // faceCount
+    write_u32(bytes, 40, numLevels);
+    write_u32(bytes, 48, uint32_t(dfdOffset));
+    write_u32(bytes, 52, uint32_t(dfd.size()));
+    std::memcpy(&bytes[dfdOffset], &dfd[0], dfd.size());
+    for (uint32_t level = 0; level < numLevels; ++level) {
+        const std::vector<char> &data = hasLevels ? image.levels[level] : image.data;
+        write_u64(bytes, 80 + 24 * level, levelOffsets[level]);
+        write_u64(bytes, 80 + 24 * level + 8, data.size());
+        write_u64(bytes, 80 + 24 * level + 16, data.size());
+        std::memcpy(&bytes[levelOffsets[level]], &data[0], data.size());
+    }
+    return true;
+}
+
+bool save_ktx2_image(const std::string &filename, const Image &image)
+{
+    std::vector<char> bytes;
+    if (!encode_ktx2_image(image, bytes)) return false;
+    std::ofstream file(filename, std::ios::binary);
+    file.write(&bytes[0], bytes.size());
+    return bool(file);
+}
+
+bool encode_ktx2_cubemap(const std::vector<cg::CubemapFaces> &levels, std::vector<char> &bytes)
+{
+    if (levels.empty()) return false;
+    const int glFormat = levels[0].format;
+    const KTX2Format *format = find_gl_format(glFormat, glFormat ? 0 : 4);
+    const uint32_t numLevels = uint32_t(levels.size());
+    if (!format) return false;
+
+    const std::vector<char> dfd = create_dfd(glFormat, 4);
+    const size_t dfdOffset = 80 + 24 * size_t(numLevels);
+    const size_t alignment = glFormat ? cg::block_size(glFormat) : 4;
+
+    // Mip levels are stored from the smallest to the largest, each with its
+    // six faces in the order of the GL cubemap targets
+    std::vector<size_t> levelOffsets(numLevels);
+    size_t fileSize = dfdOffset + dfd.size();
+    for (int level = int(numLevels) - 1; level >= 0; --level) {
+        if (levels[level].format != glFormat) return false;
+        fileSize = (fileSize + alignment - 1) / alignment * alignment;
+        levelOffsets[level] = fileSize;
+        fileSize += 6 * levels[level].faces[0].size();
+    }
+
+    bytes.assign(fileSize, 0);
+    std::memcpy(&bytes[0], KTX2_IDENTIFIER, 12);
+    write_u32(bytes, 12, format->vkFormat);
+    write_u32(bytes, 16, 1);  // typeSize
+    write_u32(bytes, 20, uint32_t(levels[0].size));
+    write_u32(bytes, 24, uint32_t(levels[0].size));
+    write_u32(bytes, 36, 6);  // faceCount
+    write_u32(bytes, 40, numLevels);
+    write_u32(bytes, 48, uint32_t(dfdOffset));
+    write_u32(bytes, 52, uint32_t(dfd.size()));
+    std::memcpy(&bytes[dfdOffset], &dfd[0], dfd.size());
+    for (uint32_t level = 0; level < numLevels; ++level) {
+        const size_t faceSize = levels[level].faces[0].size();
+        write_u64(bytes, 80 + 24 * level, levelOffsets[level]);
+        write_u64(bytes, 80 + 24 * level + 8, 6 * faceSize);
+        write_u64(bytes, 80 + 24 * level + 16, 6 * faceSize);
+        for (int face = 0; face < 6; ++face) {
+            if (levels[level].faces[face].size() != faceSize) return false;
+            std::memcpy(&bytes[levelOffsets[level] + face * faceSize],
+                        &levels[level].faces[face][0], faceSize);
+        }
+    }
+    return true;
+}
+
+bool decode_ktx2_cubemap(const std::vector<char> &bytes, const std::string &filename,
+                         std::vector<cg::CubemapFaces> &levels)
+{
+    if (bytes.size() < 80 || std::memcmp(&bytes[0], KTX2_IDENTIFIER, 12) != 0) {
+        std::cerr << "Error: " << filename << " is not a KTX2 file" << std::endl;
+        return false;
+    }
+    const uint32_t vkFormat = read_u32(bytes, 12);
+    const uint32_t width = read_u32(bytes, 20);
+    const uint32_t height = read_u32(bytes, 24);
+    const uint32_t depth = read_u32(bytes, 28);
+    const uint32_t numLayers = read_u32(bytes, 32);
+    const uint32_t numFaces = read_u32(bytes, 36);
+    const uint32_t numLevels = std::max(1u, read_u32(bytes, 40));
+    const uint32_t supercompression = read_u32(bytes, 44);
+
+    const KTX2Format *format = find_vk_format(vkFormat);
+    if (!format || supercompression != 0 || (!format->glFormat && format->channels != 4)) {
+        std::cerr << "Error: " << filename << " has unsupported format " << vkFormat << std::endl;
+        return false;
+    }
+    if (depth > 0 || numLayers > 1 || numFaces != 6 || width == 0 || width != height ||
+        bytes.size() < 80 + 24 * size_t(numLevels)) {
+        std::cerr << "Error: " << filename << " is not a valid cubemap" << std::endl;
+        return false;
+    }
+
+    levels.assign(numLevels, cg::CubemapFaces());
+    for (uint32_t level = 0; level < numLevels; ++level) {
+        const uint64_t offset = read_u64(bytes, 80 + 24 * level);
+        const uint64_t length = read_u64(bytes, 80 + 24 * level + 8);
+        const int size = std::max(1u, width >> level);
+        const size_t faceSize = format->glFormat
+                                    ? cg::compressed_image_size(format->glFormat, size, size)
+                                    : size_t(size) * size * 4;
+        if (length != 6 * faceSize || offset + length > bytes.size()) {
+            std::cerr << "Error: " << filename << " has a corrupt mip level" << std::endl;
+            levels.clear();
+            return false;
+        }
+
+        levels[level].size = size;
+        levels[level].format = format->glFormat;
+        for (int face = 0; face < 6; ++face) {
+            const char *src = &bytes[offset + face * faceSize];
+            levels[level].faces[face].assign(src, src + faceSize);
+        }
+    }
+    return true;
+}
+
+// How materials use an image (several flags can be set for shared images)
+enum TextureUsage {
+    USAGE_COLOR = 1,
+    USAGE_METALLIC_ROUGHNESS = 2,
+    USAGE_NORMAL = 4,
+    USAGE_OCCLUSION = 8
+};
+
+static void add_usage(const GLTFAsset &asset, int texture, int flag, std::vector<int> &usage)
+{
+    if (texture < 0 || texture >= int(asset.textures.size())) return;
+    const int source = asset.textures[texture].source;
+    if (source >= 0 && source < int(usage.size())) usage[source] |= flag;
+}
+
+// Returns the usage flags of each image
+static std::vector<int> image_usage(const GLTFAsset &asset)
+{
+    std::vector<int> usage(asset.images.size(), 0);
+    for (const auto &material : asset.materials) {
+        const PBRMetallicRoughness &pbr = material.pbrMetallicRoughness;
+        if (pbr.hasBaseColorTexture) {
+            add_usage(asset, pbr.baseColorTexture.index, USAGE_COLOR, usage);
+        }
+        if (pbr.hasMetallicRoughnessTexture) {
+            add_usage(asset, pbr.metallicRoughnessTexture.index, USAGE_METALLIC_ROUGHNESS, usage);
+        }
+        if (material.hasNormalTexture) {
+            add_usage(asset, material.normalTexture.index, USAGE_NORMAL, usage);
+        }
+        if (material.hasOcclusionTexture) {
+            add_usage(asset, material.occlusionTexture.index, USAGE_OCCLUSION, usage);
+        }
+    }
+    return usage;
+}
+
+// Returns the pixels of an uncompressed image, before or after its mip chain
+// has been built
+static const std::vector<char> &base_level(const Image &image)
+{
+    return image.levels.empty() ? image.data : image.levels[0];
+}
+
+// Returns the stored channel (0-3) that a sampled component (0-3) comes
+// from, or -1 if it is a constant
+static int swizzle_source(const Image &image, int component)
+{
+    if (image.swizzle.empty()) return component;
+    const char *channels = "rgba";
+    for (int c = 0; c < 4; ++c) {
+        if (image.swizzle[component] == channels[c]) return c;
+    }
+    return -1;
+}
+
+static bool has_alpha(const Image &image)
+{
+    const int channel = swizzle_source(image, 3);
+    if (channel < 0) return false;
+    const std::vector<char> &pixels = base_level(image);
+    for (size_t i = channel; i < pixels.size(); i += image.channels) {
+        if (uint8_t(pixels[i]) != 255) return true;
+    }
+    return false;
+}
+
+// Pads pixels with fewer than four channels to RGBA8 (missing color channels
+// are zero and missing alpha is opaque), without applying the swizzle, so
+// that encoders see the channels where the GL will store them
+static std::vector<char> expand_to_rgba(const std::vector<char> &pixels, int channels)
+{
+    if (channels == 4) return pixels;
+    const size_t numPixels = pixels.size() / channels;
+    std::vector<char> rgba(numPixels * 4);
+    for (size_t i = 0; i < numPixels; ++i) {
+        for (int c = 0; c < 4; ++c) {
+            rgba[4 * i + c] = c < channels ? pixels[channels * i + c] : char(c == 3 ? 255 : 0);
+        }
+    }
+    return rgba;
+}
+
+// Inverse of expand_to_rgba()
+static void shrink_from_rgba(std::vector<char> &pixels, int channels)
+{
+    if (channels == 4) return;
+    const size_t numPixels = pixels.size() / 4;
+    for (size_t i = 0; i < numPixels; ++i) {
+        for (int c = 0; c < channels; ++c) pixels[channels * i + c] = pixels[4 * i + c];
+    }
+    pixels.resize(numPixels * channels);
+}
+
+static int choose_format(const Image &image, int usage, const TextureCompressionSettings &settings)
+{
+    // Images that were reduced to one or two channels (occlusion, normal and
+    // metallic-roughness maps) fit RGTC, which is core in OpenGL 3.0
+    if (image.channels == 1) return cg::FORMAT_BC4;
+    if (image.channels == 2) return cg::FORMAT_BC5;
+    if (usage == USAGE_NORMAL) return cg::FORMAT_BC5;
+    if (usage == USAGE_OCCLUSION) return cg::FORMAT_BC4;
+    if (settings.hasBPTC) return cg::FORMAT_BC7;
+    if (usage & USAGE_NORMAL) return 0;  // Shared with other data; BC1 would hurt the normals
+    if (settings.hasS3TC) {
+        return (has_alpha(image) && (usage & USAGE_COLOR)) ? cg::FORMAT_BC3 : cg::FORMAT_BC1;
+    }
+    return 0;
+}
+
+// Base color is the only sRGB-encoded data the viewer samples. Normal maps
+// are renormalized only when they still have their Z channel.
+static cg::MipContent mip_content(const Image &image, int usage)
+{
+    if (usage == USAGE_COLOR) return cg::MIP_CONTENT_SRGB;
+    if (usage == USAGE_NORMAL && image.channels == 4) return cg::MIP_CONTENT_NORMAL_MAP;
+    return cg::MIP_CONTENT_LINEAR;
+}
+
+// Moves the pixels of an uncompressed image into a full mip chain
+static void build_mip_chain(Image &image, int usage, cg::MipFilter filter)
+{
+    if (image.compressedFormat || !image.levels.empty() || image.data.empty()) return;
+    const std::vector<char> rgba = expand_to_rgba(image.data, image.channels);
+    cg::generate_mip_chain((const uint8_t *)&rgba[0], image.width, image.height, filter,
+                           mip_content(image, usage), image.levels);
+    for (auto &level : image.levels) shrink_from_rgba(level, image.channels);
+    std::vector<char>().swap(image.data);
+}
+
+// Compresses every level of the mip chain of an image
+static void compress_mip_chain(Image &image, int format)
+{
+    std::vector<std::vector<char> > levels(image.levels.size());
+    for (size_t level = 0; level < levels.size(); ++level) {
+        const std::vector<char> rgba = expand_to_rgba(image.levels[level], image.channels);
+        cg::compress_image(format, (const uint8_t *)&rgba[0], std::max(1, image.width >> level),
+                           std::max(1, image.height >> level), levels[level]);
+    }
+    image.levels.swap(levels);
+    image.compressedFormat = format;
+}
+
+static size_t mip_chain_size(int width, int height, int channels)
+{
+    size_t size = 0;
+    while (true) {
+        size += size_t(width) * height * channels;
+        if (width == 1 && height == 1) break;
+        width = std::max(1, width / 2), height = std::max(1, height / 2);
+    }
+    return size;
+}
+
+// Returns the cache file of an image, named by a hash (FNV-1a) of its pixels
+// and of everything else that affects the encoder output
+static std::string cache_filename(const std::string &cacheDir, const Image &image, int format)
+{
+    const uint32_t header[5] = {ENCODER_VERSION, uint32_t(format), uint32_t(image.width),
+                                uint32_t(image.height), uint32_t(image.channels)};
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < sizeof(header); ++i) {
+        hash = (hash ^ ((const uint8_t *)header)[i]) * 1099511628211ull;
+    }
+    const std::vector<char> &pixels = base_level(image);
+    for (size_t i = 0; i < pixels.size(); ++i) {
+        hash = (hash ^ uint8_t(pixels[i])) * 1099511628211ull;
+    }
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.ktx2", (unsigned long long)hash);
+    return cacheDir + "/" + name;
+}
+
+static bool load_from_cache(const std::string &filename, int format, Image &image)
+{
+    if (!std::ifstream(filename).good()) return false;
+    Image cached;
+    if (!load_ktx2_image(filename, cached)) return false;
+    if (cached.compressedFormat != format || cached.width != image.width ||
+        cached.height != image.height) {
+        return false;
+    }
+    image.levels.swap(cached.levels);
+    image.compressedFormat = format;
+    return true;
+}
+
+static void make_directory(const std::string &path)
+{
+#ifdef _WIN32
+    _mkdir(path.c_str());
+#else
+    mkdir(path.c_str(), 0755);
+#endif
+}
+
+// Returns the sampled value of a component (0-3) of a pixel
+static char sample_component(const Image &image, size_t pixel, int component)
+{
+    const int channel = swizzle_source(image, component);
+    if (channel < 0) return image.swizzle[component] == '1' ? char(255) : char(0);
+    return image.data[pixel * image.channels + channel];
+}
+
+static bool same_sampler(const Texture &a, const Texture &b)
+{
+    return a.hasSampler == b.hasSampler && (!a.hasSampler || a.sampler == b.sampler);
+}
+
+static bool is_plain_image(const Image &image)
+{
+    return !image.compressedFormat && image.levels.empty() && !image.data.empty();
+}
+
+// Moves a separate occlusion map into the unused red channel of the
+// metallic-roughness map of the same material, as in the ORM layout that
+// glTF allows. Returns the number of maps that were packed.
+static int pack_occlusion_maps(GLTFAsset &asset, std::vector<int> &usage)
+{
+    int packed = 0;
+    for (auto &material : asset.materials) {
+        PBRMetallicRoughness &pbr = material.pbrMetallicRoughness;
+        if (!material.hasOcclusionTexture || !pbr.hasMetallicRoughnessTexture) continue;
+        MaterialTexture &occlusion = material.occlusionTexture;
+        const MaterialTexture &mr = pbr.metallicRoughnessTexture;
+        if (occlusion.texCoord != mr.texCoord || occlusion.index == mr.index) continue;
+        const Texture &occlusionTexture = asset.textures[occlusion.index];
+        const Texture &mrTexture = asset.textures[mr.index];
+        const int occlusionSource = occlusionTexture.source, mrSource = mrTexture.source;
+        if (occlusionSource < 0 || mrSource < 0 || occlusionSource == mrSource) continue;
+        if (usage[occlusionSource] != USAGE_OCCLUSION ||
+            usage[mrSource] != USAGE_METALLIC_ROUGHNESS ||
+            !same_sampler(occlusionTexture, mrTexture)) {
+            continue;
+        }
+        const Image &occlusionImage = asset.images[occlusionSource];
+        Image &mrImage = asset.images[mrSource];
+        if (!is_plain_image(occlusionImage) || !is_plain_image(mrImage) ||
+            occlusionImage.width != mrImage.width || occlusionImage.height != mrImage.height) {
+            continue;
+        }
+
+        const size_t numPixels = size_t(mrImage.width) * mrImage.height;
+        std::vector<char> orm(numPixels * 4);
+        for (size_t i = 0; i < numPixels; ++i) {
+            orm[4 * i + 0] = sample_component(occlusionImage, i, 0);
+            orm[4 * i + 1] = sample_component(mrImage, i, 1);
+            orm[4 * i + 2] = sample_component(mrImage, i, 2);
+            orm[4 * i + 3] = char(255);
+        }
+        mrImage.data.swap(orm);
+        mrImage.channels = 4;
+        mrImage.swizzle.clear();
+
+        // Other materials that use the same occlusion map keep the original
+        occlusion.index = mr.index;
+        usage[mrSource] |= USAGE_OCCLUSION;
+        packed += 1;
+    }
+    return packed;
+}
+
+TextureFormatStats choose_texture_formats(GLTFAsset &asset, bool packOcclusion)
+{
+    TextureFormatStats stats;
+    std::vector<int> usage = image_usage(asset);
+    for (const auto &image : asset.images) {
+        if (!is_plain_image(image)) continue;
+        stats.bytesBefore += mip_chain_size(image.width, image.height, 4);
+    }
+
+    if (packOcclusion) {
+        stats.packed = pack_occlusion_maps(asset, usage);
+        usage = image_usage(asset);
+    }
+
+    // Components that shaders read for each kind of usage
+    const int USAGE_COMPONENTS[][2] = {{USAGE_COLOR, 0xf},
+                                       {USAGE_METALLIC_ROUGHNESS, 0x6},  // Green and blue
+                                       {USAGE_NORMAL, 0x3},              // Z is reconstructed
+                                       {USAGE_OCCLUSION, 0x1}};
+    for (size_t i = 0; i < asset.images.size(); ++i) {
+        Image &image = asset.images[i];
+        // There are no one- or two-channel sRGB formats in core OpenGL, so
+        // base color stays RGBA
+        if (usage[i] == USAGE_COLOR) image.srgb = true;
+        if (!is_plain_image(image)) continue;
+        if (!usage[i]) {
+            // No longer used by any material (an occlusion map that was packed)
+            std::vector<char>().swap(image.data);
+            continue;
+        }
+
+        int needed = 0;
+        for (const auto &components : USAGE_COMPONENTS) {
+            if (usage[i] & components[0]) needed |= components[1];
+        }
+        const int numPixels = image.width * image.height;
+        if (usage[i] == USAGE_COLOR) {
+            if (image.channels == 4 && image.swizzle.empty()) continue;
+            std::vector<char> rgba(size_t(numPixels) * 4);
+            for (int p = 0; p < numPixels; ++p) {
+                for (int c = 0; c < 4; ++c) rgba[4 * size_t(p) + c] = sample_component(image, p, c);
+            }
+            image.data.swap(rgba);
+            image.channels = 4;
+            image.swizzle.clear();
+            stats.images += 1;
+            continue;
+        }
+
+        // Keep only the stored channels that needed components come from
+        std::vector<int> sources;
+        for (int c = 0; c < 4; ++c) {
+            const int source = swizzle_source(image, c);
+            if ((needed & (1 << c)) && source >= 0 &&
+                std::find(sources.begin(), sources.end(), source) == sources.end()) {
+                sources.push_back(source);
+            }
+        }
+        if (sources.empty() || sources.size() > 2 || int(sources.size()) >= image.channels) {
+            continue;
+        }
+
+        std::string swizzle = "0001";
+        for (int c = 0; c < 4; ++c) {
+            if (!(needed & (1 << c))) continue;
+            const int source = swizzle_source(image, c);
+            const size_t k = std::find(sources.begin(), sources.end(), source) - sources.begin();
+            swizzle[c] = source < 0 ? image.swizzle[c] : "rgba"[k];
+        }
+        const int channels = int(sources.size());
+        std::vector<char> reduced(size_t(numPixels) * channels);
+        for (int p = 0; p < numPixels; ++p) {
+            for (int k = 0; k < channels; ++k) {
+                const size_t pixel = size_t(p);
+                reduced[pixel * channels + k] = image.data[pixel * image.channels + sources[k]];
+            }
+        }
+        image.data.swap(reduced);
+        image.channels = channels;
+        image.swizzle = swizzle;
+        stats.images += 1;
+    }
+
+    for (const auto &image : asset.images) {
+        if (is_plain_image(image)) {
+            stats.bytesAfter += mip_chain_size(image.width, image.height, image.channels);
+        }
+    }
+    return stats;
+}
+
+MipmapStats generate_mipmaps(GLTFAsset &asset, cg::MipFilter filter)
+{
+    MipmapStats stats;
+    const auto start = std::chrono::steady_clock::now();
+
+    const std::vector<int> usage = image_usage(asset);
+    std::vector<int> jobs;
+    for (size_t i = 0; i < asset.images.size(); ++i) {
+        const Image &image = asset.images[i];
+        if (!image.compressedFormat && image.levels.empty() && !image.data.empty()) {
+            jobs.push_back(int(i));
+        }
+    }
+    cg::parallel_for(int(jobs.size()), [&](int job) {
+        build_mip_chain(asset.images[jobs[job]], usage[jobs[job]], filter);
+    });
+
+    stats.images = int(jobs.size());
+    stats.seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+TextureCompressionStats compress_textures(GLTFAsset &asset,
+                                          const TextureCompressionSettings &settings)
+{
+    TextureCompressionStats stats;
+    if (!settings.enabled) return stats;
+    const auto start = std::chrono::steady_clock::now();
+
+    const std::vector<int> usage = image_usage(asset);
+    if (!settings.cacheDir.empty()) make_directory(settings.cacheDir);
+
+    for (size_t i = 0; i < asset.images.size(); ++i) {
+        Image &image = asset.images[i];
+        if (!usage[i] || image.compressedFormat || base_level(image).empty()) continue;
+        const int format = choose_format(image, usage[i], settings);
+        if (!format) continue;
+
+        std::string filename;
+        if (!settings.cacheDir.empty()) filename = cache_filename(settings.cacheDir, image, format);
+        const bool hit = !filename.empty() && load_from_cache(filename, format, image);
+        if (!filename.empty()) cg::count_cache_lookup(hit);
+        if (hit) {
+            stats.cacheHits += 1;
+        } else {
+            build_mip_chain(image, usage[i], cg::MIP_FILTER_KAISER);
+            compress_mip_chain(image, format);
+            if (!filename.empty() && !save_ktx2_image(filename, image)) {
+                std::cerr << "Warning: could not write " << filename << std::endl;
+            }
+        }
+
+        stats.images += 1;
+        stats.bytesBefore += mip_chain_size(image.width, image.height, image.channels);
+        for (const auto &level : image.levels) stats.bytesAfter += level.size();
+        std::vector<char>().swap(image.data);  // The uncompressed copy is no longer needed
+    }
+
+    stats.seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+// Returns the cache file of a cubemap, named by a hash (FNV-1a) of its faces
+// like the images in cache_filename()
+static std::string cubemap_cache_filename(const std::string &cacheDir,
+                                          const std::vector<cg::CubemapFaces> &levels, int format)
+{
+    const uint32_t header[4] = {ENCODER_VERSION, uint32_t(format), uint32_t(levels[0].size),
+                                uint32_t(levels.size())};
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < sizeof(header); ++i) {
+        hash = (hash ^ ((const uint8_t *)header)[i]) * 1099511628211ull;
+    }
+    for (const auto &level : levels) {
+        for (const auto &face : level.faces) {
+            for (char c : face) hash = (hash ^ uint8_t(c)) * 1099511628211ull;
+        }
+    }
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.ktx2", (unsigned long long)hash);
+    return cacheDir + "/" + name;
+}
+
+static bool load_cubemap_from_cache(const std::string &filename, int format,
+                                    std::vector<cg::CubemapFaces> &levels)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) return false;
+    std::vector<char> bytes((std::istreambuf_iterator<char>(file)),
+                            std::istreambuf_iterator<char>());
+    std::vector<cg::CubemapFaces> cached;
+    if (!decode_ktx2_cubemap(bytes, filename, cached)) return false;
+    if (cached.size() != levels.size() || cached[0].size != levels[0].size ||
+        cached[0].format != format) {
+        return false;
+    }
+    levels.swap(cached);
+    return true;
+}
+
+static bool save_cubemap_to_cache(const std::string &filename,
+                                  const std::vector<cg::CubemapFaces> &levels)
+{
+    std::vector<char> bytes;
+    if (!encode_ktx2_cubemap(levels, bytes)) return false;
+    std::ofstream file(filename, std::ios::binary);
+    file.write(&bytes[0], bytes.size());
+    return bool(file);
+}
+
+bool compress_environment(std::vector<cg::CubemapFaces> &levels,
+                          const TextureCompressionSettings &settings)
+{
+    // Environments are opaque sRGB color, so they get the format of opaque
+    // base color
+    int format = 0;
+    if (settings.hasBPTC) {
+        format = cg::FORMAT_BC7;
+    } else if (settings.hasS3TC) {
+        format = cg::FORMAT_BC1;
+    }
+    if (!settings.enabled || !format || levels.empty() || levels[0].format) return false;
+
+    std::string filename;
+    if (!settings.cacheDir.empty()) {
+        make_directory(settings.cacheDir);
+        filename = cubemap_cache_filename(settings.cacheDir, levels, format);
+    }
+    const bool hit = !filename.empty() && load_cubemap_from_cache(filename, format, levels);
+    if (!filename.empty()) cg::count_cache_lookup(hit);
+    if (!hit) {
+        cg::compress_cubemap(levels, format);
+        if (!filename.empty() && !save_cubemap_to_cache(filename, levels)) {
+            std::cerr << "Warning: could not write " << filename << std::endl;
+        }
+    }
+    return true;
+}
+
+int embed_ktx2_images(GLTFAsset &asset)
+{
+    std::vector<std::vector<char> > files(asset.images.size());
+    cg::parallel_for(int(asset.images.size()), [&](int i) {
+        if (!encode_ktx2_image(asset.images[i], files[i])) files[i].clear();
+    });
+
+    int embedded = 0;
+    for (size_t i = 0; i < asset.images.size(); ++i) {
+        if (files[i].empty()) continue;
+        Image &image = asset.images[i];
+        image.bufferView = append_buffer_view(asset, files[i].data(), int(files[i].size()));
+        image.uri.clear();
+        image.mimeType = "image/ktx2";
+        embedded += 1;
+    }
+    return embedded;
+}
+
+}  // namespace gltf
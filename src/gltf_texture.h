@@ -0,0 +1,109 @@
+// Texture compression and KTX2 images for glTF assets.
+//
+
+#pragma once
+
+#include "gltf_scene.h"
+#include "cg_mipmap.h"
+#include "cg_prefilter.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace gltf {
+
+struct TextureCompressionSettings {
+    bool enabled = true;
+    bool hasS3TC = false;  // BC1 and BC3 can be uploaded
+    bool hasBPTC = false;  // BC7 can be uploaded
+    std::string cacheDir;  // Directory for compressed images (empty = no disk cache)
+};
+
+struct MipmapStats {
+    int images = 0;
+    double seconds = 0.0;
+};
+
+struct TextureCompressionStats {
+    int images = 0;          // Number of images that were compressed or read from cache
+    int cacheHits = 0;
+    size_t bytesBefore = 0;  // Size of the images as RGBA8 with full mip chains
+    size_t bytesAfter = 0;
+    double seconds = 0.0;
+};
+
+struct TextureFormatStats {
+    int images = 0;          // Number of images whose channels changed
+    int packed = 0;          // Number of occlusion maps packed into metallic-roughness maps
+    size_t bytesBefore = 0;  // Size of the images as RGBA8 with full mip chains
+    size_t bytesAfter = 0;
+};
+
+// Returns true if an image refers to a KTX2 file (by MIME type or extension)
+bool is_ktx2_image(const Image &image);
+
+// Loads an image from a KTX2 file, which can contain 8-bit RGBA, RG, or R
+// data, or BC1, BC3, BC4, BC5 or BC7 blocks. Supercompressed files (Basis
+// Universal or Zstandard) are rejected, since we do not have a transcoder.
+bool load_ktx2_image(const std::string &filename, Image &image);
+
+// Same as load_ktx2_image(), for a file already in memory. The filename is
+// only used in error messages.
+bool decode_ktx2_image(const std::vector<char> &bytes, const std::string &filename, Image &image);
+
+// Writes the mip levels of an image (or the RGBA8 data of an image without
+// levels) to a KTX2 file
+bool save_ktx2_image(const std::string &filename, const Image &image);
+
+// Same as save_ktx2_image(), but to memory
+bool encode_ktx2_image(const Image &image, std::vector<char> &bytes);
+
+// Writes the levels of a cubemap (RGBA8 or compressed) as a KTX2 cubemap
+bool encode_ktx2_cubemap(const std::vector<cg::CubemapFaces> &levels, std::vector<char> &bytes);
+
+// Reads a KTX2 cubemap of RGBA8 or block-compressed faces. The filename is
+// only used in error messages.
+bool decode_ktx2_cubemap(const std::vector<char> &bytes, const std::string &filename,
+                         std::vector<cg::CubemapFaces> &levels);
+
+// Stores every image that has pixel data as a KTX2 file in a new buffer view
+// of the asset (so that a GLB file can hold it), and drops its URI. Images
+// keep their channels, mip levels and compression, so an asset that went
+// through compress_textures() is written ready to upload. Returns the number
+// of images embedded.
+int embed_ktx2_images(GLTFAsset &asset);
+
+// Reduces the channels of each image to those that materials read from it:
+// R8 for occlusion maps, RG8 for normal maps (Z is reconstructed) and for the
+// green and blue of metallic-roughness maps, and sRGB RGBA8 for base color.
+// Image::swizzle makes the shaders see the components where they expect
+// them. With packOcclusion, separate occlusion maps with the same texture
+// coordinates as the metallic-roughness map of their material are packed
+// into its red channel. This takes more memory uncompressed (RGBA8 instead
+// of R8 and RG8) but less once compressed (one BC1 or BC7 image instead of
+// BC4 and BC5), so it should be used with texture compression.
+TextureFormatStats choose_texture_formats(GLTFAsset &asset, bool packOcclusion);
+
+// Builds the mip chains of all uncompressed images on the CPU, one image per
+// worker thread, and moves them to Image::levels. Base color is filtered in
+// linear space (it is sRGB-encoded) and normal maps are renormalized, and
+// textures then upload every level instead of calling glGenerateMipmap.
+MipmapStats generate_mipmaps(GLTFAsset &asset, cg::MipFilter filter);
+
+// Compresses the images of an asset to BCn formats chosen from how materials
+// use them: BC4 and BC5 for images with one or two channels (see
+// choose_texture_formats), BC5 for normal maps, BC4 for occlusion maps and
+// BC7, BC1 or BC3 for the rest. All levels of the mip chains (built as in generate_mipmaps
+// if needed) are compressed. Results are kept in the cache directory (as
+// KTX2 files) so that later loads of the same image skip the encoder.
+TextureCompressionStats compress_textures(GLTFAsset &asset,
+                                          const TextureCompressionSettings &settings);
+
+// Compresses the RGBA8 levels of an environment cubemap to BC7, or to BC1
+// without BPTC, through the same KTX2 cache as compress_textures(). Returns
+// false (and leaves the levels as they are) if neither format can be used.
+bool compress_environment(std::vector<cg::CubemapFaces> &levels,
+                          const TextureCompressionSettings &settings);
+
+}  // namespace gltf
@@ -0,0 +1,142 @@
+// Uploads a loaded asset to new GL objects in slices, a limited number of
+// bytes per frame, so that the scene that is already shown keeps rendering at
+// full frame rate while a large asset is uploaded.
+//
+
+#include "gltf_upload.h"
+#include "cg_utils.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace gltf {
+
+void begin_scene_upload(SceneUpload &upload, const GLTFAsset &asset,
+                        const ResidencySettings &settings)
+{
+    cancel_scene_upload(upload);
+    if (!asset.buffers.empty()) {
+        const size_t size = asset.buffers[0].data.size();
+        glGenBuffers(1, &upload.buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, upload.buffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_STATIC_DRAW);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        cg::track_gpu_object(cg::MEMORY_BUFFERS, cg::GPU_BUFFER, upload.buffer, size,
+                             "vertex and index buffer");
+        upload.totalBytes += size;
+    }
+
+    upload.residency.settings = settings;
+    begin_streamed_textures(upload.residency, upload.textures, asset);
+    for (int i = 0; i < int(upload.textures.size()); ++i) {
+        const StreamedTexture &streamed = upload.residency.textures[i];
+        if (streamed.numLevels == 0) continue;
+        const Image &image = asset.images[asset.textures[i].source];
+        for (int level = streamed.tailLevel; level < streamed.numLevels; ++level) {
+            upload.totalBytes += image.levels[level].size();
+        }
+    }
+}
+
+// Uploads slices of the vertex and index buffer. Returns false if the ring is
+// full.
+static bool upload_buffer_slices(SceneUpload &upload, cg::StagingRing &ring,
+                                 const GLTFAsset &asset, size_t budgetBytes, size_t &bytes)
+{
+    if (!upload.buffer) return true;
+    const std::vector<char> &data = asset.buffers[0].data;
+    const size_t sliceBytes = std::max(ring.size / 4, size_t(1));
+    while (upload.bufferOffset < data.size() && bytes < budgetBytes) {
+        const size_t size = std::min(sliceBytes, data.size() - upload.bufferOffset);
+        size_t offset;
+        if (!cg::stage_data(ring, &data[upload.bufferOffset], size, offset)) return false;
+        glBindBuffer(GL_COPY_READ_BUFFER, ring.buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, upload.buffer);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, offset,
+                            upload.bufferOffset, size);
+        upload.bufferOffset += size;
+        bytes += size;
+    }
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    return true;
+}
+
+// Uploads slices of rows of the resident tails of the textures, one level
+// after the other. Returns false if the ring is full.
+static bool upload_texture_slices(SceneUpload &upload, cg::StagingRing &ring,
+                                  const GLTFAsset &asset, size_t budgetBytes, size_t &bytes)
+{
+    const size_t sliceBytes = std::max(ring.size / 4, size_t(1));
+    bool staged = true;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring.buffer);
+    while (upload.texture < int(upload.textures.size()) && bytes < budgetBytes) {
+        const StreamedTexture &streamed = upload.residency.textures[upload.texture];
+        if (upload.level < 0) upload.level = streamed.tailLevel, upload.row = 0;
+        if (upload.level >= streamed.numLevels) {
+            // Done, or not streamed and uploaded when it was created
+            finish_streamed_texture(upload.residency, upload.textures, asset, upload.texture);
+            upload.texture += 1;
+            upload.level = -1;
+            continue;
+        }
+
+        const Image &image = asset.images[asset.textures[upload.texture].source];
+        const std::vector<char> &data = image.levels[upload.level];
+        const int numRows = texture_level_rows(image, upload.level);
+        const size_t rowBytes = texture_row_bytes(image, upload.level);
+        const int sliceRows = int(sliceBytes / std::max(rowBytes, size_t(1)));
+        const int rows = std::max(1, std::min(numRows - upload.row, sliceRows));
+        size_t offset;
+        if (!cg::stage_data(ring, &data[upload.row * rowBytes], rows * rowBytes, offset)) {
+            staged = false;
+            break;
+        }
+        glBindTexture(GL_TEXTURE_2D, upload.textures[upload.texture]);
+        if (upload.row == 0) allocate_texture_level(image, upload.level);
+        upload_texture_rows(image, upload.level, upload.row, rows, (const char *)(intptr_t)offset);
+        upload.row += rows;
+        bytes += rows * rowBytes;
+        if (upload.row == numRows) upload.level += 1, upload.row = 0;
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return staged;
+}
+
+bool continue_scene_upload(SceneUpload &upload, cg::StagingRing &ring, const GLTFAsset &asset,
+                           size_t budgetBytes)
+{
+    if (upload.done) return true;
+    upload.frames += 1;
+    size_t bytes = 0;
+    const bool staged = upload_buffer_slices(upload, ring, asset, budgetBytes, bytes) &&
+                        upload_texture_slices(upload, ring, asset, budgetBytes, bytes);
+    cg::fence_staged_data(ring);
+    upload.uploadedBytes += bytes;
+    if (!staged || upload.texture < int(upload.textures.size())) return false;
+    if (upload.buffer && upload.bufferOffset < asset.buffers[0].data.size()) return false;
+
+    if (!asset.meshes.empty() && upload.buffer) {
+        create_drawables_with_buffer(upload.drawables, asset, upload.buffer);
+    } else if (upload.buffer) {
+        cg::untrack_gpu_object(cg::GPU_BUFFER, upload.buffer);
+        glDeleteBuffers(1, &upload.buffer);
+    }
+    upload.buffer = 0;
+    upload.done = true;
+    return true;
+}
+
+void cancel_scene_upload(SceneUpload &upload)
+{
+    if (upload.drawables.empty() && upload.buffer) {
+        cg::untrack_gpu_object(cg::GPU_BUFFER, upload.buffer);
+        glDeleteBuffers(1, &upload.buffer);
+    }
+    destroy_drawables(upload.drawables);
+    destroy_textures(upload.textures);
+    upload = SceneUpload();
+}
+
+}  // namespace gltf
@@ -0,0 +1,47 @@
+// Uploads a loaded asset to new GL objects in slices, a limited number of
+// bytes per frame, so that the scene that is already shown keeps rendering at
+// full frame rate while a large asset is uploaded.
+//
+// Nothing is handed over before everything has been uploaded, so the new
+// drawables and textures can replace the old ones in a single frame.
+//
+
+#pragma once
+
+#include "gltf_residency.h"
+#include "cg_staging.h"
+
+#include <cstddef>
+
+namespace gltf {
+
+struct SceneUpload {
+    DrawableList drawables;  // Created when the upload is complete
+    TextureList textures;
+    TextureResidency residency;
+    GLuint buffer = 0;        // Vertex and index buffer of the drawables
+    size_t bufferOffset = 0;  // Bytes of the buffer uploaded so far
+    int texture = 0;          // Texture being uploaded
+    int level = -1;           // Its level being uploaded (-1 if not started)
+    int row = 0;              // First row of the level not uploaded yet
+    size_t totalBytes = 0;
+    size_t uploadedBytes = 0;
+    int frames = 0;  // Calls of continue_scene_upload()
+    bool done = false;
+};
+
+// Creates the GL objects for an asset without uploading its data. The asset
+// must stay unchanged (and at the same address) until the upload is done.
+void begin_scene_upload(SceneUpload &upload, const GLTFAsset &asset,
+                        const ResidencySettings &settings);
+
+// Uploads up to budgetBytes more of the asset through the staging ring (less
+// if the ring is full), and returns true once everything has been uploaded.
+// Call once per frame.
+bool continue_scene_upload(SceneUpload &upload, cg::StagingRing &ring, const GLTFAsset &asset,
+                           size_t budgetBytes);
+
+// Deletes the GL objects of an upload that will not be used
+void cancel_scene_upload(SceneUpload &upload);
+
+}  // namespace gltf
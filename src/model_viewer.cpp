@@ -3,10 +3,29 @@
 // Modify this and other source files according to the tasks in the instructions.
 //
 
+#include "gltf_animation.h"
 #include "gltf_io.h"
 #include "gltf_scene.h"
 #include "gltf_render.h"
+#include "gltf_mesh.h"
+#include "gltf_bvh.h"
+#include "gltf_cache.h"
+#include "gltf_culling.h"
+#include "gltf_texture.h"
+#include "gltf_residency.h"
+#include "gltf_diff.h"
+#include "gltf_lights.h"
+#include "gltf_shadows.h"
+#include "gltf_upload.h"
 #include "cg_utils.h"
+#include "cg_filewatch.h"
+#include "cg_loadstats.h"
+#include "cg_memory.h"
+#include "cg_parallel.h"
+#include "cg_prefilter.h"
+#include "cg_profiler.h"
+#include "cg_resolution.h"
+#include "cg_staging.h"
 #include "cg_trackball.h"
 
 #include <GL/gl3w.h>
@@ -19,11 +38,21 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <cmath>
+#include <future>
+#include <memory>
+#include <set>
 
 #include <array>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
 
 
 constexpr uint32_t CUBEMAP_MAX_DIRS = 5;
@@ -33,13 +62,45 @@ constexpr uint32_t CUBEMAP_PREFILTERED_MAX_NUMBER = 8;
 // Struct for representing a shadow casting point light
 struct ShadowCastingLight {
     glm::vec3 position;      // Light source position
-    glm::mat4 shadowMatrix;  // Camera matrix for shadowmap
-    GLuint shadowmap;        // Depth texture
+    GLuint shadowmap;        // Depth texture (the shadow atlas of the spot lights)
     GLuint shadowFBO;        // Depth framebuffer
+    GLuint shadowCube;       // Depth cube map (distance to the light)
+    GLuint shadowCubeFBO;    // Depth framebuffer of the cube (all faces or one)
+    float shadowFar;         // Distance covered by the cube (farthest caster)
     float shadowBias;        // Bias for depth comparison
 };
 
 
+// Cost of the cube shadow map, measured in one pass or in six passes
+struct CubeShadowStats {
+    bool measured = false;
+    int drawCalls = 0;
+    double ms = 0.0;  // GPU time
+};
+
+// Cost of the main pass, measured with the depth prepass off or on
+struct PrepassStats {
+    bool measured = false;
+    uint64_t fragments = 0;  // Shaded by the main pass
+    double prepassMs = 0.0;  // GPU time
+    double sceneMs = 0.0;
+};
+
+
+// An asset loaded (or reloaded) on a worker thread, with the CPU data that is
+// built from it, ready to be uploaded
+struct LoadedScene {
+    bool ok = false;
+    std::string filename;
+    gltf::GLTFAsset asset;
+    std::vector<gltf::CullingMesh> cullingMeshes;
+    gltf::SceneBVH bvh;
+    // Set if only these images were loaded again, in which case the asset
+    // holds no other data (the meshes did not change)
+    std::vector<int> reloadedImages;
+};
+
+
 // Struct for our application context
 struct Context {
     int width = 1920;
@@ -53,6 +114,7 @@ struct Context {
     GLuint texture;
     float elapsedTime;
     std::string gltfFilename = "lpshead.gltf";
+    float weldEpsilon = 1e-5f;  // Grid spacing for vertex welding (0 = exact matches only)
     glm::vec3 backgroundColor = glm::vec3(1.0f, 0.5f, 0.9f);
     // Add more variables here...
 
@@ -81,73 +143,322 @@ struct Context {
     // std::vector<string> textureIDs = {}; std::vector([])
     uint32_t activeCubemapLevel = 0;
     uint32_t cubemapTextureDir = 0;
-    std::array<std::array<GLuint, CUBEMAP_PREFILTERED_MAX_NUMBER>, CUBEMAP_MAX_DIRS> cubemapTextures = {0};
+    std::array<GLuint, CUBEMAP_MAX_DIRS> cubemapTextures = {{0}};  // Loaded when first selected
+    bool cpuPrefilter = false;  // Prefilter the base faces instead of loading prefiltered/
+    cg::PrefilterSettings prefilterSettings;
+    std::vector<double> prefilterSeconds;  // Benchmark result per thread count (1, 2, 4, ...)
+    std::future<std::vector<double> > prefilterBenchmark;  // Runs on a worker thread
     const char *cubemapDirs[CUBEMAP_MAX_DIRS] = {"debug", "Forrest", "LarnacaCastle", "reference", "RomeChurch"};
     const char *roughnessLevels[CUBEMAP_PREFILTERED_MAX_NUMBER] = {"2048", "512", "128", "32", "8", "2", "0.5", "0.125"};
     gltf::TextureList textures;
+    gltf::TextureCompressionSettings textureCompression;
+    gltf::TextureResidency residency;
 
     // Shadow mapping attributes
     ShadowCastingLight light;
     GLuint shadowProgram;
     bool enableShadowmap = true;
 
+    // Shadow atlas shared by the main light and the spot lights of the asset.
+    // Tiles are sized by importance on screen, and the scheduler only renders
+    // those that changed, within a triangle budget per frame.
+    gltf::ShadowSettings shadowSettings;
+    gltf::ShadowAtlas shadowAtlas;
+    std::vector<gltf::ShadowUpdate> shadowUpdates;  // Tiles to render this frame
+
+    // Cube shadow map of the main light. In a single pass, a geometry shader
+    // sends each triangle to the faces it reaches (layered rendering), while
+    // six passes draw the casters of each face on their own, for comparison.
+    GLuint shadowCubeProgram;  // With the geometry shader
+    GLuint shadowFaceProgram;  // One face per pass
+    GLuint shadowDebugProgram;  // Draws the faces for the depth visualization
+    bool singlePassCube = true;
+    int cubeShadowSize = 1024;
+    std::vector<gltf::CubeShadowCaster> cubeCasters;  // Culled against the faces
+    int cubeDrawCalls = 0;
+    int cubeFaceDraws = 0;  // Draw calls that six passes need
+    CubeShadowStats cubeStats[2];  // Six passes and single pass
+    uint64_t cubeModeChangedFrame = 0;
+
+    // Picking (right mouse button)
+    gltf::SceneBVH bvh;
+    gltf::PickResult pick;
+    bool hasPick = false;
+    double pickRaysPerSecond = 0.0;     // Benchmark result using one thread
+    double pickRaysPerSecondMT = 0.0;   // ...and using all threads
+
+    // Frustum and occlusion culling
+    std::vector<gltf::CullingMesh> cullingMeshes;
+    gltf::OcclusionBuffer occlusionBuffer;
+    gltf::CullingSettings cullingSettings;
+    gltf::CullingStats cullingStats;
+    std::vector<char> nodeVisible;
+    bool showOcclusionBuffer = false;
+    GLuint occlusionDebugTexture = 0;
+    gltf::DrawList drawList;  // Rebuilt every frame after culling
+
+    // Clustered lighting with the KHR_lights_punctual lights of the asset and
+    // generated test lights, binned on the CPU every frame
+    bool clusteredLights = true;
+    gltf::ClusterSettings clusterSettings;
+    gltf::LightClusters lightClusters;
+    gltf::LightBuffers lightBuffers;
+    std::vector<gltf::PunctualLight> sceneLights;  // Rebuilt every frame
+    std::vector<gltf::PunctualLight> testLights;
+    int numTestLights = 256;
+    std::vector<gltf::DirectionalLight> directionalLights;  // Not clustered, rebuilt every frame
+
+    // Depth prepass. The visible nodes are first drawn depth-only with the
+    // shadow program, so that the main pass (which tests for equal depth and
+    // does not write it) runs mesh.frag only once per pixel.
+    bool depthPrepass = false;
+    cg::GpuCounter fragmentCounter;  // Around the main pass
+    PrepassStats prepassStats[2];    // Without and with the prepass
+    uint64_t prepassChangedFrame = 0;
+
+    // Dynamic resolution. The scene is rendered into sceneTarget at a scale
+    // of the window size that follows the GPU frame time, and upscaled to the
+    // window before ImGui draws on top at native resolution.
+    cg::ResolutionSettings resolutionSettings;
+    cg::DynamicResolution resolution;
+    cg::RenderTarget sceneTarget;
+    int renderWidth = 1920;  // Of this frame
+    int renderHeight = 1080;
+
+    // Animation playback. A clip of the asset is sampled every frame into
+    // the nodes, and the joint matrices of skinned nodes (which mesh.vert and
+    // the shadow shaders blend by the vertex weights) are uploaded after.
+    gltf::AnimationSet animations;
+    int animationClip = 0;
+    bool playAnimation = true;
+    float animationSpeed = 1.0f;
+    float animationTime = 0.0f;  // In seconds, within the clip
+    gltf::AnimationCursor animationCursor;
+    std::vector<glm::vec4> animationValues;  // Sampled this frame, one per channel
+    std::vector<glm::mat4> jointMatrices;
+    std::vector<int> jointOffsets;  // Per node, into jointMatrices (-1 if not skinned)
+    gltf::JointBuffer jointBuffer;
+
+    // Frame profiler
+    cg::Profiler profiler;
+    std::vector<cg::ProfileAverage> profileAverages;
+    std::string profileExportStatus;
+
+    // Memory accounting
+    cg::MemoryBudget memoryBudget;
+    std::string memoryWarning;  // From the last budget check
+    bool dropCpuCopies = false;  // Free buffers and images once they are uploaded
+    bool cpuCopiesDropped = false;
+    std::string memoryExportStatus;
+
+    // Hot reloading of the asset and shaders when their files change
+    cg::FileWatcher fileWatcher;
+    bool hotReload = true;
+    std::vector<std::string> changedFiles;  // Not yet reloaded
+    std::future<LoadedScene> reload;        // Runs on a worker thread
+    double reloadStart = 0.0;
+    std::string reloadStatus;
+
+    // Background loading. The asset is loaded (and reloaded) on a worker
+    // thread, uploaded a slice per frame through the staging ring while the
+    // current scene is drawn, and swapped in once all of it is on the GPU.
+    cg::StagingRing stagingRing;
+    size_t uploadBytesPerFrame = size_t(16) << 20;
+    std::unique_ptr<LoadedScene> pendingScene;  // Being uploaded
+    gltf::SceneUpload sceneUpload;
+    std::unique_ptr<cg::LoadReport> startupReport;  // Until the first scene is swapped in
+
+    // Switching between the assets in gltf_dir(). Scenes that are switched
+    // away from stay loaded and uploaded until the cache needs the space.
+    gltf::SceneCache sceneCache;
+    std::vector<std::string> assetFiles;  // Listed when the browser is first shown
+    bool assetFilesListed = false;
 };
 
-// Update the shadowmap and shadow matrix for a light source
-void update_shadowmap(Context &ctx, ShadowCastingLight &light, GLuint shadowFBO)
+// Binds the joint matrices to a program, on a texture unit of their own
+void bind_joint_matrices(const Context &ctx, GLuint program)
+{
+    glActiveTexture(GL_TEXTURE9);
+    glBindTexture(GL_TEXTURE_BUFFER, ctx.jointBuffer.texture);
+    glUniform1i(glGetUniformLocation(program, "u_jointMatrices"), 9);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+// Returns where the joint matrices of a node start, or -1 if the drawable
+// of the node is not skinned
+int joint_offset(const Context &ctx, int node, const gltf::Drawable &drawable)
+{
+    if (!drawable.hasJoints || node >= int(ctx.jointOffsets.size())) return -1;
+    return ctx.jointOffsets[node];
+}
+
+// Draws the depth of nodes from a light camera into the bound framebuffer
+void draw_shadow_casters(Context &ctx, const glm::mat4 &viewProj, const std::vector<int> &nodes,
+                         const std::vector<glm::mat4> &worldMatrices)
+{
+    const glm::mat4 identity(1.0f);
+    glUniformMatrix4fv(glGetUniformLocation(ctx.shadowProgram, "u_view"), 1, GL_FALSE,
+                       &identity[0][0]);
+    glUniformMatrix4fv(glGetUniformLocation(ctx.shadowProgram, "u_proj"), 1, GL_FALSE,
+                       &viewProj[0][0]);
+    const GLint modelLocation = glGetUniformLocation(ctx.shadowProgram, "u_model");
+    const GLint jointLocation = glGetUniformLocation(ctx.shadowProgram, "u_jointOffset");
+    bind_joint_matrices(ctx, ctx.shadowProgram);
+    for (int i : nodes) {
+        const gltf::Node &node = ctx.asset.nodes[i];
+        if (node.mesh < 0) continue;
+        const gltf::Drawable &drawable = ctx.drawables[node.mesh];
+        glUniformMatrix4fv(modelLocation, 1, GL_FALSE, &worldMatrices[i][0][0]);
+        glUniform1i(jointLocation, joint_offset(ctx, i, drawable));
+
+        // Draw object
+        glBindVertexArray(drawable.vao);
+        glDrawElements(GL_TRIANGLES, drawable.indexCount, drawable.indexType,
+                       (GLvoid *)(intptr_t)drawable.indexByteOffset);
+    }
+    glBindVertexArray(0);
+}
+
+// Binds the offscreen target of the scene, with the viewport of this frame's
+// resolution
+void bind_scene_target(Context &ctx)
 {
-    // Set up rendering to shadowmap framebuffer
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, shadowFBO);
-    if (shadowFBO) glViewport(0, 0, 2048, 2048);  // TODO Set viewport to shadowmap size
-    glClear(GL_DEPTH_BUFFER_BIT);               // Clear depth values to 1.0
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx.sceneTarget.framebuffer);
+    glViewport(0, 0, ctx.renderWidth, ctx.renderHeight);
+}
+
+// Renders the tiles of the shadow atlas that the scheduler picked this frame
+// (see update_shadow_atlas())
+void update_shadowmap(Context &ctx)
+{
+    std::vector<glm::mat4> worldMatrices;
+    gltf::compute_world_matrices(ctx.asset, worldMatrices);
 
     // Set up pipeline
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, ctx.light.shadowFBO);
     glUseProgram(ctx.shadowProgram);
     glEnable(GL_DEPTH_TEST);  // Enable Z-buffering
 
-    // TODO Define view and projection matrices for the shadowmap camera. The
-    // view matrix should be a lookAt-matrix computed from the light source
-    // position, and the projection matrix should be a frustum that covers the
-    // parts of the scene that shall recieve shadows.
-    glm::mat4 shadowView = glm::lookAt(ctx.lightPosition, glm::vec3(0.0f), glm::vec3(0,0,1));
-    glm::mat4 shadowProj = glm::perspective(glm::radians(45.f), 1.0f, 1.0f, 90.0f);
-    glUniformMatrix4fv(glGetUniformLocation(ctx.shadowProgram, "u_view"), 1, GL_FALSE, &shadowView[0][0]);
-    glUniformMatrix4fv(glGetUniformLocation(ctx.shadowProgram, "u_proj"), 1, GL_FALSE, &shadowProj[0][0]);
-
-    // Store updated shadow matrix for use in draw_scene()
-    light.shadowMatrix = shadowProj * shadowView;
+    // Each tile is cleared and drawn on its own, so that the others keep
+    // their depth
+    glEnable(GL_SCISSOR_TEST);
+    for (const gltf::ShadowUpdate &update : ctx.shadowUpdates) {
+        const gltf::ShadowTile &tile = ctx.shadowAtlas.tiles[update.tile];
+        glViewport(tile.offset.x, tile.offset.y, tile.size, tile.size);
+        glScissor(tile.offset.x, tile.offset.y, tile.size, tile.size);
+        glClear(GL_DEPTH_BUFFER_BIT);  // Clear depth values to 1.0
+        draw_shadow_casters(ctx, tile.viewProj, update.casters, worldMatrices);
+    }
+    glDisable(GL_SCISSOR_TEST);
 
-    // Draw scene
-    for (unsigned i = 0; i < ctx.asset.nodes.size(); ++i) {
-        const gltf::Node &node = ctx.asset.nodes[i];
-        const gltf::Drawable &drawable = ctx.drawables[node.mesh];
+    // Clean up
+    cg::reset_gl_render_state();
+    glUseProgram(0);
+    bind_scene_target(ctx);
+}
 
-        // TODO Define the model matrix for the drawable - Done?
-        glm::mat4 model = glm::mat4(1.0f);
-        model = glm::scale(model, glm::vec3(node.scale));
-        model = glm::translate(model, node.translation);
-        model = glm::rotate(model, node.rotationX, glm::vec3(1,0,0));
-        model = glm::rotate(model, node.rotationY, glm::vec3(0,1,0));
-        model = glm::rotate(model, node.rotationZ, glm::vec3(0,0,1));
+// Draws the faces of the cube shadow map of the main light over the scene,
+// unfolded into a cross, with the distance to the light as gray levels
+void draw_cube_shadow_debug(Context &ctx)
+{
+    bind_scene_target(ctx);
+    glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(0, 0, ctx.renderWidth, ctx.renderHeight);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glDisable(GL_SCISSOR_TEST);
+
+    glDisable(GL_DEPTH_TEST);
+    glUseProgram(ctx.shadowDebugProgram);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, ctx.light.shadowCube);
+    glUniform1i(glGetUniformLocation(ctx.shadowDebugProgram, "u_shadowCube"), 0);
+    glUniform2f(glGetUniformLocation(ctx.shadowDebugProgram, "u_viewportSize"),
+                float(ctx.renderWidth), float(ctx.renderHeight));
+    glBindVertexArray(ctx.emptyVAO);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    cg::reset_gl_render_state();
+    glUseProgram(0);
+}
 
-        glUniformMatrix4fv(glGetUniformLocation(ctx.shadowProgram, "u_model"), 1, GL_FALSE, &model[0][0]);
+// Renders the cube shadow map of the main light, either in a single pass (a
+// geometry shader sends each triangle to the faces it reaches) or in six
+// passes, one per face. Both only draw the casters that reach a face.
+void update_cube_shadowmap(Context &ctx)
+{
+    // The cube covers the scene up to its farthest caster
+    const glm::vec3 position = ctx.lightPosition;
+    const std::vector<gltf::ShadowCaster> &casters = ctx.shadowAtlas.casters;
+    float farthest = 0.0f;
+    for (const gltf::ShadowCaster &caster : casters) {
+        const glm::vec3 corner = glm::max(glm::abs(caster.bounds.min - position),
+                                          glm::abs(caster.bounds.max - position));
+        farthest = std::max(farthest, glm::length(corner));
+    }
+    ctx.light.shadowFar = std::max(farthest, 1e-3f);
+    const float nearDepth = 0.001f * ctx.light.shadowFar;
+    ctx.cubeFaceDraws = gltf::cull_cube_shadow_casters(casters, position, nearDepth,
+                                                       ctx.light.shadowFar, ctx.cubeCasters);
+    glm::mat4 faces[6];
+    for (int face = 0; face < 6; ++face) {
+        faces[face] = gltf::cube_face_view_proj(position, face, nearDepth, ctx.light.shadowFar);
+    }
 
-        // Draw object
+    std::vector<glm::mat4> worldMatrices;
+    gltf::compute_world_matrices(ctx.asset, worldMatrices);
+    const GLuint program = ctx.singlePassCube ? ctx.shadowCubeProgram : ctx.shadowFaceProgram;
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, ctx.light.shadowCubeFBO);
+    glViewport(0, 0, ctx.cubeShadowSize, ctx.cubeShadowSize);
+    glUseProgram(program);
+    glEnable(GL_DEPTH_TEST);
+    glUniform3fv(glGetUniformLocation(program, "u_lightPosition"), 1, &position[0]);
+    glUniform1f(glGetUniformLocation(program, "u_far"), ctx.light.shadowFar);
+    const GLint modelLocation = glGetUniformLocation(program, "u_model");
+    const GLint maskLocation = glGetUniformLocation(program, "u_faceMask");
+    const GLint viewProjLocation = glGetUniformLocation(program, "u_viewProj");
+    const GLint jointLocation = glGetUniformLocation(program, "u_jointOffset");
+    bind_joint_matrices(ctx, program);
+    ctx.cubeDrawCalls = 0;
+    auto draw = [&](const gltf::CubeShadowCaster &caster) {
+        const gltf::Drawable &drawable = ctx.drawables[ctx.asset.nodes[caster.node].mesh];
+        glUniformMatrix4fv(modelLocation, 1, GL_FALSE, &worldMatrices[caster.node][0][0]);
+        glUniform1i(jointLocation, joint_offset(ctx, caster.node, drawable));
         glBindVertexArray(drawable.vao);
         glDrawElements(GL_TRIANGLES, drawable.indexCount, drawable.indexType,
                        (GLvoid *)(intptr_t)drawable.indexByteOffset);
-        glBindVertexArray(0);
+        ctx.cubeDrawCalls += 1;
+    };
+
+    if (ctx.singlePassCube) {
+        // All six faces are attached as layers
+        glFramebufferTexture(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, ctx.light.shadowCube, 0);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        glUniformMatrix4fv(glGetUniformLocation(program, "u_faceViewProj"), 6, GL_FALSE,
+                           &faces[0][0][0]);
+        for (const gltf::CubeShadowCaster &caster : ctx.cubeCasters) {
+            glUniform1i(maskLocation, caster.faces);
+            draw(caster);
+        }
+    } else {
+        for (int face = 0; face < 6; ++face) {
+            glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                                   GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, ctx.light.shadowCube, 0);
+            glClear(GL_DEPTH_BUFFER_BIT);
+            glUniformMatrix4fv(viewProjLocation, 1, GL_FALSE, &faces[face][0][0]);
+            for (const gltf::CubeShadowCaster &caster : ctx.cubeCasters) {
+                if (caster.faces & (1 << face)) draw(caster);
+            }
+        }
     }
+    glBindVertexArray(0);
 
     // Clean up
     cg::reset_gl_render_state();
     glUseProgram(0);
-    glViewport(0, 0, ctx.width, ctx.height);
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    bind_scene_target(ctx);
 }
 
-
-
 // Returns the absolute path to the cubemap directory
 std::string cubemap_dir()
 {
@@ -181,34 +492,714 @@ std::string gltf_dir(void)
     return rootDir + "/assets/gltf/";
 }
 
-void store_cubemaps(Context &ctx) {
-    for (uint32_t i = 0; i < CUBEMAP_MAX_DIRS; i++) {
-        for (uint32_t j = 0; j < CUBEMAP_PREFILTERED_MAX_NUMBER; j++) {
-            std::cout << "Loading cubemap: " << cubemap_dir() + ctx.cubemapDirs[i] + "/prefiltered/" + ctx.roughnessLevels[j] + "/" << std::endl;
-            ctx.cubemapTextures[i][j] = cg::load_cubemap(cubemap_dir() + ctx.cubemapDirs[i] + "/prefiltered/" + ctx.roughnessLevels[j] + "/");
+// Returns the absolute path to the directory for cached (compressed) textures
+std::string cache_dir(void)
+{
+    std::string rootDir = cg::get_env_var("MODEL_VIEWER_ROOT");
+    if (rootDir.empty()) {
+        std::cout << "Error: MODEL_VIEWER_ROOT is not set." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    return rootDir + "/cache";
+}
+
+// Returns the absolute path to the directory for exported profiler traces,
+// creating it if needed
+std::string trace_dir(void)
+{
+    std::string rootDir = cg::get_env_var("MODEL_VIEWER_ROOT");
+    if (rootDir.empty()) {
+        std::cout << "Error: MODEL_VIEWER_ROOT is not set." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    const std::string dirname = rootDir + "/traces";
+#ifdef _WIN32
+    _mkdir(dirname.c_str());
+#else
+    mkdir(dirname.c_str(), 0755);
+#endif
+    return dirname;
+}
+
+// Returns the cubemap of the selected environment, loading it on first use.
+// Each environment is a single cubemap whose mip levels are the prefiltered
+// roughness levels (instead of one cubemap per roughness level), so only
+// the environments that are actually viewed take up memory. The levels are
+// compressed like base color when the GL can sample BC7 or BC1.
+GLuint environment_cubemap(Context &ctx)
+{
+    GLuint &texture = ctx.cubemapTextures[ctx.cubemapTextureDir];
+    if (!texture) {
+        double start = glfwGetTime();
+        std::string dirname = cubemap_dir() + ctx.cubemapDirs[ctx.cubemapTextureDir];
+        std::vector<cg::CubemapFaces> levels;
+        if (!ctx.cpuPrefilter ||
+            !cg::load_prefiltered_levels(dirname, cache_dir(), ctx.prefilterSettings, levels)) {
+            cg::load_cubemap_prefiltered(dirname + "/prefiltered/", levels);
         }
+        gltf::compress_environment(levels, ctx.textureCompression);
+        texture = cg::create_cubemap(levels);
+        cg::track_texture(cg::MEMORY_CUBEMAPS, GL_TEXTURE_CUBE_MAP, texture,
+                          ctx.cubemapDirs[ctx.cubemapTextureDir]);
+        std::cout << "Loaded cubemap " << ctx.cubemapDirs[ctx.cubemapTextureDir] << " in "
+                  << 1000.0 * (glfwGetTime() - start) << " ms ("
+                  << cg::gpu_object_bytes(cg::GPU_TEXTURE, texture) / 1024 << " KiB)"
+                  << std::endl;
     }
+    return texture;
+}
+
+glm::mat4 camera_view(const Context &ctx)
+{
+    glm::mat4 view = glm::mat4(ctx.trackball.orient);
+    return view * glm::lookAt(glm::vec3(2.0f, 0.0f, 0.0f), glm::vec3(0.0f), glm::vec3(0,0,1));
+}
+
+glm::mat4 camera_projection(const Context &ctx)
+{
+    float aspect = (float)ctx.width / (float)ctx.height;
+    return ctx.showOrtho
+        ? glm::ortho(-1.0f * aspect, 1.0f * aspect, -1.0f, 1.0f, -10.0f, 10.0f) // Orthographic
+        : glm::perspective(glm::radians(65.0f*ctx.zoom_factor), aspect, 0.1f, 40.0f); // Perspective
+}
+
+std::vector<glm::mat4> node_world_matrices(const Context &ctx)
+{
+    std::vector<glm::mat4> matrices;
+    gltf::compute_world_matrices(ctx.asset, matrices);
+    return matrices;
+}
+
+// Casts a ray through a window position (in pixels) and stores the closest
+// hit in the context
+void pick_at_cursor(Context &ctx, double x, double y)
+{
+    // Node transforms can be edited at any time, so the top-level BVH is
+    // rebuilt before each pick (this only touches one box per node)
+    gltf::build_instance_bvh(ctx.bvh, ctx.asset, node_world_matrices(ctx));
+
+    glm::mat4 view = camera_view(ctx);
+    glm::mat4 projection = camera_projection(ctx);
+    glm::vec4 viewport(0.0f, 0.0f, ctx.width, ctx.height);
+    glm::vec3 windowPos(float(x), float(ctx.height - y), 0.0f);
+    glm::vec3 nearPos = glm::unProject(windowPos, view, projection, viewport);
+    windowPos.z = 1.0f;
+    glm::vec3 farPos = glm::unProject(windowPos, view, projection, viewport);
+
+    ctx.hasPick = gltf::pick(ctx.bvh, nearPos, glm::normalize(farPos - nearPos), ctx.pick);
+}
+
+// Settings for processing an asset after it has been loaded. Reloads get a
+// copy, since they run on a worker thread.
+struct AssetSettings {
+    float weldEpsilon;
+    gltf::TextureCompressionSettings textureCompression;
+};
+
+AssetSettings asset_settings(const Context &ctx)
+{
+    AssetSettings settings;
+    settings.weldEpsilon = ctx.weldEpsilon;
+    settings.textureCompression = ctx.textureCompression;
+    return settings;
+}
+
+// Picks formats for the images that have not been processed yet, and builds
+// their mip chains and compresses them
+void process_images(gltf::GLTFAsset &asset, const AssetSettings &settings)
+{
+    // Occlusion maps are packed with metallic-roughness only when the result
+    // gets compressed, since it is larger than the two maps uncompressed
+    const gltf::TextureCompressionSettings &compressionSettings = settings.textureCompression;
+    const bool packOcclusion = compressionSettings.enabled &&
+                               (compressionSettings.hasS3TC || compressionSettings.hasBPTC);
+    gltf::TextureFormatStats formats;
+    {
+        cg::LoadScope scope(cg::LOAD_TEXTURE_COMPRESSION, "choose_texture_formats");
+        formats = gltf::choose_texture_formats(asset, packOcclusion);
+        scope.bytes = formats.bytesBefore;
+    }
+    if (formats.bytesBefore) {
+        std::cout << "Texture formats: " << formats.images << " image(s) changed, "
+                  << formats.packed << " occlusion map(s) packed, "
+                  << formats.bytesBefore / 1024 << " -> " << formats.bytesAfter / 1024
+                  << " KiB (" << (formats.bytesBefore - formats.bytesAfter) / 1024
+                  << " KiB saved)" << std::endl;
+    }
+
+    gltf::MipmapStats mipmaps;
+    {
+        cg::LoadScope scope(cg::LOAD_MIP_GENERATION, "generate_mipmaps");
+        mipmaps = gltf::generate_mipmaps(asset, cg::MIP_FILTER_KAISER);
+        for (const auto &image : asset.images) {
+            for (size_t i = 1; i < image.levels.size(); ++i) scope.bytes += image.levels[i].size();
+        }
+    }
+    if (mipmaps.images) {
+        std::cout << "Built mipmaps for " << mipmaps.images << " image(s) on "
+                  << cg::num_worker_threads() << " thread(s) in " << 1000.0 * mipmaps.seconds
+                  << " ms" << std::endl;
+    }
+
+    gltf::TextureCompressionStats compression;
+    {
+        cg::LoadScope scope(cg::LOAD_TEXTURE_COMPRESSION, "compress_textures");
+        compression = gltf::compress_textures(asset, compressionSettings);
+        scope.bytes = compression.bytesBefore;
+    }
+    if (compression.images) {
+        std::cout << "Compressed " << compression.images << " texture(s) ("
+                  << compression.cacheHits << " from cache): " << compression.bytesBefore / 1024
+                  << " -> " << compression.bytesAfter / 1024 << " KiB in "
+                  << 1000.0 * compression.seconds << " ms" << std::endl;
+    }
+}
+
+// Prepares a loaded asset for rendering: welds vertices and processes images
+void process_asset(gltf::GLTFAsset &asset, const AssetSettings &settings)
+{
+    double weldStart = glfwGetTime();
+    gltf::WeldStats weld;
+    {
+        cg::LoadScope scope(cg::LOAD_MESH_PROCESSING, "weld_vertices");
+        weld = gltf::weld_vertices(asset, settings.weldEpsilon);
+    }
+    if (weld.verticesBefore) {
+        std::cout << "Welded " << weld.primitives << " primitive(s): " << weld.verticesBefore
+                  << " -> " << weld.verticesAfter << " vertices ("
+                  << 100.0 * (1.0 - double(weld.verticesAfter) / weld.verticesBefore)
+                  << "% fewer) in " << 1000.0 * (glfwGetTime() - weldStart) << " ms"
+                  << std::endl;
+    }
+
+    process_images(asset, settings);
+}
+
+// Frees the CPU copies of the asset that have been uploaded to the GPU
+void drop_cpu_copies(Context &ctx)
+{
+    const gltf::ReleaseStats stats = gltf::release_cpu_copies(ctx.asset, ctx.residency);
+    ctx.cpuCopiesDropped = true;
+    std::cout << "Dropped CPU copies: " << stats.bufferBytes / 1024 << " KiB of buffers, "
+              << stats.imageBytes / 1024 << " KiB of images (" << stats.imagesKept
+              << " streamed image(s) kept)" << std::endl;
+}
+
+// Loads and processes a whole asset (runs on a worker thread)
+LoadedScene load_scene(const std::string &filename, const std::string &filedir,
+                       const AssetSettings &settings)
+{
+    LoadedScene scene;
+    scene.filename = filename;
+    scene.ok = gltf::load_gltf_asset(filename, filedir, scene.asset);
+    if (!scene.ok) return scene;
+    process_asset(scene.asset, settings);
+    {
+        cg::LoadScope scope(cg::LOAD_MESH_PROCESSING, "create_culling_meshes");
+        gltf::create_culling_meshes(scene.cullingMeshes, scene.asset);
+    }
+    {
+        cg::LoadScope scope(cg::LOAD_MESH_PROCESSING, "build_bvh");
+        gltf::build_mesh_bvhs(scene.bvh, scene.asset);
+    }
+    return scene;
 }
 
 void do_initialization(Context &ctx)
 {
+    // Time each loading stage for the startup report, and record them as
+    // profiler events (of frame 0) for the startup trace. The report ends
+    // when the asset has been swapped in.
+    ctx.startupReport.reset(new cg::LoadReport());
+    cg::begin_load_report(*ctx.startupReport, &ctx.profiler);
+
+    // Base color and the environments are uploaded as sRGB, so S3TC also
+    // needs the sRGB variants of its formats (from EXT_texture_sRGB)
+    ctx.textureCompression.hasS3TC = cg::has_gl_extension("GL_EXT_texture_compression_s3tc") &&
+                                     cg::has_gl_extension("GL_EXT_texture_sRGB");
+    ctx.textureCompression.hasBPTC =
+        gl3wIsSupported(4, 2) || cg::has_gl_extension("GL_ARB_texture_compression_bptc");
+    ctx.textureCompression.cacheDir = cache_dir();
+
     ctx.program = cg::load_shader_program(shader_dir() + "mesh.vert", shader_dir() + "mesh.frag");
-    store_cubemaps(ctx);
+    {
+        cg::ProfileScope scope(ctx.profiler, "environment_cubemap");
+        environment_cubemap(ctx);
+    }
 
     
     ctx.shadowProgram =
         cg::load_shader_program(shader_dir() + "shadow.vert", shader_dir() + "shadow.frag");
 
-    ctx.light.shadowmap = cg::create_depth_texture(2048, 2048);
+    gltf::init_shadow_atlas(ctx.shadowAtlas, ctx.shadowSettings);
+    ctx.light.shadowmap = cg::create_depth_texture(ctx.shadowAtlas.size, ctx.shadowAtlas.size);
     ctx.light.shadowFBO = cg::create_depth_framebuffer(ctx.light.shadowmap);
+    cg::track_texture(cg::MEMORY_SHADOW_MAPS, GL_TEXTURE_2D, ctx.light.shadowmap, "shadow atlas");
+    // The framebuffer has no storage of its own (its attachment is counted above)
+    cg::track_gpu_object(cg::MEMORY_FRAMEBUFFERS, cg::GPU_FRAMEBUFFER, ctx.light.shadowFBO, 0,
+                         "shadow atlas framebuffer");
     ctx.light.position = ctx.lightPosition;
     ctx.light.shadowBias = 0.01f;
-    ctx.light.shadowMatrix = glm::mat4(1.0f);
+
+    ctx.shadowCubeProgram = cg::load_shader_program(shader_dir() + "shadow_cube.vert",
+                                                    shader_dir() + "shadow_cube.geom",
+                                                    shader_dir() + "shadow_cube.frag");
+    ctx.shadowFaceProgram = cg::load_shader_program(shader_dir() + "shadow_cube.vert",
+                                                    shader_dir() + "shadow_cube.frag");
+    ctx.shadowDebugProgram = cg::load_shader_program(shader_dir() + "shadow_debug.vert",
+                                                     shader_dir() + "shadow_debug.frag");
+    ctx.light.shadowCube = cg::create_depth_cubemap(ctx.cubeShadowSize);
+    ctx.light.shadowCubeFBO = cg::create_depth_framebuffer(ctx.light.shadowCube);
+    cg::track_texture(cg::MEMORY_SHADOW_MAPS, GL_TEXTURE_CUBE_MAP, ctx.light.shadowCube,
+                      "shadow cube map");
+    cg::track_gpu_object(cg::MEMORY_FRAMEBUFFERS, cg::GPU_FRAMEBUFFER, ctx.light.shadowCubeFBO, 0,
+                         "shadow cube map framebuffer");
+    ctx.light.shadowFar = 1.0f;
     
 
-    gltf::load_gltf_asset(ctx.gltfFilename, gltf_dir(), ctx.asset);
-    gltf::create_drawables_from_gltf_asset(ctx.drawables, ctx.asset);
-    gltf::create_textures_from_gltf_asset(ctx.textures, ctx.asset);
+    gltf::init_occlusion_buffer(ctx.occlusionBuffer, 256, 128);
+    GLint maxTexels = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+    ctx.clusterSettings.maxIndices = std::max(maxTexels, 65536);
+
+    // The asset is loaded and processed on a worker thread while the window
+    // keeps rendering, and uploaded by update_scene_upload(). The ring holds
+    // a few frames of uploads, so that it rarely has to wait for the GPU.
+    cg::init_staging_ring(ctx.stagingRing, 4 * ctx.uploadBytesPerFrame);
+    ctx.reloadStart = glfwGetTime();
+    ctx.reloadStatus = "Loading " + ctx.gltfFilename + "...";
+    ctx.reload = std::async(std::launch::async, load_scene, ctx.gltfFilename, gltf_dir(),
+                            asset_settings(ctx));
+}
+
+// Ends the startup report once the first asset has been swapped in (or has
+// failed to load), and writes it out
+void finish_startup_report(Context &ctx, bool loaded)
+{
+    if (!ctx.startupReport) return;
+    cg::LoadReport &report = *ctx.startupReport;
+    cg::end_load_report(report);
+    if (loaded) {
+        cg::print_load_report(report, ctx.gltfFilename);
+        const std::string dirname = trace_dir();
+        if (!cg::write_load_report_json(report, ctx.gltfFilename,
+                                        dirname + "/startup_report.json") ||
+            !cg::append_load_history(report, ctx.gltfFilename,
+                                     dirname + "/startup_history.csv") ||
+            !cg::write_chrome_trace(ctx.profiler, dirname + "/startup_trace.json")) {
+            std::cerr << "Warning: could not write the startup report to " << dirname
+                      << std::endl;
+        }
+    }
+    ctx.startupReport.reset();
+}
+
+// Returns the name of a file without its directory
+std::string base_name(const std::string &filename)
+{
+    const size_t slash = filename.find_last_of("/\\");
+    return slash == std::string::npos ? filename : filename.substr(slash + 1);
+}
+
+// Reloads the shader programs that use a changed file (all of them if the
+// filename is empty). A program that fails to compile keeps its old version.
+void reload_shaders(Context &ctx, const std::string &filename)
+{
+    const struct {
+        GLuint *program;
+        const char *vertexShader;
+        const char *geometryShader;  // Null if none
+        const char *fragmentShader;
+    } programs[] = {{&ctx.program, "mesh.vert", nullptr, "mesh.frag"},
+                    {&ctx.shadowProgram, "shadow.vert", nullptr, "shadow.frag"},
+                    {&ctx.shadowCubeProgram, "shadow_cube.vert", "shadow_cube.geom",
+                     "shadow_cube.frag"},
+                    {&ctx.shadowFaceProgram, "shadow_cube.vert", nullptr, "shadow_cube.frag"},
+                    {&ctx.shadowDebugProgram, "shadow_debug.vert", nullptr, "shadow_debug.frag"}};
+    const std::string name = base_name(filename);
+    for (const auto &it : programs) {
+        if (!name.empty() && name != it.vertexShader && name != it.fragmentShader &&
+            (!it.geometryShader || name != it.geometryShader)) {
+            continue;
+        }
+        GLuint program =
+            it.geometryShader
+                ? cg::load_shader_program(shader_dir() + it.vertexShader,
+                                          shader_dir() + it.geometryShader,
+                                          shader_dir() + it.fragmentShader)
+                : cg::load_shader_program(shader_dir() + it.vertexShader,
+                                          shader_dir() + it.fragmentShader);
+        if (!program) {
+            std::cerr << "Warning: keeping the old " << it.vertexShader << "/"
+                      << it.fragmentShader << " program" << std::endl;
+            continue;
+        }
+        glDeleteProgram(*it.program);
+        *it.program = program;
+    }
+}
+
+// The shaders that reload_shaders() loads
+const char *const SHADER_FILES[] = {"mesh.vert",        "mesh.frag",        "shadow.vert",
+                                    "shadow.frag",      "shadow_cube.vert", "shadow_cube.geom",
+                                    "shadow_cube.frag", "shadow_debug.vert", "shadow_debug.frag"};
+
+bool is_shader_file(const std::string &filename)
+{
+    const std::string name = base_name(filename);
+    for (const char *shader : SHADER_FILES) {
+        if (name == shader) return true;
+    }
+    return false;
+}
+
+// Watches the files of the asset (the glTF file, its buffers and images) and
+// the shaders
+void watch_scene_files(Context &ctx)
+{
+    cg::unwatch_files(ctx.fileWatcher);
+    cg::watch_file(ctx.fileWatcher, gltf_dir() + ctx.gltfFilename);
+    for (const auto &buffer : ctx.asset.buffers) {
+        if (!buffer.uri.empty()) cg::watch_file(ctx.fileWatcher, gltf_dir() + buffer.uri);
+    }
+    for (const auto &image : ctx.asset.images) {
+        if (image.bufferView < 0 && !image.uri.empty()) {
+            cg::watch_file(ctx.fileWatcher, gltf_dir() + image.uri);
+        }
+    }
+    for (const char *name : SHADER_FILES) cg::watch_file(ctx.fileWatcher, shader_dir() + name);
+}
+
+// Finds the images that changed files belong to. Returns false unless every
+// file is an image that can be loaded again on its own, i.e., one that a
+// material samples directly. Images packed with another one at load time
+// (occlusion and metallic-roughness) need the whole asset.
+bool find_changed_images(const gltf::GLTFAsset &asset, const std::string &filedir,
+                         const std::vector<std::string> &files, std::vector<int> &images)
+{
+    std::set<int> sampled, packed;
+    auto add = [&](const gltf::MaterialTexture &texture, std::set<int> &sources) {
+        if (texture.index < 0 || texture.index >= int(asset.textures.size())) return;
+        if (asset.textures[texture.index].source >= 0) {
+            sources.insert(asset.textures[texture.index].source);
+        }
+    };
+    for (const auto &material : asset.materials) {
+        const gltf::PBRMetallicRoughness &pbr = material.pbrMetallicRoughness;
+        if (pbr.hasBaseColorTexture) add(pbr.baseColorTexture, sampled);
+        if (pbr.hasMetallicRoughnessTexture) add(pbr.metallicRoughnessTexture, sampled);
+        if (material.hasNormalTexture) add(material.normalTexture, sampled);
+        if (material.hasOcclusionTexture) add(material.occlusionTexture, sampled);
+        if (material.hasOcclusionTexture && pbr.hasMetallicRoughnessTexture &&
+            material.occlusionTexture.index == pbr.metallicRoughnessTexture.index) {
+            add(pbr.metallicRoughnessTexture, packed);
+        }
+    }
+
+    images.clear();
+    for (const std::string &filename : files) {
+        int found = -1;
+        for (int i = 0; i < int(asset.images.size()); ++i) {
+            const gltf::Image &image = asset.images[i];
+            if (image.bufferView < 0 && filename == filedir + image.uri) found = i;
+        }
+        if (found < 0 || !sampled.count(found) || packed.count(found)) return false;
+        images.push_back(found);
+    }
+    return true;
+}
+
+// Loads and processes some of the images of an asset again (runs on a worker
+// thread). The asset needs the materials, textures and samplers, and images
+// without pixels (which processing skips) for the rest.
+LoadedScene reload_scene_images(gltf::GLTFAsset asset, const std::vector<int> &images,
+                                const std::string &filedir, const AssetSettings &settings)
+{
+    LoadedScene scene;
+    scene.ok = true;
+    for (int image : images) scene.ok = gltf::reload_image(filedir, asset, image) && scene.ok;
+    process_images(asset, settings);
+    scene.asset = std::move(asset);
+    scene.reloadedImages = images;
+    return scene;
+}
+
+// Starts reloading the asset on a worker thread, only the changed images if
+// possible
+void start_reload(Context &ctx)
+{
+    std::vector<int> images;
+    const bool imagesOnly = find_changed_images(ctx.asset, gltf_dir(), ctx.changedFiles, images);
+    for (const auto &filename : ctx.changedFiles) std::cout << "Changed: " << filename << std::endl;
+    ctx.changedFiles.clear();
+    ctx.reloadStart = glfwGetTime();
+    if (!imagesOnly) {
+        ctx.reload = std::async(std::launch::async, load_scene, ctx.gltfFilename, gltf_dir(),
+                                asset_settings(ctx));
+        return;
+    }
+
+    gltf::GLTFAsset asset;
+    asset.materials = ctx.asset.materials;
+    asset.textures = ctx.asset.textures;
+    asset.samplers = ctx.asset.samplers;
+    asset.images.resize(ctx.asset.images.size());
+    for (size_t i = 0; i < asset.images.size(); ++i) {
+        const gltf::Image &image = ctx.asset.images[i];
+        gltf::Image &copy = asset.images[i];
+        copy.uri = image.uri;
+        copy.mimeType = image.mimeType;
+        copy.bufferView = image.bufferView;
+        copy.width = image.width;
+        copy.height = image.height;
+        copy.channels = image.channels;
+        copy.srgb = image.srgb;
+        copy.swizzle = image.swizzle;
+        copy.compressedFormat = image.compressedFormat;
+    }
+    ctx.reload = std::async(std::launch::async, reload_scene_images, std::move(asset), images,
+                            gltf_dir(), asset_settings(ctx));
+}
+
+// Decodes the animations of the current scene (before the CPU copies of its
+// buffers can be dropped), and starts the clip over
+void animations_replaced(Context &ctx)
+{
+    gltf::build_animation_set(ctx.asset, ctx.animations);
+    ctx.animationCursor = gltf::AnimationCursor();
+    ctx.animationTime = 0.0f;
+    ctx.jointOffsets.clear();
+    if (ctx.animationClip >= int(ctx.animations.clips.size())) ctx.animationClip = 0;
+}
+
+// Updates what depends on the current scene after it has been replaced
+void scene_replaced(Context &ctx)
+{
+    animations_replaced(ctx);
+    gltf::build_instance_bvh(ctx.bvh, ctx.asset, node_world_matrices(ctx));
+    ctx.nodeVisible.clear();
+    ctx.hasPick = false;
+    ctx.prepassStats[0] = ctx.prepassStats[1] = PrepassStats();
+    ctx.prepassChangedFrame = ctx.profiler.frame;
+    ctx.cubeStats[0] = ctx.cubeStats[1] = CubeShadowStats();
+    ctx.cubeModeChangedFrame = ctx.profiler.frame;
+    ctx.shadowAtlas.previousMatrices.clear();  // Render every tile again
+
+    gltf::track_asset_memory(ctx.asset);
+    if (ctx.cpuCopiesDropped) {
+        gltf::release_cpu_copies(ctx.asset, ctx.residency);
+    } else if (ctx.dropCpuCopies) {
+        drop_cpu_copies(ctx);
+    }
+    watch_scene_files(ctx);
+}
+
+// Moves the current scene (its CPU data and GL objects) into the cache,
+// leaving the context without a scene
+void cache_current_scene(Context &ctx)
+{
+    if (ctx.drawables.empty() && ctx.textures.empty()) return;
+    gltf::untrack_asset_memory(ctx.asset);
+    gltf::CachedScene scene;
+    scene.filename = ctx.gltfFilename;
+    scene.asset = std::move(ctx.asset);
+    scene.drawables.swap(ctx.drawables);
+    scene.textures.swap(ctx.textures);
+    scene.residency = std::move(ctx.residency);
+    scene.cullingMeshes.swap(ctx.cullingMeshes);
+    scene.bvh = std::move(ctx.bvh);
+    ctx.asset = gltf::GLTFAsset();
+    ctx.residency = gltf::TextureResidency();
+    ctx.residency.settings = scene.residency.settings;
+    gltf::cache_scene(ctx.sceneCache, scene);
+}
+
+// Swaps in a scene whose upload has completed, replacing the drawables,
+// textures and asset all at once. The old scene is deleted if this was a
+// reload, and cached if it was another asset.
+void swap_in_uploaded_scene(Context &ctx)
+{
+    LoadedScene &scene = *ctx.pendingScene;
+    gltf::SceneUpload &upload = ctx.sceneUpload;
+    const bool reloaded = !ctx.startupReport && scene.filename == ctx.gltfFilename;
+    if (!reloaded) {
+        cache_current_scene(ctx);
+        ctx.changedFiles.clear();  // Of the asset switched away from
+    }
+    gltf::destroy_drawables(ctx.drawables);
+    gltf::destroy_textures(ctx.textures);
+    ctx.drawables.swap(upload.drawables);
+    ctx.textures.swap(upload.textures);
+    upload.residency.settings = ctx.residency.settings;  // Could have been edited meanwhile
+    ctx.residency = std::move(upload.residency);
+
+    ctx.gltfFilename = scene.filename;
+    ctx.asset = std::move(scene.asset);
+    ctx.cullingMeshes.swap(scene.cullingMeshes);
+    ctx.bvh = std::move(scene.bvh);
+    scene_replaced(ctx);
+
+    char status[256];
+    std::snprintf(status, sizeof(status),
+                  "%s %s in %.0f ms (%.1f MiB uploaded over %d frame(s))",
+                  reloaded ? "Reloaded" : "Loaded", ctx.gltfFilename.c_str(),
+                  1000.0 * (glfwGetTime() - ctx.reloadStart), upload.uploadedBytes / 1048576.0,
+                  upload.frames);
+    ctx.reloadStatus = status;
+    std::cout << status << std::endl;
+    finish_startup_report(ctx, true);
+
+    ctx.pendingScene.reset();
+    ctx.sceneUpload = gltf::SceneUpload();
+}
+
+// Continues uploading a loaded scene, and swaps it in once it is complete.
+// Returns true while the upload is still in progress.
+bool update_scene_upload(Context &ctx)
+{
+    if (!ctx.pendingScene) return false;
+    gltf::SceneUpload &upload = ctx.sceneUpload;
+    const size_t uploadedBefore = upload.uploadedBytes;
+    bool done;
+    {
+        cg::LoadScope scope(cg::LOAD_GL_UPLOAD, "upload_scene");
+        done = gltf::continue_scene_upload(upload, ctx.stagingRing, ctx.pendingScene->asset,
+                                           ctx.uploadBytesPerFrame);
+        scope.bytes = upload.uploadedBytes - uploadedBefore;
+    }
+    if (!done) return true;
+    swap_in_uploaded_scene(ctx);
+    return false;
+}
+
+// Applies a loaded or reloaded scene. A new asset, or one whose layout has
+// changed, is uploaded to new objects over the next frames by
+// update_scene_upload(). Otherwise only the buffer ranges and textures that
+// differ from the current asset are uploaded right away.
+void apply_reload(Context &ctx, LoadedScene &scene)
+{
+    const double ms = 1000.0 * (glfwGetTime() - ctx.reloadStart);
+    if (!scene.ok) {
+        const bool otherAsset = !scene.filename.empty() && scene.filename != ctx.gltfFilename;
+        ctx.reloadStatus = ctx.startupReport || otherAsset
+                               ? "Could not load " + scene.filename
+                               : "Reload failed (kept the current version)";
+        finish_startup_report(ctx, false);
+        return;
+    }
+
+    size_t uploadedBytes = 0;
+    int uploadedTextures = 0;
+    if (!scene.reloadedImages.empty()) {
+        std::vector<char> reloaded(ctx.asset.images.size(), 0);
+        for (int image : scene.reloadedImages) {
+            ctx.asset.images[image] = std::move(scene.asset.images[image]);
+            reloaded[image] = 1;
+        }
+        for (int i = 0; i < int(ctx.asset.textures.size()); ++i) {
+            const int source = ctx.asset.textures[i].source;
+            if (source < 0 || !reloaded[source]) continue;
+            gltf::reload_streamed_texture(ctx.residency, ctx.textures, ctx.asset, i);
+            uploadedTextures += 1;
+        }
+    } else {
+        // Another asset, or a reload that cannot be applied as an update
+        const bool otherAsset = scene.filename != ctx.gltfFilename;
+        const gltf::AssetDiff diff = otherAsset ? gltf::AssetDiff()
+                                                : gltf::diff_assets(ctx.asset, scene.asset);
+        if (otherAsset || diff.layoutChanged ||
+            ctx.textures.size() != scene.asset.textures.size()) {
+            ctx.pendingScene.reset(new LoadedScene(std::move(scene)));
+            gltf::begin_scene_upload(ctx.sceneUpload, ctx.pendingScene->asset,
+                                     ctx.residency.settings);
+            return;
+        }
+        uploadedBytes = gltf::update_drawables(ctx.drawables, scene.asset, diff.bufferRanges);
+        for (int texture : diff.textures) {
+            gltf::reload_streamed_texture(ctx.residency, ctx.textures, scene.asset, texture);
+        }
+        uploadedTextures = int(diff.textures.size());
+        if (!diff.bufferRanges.empty()) gltf::update_texel_densities(ctx.residency, scene.asset);
+
+        ctx.asset = std::move(scene.asset);
+        ctx.cullingMeshes.swap(scene.cullingMeshes);
+        ctx.bvh = std::move(scene.bvh);
+        animations_replaced(ctx);
+        gltf::build_instance_bvh(ctx.bvh, ctx.asset, node_world_matrices(ctx));
+        ctx.nodeVisible.clear();
+        ctx.hasPick = false;
+    }
+
+    gltf::track_asset_memory(ctx.asset);
+    if (ctx.cpuCopiesDropped) gltf::release_cpu_copies(ctx.asset, ctx.residency);
+    watch_scene_files(ctx);
+
+    char status[256];
+    std::snprintf(status, sizeof(status),
+                  "Reloaded %s in %.0f ms (%.1f KiB of buffers, %d texture(s) uploaded)",
+                  scene.reloadedImages.empty() ? "asset" : "images", ms,
+                  uploadedBytes / 1024.0, uploadedTextures);
+    ctx.reloadStatus = status;
+    std::cout << status << std::endl;
+}
+
+// Switches to another asset in gltf_dir(), right away if it is cached, and
+// otherwise by loading it in the background like a reload (the current scene
+// is drawn until the new one has been uploaded)
+void switch_asset(Context &ctx, const std::string &filename)
+{
+    if (filename == ctx.gltfFilename || ctx.reload.valid() || ctx.pendingScene) return;
+    ctx.reloadStart = glfwGetTime();
+    ctx.changedFiles.clear();
+    gltf::CachedScene cached;
+    if (!gltf::take_cached_scene(ctx.sceneCache, filename, cached)) {
+        ctx.reloadStatus = "Loading " + filename + "...";
+        ctx.reload = std::async(std::launch::async, load_scene, filename, gltf_dir(),
+                                asset_settings(ctx));
+        return;
+    }
+
+    cache_current_scene(ctx);
+    ctx.gltfFilename = cached.filename;
+    ctx.asset = std::move(cached.asset);
+    ctx.drawables.swap(cached.drawables);
+    ctx.textures.swap(cached.textures);
+    cached.residency.settings = ctx.residency.settings;
+    ctx.residency = std::move(cached.residency);
+    ctx.cullingMeshes.swap(cached.cullingMeshes);
+    ctx.bvh = std::move(cached.bvh);
+    scene_replaced(ctx);
+
+    char status[256];
+    std::snprintf(status, sizeof(status), "Switched to %s from the cache in %.1f ms",
+                  ctx.gltfFilename.c_str(), 1000.0 * (glfwGetTime() - ctx.reloadStart));
+    ctx.reloadStatus = status;
+    std::cout << status << std::endl;
+}
+
+// Reloads shaders right away, and starts or finishes reloading the asset when
+// its files have changed. Call once per frame.
+void update_hot_reload(Context &ctx)
+{
+    for (const std::string &filename : cg::poll_file_changes(ctx.fileWatcher)) {
+        if (!ctx.hotReload) continue;
+        if (is_shader_file(filename)) {
+            reload_shaders(ctx, filename);
+            ctx.reloadStatus = "Reloaded shaders using " + base_name(filename);
+        } else if (std::find(ctx.changedFiles.begin(), ctx.changedFiles.end(), filename) ==
+                   ctx.changedFiles.end()) {
+            ctx.changedFiles.push_back(filename);
+        }
+    }
+
+    // Another reload waits until the upload of the last one is done
+    if (update_scene_upload(ctx)) return;
+    if (ctx.reload.valid()) {
+        if (ctx.reload.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return;
+        LoadedScene scene = ctx.reload.get();
+        apply_reload(ctx, scene);
+    }
+    if (!ctx.changedFiles.empty()) start_reload(ctx);
 }
 
 void draw_scene(Context &ctx)
@@ -218,10 +1209,16 @@ void draw_scene(Context &ctx)
 
     // Set render state
     glEnable(GL_DEPTH_TEST);  // Enable Z-buffering
+    if (ctx.depthPrepass) {
+        // The depth buffer already holds the nearest surfaces
+        glDepthFunc(GL_EQUAL);
+        glDepthMask(GL_FALSE);
+    }
     
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_CUBE_MAP,ctx.cubemapTextures[ctx.cubemapTextureDir][ctx.activeCubemapLevel]);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, environment_cubemap(ctx));
     glUniform1i(glGetUniformLocation(ctx.program, "u_cubemap"), 0);
+    glUniform1f(glGetUniformLocation(ctx.program, "u_cubemapLod"), float(ctx.activeCubemapLevel));
     
 
     // Define per-scene uniforms
@@ -241,56 +1238,105 @@ void draw_scene(Context &ctx)
     glUniform1f(glGetUniformLocation(ctx.program, "u_shadowBias"), ctx.light.shadowBias);
     glUniform1f(glGetUniformLocation(ctx.program, "u_enableShadowmap"), ctx.enableShadowmap);
 
-    float aspect = (float)ctx.width / (float)ctx.height;
-    glm::mat4 view = glm::mat4(ctx.trackball.orient);
-    view = view * glm::lookAt(glm::vec3(2.0f, 0.0f, 0.0f), glm::vec3(0.0f), glm::vec3(0,0,1));
-    glm::mat4 projection = ctx.showOrtho
-        ? glm::ortho(-1.0f * aspect, 1.0f * aspect, -1.0f, 1.0f, -10.0f, 10.0f) // Orthographic
-        : glm::perspective(glm::radians(65.0f*ctx.zoom_factor), aspect, 0.1f, 40.0f); // Perspective
-
-    glm::mat4 shadowFromView = ctx.light.shadowMatrix * glm::inverse(view);
-    // Assignment 3 part 4, shadow mapping
-    glUniformMatrix4fv(glGetUniformLocation(ctx.program, "u_shadowFromView"), 1, GL_FALSE, &shadowFromView[0][0]);
-
-    // ASsignemnt 3 part 4, shadow map
+    glm::mat4 view = camera_view(ctx);
+    glm::mat4 projection = camera_projection(ctx);
+
+    // Assignment 3 part 4, shadow mapping. The cube map of the main light is
+    // looked up with the world-space offset from the light.
+    glm::mat4 shadowCubeFromView =
+        glm::translate(glm::mat4(1.0f), -ctx.lightPosition) * glm::inverse(view);
+    glUniformMatrix4fv(glGetUniformLocation(ctx.program, "u_shadowCubeFromView"), 1, GL_FALSE,
+                       &shadowCubeFromView[0][0]);
+    glUniform1f(glGetUniformLocation(ctx.program, "u_shadowCubeFar"), ctx.light.shadowFar);
+    glActiveTexture(GL_TEXTURE8);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, ctx.light.shadowCube);
+    glUniform1i(glGetUniformLocation(ctx.program, "u_shadowCube"), 8);
+
+    // ASsignemnt 3 part 4, shadow map (the atlas of the spot lights)
     glActiveTexture(GL_TEXTURE3);
     glBindTexture(GL_TEXTURE_2D, ctx.light.shadowmap);
     glUniform1i(glGetUniformLocation(ctx.program, "u_shadowMap"), 3);
 
-    // Draw scene
-    for (unsigned i = 0; i < ctx.asset.nodes.size(); ++i) {
-        const gltf::Node &node = ctx.asset.nodes[i];
-        const gltf::Drawable &drawable = ctx.drawables[node.mesh];
+    // Per-view uniforms
+    glUniformMatrix4fv(glGetUniformLocation(ctx.program, "u_view"), 1, GL_FALSE, &view[0][0]);
+    glUniformMatrix4fv(glGetUniformLocation(ctx.program, "u_projection"), 1, GL_FALSE, &projection[0][0]);
+    glUniform3fv(glGetUniformLocation(ctx.program, "u_diffuseColor"), 1, &ctx.diffuseColor[0]);
+    glUniform3fv(glGetUniformLocation(ctx.program, "u_lightPosition"), 1, &ctx.lightPosition[0]);
+    glUniform3fv(glGetUniformLocation(ctx.program, "u_ambientColor"), 1, &ctx.ambientColor[0]);
+    glUniform3fv(glGetUniformLocation(ctx.program, "u_specularColor"), 1, &ctx.specularColor[0]);
+    glUniform3fv(glGetUniformLocation(ctx.program, "u_lightColor"), 1, &ctx.lightColor[0]);
+    glUniform1f(glGetUniformLocation(ctx.program, "u_specularPower"), ctx.specularPower);
+
+    // Clustered lights
+    const gltf::ClusterGrid &grid = ctx.lightClusters.grid;
+    glUniform1i(glGetUniformLocation(ctx.program, "u_clusteredLights"),
+                ctx.clusteredLights && !ctx.sceneLights.empty());
+    glActiveTexture(GL_TEXTURE4);
+    glBindTexture(GL_TEXTURE_BUFFER, ctx.lightBuffers.lightTexture);
+    glUniform1i(glGetUniformLocation(ctx.program, "u_lights"), 4);
+    glActiveTexture(GL_TEXTURE5);
+    glBindTexture(GL_TEXTURE_BUFFER, ctx.lightBuffers.clusterTexture);
+    glUniform1i(glGetUniformLocation(ctx.program, "u_lightClusters"), 5);
+    glActiveTexture(GL_TEXTURE6);
+    glBindTexture(GL_TEXTURE_BUFFER, ctx.lightBuffers.indexTexture);
+    glUniform1i(glGetUniformLocation(ctx.program, "u_lightIndices"), 6);
+    glActiveTexture(GL_TEXTURE7);
+    glBindTexture(GL_TEXTURE_BUFFER, ctx.lightBuffers.shadowTexture);
+    glUniform1i(glGetUniformLocation(ctx.program, "u_lightShadows"), 7);
+    glUniform3i(glGetUniformLocation(ctx.program, "u_clusterDims"), grid.tilesX, grid.tilesY,
+                grid.slices);
+    glUniform1i(glGetUniformLocation(ctx.program, "u_clusterLogDepth"), grid.logDepth);
+    glUniform2fv(glGetUniformLocation(ctx.program, "u_clusterDepthScaleBias"), 1,
+                 &grid.depthScaleBias[0]);
+    glUniform2f(glGetUniformLocation(ctx.program, "u_viewportSize"), float(ctx.renderWidth),
+                float(ctx.renderHeight));
+
+    // Directional lights, as view-space directions towards the light
+    const int numDirectional = int(ctx.directionalLights.size());
+    std::vector<glm::vec3> directions(numDirectional), colors(numDirectional);
+    for (int i = 0; i < numDirectional; ++i) {
+        const gltf::DirectionalLight &light = ctx.directionalLights[i];
+        directions[i] = -glm::normalize(glm::mat3(view) * light.direction);
+        colors[i] = light.color;
+    }
+    glUniform1i(glGetUniformLocation(ctx.program, "u_numDirectionalLights"), numDirectional);
+    if (numDirectional > 0) {
+        glUniform3fv(glGetUniformLocation(ctx.program, "u_directionalLightDirections"),
+                     numDirectional, &directions[0][0]);
+        glUniform3fv(glGetUniformLocation(ctx.program, "u_directionalLightColors"),
+                     numDirectional, &colors[0][0]);
+    }
+
+    // Draw scene, sorted by material and mesh so that textures and vertex
+    // arrays are only bound when they change
+    const std::vector<glm::mat4> worldMatrices = node_world_matrices(ctx);
+    bind_joint_matrices(ctx, ctx.program);
+    int boundMaterial = -1, boundMesh = -1;
+    for (const gltf::DrawItem &item : ctx.drawList) {
+        const gltf::Drawable &drawable = ctx.drawables[item.mesh];
 
         // Define per-object uniforms
-        glm::mat4 model = glm::mat4(1.0f);
-
-        // Apply model transformation
-        model = glm::scale(model, glm::vec3(node.scale));
-        model = glm::translate(model, node.translation);
-        model = glm::rotate(model, node.rotationX, glm::vec3(1,0,0));
-        model = glm::rotate(model, node.rotationY, glm::vec3(0,1,0));
-        model = glm::rotate(model, node.rotationZ, glm::vec3(0,0,1));
-            
-        // Draw object
-        glUniformMatrix4fv(glGetUniformLocation(ctx.program, "u_view"), 1, GL_FALSE, &view[0][0]);
-        glUniformMatrix4fv(glGetUniformLocation(ctx.program, "u_projection"), 1, GL_FALSE, &projection[0][0]);
+        const glm::mat4 &model = worldMatrices[item.node];
         glUniformMatrix4fv(glGetUniformLocation(ctx.program, "u_model"), 1, GL_FALSE, &model[0][0]);
+        glUniform1i(glGetUniformLocation(ctx.program, "u_jointOffset"),
+                    joint_offset(ctx, item.node, drawable));
 
-        glUniform3fv(glGetUniformLocation(ctx.program, "u_diffuseColor"), 1, &ctx.diffuseColor[0]);
-        glUniform3fv(glGetUniformLocation(ctx.program, "u_lightPosition"), 1, &ctx.lightPosition[0]);
-        
-        glUniform3fv(glGetUniformLocation(ctx.program, "u_ambientColor"), 1, &ctx.ambientColor[0]);
-        glUniform3fv(glGetUniformLocation(ctx.program, "u_specularColor"), 1, &ctx.specularColor[0]);
-        glUniform3fv(glGetUniformLocation(ctx.program, "u_lightColor"), 1, &ctx.lightColor[0]);
-        glUniform1f(glGetUniformLocation(ctx.program, "u_specularPower"), ctx.specularPower);
-
-
-        // Assignment 3 part 3, material textures.
-        const gltf::Mesh &mesh = ctx.asset.meshes[node.mesh];        
-        if (mesh.primitives[0].hasMaterial) {
-            const gltf::Primitive &primitive = mesh.primitives[0];
-            const gltf::Material &material = ctx.asset.materials[primitive.material];
+        // Assignment 3 part 3, material textures. Textures are requested
+        // for every node, since the residency depends on its screen size.
+        if (item.material >= 0) {
+            const gltf::Material &material = ctx.asset.materials[item.material];
+            const gltf::PBRMetallicRoughness &pbr = material.pbrMetallicRoughness;
+            if (pbr.hasBaseColorTexture) {
+                gltf::request_texture(ctx.residency, pbr.baseColorTexture.index, item.mesh,
+                                      view * model, projection, ctx.renderHeight);
+            }
+            if (material.hasNormalTexture) {
+                gltf::request_texture(ctx.residency, material.normalTexture.index, item.mesh,
+                                      view * model, projection, ctx.renderHeight);
+            }
+        }
+        if (item.material >= 0 && item.material != boundMaterial) {
+            const gltf::Material &material = ctx.asset.materials[item.material];
             const gltf::PBRMetallicRoughness &pbr = material.pbrMetallicRoughness;
             // Define material textures and uniforms
             if (pbr.hasBaseColorTexture) {
@@ -323,45 +1369,315 @@ void draw_scene(Context &ctx)
                 // the shader that no bumpmap texture is available
                 glUniform1i(glGetUniformLocation(ctx.program, "u_hasBumpMap"), GL_FALSE);
             }
-        }    
-        
-        glBindVertexArray(drawable.vao);
+            boundMaterial = item.material;
+        }
+        // Tangents are per mesh, so this is set even if the material is bound
+        glUniform1i(glGetUniformLocation(ctx.program, "u_hasTangents"), drawable.hasTangents);
+
+        if (item.mesh != boundMesh) {
+            glBindVertexArray(drawable.vao);
+            boundMesh = item.mesh;
+        }
         glDrawElements(GL_TRIANGLES, drawable.indexCount, drawable.indexType,
                        (GLvoid *)(intptr_t)drawable.indexByteOffset);
-        glBindVertexArray(0);
     }
+    glBindVertexArray(0);
 
     // Clean up
     cg::reset_gl_render_state();
     glUseProgram(0);
 }
 
+// Draws the depth of the nodes in the draw list with the shadow program
+// (positions only, no shading), before draw_scene()
+void draw_depth_prepass(Context &ctx)
+{
+    glUseProgram(ctx.shadowProgram);
+    glEnable(GL_DEPTH_TEST);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+
+    const glm::mat4 view = camera_view(ctx);
+    const glm::mat4 projection = camera_projection(ctx);
+    glUniformMatrix4fv(glGetUniformLocation(ctx.shadowProgram, "u_view"), 1, GL_FALSE, &view[0][0]);
+    glUniformMatrix4fv(glGetUniformLocation(ctx.shadowProgram, "u_proj"), 1, GL_FALSE,
+                       &projection[0][0]);
+
+    const std::vector<glm::mat4> worldMatrices = node_world_matrices(ctx);
+    const GLint modelLocation = glGetUniformLocation(ctx.shadowProgram, "u_model");
+    const GLint jointLocation = glGetUniformLocation(ctx.shadowProgram, "u_jointOffset");
+    bind_joint_matrices(ctx, ctx.shadowProgram);
+    int boundMesh = -1;
+    for (const gltf::DrawItem &item : ctx.drawList) {
+        const gltf::Drawable &drawable = ctx.drawables[item.mesh];
+        glUniformMatrix4fv(modelLocation, 1, GL_FALSE, &worldMatrices[item.node][0][0]);
+        glUniform1i(jointLocation, joint_offset(ctx, item.node, drawable));
+        if (item.mesh != boundMesh) {
+            glBindVertexArray(drawable.vao);
+            boundMesh = item.mesh;
+        }
+        glDrawElements(GL_TRIANGLES, drawable.indexCount, drawable.indexType,
+                       (GLvoid *)(intptr_t)drawable.indexByteOffset);
+    }
+    glBindVertexArray(0);
+
+    // Clean up
+    cg::reset_gl_render_state();
+    glUseProgram(0);
+}
+
+// Stores the cost of the main pass in the current prepass mode, once the
+// averages only cover frames that were drawn in that mode
+void update_prepass_stats(Context &ctx)
+{
+    const uint64_t frames = 60 + cg::PROFILER_FRAMES_IN_FLIGHT;
+    if (ctx.profiler.frame < ctx.prepassChangedFrame + frames) return;
+    PrepassStats &stats = ctx.prepassStats[ctx.depthPrepass];
+    stats.measured = true;
+    stats.fragments = ctx.fragmentCounter.value;
+    stats.prepassMs = 0.0;
+    for (const auto &average : ctx.profileAverages) {
+        if (!average.gpu) continue;
+        if (std::strcmp(average.name, "depth_prepass") == 0) stats.prepassMs = average.ms;
+        if (std::strcmp(average.name, "draw_scene") == 0) stats.sceneMs = average.ms;
+    }
+}
+
+// Stores the cost of the cube shadow map in the current mode, as
+// update_prepass_stats() does for the prepass
+void update_cube_shadow_stats(Context &ctx)
+{
+    const uint64_t frames = 60 + cg::PROFILER_FRAMES_IN_FLIGHT;
+    if (ctx.profiler.frame < ctx.cubeModeChangedFrame + frames) return;
+    CubeShadowStats &stats = ctx.cubeStats[ctx.singlePassCube];
+    for (const auto &average : ctx.profileAverages) {
+        if (!average.gpu || std::strcmp(average.name, "update_cube_shadowmap") != 0) continue;
+        stats.measured = true;
+        stats.drawCalls = ctx.cubeDrawCalls;
+        stats.ms = average.ms;
+    }
+}
+
+// Places the test lights in the bounds of the scene
+void generate_test_lights(Context &ctx)
+{
+    ctx.testLights.clear();
+    if (ctx.numTestLights <= 0) return;
+    gltf::AABB bounds = {glm::vec3(-1.0f), glm::vec3(1.0f)};
+    if (!ctx.bvh.nodes.empty()) bounds = ctx.bvh.nodes[0].bounds;
+    const float size = glm::length(bounds.max - bounds.min);
+    const float range = 0.5f * size / std::cbrt(float(ctx.numTestLights)) + 1e-3f;
+    gltf::generate_test_lights(bounds, ctx.numTestLights, range, ctx.testLights);
+}
+
+// Gives the spot lights of the asset (in sceneLights) their tiles of the
+// shadow atlas, and picks the tiles to render this frame
+void update_shadow_atlas(Context &ctx, const std::vector<glm::mat4> &worldMatrices)
+{
+    const glm::mat4 view = camera_view(ctx), projection = camera_projection(ctx);
+    std::vector<gltf::ShadowLight> lights;
+    for (size_t i = 0; i < ctx.sceneLights.size() && ctx.enableShadowmap; ++i) {
+        const gltf::PunctualLight &light = ctx.sceneLights[i];
+        if (light.type != gltf::LIGHT_SPOT) continue;
+        const float importance =
+            gltf::light_importance(light.position, light.range, view, projection);
+        const gltf::ShadowLight spotLight = {uint64_t(i), gltf::spot_light_view_proj(light),
+                                             importance};
+        lights.push_back(spotLight);
+    }
+    gltf::schedule_shadow_updates(ctx.shadowAtlas, lights, ctx.asset, ctx.cullingMeshes,
+                                  worldMatrices, ctx.shadowSettings, ctx.shadowUpdates);
+    // The tiles are rendered later in the frame, with the cameras of this frame
+    for (const gltf::ShadowUpdate &update : ctx.shadowUpdates) {
+        gltf::finish_shadow_update(ctx.shadowAtlas, update);
+    }
+
+    for (size_t i = 0; i < ctx.sceneLights.size(); ++i) {
+        gltf::PunctualLight &light = ctx.sceneLights[i];
+        const int index = gltf::find_shadow_tile(ctx.shadowAtlas, i);
+        if (index < 0) continue;
+        const gltf::ShadowTile &tile = ctx.shadowAtlas.tiles[index];
+        light.castsShadow = true;
+        light.shadowMatrix = tile.viewProj;
+        light.shadowRect = gltf::shadow_tile_rect(ctx.shadowAtlas, tile);
+        light.shadowBias = ctx.light.shadowBias;
+    }
+}
+
+// Bins the lights of the scene into the clusters of the current view and
+// uploads them for draw_scene(), after giving them their shadows
+void update_light_clusters(Context &ctx)
+{
+    ctx.sceneLights.clear();
+    ctx.directionalLights.clear();
+    const std::vector<glm::mat4> worldMatrices = node_world_matrices(ctx);
+    gltf::collect_directional_lights(ctx.asset, worldMatrices, ctx.directionalLights);
+    if (ctx.clusteredLights) {
+        gltf::collect_punctual_lights(ctx.asset, worldMatrices, ctx.clusterSettings.minIntensity,
+                                      ctx.sceneLights);
+    }
+    update_shadow_atlas(ctx, worldMatrices);
+    if (!ctx.clusteredLights) return;
+    ctx.sceneLights.insert(ctx.sceneLights.end(), ctx.testLights.begin(), ctx.testLights.end());
+    gltf::bin_lights(ctx.lightClusters, ctx.sceneLights, camera_view(ctx),
+                     camera_projection(ctx), ctx.clusterSettings);
+    gltf::upload_light_clusters(ctx.lightBuffers, ctx.lightClusters);
+}
+
+// Samples the current clip into the nodes, and uploads the joint matrices of
+// the skinned nodes for this frame. The time is kept when paused, so that it
+// can be scrubbed.
+void update_animation(Context &ctx, float deltaTime)
+{
+    if (ctx.animationClip < int(ctx.animations.clips.size())) {
+        const gltf::AnimationClip &clip = ctx.animations.clips[ctx.animationClip];
+        if (ctx.playAnimation && clip.duration > 0.0f) {
+            float time = std::fmod(ctx.animationTime + deltaTime * ctx.animationSpeed,
+                                   clip.duration);
+            ctx.animationTime = time < 0.0f ? time + clip.duration : time;
+        }
+        gltf::sample_animation(clip, ctx.animationTime, ctx.animationCursor,
+                               ctx.animationValues);
+        gltf::apply_animation(clip, ctx.animationValues, ctx.asset.nodes);
+    }
+    if (ctx.animations.skins.empty()) return;
+    const std::vector<glm::mat4> previousJoints = ctx.jointMatrices;
+    gltf::compute_joint_matrices(ctx.asset, ctx.animations, node_world_matrices(ctx),
+                                 ctx.jointMatrices, ctx.jointOffsets);
+    gltf::upload_joint_matrices(ctx.jointBuffer, ctx.jointMatrices);
+
+    // Skinned meshes change shape without their nodes moving, which the shadow
+    // scheduler would not notice, so its tiles (and the bounds of the skinned
+    // casters) are rendered again whenever the pose changed, also when the
+    // time is scrubbed while paused
+    if (ctx.jointMatrices.size() != previousJoints.size() ||
+        (!ctx.jointMatrices.empty() &&
+         std::memcmp(&ctx.jointMatrices[0], &previousJoints[0],
+                     ctx.jointMatrices.size() * sizeof(glm::mat4)) != 0)) {
+        ctx.shadowAtlas.previousMatrices.clear();
+    }
+}
+
+// Decides which nodes draw_scene() should draw from the current camera
+void update_culling(Context &ctx)
+{
+    glm::mat4 viewProj = camera_projection(ctx) * camera_view(ctx);
+    gltf::cull_nodes(ctx.asset, ctx.cullingMeshes, node_world_matrices(ctx), viewProj,
+                     ctx.cullingSettings, ctx.occlusionBuffer, ctx.nodeVisible, ctx.cullingStats);
+
+    // The bounds of skinned meshes are those of the bind pose, which the
+    // joints can move them out of, so they are always drawn
+    for (size_t i = 0; i < ctx.jointOffsets.size() && i < ctx.nodeVisible.size(); ++i) {
+        if (ctx.jointOffsets[i] >= 0) ctx.nodeVisible[i] = 1;
+    }
+}
+
+// Copies the occlusion buffer to a texture that can be shown in ImGui
+void update_occlusion_debug_texture(Context &ctx)
+{
+    const gltf::OcclusionBuffer &buffer = ctx.occlusionBuffer;
+    if (buffer.depth.empty()) return;
+
+    // Stretch the used depth range to the full intensity range, since
+    // perspective depth values are crowded close to 1
+    float nearest = 1.0f;
+    for (float depth : buffer.depth) nearest = std::min(nearest, depth);
+    const float scale = nearest < 1.0f ? 1.0f / (1.0f - nearest) : 0.0f;
+    std::vector<uint8_t> pixels(buffer.depth.size());
+    for (size_t i = 0; i < pixels.size(); ++i) {
+        pixels[i] = uint8_t(255.0f * glm::clamp((1.0f - buffer.depth[i]) * scale, 0.0f, 1.0f));
+    }
+
+    if (!ctx.occlusionDebugTexture) {
+        glGenTextures(1, &ctx.occlusionDebugTexture);
+        glBindTexture(GL_TEXTURE_2D, ctx.occlusionDebugTexture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        GLint swizzle[] = {GL_RED, GL_RED, GL_RED, GL_ONE};
+        glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+    }
+    glBindTexture(GL_TEXTURE_2D, ctx.occlusionDebugTexture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, buffer.width, buffer.height, 0, GL_RED,
+                 GL_UNSIGNED_BYTE, &pixels[0]);
+    cg::track_gpu_object(cg::MEMORY_TEXTURES, cg::GPU_TEXTURE, ctx.occlusionDebugTexture,
+                         pixels.size(), "occlusion buffer (debug)");
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
 void do_rendering(Context &ctx)
 {
     // Clear render states at the start of each frame
     cg::reset_gl_render_state();
 
-    // Clear color and depth buffers
-    
+    // Pick the resolution of this frame from the GPU frame time that arrived
+    // this frame, if any
+    const float gpuFrameMs = ctx.profiler.newGpuFrameMs ? ctx.profiler.gpuFrameMs.back() : 0.0f;
+    cg::update_dynamic_resolution(ctx.resolution, gpuFrameMs, ctx.resolutionSettings);
+    cg::resize_render_target(ctx.sceneTarget, ctx.width, ctx.height);
+    ctx.renderWidth = cg::scaled_size(ctx.width, ctx.resolution.scale);
+    ctx.renderHeight = cg::scaled_size(ctx.height, ctx.resolution.scale);
+    bind_scene_target(ctx);
+
+    // Clear color and depth buffers (only the part that is rendered)
     glClearColor(ctx.backgroundColor.r, ctx.backgroundColor.g, ctx.backgroundColor.b, 1.0f);
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(0, 0, ctx.renderWidth, ctx.renderHeight);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glDisable(GL_SCISSOR_TEST);
 
-    
-    update_shadowmap(ctx, ctx.light, ctx.light.shadowFBO);
-    draw_scene(ctx);
-
-    if (ctx.depthVisualization) {
-        // Draw shadowmap on default screen framebuffer
-        glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT); 
-        update_shadowmap(ctx, ctx.light, 0);
+    {
+        cg::ProfileScope scope(ctx.profiler, "update_animation");
+        update_animation(ctx, ImGui::GetIO().DeltaTime);
+    }
+    {
+        cg::ProfileScope scope(ctx.profiler, "update_culling");
+        update_culling(ctx);
+    }
+    if (ctx.showOcclusionBuffer) update_occlusion_debug_texture(ctx);
+    {
+        cg::ProfileScope scope(ctx.profiler, "build_draw_list");
+        gltf::build_draw_list(ctx.asset, ctx.nodeVisible, ctx.drawList);
+    }
+    {
+        cg::ProfileScope scope(ctx.profiler, "bin_lights");
+        update_light_clusters(ctx);
+    }
+    {
+        cg::ProfileScope scope(ctx.profiler, "update_shadowmap");
+        cg::GpuProfileScope gpuScope(ctx.profiler, "update_shadowmap");
+        update_shadowmap(ctx);
+    }
+    if (ctx.enableShadowmap) {
+        cg::ProfileScope scope(ctx.profiler, "update_cube_shadowmap");
+        cg::GpuProfileScope gpuScope(ctx.profiler, "update_cube_shadowmap");
+        update_cube_shadowmap(ctx);
+    }
+    if (ctx.depthPrepass) {
+        cg::ProfileScope scope(ctx.profiler, "depth_prepass");
+        cg::GpuProfileScope gpuScope(ctx.profiler, "depth_prepass");
+        draw_depth_prepass(ctx);
+    }
+    {
+        cg::ProfileScope scope(ctx.profiler, "draw_scene");
+        cg::GpuProfileScope gpuScope(ctx.profiler, "draw_scene");
+        cg::begin_gpu_counter(ctx.fragmentCounter);
+        draw_scene(ctx);
+        cg::end_gpu_counter(ctx.fragmentCounter);
+    }
+    {
+        cg::ProfileScope scope(ctx.profiler, "update_residency");
+        gltf::update_residency(ctx.residency, ctx.textures, ctx.asset);
     }
-}
 
-void reload_shaders(Context *ctx)
-{
-    glDeleteProgram(ctx->program);
-    ctx->program = cg::load_shader_program(shader_dir() + "mesh.vert", shader_dir() + "mesh.frag");
+    if (ctx.depthVisualization) draw_cube_shadow_debug(ctx);
+    {
+        cg::ProfileScope scope(ctx.profiler, "upscale_scene");
+        cg::GpuProfileScope gpuScope(ctx.profiler, "upscale_scene");
+        cg::upscale_render_target(ctx.sceneTarget, ctx.renderWidth, ctx.renderHeight, ctx.width,
+                                  ctx.height);
+        glViewport(0, 0, ctx.width, ctx.height);
+    }
 }
 
 void error_callback(int /*error*/, const char *description)
@@ -376,7 +1692,7 @@ void key_callback(GLFWwindow *window, int key, int scancode, int action, int mod
     if (ImGui::GetIO().WantCaptureKeyboard) return;
 
     Context *ctx = static_cast<Context *>(glfwGetWindowUserPointer(window));
-    if (key == GLFW_KEY_R && action == GLFW_PRESS) { reload_shaders(ctx); }
+    if (key == GLFW_KEY_R && action == GLFW_PRESS) { reload_shaders(*ctx, ""); }
 }
 
 void char_callback(GLFWwindow *window, unsigned int codepoint)
@@ -400,6 +1716,9 @@ void mouse_button_callback(GLFWwindow *window, int button, int action, int mods)
         ctx->trackball.center = glm::vec2(x, y);
         ctx->trackball.tracking = (action == GLFW_PRESS);
     }
+    if (button == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_PRESS) {
+        pick_at_cursor(*ctx, x, y);
+    }
 }
 
 void cursor_pos_callback(GLFWwindow *window, double x, double y)
@@ -436,6 +1755,14 @@ int main(int argc, char *argv[])
     Context ctx = Context();
     if (argc > 1) { ctx.gltfFilename = std::string(argv[1]); }
 
+    // Render nodes set their memory limits (in MiB) and can free the CPU copies
+    // of the scene from the environment
+    const std::string cpuBudget = cg::get_env_var("MODEL_VIEWER_CPU_BUDGET_MB");
+    const std::string gpuBudget = cg::get_env_var("MODEL_VIEWER_GPU_BUDGET_MB");
+    if (!cpuBudget.empty()) ctx.memoryBudget.cpuBytes = size_t(std::atoll(cpuBudget.c_str())) << 20;
+    if (!gpuBudget.empty()) ctx.memoryBudget.gpuBytes = size_t(std::atoll(gpuBudget.c_str())) << 20;
+    ctx.dropCpuCopies = cg::get_env_var("MODEL_VIEWER_DROP_CPU_COPIES") == "1";
+
     // Create a GLFW window
     glfwSetErrorCallback(error_callback);
     glfwInit();
@@ -469,12 +1796,22 @@ int main(int argc, char *argv[])
     glGenVertexArrays(1, &ctx.emptyVAO);
     glBindVertexArray(ctx.emptyVAO);
     glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+    cg::init_profiler(ctx.profiler);
+    cg::init_gpu_counter(ctx.fragmentCounter);
     do_initialization(ctx);
+    ctx.memoryWarning = cg::check_memory_budget(ctx.memoryBudget, cg::available_gpu_memory());
+    cg::init_file_watcher(ctx.fileWatcher);
+    watch_scene_files(ctx);
 
     // Start rendering loop
     while (!glfwWindowShouldClose(ctx.window)) {
+        cg::begin_profiler_frame(ctx.profiler);
         glfwPollEvents();
         ctx.elapsedTime = glfwGetTime();
+        {
+            cg::ProfileScope scope(ctx.profiler, "update_hot_reload");
+            update_hot_reload(ctx);
+        }
 
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
@@ -528,23 +1865,333 @@ int main(int argc, char *argv[])
         ImGui::Text("Debug");
         ImGui::Checkbox("Show normals", &ctx.showNormals);
         ImGui::Checkbox("Show ortho", &ctx.showOrtho);
-        ImGui::Checkbox("Depth visualization (shadow map debug)", &ctx.depthVisualization);
+        ImGui::Checkbox("Depth visualization (shadow cube map)", &ctx.depthVisualization);
         
         ImGui::Text("Cubemap");
         ImGui::Combo("Cubemap", (int*)&ctx.cubemapTextureDir, ctx.cubemapDirs, CUBEMAP_MAX_DIRS);
         ImGui::Combo("Cubemap Roughness", (int*)&ctx.activeCubemapLevel, ctx.roughnessLevels, CUBEMAP_PREFILTERED_MAX_NUMBER);
-        
+        if (ImGui::Checkbox("GGX prefilter on CPU", &ctx.cpuPrefilter)) {
+            // Reload the environments from the other source when next used
+            for (GLuint &texture : ctx.cubemapTextures) {
+                cg::untrack_gpu_object(cg::GPU_TEXTURE, texture);
+                glDeleteTextures(1, &texture);
+                texture = 0;
+            }
+        }
+        if (ctx.prefilterBenchmark.valid()) {
+            if (ctx.prefilterBenchmark.wait_for(std::chrono::seconds(0)) ==
+                std::future_status::ready) {
+                ctx.prefilterSeconds = ctx.prefilterBenchmark.get();
+            } else {
+                ImGui::Text("Benchmarking on a worker thread...");
+            }
+        } else if (ImGui::Button("Benchmark prefiltering")) {
+            ctx.prefilterSeconds.clear();
+            ctx.prefilterBenchmark = std::async(std::launch::async, []() {
+                std::vector<double> seconds;
+                for (unsigned threads = 1; threads <= cg::num_worker_threads(); threads *= 2) {
+                    seconds.push_back(cg::benchmark_prefilter(512, threads));
+                }
+                return seconds;
+            });
+        }
+        for (size_t i = 0; i < ctx.prefilterSeconds.size(); ++i) {
+            ImGui::Text("%u thread(s): %.2f s per 512x512 environment", 1u << i,
+                        ctx.prefilterSeconds[i]);
+        }
+
+        ImGui::Text("Culling");
+        ImGui::Checkbox("Frustum culling", &ctx.cullingSettings.frustumCulling);
+        ImGui::Checkbox("Occlusion culling", &ctx.cullingSettings.occlusionCulling);
+        ImGui::SliderInt("Max occluders", &ctx.cullingSettings.maxOccluders, 1, 64);
+        ImGui::Text("Draws rejected: %d frustum, %d occlusion (of %d)",
+                    ctx.cullingStats.frustumCulled, ctx.cullingStats.occlusionCulled,
+                    ctx.cullingStats.tested);
+        ImGui::Text("Occluders: %d (%d triangles, %.2f ms)", ctx.cullingStats.occluders,
+                    ctx.cullingStats.occluderTriangles, ctx.cullingStats.rasterMs);
+        ImGui::Checkbox("Show occlusion buffer", &ctx.showOcclusionBuffer);
+        if (ctx.showOcclusionBuffer && ctx.occlusionDebugTexture) {
+            // Flip vertically, since the buffer rows go from bottom to top
+            ImGui::Image((void *)(intptr_t)ctx.occlusionDebugTexture,
+                         ImVec2(2.0f * ctx.occlusionBuffer.width, 2.0f * ctx.occlusionBuffer.height),
+                         ImVec2(0.0f, 1.0f), ImVec2(1.0f, 0.0f));
+        }
+
+        ImGui::Text("Clustered lights");
+        ImGui::Checkbox("Clustered lighting", &ctx.clusteredLights);
+        ImGui::SliderInt("Test lights", &ctx.numTestLights, 0, 4096);
+        if (ImGui::Button("Scatter test lights")) generate_test_lights(ctx);
+        ImGui::SameLine();
+        if (ImGui::Button("Remove test lights")) ctx.testLights.clear();
+        ImGui::SliderInt("Tiles X", &ctx.clusterSettings.tilesX, 1, 64);
+        ImGui::SliderInt("Tiles Y", &ctx.clusterSettings.tilesY, 1, 64);
+        ImGui::SliderInt("Depth slices", &ctx.clusterSettings.slices, 1, 64);
+        ImGui::SliderInt("Max lights per cluster", &ctx.clusterSettings.maxLightsPerCluster, 1,
+                         1024);
+        const gltf::LightClusterStats &lightStats = ctx.lightClusters.stats;
+        if (ctx.clusteredLights) {
+            ImGui::Text("%d light(s) (%d in the asset), binned in %.2f ms", lightStats.lights,
+                        int(ctx.sceneLights.size()) - int(ctx.testLights.size()),
+                        lightStats.binMs);
+            ImGui::Text("%d index(es), at most %d per cluster, %d dropped", lightStats.indices,
+                        lightStats.maxPerCluster, lightStats.dropped);
+        }
+
+        ImGui::Text("Shadow atlas");
+        ImGui::SliderInt("Max shadow tile size", &ctx.shadowSettings.maxTileSize,
+                         ctx.shadowSettings.minTileSize, ctx.shadowAtlas.size);
+        ImGui::SliderInt("Max shadow-casting lights", &ctx.shadowSettings.maxLights, 1, 256);
+        int budget = int(ctx.shadowSettings.triangleBudget / 1000);
+        if (ImGui::SliderInt("Triangle budget (thousands)", &budget, 1, 10000)) {
+            ctx.shadowSettings.triangleBudget = int64_t(budget) * 1000;
+        }
+        const gltf::ShadowStats &shadowStats = ctx.shadowAtlas.stats;
+        ImGui::Text("%d tile(s) for %d light(s) (%d dropped), %d%% of the atlas",
+                    shadowStats.tiles, shadowStats.lights, shadowStats.dropped,
+                    shadowStats.usedTexels);
+        ImGui::Text("Rendered %d (%d forced, %d deferred), %lld triangles", shadowStats.rendered,
+                    shadowStats.forced, shadowStats.deferred, (long long)shadowStats.triangles);
+
+        ImGui::Text("Cube shadow map (main light)");
+        if (ImGui::Checkbox("Single pass (geometry shader layers)", &ctx.singlePassCube)) {
+            ctx.cubeModeChangedFrame = ctx.profiler.frame;
+        }
+        ImGui::Text("%d caster(s), %d draw call(s) (six passes: %d)", int(ctx.cubeCasters.size()),
+                    ctx.cubeDrawCalls, ctx.cubeFaceDraws);
+        for (int i = 0; i < 2; ++i) {
+            const CubeShadowStats &stats = ctx.cubeStats[i];
+            if (!stats.measured) {
+                ImGui::Text("%s: not measured yet", i ? "Single pass" : "Six passes");
+                continue;
+            }
+            ImGui::Text("%s: %d draw call(s), %.3f ms (GPU)", i ? "Single pass" : "Six passes",
+                        stats.drawCalls, stats.ms);
+        }
+
+        ImGui::Text("Dynamic resolution");
+        ImGui::Checkbox("Scale resolution to hold the target", &ctx.resolutionSettings.enabled);
+        ImGui::SliderFloat("Target FPS", &ctx.resolutionSettings.targetFps, 5.0f, 240.0f, "%.0f");
+        ImGui::SliderFloat("Min scale", &ctx.resolutionSettings.minScale, 0.1f, 1.0f, "%.2f");
+        ImGui::Text("Rendering %dx%d of %dx%d (scale %.2f), GPU frame %.2f ms", ctx.renderWidth,
+                    ctx.renderHeight, ctx.width, ctx.height, ctx.resolution.scale,
+                    ctx.profiler.gpuFrameMs.back());
+
+        ImGui::Text("Animation");
+        const std::vector<gltf::AnimationClip> &clips = ctx.animations.clips;
+        if (clips.empty()) {
+            ImGui::Text("No animations (%d skin(s))", int(ctx.animations.skins.size()));
+        } else {
+            const gltf::AnimationClip &current = clips[ctx.animationClip];
+            if (ImGui::BeginCombo("Clip", current.name.empty() ? "(unnamed)"
+                                                               : current.name.c_str())) {
+                for (int i = 0; i < int(clips.size()); ++i) {
+                    const std::string label = std::to_string(i) + ": " + clips[i].name;
+                    if (ImGui::Selectable(label.c_str(), i == ctx.animationClip)) {
+                        ctx.animationClip = i;
+                        ctx.animationTime = 0.0f;
+                        ctx.animationCursor = gltf::AnimationCursor();
+                    }
+                }
+                ImGui::EndCombo();
+            }
+            const gltf::AnimationClip &clip = clips[ctx.animationClip];
+            ImGui::Checkbox("Play", &ctx.playAnimation);
+            ImGui::SliderFloat("Speed", &ctx.animationSpeed, -2.0f, 2.0f, "%.2f");
+            ImGui::SliderFloat("Time (s)", &ctx.animationTime, 0.0f, clip.duration, "%.2f");
+            ImGui::Text("%d channel(s), %d skin(s), %d joint matrices", int(clip.channels.size()),
+                        int(ctx.animations.skins.size()), int(ctx.jointMatrices.size()));
+        }
+
+        ImGui::Text("Depth prepass");
+        if (ImGui::Checkbox("Depth prepass (main pass tests for equal depth)", &ctx.depthPrepass)) {
+            ctx.prepassChangedFrame = ctx.profiler.frame;
+        }
+        const char *fragmentLabel =
+            ctx.fragmentCounter.invocations ? "fragment shader invocations" : "samples passed";
+        ImGui::Text("Main pass: %llu %s", (unsigned long long)ctx.fragmentCounter.value,
+                    fragmentLabel);
+        for (int i = 0; i < 2; ++i) {
+            const PrepassStats &stats = ctx.prepassStats[i];
+            if (!stats.measured) {
+                ImGui::Text("%s prepass: not measured yet", i ? "With" : "Without");
+                continue;
+            }
+            ImGui::Text("%s prepass: %llu fragments, %.3f + %.3f ms (GPU)", i ? "With" : "Without",
+                        (unsigned long long)stats.fragments, stats.prepassMs, stats.sceneMs);
+        }
+
+        ImGui::Text("Texture streaming");
+        int budgetMiB = int(ctx.residency.settings.budgetBytes >> 20);
+        if (ImGui::SliderInt("Budget (MiB)", &budgetMiB, 1, 1024)) {
+            ctx.residency.settings.budgetBytes = size_t(budgetMiB) << 20;
+        }
+        ImGui::Text("Resident: %.1f MiB, requested: %.1f MiB",
+                    ctx.residency.residentBytes / 1048576.0,
+                    ctx.residency.requestedBytes / 1048576.0);
+        ImGui::Text("Last frame: %.1f KiB uploaded, %d level(s) evicted",
+                    ctx.residency.uploadedBytes / 1024.0, ctx.residency.evictedLevels);
+
+        ImGui::Text("Picking (right click)");
+        if (ctx.hasPick) {
+            const gltf::PickResult &pick = ctx.pick;
+            ImGui::Text("Node %d (%s)", pick.node, ctx.asset.nodes[pick.node].name.c_str());
+            ImGui::Text("Primitive %d, triangle %d", pick.primitive, pick.triangle);
+            ImGui::Text("Barycentrics (%.3f, %.3f, %.3f)", 1.0f - pick.barycentrics.x - pick.barycentrics.y,
+                        pick.barycentrics.x, pick.barycentrics.y);
+            ImGui::Text("Position (%.3f, %.3f, %.3f)", pick.position.x, pick.position.y, pick.position.z);
+        } else {
+            ImGui::Text("Nothing picked");
+        }
+        if (ImGui::Button("Benchmark picking")) {
+            gltf::build_instance_bvh(ctx.bvh, ctx.asset, node_world_matrices(ctx));
+            ctx.pickRaysPerSecond = gltf::benchmark_picking(ctx.bvh, 100000, 1);
+            ctx.pickRaysPerSecondMT = gltf::benchmark_picking(ctx.bvh, 100000, 0);
+        }
+        ImGui::Text("Rays/s: %.0f (1 thread), %.0f (all threads)", ctx.pickRaysPerSecond,
+                    ctx.pickRaysPerSecondMT);
+
+        ImGui::Text("Profiler");
+        ImGui::Checkbox("Record events", &ctx.profiler.enabled);
+        ImGui::PlotLines("CPU frame (ms)", ctx.profiler.cpuFrameMs.data(),
+                         int(ctx.profiler.cpuFrameMs.size()), 0, nullptr, 0.0f, 33.3f,
+                         ImVec2(0.0f, 60.0f));
+        ImGui::PlotLines("GPU frame (ms)", ctx.profiler.gpuFrameMs.data(),
+                         int(ctx.profiler.gpuFrameMs.size()), 0, nullptr, 0.0f, 33.3f,
+                         ImVec2(0.0f, 60.0f));
+        if (ImGui::GetFrameCount() % 30 == 0) {
+            cg::profile_averages(ctx.profiler, 60, ctx.profileAverages);
+            update_prepass_stats(ctx);
+            update_cube_shadow_stats(ctx);
+        }
+        for (const auto &average : ctx.profileAverages) {
+            ImGui::Text("%s %s: %.3f ms", average.gpu ? "GPU" : "CPU", average.name, average.ms);
+        }
+        ImGui::Text("Dropped GPU results: %d", ctx.profiler.droppedGpuResults);
+        if (ImGui::Button("Export trace")) {
+            const std::string filename = trace_dir() + "/profile_trace.json";
+            const bool ok = cg::write_chrome_trace(ctx.profiler, filename);
+            ctx.profileExportStatus = (ok ? "Wrote " : "Could not write ") + filename;
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Export CSV")) {
+            const std::string filename = trace_dir() + "/profile.csv";
+            const bool ok = cg::write_profile_csv(ctx.profiler, filename);
+            ctx.profileExportStatus = (ok ? "Wrote " : "Could not write ") + filename;
+        }
+        if (!ctx.profileExportStatus.empty()) {
+            ImGui::TextWrapped("%s", ctx.profileExportStatus.c_str());
+        }
+
+        ImGui::Text("Assets");
+        if (!ctx.assetFilesListed || ImGui::Button("Refresh list")) {
+            ctx.assetFiles.clear();
+            gltf::list_gltf_files(gltf_dir(), ctx.assetFiles);
+            ctx.assetFilesListed = true;
+        }
+        const bool busy = ctx.reload.valid() || ctx.pendingScene;
+        ImGui::BeginChild("Asset list", ImVec2(0.0f, 120.0f), true);
+        for (const std::string &filename : ctx.assetFiles) {
+            const std::string label = gltf::is_scene_cached(ctx.sceneCache, filename)
+                                          ? filename + " (cached)"
+                                          : filename;
+            if (ImGui::Selectable(label.c_str(), filename == ctx.gltfFilename) && !busy) {
+                switch_asset(ctx, filename);
+            }
+        }
+        ImGui::EndChild();
+        int cacheMiB = int(ctx.sceneCache.budgetBytes >> 20);
+        if (ImGui::SliderInt("Scene cache (MiB)", &cacheMiB, 0, 4096)) {
+            ctx.sceneCache.budgetBytes = size_t(cacheMiB) << 20;
+            gltf::trim_scene_cache(ctx.sceneCache);
+        }
+        ImGui::Text("Cached: %d scene(s), %.1f MiB (%d hit(s), %d miss(es), %d evicted)",
+                    int(ctx.sceneCache.scenes.size()), ctx.sceneCache.bytes / 1048576.0,
+                    ctx.sceneCache.hits, ctx.sceneCache.misses, ctx.sceneCache.evictions);
+
+        ImGui::Text("Loading and hot reload");
+        ImGui::Checkbox("Reload when files change", &ctx.hotReload);
+        int uploadMiB = int(ctx.uploadBytesPerFrame >> 20);
+        if (ImGui::SliderInt("Upload per frame (MiB)", &uploadMiB, 1, 64)) {
+            ctx.uploadBytesPerFrame = size_t(uploadMiB) << 20;
+        }
+        if (ctx.reload.valid()) ImGui::Text("Loading on a worker thread...");
+        if (ctx.pendingScene) {
+            const gltf::SceneUpload &upload = ctx.sceneUpload;
+            const float progress =
+                upload.totalBytes ? float(upload.uploadedBytes) / upload.totalBytes : 1.0f;
+            ImGui::ProgressBar(progress, ImVec2(-1.0f, 0.0f));
+            ImGui::Text("Uploaded %.1f of %.1f MiB", upload.uploadedBytes / 1048576.0,
+                        upload.totalBytes / 1048576.0);
+        }
+        if (!ctx.reloadStatus.empty()) ImGui::TextWrapped("%s", ctx.reloadStatus.c_str());
+
+        ImGui::Text("Memory");
+        if (ImGui::GetFrameCount() % 30 == 0) {
+            ctx.memoryWarning =
+                cg::check_memory_budget(ctx.memoryBudget, cg::available_gpu_memory());
+        }
+        const cg::MemoryUsage memory = cg::memory_usage();
+        for (int i = 0; i < cg::NUM_MEMORY_CATEGORIES; ++i) {
+            const cg::MemoryCategoryUsage &category = memory.categories[i];
+            ImGui::Text("%-12s CPU %7.1f MiB, GPU %7.1f MiB (%d object(s))",
+                        cg::memory_category_name(cg::MemoryCategory(i)),
+                        category.cpuBytes / 1048576.0, category.gpuBytes / 1048576.0,
+                        category.gpuObjects);
+        }
+        ImGui::Text("Total: %.1f MiB CPU (peak %.1f), %.1f MiB GPU (peak %.1f)",
+                    memory.cpuBytes / 1048576.0, memory.peakCpuBytes / 1048576.0,
+                    memory.gpuBytes / 1048576.0, memory.peakGpuBytes / 1048576.0);
+        int cpuBudgetMiB = int(ctx.memoryBudget.cpuBytes >> 20);
+        if (ImGui::SliderInt("CPU budget (MiB)", &cpuBudgetMiB, 0, 65536)) {
+            ctx.memoryBudget.cpuBytes = size_t(cpuBudgetMiB) << 20;
+        }
+        int gpuBudgetMiB = int(ctx.memoryBudget.gpuBytes >> 20);
+        if (ImGui::SliderInt("GPU budget (MiB)", &gpuBudgetMiB, 0, 32768)) {
+            ctx.memoryBudget.gpuBytes = size_t(gpuBudgetMiB) << 20;
+        }
+        if (!ctx.memoryWarning.empty()) {
+            ImGui::TextColored(ImVec4(1.0f, 0.3f, 0.2f, 1.0f), "%s", ctx.memoryWarning.c_str());
+        }
+        if (ctx.cpuCopiesDropped) {
+            ImGui::Text("CPU copies dropped after upload");
+        } else if (ImGui::Button("Drop CPU copies")) {
+            drop_cpu_copies(ctx);
+        }
+        if (ImGui::Button("Dump memory report")) {
+            const std::string filename = trace_dir() + "/memory_report.json";
+            cg::print_memory_report();
+            const bool ok = cg::write_memory_report_json(filename);
+            ctx.memoryExportStatus = (ok ? "Wrote " : "Could not write ") + filename;
+        }
+        if (!ctx.memoryExportStatus.empty()) {
+            ImGui::TextWrapped("%s", ctx.memoryExportStatus.c_str());
+        }
 
         ImGui::End();
 
         do_rendering(ctx);
-        ImGui::Render();
-        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        {
+            cg::ProfileScope scope(ctx.profiler, "imgui_render");
+            cg::GpuProfileScope gpuScope(ctx.profiler, "imgui_render");
+            ImGui::Render();
+            ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        }
 
         glfwSwapBuffers(ctx.window);
     }
 
     // Shutdown
+    if (ctx.reload.valid()) ctx.reload.wait();
+    if (ctx.prefilterBenchmark.valid()) ctx.prefilterBenchmark.wait();
+    gltf::cancel_scene_upload(ctx.sceneUpload);
+    gltf::clear_scene_cache(ctx.sceneCache);
+    cg::destroy_staging_ring(ctx.stagingRing);
+    cg::destroy_file_watcher(ctx.fileWatcher);
+    gltf::destroy_light_buffers(ctx.lightBuffers);
+    cg::destroy_render_target(ctx.sceneTarget);
+    gltf::destroy_joint_buffer(ctx.jointBuffer);
+    cg::destroy_gpu_counter(ctx.fragmentCounter);
+    cg::destroy_profiler(ctx.profiler);
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
     ImGui::DestroyContext();
@@ -9,11 +9,39 @@ uniform vec3 u_ambientColor;
 uniform vec3 u_specularColor;
 uniform float u_specularPower;
 uniform samplerCube u_cubemap;
+uniform float u_cubemapLod; // Mip level = prefiltered roughness level
 uniform sampler2D u_texture1;
 uniform sampler2D u_bumpMap1;
 
-uniform sampler2D u_shadowMap; // the depth texture (shadowmap)
-uniform mat4 u_shadowFromView; // transforms main view-space -> shadow clip-space
+// Clustered lights (see gltf_lights.h). Each light is four texels: view-space
+// position and range, color and spot offset, view-space direction and spot
+// scale, and shadow index and bias. Each shadow is five texels: the columns of
+// the view-space to light clip-space matrix, and its tile of the shadow atlas.
+// Each cluster is an offset and count in the index list.
+uniform bool u_clusteredLights;
+uniform samplerBuffer u_lights;
+uniform usamplerBuffer u_lightClusters;
+uniform usamplerBuffer u_lightIndices;
+uniform samplerBuffer u_lightShadows;
+uniform ivec3 u_clusterDims;         // Tiles in x and y, depth slices
+uniform bool u_clusterLogDepth;
+uniform vec2 u_clusterDepthScaleBias;
+uniform vec2 u_viewportSize;
+
+// Directional lights of the asset, which reach everywhere and are not
+// clustered (see MAX_DIRECTIONAL_LIGHTS in gltf_lights.h). Directions are
+// view-space and point towards the light.
+uniform int u_numDirectionalLights;
+uniform vec3 u_directionalLightDirections[4];
+uniform vec3 u_directionalLightColors[4];
+
+uniform sampler2D u_shadowMap; // the depth texture (shadow atlas, see gltf_shadows.h)
+
+// Cube shadow map of the main light, with the distance to the light relative
+// to the far plane
+uniform samplerCube u_shadowCube;
+uniform mat4 u_shadowCubeFromView; // main view-space -> world-space offset from the light
+uniform float u_shadowCubeFar;
 
 
 
@@ -28,6 +56,7 @@ uniform bool u_environmentMapping;
 uniform bool u_showTexcoords;
 uniform bool u_bumpMappingEnabled;
 uniform bool u_hasBumpMap;
+uniform bool u_hasTangents;
 uniform bool u_showMaterial;
 uniform bool u_hasTexture;
 uniform bool u_enableShadowmap;
@@ -39,6 +68,8 @@ in vec3 V;      // View vector (direction)
 in vec3 v_normal;
 in float v_distance;
 in vec2 v_texcoord; // interpolated texture coordinate
+in vec3 v_tangent;   // View-space tangent
+in vec3 v_bitangent; // View-space bitangent
 
 in vec3 fragPosLight;
 
@@ -64,11 +95,19 @@ mat3 tangent_space(vec3 eye, vec2 texcoord, vec3 normal)
     return mat3(T, B, N);
 }
 
-float shadowmap_visibility(sampler2D shadowmap, vec4 shadowPos, float bias)
+float shadowmap_visibility(sampler2D shadowmap, vec4 shadowPos, float bias, vec4 rect)
 {
     vec2 delta = vec2(0.5) / textureSize(shadowmap, 0).xy;
     vec2 texcoord = (shadowPos.xy / shadowPos.w) * 0.5 + 0.5;
     float depth = (shadowPos.z / shadowPos.w) * 0.5 + 0.5;
+
+    // Outside the light camera, where its tile has no depth (the texels
+    // around it belong to other lights)
+    if (shadowPos.w <= 0.0 || any(lessThan(texcoord, vec2(0.0))) ||
+        any(greaterThan(texcoord, vec2(1.0))) || depth > 1.0) {
+        return 1.0;
+    }
+    texcoord = texcoord * rect.xy + rect.zw;
     
     // Sample the shadowmap and compare texels with (depth - bias) to
     // return a visibility value in range [0, 1]. If you take more
@@ -79,35 +118,95 @@ float shadowmap_visibility(sampler2D shadowmap, vec4 shadowPos, float bias)
     return visibility;
 }
 
+// Same for a cube shadow map, looked up with the offset from the light
+float cube_shadow_visibility(samplerCube shadowCube, vec3 fromLight, float bias)
+{
+    float depth = length(fromLight) / u_shadowCubeFar;
+    if (depth > 1.0) return 1.0;
+    float texel = texture(shadowCube, fromLight).r;
+    return float(texel > (depth - bias));
+}
+
+// Returns the cluster that a fragment at a view-space position falls into
+int light_cluster(vec3 position)
+{
+    float depth = -position.z;
+    float slice = (u_clusterLogDepth ? log(max(depth, 1e-4)) : depth) *
+                  u_clusterDepthScaleBias.x + u_clusterDepthScaleBias.y;
+    ivec3 cluster = ivec3(gl_FragCoord.xy / u_viewportSize * vec2(u_clusterDims.xy), slice);
+    cluster = clamp(cluster, ivec3(0), u_clusterDims - 1);
+    return (cluster.z * u_clusterDims.y + cluster.y) * u_clusterDims.x + cluster.x;
+}
+
+// Adds the diffuse and specular light of the clustered lights that reach a
+// fragment (glTF falloff: inverse square, windowed by the range)
+void add_clustered_lights(vec3 position, vec3 normal, vec3 view, inout vec3 diffuse,
+                          inout vec3 specular)
+{
+    uvec2 range = texelFetch(u_lightClusters, light_cluster(position)).rg;
+    for (uint i = 0u; i < range.y; ++i) {
+        int light = int(texelFetch(u_lightIndices, int(range.x + i)).r);
+        vec4 positionRange = texelFetch(u_lights, 4 * light);
+        vec4 colorOffset = texelFetch(u_lights, 4 * light + 1);
+        vec4 directionScale = texelFetch(u_lights, 4 * light + 2);
+        vec4 shadowBias = texelFetch(u_lights, 4 * light + 3);
+
+        vec3 toLight = positionRange.xyz - position;
+        float distance2 = max(dot(toLight, toLight), 1e-4);
+        vec3 l = toLight * inversesqrt(distance2);
+        float window = clamp(1.0 - pow(distance2 / (positionRange.w * positionRange.w), 2.0),
+                             0.0, 1.0);
+        float spot = clamp(dot(directionScale.xyz, -l) * directionScale.w + colorOffset.w,
+                           0.0, 1.0);
+        vec3 radiance = colorOffset.rgb * (window * window * spot * spot / distance2);
+        if (u_enableShadowmap && shadowBias.x >= 0.0 && dot(radiance, radiance) > 0.0) {
+            int shadow = 5 * int(shadowBias.x);
+            mat4 shadowFromView = mat4(texelFetch(u_lightShadows, shadow),
+                                       texelFetch(u_lightShadows, shadow + 1),
+                                       texelFetch(u_lightShadows, shadow + 2),
+                                       texelFetch(u_lightShadows, shadow + 3));
+            radiance *= shadowmap_visibility(u_shadowMap, shadowFromView * vec4(position, 1.0),
+                                             shadowBias.y, texelFetch(u_lightShadows, shadow + 4));
+        }
+
+        diffuse += max(0.0, dot(normal, l)) * radiance;
+        vec3 h = normalize(l + view);
+        specular += pow(max(dot(normal, h), 0.0), u_specularPower) * radiance;
+    }
+}
+
+// Adds the diffuse and specular light of the directional lights, which cast
+// no shadows
+void add_directional_lights(vec3 normal, vec3 view, inout vec3 diffuse, inout vec3 specular)
+{
+    for (int i = 0; i < u_numDirectionalLights; ++i) {
+        vec3 l = u_directionalLightDirections[i];
+        vec3 radiance = u_directionalLightColors[i];
+        diffuse += max(0.0, dot(normal, l)) * radiance;
+        vec3 h = normalize(l + view);
+        specular += pow(max(dot(normal, h), 0.0), u_specularPower) * radiance;
+    }
+}
+
 void main()
 {    
     vec3 N2 = N;
 
     if (u_bumpMappingEnabled && u_hasBumpMap) {
-        mat3 TBN = tangent_space(V, v_texcoord, N);
-        // === FOR RGB NORMAL MAPS === //
-        //normal_tangent = texture(u_bumpMap1, v_texcoord).r * 2.0 - 1.0; 
-        // vec3 normal_world = TBN * vec3(normal_tangent;
-        //N2 = normal_world;
+        // Use the precomputed (MikkTSpace) tangent frame when the mesh has
+        // one, and only fall back to pixel derivatives otherwise. The
+        // derivative frame takes the view-space position, which is -V (see
+        // mesh.vert); passing V would flip T and B.
+        mat3 TBN = u_hasTangents
+            ? mat3(normalize(v_tangent), normalize(v_bitangent), normalize(N))
+            : tangent_space(-V, v_texcoord, N);
 
-        // === FOR GRAY BUMP MAPS === //
-        // Calculating new normals using gray-scale bump map and surrounding values (Couldn't find examples of this, so I asked ChatGPT since it was optional anyway)
-
-        // Sample height values (grayscale bump map)
-        float heightCenter = texture(u_bumpMap1, v_texcoord).r; 
-        float heightRight  = texture(u_bumpMap1, v_texcoord + vec2(0.001, 0.0)).r; 
-        float heightUp     = texture(u_bumpMap1, v_texcoord + vec2(0.0, 0.001)).r;
-
-        // Compute the slope of the height map (finite differences)
+        // Grayscale bump maps are converted to normal maps at import time,
+        // so a single fetch is enough (Z is reconstructed from XY)
         vec3 normal_tangent;
-        float strength = 4.0f; // Change the strength of the bump map. 
-        normal_tangent.x = (heightCenter - heightRight) * strength;  // Partial derivative in U direction
-        normal_tangent.y = (heightCenter - heightUp) * strength;     // Partial derivative in V direction
-        normal_tangent.z = 1.0;                         // Default Z component to keep it unit-length
+        normal_tangent.xy = texture(u_bumpMap1, v_texcoord).rg * 2.0 - 1.0;
+        normal_tangent.z = sqrt(max(0.0, 1.0 - dot(normal_tangent.xy, normal_tangent.xy)));
 
-        // Normalize the normal to ensure proper shading
-        normal_tangent = normalize(normal_tangent);
-        
         vec3 normal_world = TBN * normal_tangent;
         N2 = normalize(normal_world);
     }
@@ -138,13 +237,33 @@ void main()
         ? ((u_specularPower + 8.0) / 8.0) * specular * u_specularColor * u_lightColor / v_distance
         : vec3(0.0f);
 
+    // The lights of the asset test their own shadows (directional lights
+    // have none), so they are added after the shadow test of the main light
+    // below
+    vec3 assetDiffuse = vec3(0.0), assetSpecular = vec3(0.0);
+    if (u_lightEnabled) {
+        if (u_clusteredLights) {
+            add_clustered_lights(-V, N2, normalize(V), assetDiffuse, assetSpecular);
+        }
+        add_directional_lights(N2, normalize(V), assetDiffuse, assetSpecular);
+        assetDiffuse *= u_diffuseEnabled ? u_diffuseColor : vec3(0.0);
+        assetSpecular *= u_specularEnabled
+            ? ((u_specularPower + 8.0) / 8.0) * u_specularColor
+            : vec3(0.0);
+        if (u_showMaterial && u_hasTexture) assetDiffuse *= u_materialDiffuseColor;
+    }
+
     // Shadow mapping
     if (u_enableShadowmap) {
-        float visibility = shadowmap_visibility(u_shadowMap, u_shadowFromView * vec4(-V, 1.0f), u_shadowBias);
+        vec3 fromLight = (u_shadowCubeFromView * vec4(-V, 1.0f)).xyz;
+        float visibility = cube_shadow_visibility(u_shadowCube, fromLight, u_shadowBias);
         diffuseColor *= visibility;
         specularColor *= visibility;
     }
 
+    diffuseColor += assetDiffuse;
+    specularColor += assetSpecular;
+
     vec3 ambientPlusDiffuse = ambientColor + diffuseColor;
     vec3 phongColor = ambientPlusDiffuse * objectColor + specularColor;
 
@@ -160,7 +279,7 @@ void main()
     // Cube map
     if (u_environmentMapping) {
         vec3 R = reflect(-V, N2);
-        phongColor = texture(u_cubemap, R).rgb;
+        phongColor = textureLod(u_cubemap, R, u_cubemapLod).rgb;
     }
 
 
@@ -12,12 +12,20 @@ uniform mat4 u_model;
 // Uniform world colors
 uniform vec3 u_lightPosition; // The position of your light source
 
+// Skinning: joint matrices of all skinned nodes (4 texels each), where those
+// of this draw start at u_jointOffset (-1 if it is not skinned)
+uniform samplerBuffer u_jointMatrices;
+uniform int u_jointOffset;
+
 
 // Vertex inputs (attributes from vertex buffers)
 layout(location = 0) in vec4 a_position;
 layout(location = 1) in vec3 a_color;
 layout(location = 2) in vec3 a_normal;
 layout(location = 3) in vec2 a_texcoord;
+layout(location = 4) in vec4 a_tangent; // xyz = tangent, w = bitangent sign
+layout(location = 5) in uvec4 a_joints;
+layout(location = 6) in vec4 a_weights;
 
 // Vertex shader outputs 
 out vec3 L; // View-space light vector
@@ -26,21 +34,45 @@ out vec3 V; // View vector (direction)
 out vec3 v_normal;
 out float v_distance;
 out vec2 v_texcoord;
+out vec3 v_tangent;   // View-space tangent
+out vec3 v_bitangent; // View-space bitangent
 
 out vec3 fragPosLight;
 
+// The depth prepass draws with the shadow program, and the main pass tests
+// for equal depth, so both must compute the same positions
+invariant gl_Position;
+
+mat4 joint_matrix(uint joint)
+{
+    int texel = (u_jointOffset + int(joint)) * 4;
+    return mat4(texelFetch(u_jointMatrices, texel), texelFetch(u_jointMatrices, texel + 1),
+                texelFetch(u_jointMatrices, texel + 2), texelFetch(u_jointMatrices, texel + 3));
+}
+
+mat4 skin_matrix()
+{
+    return a_weights.x * joint_matrix(a_joints.x) + a_weights.y * joint_matrix(a_joints.y) +
+           a_weights.z * joint_matrix(a_joints.z) + a_weights.w * joint_matrix(a_joints.w);
+}
+
 void main()
 {
+    // Skinned vertices are posed in the space of the node first (written as
+    // in shadow.vert, for the invariance of the positions)
+    vec4 position = u_jointOffset >= 0 ? skin_matrix() * a_position : a_position;
+    mat3 skin = u_jointOffset >= 0 ? mat3(skin_matrix()) : mat3(1.0);
+
     // Part 2 (Why?): Nothing changed because we're multiplying with the identity matrices
-    gl_Position = u_projection * u_view * u_model * a_position;
+    gl_Position = u_projection * u_view * u_model * position;
 
     mat4 mv = u_view * u_model;
 
     // Transform the vertex position to view space (eye coordinates)
-    vec3 positionEye = vec3(mv * a_position);
+    vec3 positionEye = vec3(mv * position);
 
     // Calculate the view-space normal
-    N = normalize(mat3(mv) * a_normal);
+    N = normalize(mat3(mv) * (skin * a_normal));
 
     // Calculate the view-space light direction
     vec4 lightPositionView = mv * vec4(u_lightPosition, 1);
@@ -53,6 +85,10 @@ void main()
     v_distance = dot(positionEye, positionEye) * 0.5;
     v_normal = a_normal;
     v_texcoord = a_texcoord;
+
+    // Tangent frame from precomputed tangents (zero if the mesh has none)
+    v_tangent = mat3(mv) * (skin * a_tangent.xyz);
+    v_bitangent = cross(N, v_tangent) * a_tangent.w;
 }
 
 // crnPos = model * vec4(a_position, 1.0);
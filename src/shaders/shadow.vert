@@ -5,17 +5,39 @@
 uniform mat4 u_model;
 uniform mat4 u_view;
 uniform mat4 u_proj;
+// Skinning (as in mesh.vert)
+uniform samplerBuffer u_jointMatrices;
+uniform int u_jointOffset;
 // ...
 
 // Vertex inputs (attributes from vertex buffers)
 layout(location = 0) in vec4 a_position;
+layout(location = 5) in uvec4 a_joints;
+layout(location = 6) in vec4 a_weights;
 // ...
 
 // Vertex shader outputs
 // ...
 
+// Same positions as mesh.vert (for the depth prepass)
+invariant gl_Position;
+
+mat4 joint_matrix(uint joint)
+{
+    int texel = (u_jointOffset + int(joint)) * 4;
+    return mat4(texelFetch(u_jointMatrices, texel), texelFetch(u_jointMatrices, texel + 1),
+                texelFetch(u_jointMatrices, texel + 2), texelFetch(u_jointMatrices, texel + 3));
+}
+
+mat4 skin_matrix()
+{
+    return a_weights.x * joint_matrix(a_joints.x) + a_weights.y * joint_matrix(a_joints.y) +
+           a_weights.z * joint_matrix(a_joints.z) + a_weights.w * joint_matrix(a_joints.w);
+}
+
 void main()
 {
-    gl_Position = u_proj * u_view * u_model * a_position;
+    vec4 position = u_jointOffset >= 0 ? skin_matrix() * a_position : a_position;
+    gl_Position = u_proj * u_view * u_model * position;
 }
 // shadowFromView * (-V) = shadowProj * shadowView * inverse(view) * u_view * u_model * a_position
\ No newline at end of file
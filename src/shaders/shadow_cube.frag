@@ -0,0 +1,18 @@
+#version 330
+#extension GL_ARB_explicit_attrib_location : require
+
+// Uniform constants
+uniform vec3 u_lightPosition;
+uniform float u_far;
+
+// Fragment shader inputs
+in Vertex {
+    vec3 position; // World space
+} vertex;
+
+void main()
+{
+    // The cube stores the distance to the light (relative to the far plane),
+    // which is the same in all faces and does not depend on the projection
+    gl_FragDepth = length(vertex.position - u_lightPosition) / u_far;
+}
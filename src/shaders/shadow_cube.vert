@@ -0,0 +1,40 @@
+#version 330
+#extension GL_ARB_explicit_attrib_location : require
+
+// Uniform constants
+uniform mat4 u_model;
+uniform mat4 u_viewProj; // Face camera (only used when each face is its own pass)
+// Skinning (as in mesh.vert)
+uniform samplerBuffer u_jointMatrices;
+uniform int u_jointOffset;
+
+// Vertex inputs (attributes from vertex buffers)
+layout(location = 0) in vec4 a_position;
+layout(location = 5) in uvec4 a_joints;
+layout(location = 6) in vec4 a_weights;
+
+// Vertex shader outputs
+out Vertex {
+    vec3 position; // World space
+} vertex;
+
+mat4 joint_matrix(uint joint)
+{
+    int texel = (u_jointOffset + int(joint)) * 4;
+    return mat4(texelFetch(u_jointMatrices, texel), texelFetch(u_jointMatrices, texel + 1),
+                texelFetch(u_jointMatrices, texel + 2), texelFetch(u_jointMatrices, texel + 3));
+}
+
+mat4 skin_matrix()
+{
+    return a_weights.x * joint_matrix(a_joints.x) + a_weights.y * joint_matrix(a_joints.y) +
+           a_weights.z * joint_matrix(a_joints.z) + a_weights.w * joint_matrix(a_joints.w);
+}
+
+void main()
+{
+    vec4 skinned = u_jointOffset >= 0 ? skin_matrix() * a_position : a_position;
+    vec4 position = u_model * skinned;
+    vertex.position = position.xyz;
+    gl_Position = u_viewProj * position;
+}
@@ -0,0 +1,39 @@
+#version 330
+#extension GL_ARB_explicit_attrib_location : require
+
+// Uniform constants
+uniform samplerCube u_shadowCube; // Distance to the light, relative to the far plane
+uniform vec2 u_viewportSize;
+
+// Fragment shader outputs
+out vec4 frag_color;
+
+void main()
+{
+    // The faces are unfolded into a cross of 4x3 square cells that fits the
+    // viewport: -X, +Z, +X and -Z in the middle row, +Y above and -Y below +Z
+    float cellSize = min(u_viewportSize.x / 4.0, u_viewportSize.y / 3.0);
+    vec2 origin = 0.5 * (u_viewportSize - vec2(4.0, 3.0) * cellSize);
+    vec2 p = (gl_FragCoord.xy - origin) / cellSize;
+    ivec2 cell = ivec2(floor(p));
+    vec2 st = fract(p) * 2.0 - 1.0;
+    float s = st.x, t = -st.y;  // As in the cube map face layout (t down)
+
+    vec3 direction;
+    if (cell.y == 1 && cell.x == 0) {
+        direction = vec3(-1.0, -t, s);
+    } else if (cell.y == 1 && cell.x == 1) {
+        direction = vec3(s, -t, 1.0);
+    } else if (cell.y == 1 && cell.x == 2) {
+        direction = vec3(1.0, -t, -s);
+    } else if (cell.y == 1 && cell.x == 3) {
+        direction = vec3(-s, -t, -1.0);
+    } else if (cell.y == 2 && cell.x == 1) {
+        direction = vec3(s, 1.0, t);
+    } else if (cell.y == 0 && cell.x == 1) {
+        direction = vec3(s, -1.0, -t);
+    } else {
+        discard;
+    }
+    frag_color = vec4(vec3(texture(u_shadowCube, direction).r), 1.0);
+}
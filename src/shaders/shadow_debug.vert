@@ -0,0 +1,10 @@
+#version 330
+#extension GL_ARB_explicit_attrib_location : require
+
+// Draws a single triangle that covers the viewport (no vertex buffers, the
+// corners come from gl_VertexID)
+void main()
+{
+    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+}
@@ -0,0 +1,236 @@
+// Regression tests of the asset and scene code. Runs without a window or
+// OpenGL context. Assets are read from $MODEL_VIEWER_ROOT/assets/gltf.
+//
+// Usage: model_viewer_tests [--filter name]
+//
+
+#include "gltf_io.h"
+#include "gltf_lights.h"
+#include "gltf_scene.h"
+#include "gltf_shadows.h"
+#include "gltf_texture.h"
+#include "cg_bcn.h"
+#include "cg_utils.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+static int g_failures = 0;
+
+// Records a failure (with its location) without stopping the test
+#define CHECK(condition)                                                          \
+    do {                                                                          \
+        if (!(condition)) {                                                       \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, \
+                         #condition);                                             \
+            g_failures += 1;                                                      \
+        }                                                                         \
+    } while (0)
+
+static std::string gltf_dir(void)
+{
+    const std::string rootDir = cg::get_env_var("MODEL_VIEWER_ROOT");
+    return (rootDir.empty() ? std::string(".") : rootDir) + "/assets/gltf/";
+}
+
+// lpshead references a grayscale bump map as its normal texture. It must
+// reach the GPU as a two-channel tangent-space normal map, not as heights.
+static void test_bump_map_becomes_normal_map(void)
+{
+    gltf::GLTFAsset asset;
+    CHECK(gltf::load_gltf_asset("lpshead.gltf", gltf_dir(), asset));
+    if (asset.materials.empty() || !asset.materials[0].hasNormalTexture) {
+        CHECK(!"lpshead has a normal texture");
+        return;
+    }
+
+    gltf::choose_texture_formats(asset, false);
+    const int texture = asset.materials[0].normalTexture.index;
+    const gltf::Image &image = asset.images[asset.textures[texture].source];
+    CHECK(image.channels == 2);
+    CHECK(image.swizzle == "rg01");
+    CHECK(image.data.size() == size_t(image.width) * image.height * 2);
+    if (image.data.size() != size_t(image.width) * image.height * 2) return;
+
+    // Decoded normals are unit length with Z towards the surface normal, and
+    // the bumps tilt at least some of them
+    int tilted = 0;
+    for (size_t i = 0; i < image.data.size(); i += 2) {
+        const float x = uint8_t(image.data[i]) / 127.5f - 1.0f;
+        const float y = uint8_t(image.data[i + 1]) / 127.5f - 1.0f;
+        CHECK(x * x + y * y < 1.0f + 1e-2f);
+        if (std::abs(x) > 0.05f || std::abs(y) > 0.05f) tilted += 1;
+    }
+    CHECK(tilted > 0);
+}
+
+// Scale applies before translation (T * R * S), so it does not move the node
+static void test_node_model_matrix_order(void)
+{
+    gltf::Node node = gltf::Node();
+    node.translation = glm::vec3(1.0f, 0.0f, 0.0f);
+    node.rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+    node.scale = glm::vec3(2.0f);
+    const glm::mat4 model = gltf::node_model_matrix(node);
+
+    const glm::vec4 origin = model * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    CHECK(glm::length(glm::vec3(origin) - glm::vec3(1.0f, 0.0f, 0.0f)) < 1e-6f);
+    const glm::vec4 unitX = model * glm::vec4(1.0f, 0.0f, 0.0f, 1.0f);
+    CHECK(glm::length(glm::vec3(unitX) - glm::vec3(3.0f, 0.0f, 0.0f)) < 1e-6f);
+}
+
+// Directional lights are collected apart from the clustered ones, shining
+// down the -Z axis of their node
+static void test_directional_lights(void)
+{
+    gltf::GLTFAsset asset;
+    gltf::Light light = gltf::Light();
+    light.type = gltf::LIGHT_DIRECTIONAL;
+    light.color = glm::vec3(1.0f, 0.5f, 0.25f);
+    light.intensity = 2.0f;
+    asset.lights.push_back(light);
+    gltf::Node node = gltf::Node();
+    node.light = 0;
+    node.rotation = glm::angleAxis(glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+    node.scale = glm::vec3(1.0f);
+    asset.nodes.push_back(node);
+    std::vector<glm::mat4> worldMatrices;
+    gltf::compute_world_matrices(asset, worldMatrices);
+
+    std::vector<gltf::PunctualLight> punctual;
+    gltf::collect_punctual_lights(asset, worldMatrices, 0.01f, punctual);
+    CHECK(punctual.empty());
+    std::vector<gltf::DirectionalLight> directional;
+    gltf::collect_directional_lights(asset, worldMatrices, directional);
+    CHECK(directional.size() == 1);
+    if (directional.size() != 1) return;
+    CHECK(glm::length(directional[0].direction - glm::vec3(0.0f, 1.0f, 0.0f)) < 1e-5f);
+    CHECK(directional[0].color == glm::vec3(2.0f, 1.0f, 0.5f));
+}
+
+// A skinned mesh whose joint moved far from its bind-pose box still casts
+// into the atlas tile and the cube faces of lights that only see the joint
+static void test_skinned_shadow_casters(void)
+{
+    gltf::GLTFAsset asset;
+    gltf::Node node = gltf::Node();
+    node.mesh = -1;
+    node.light = -1;
+    node.skin = -1;
+    node.rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+    node.scale = glm::vec3(1.0f);
+    gltf::Node joint = node;
+    joint.translation = glm::vec3(100.0f, 0.0f, 0.0f);
+    node.mesh = 0;
+    node.skin = 0;
+    asset.nodes.push_back(node);
+    asset.nodes.push_back(joint);
+    gltf::Skin skin = gltf::Skin();
+    skin.joints.push_back(1);
+    skin.inverseBindMatrices = -1;
+    skin.skeleton = -1;
+    asset.skins.push_back(skin);
+    std::vector<gltf::CullingMesh> meshes(1);
+    meshes[0].bounds.min = glm::vec3(-1.0f);
+    meshes[0].bounds.max = glm::vec3(1.0f);
+    meshes[0].indices.assign(3, 0);
+    std::vector<glm::mat4> worldMatrices;
+    gltf::compute_world_matrices(asset, worldMatrices);
+
+    // A spot light above the joint, looking down
+    const glm::vec3 eye(100.0f, 10.0f, 0.0f);
+    const glm::mat4 viewProj =
+        glm::perspective(glm::radians(30.0f), 1.0f, 0.1f, 20.0f) *
+        glm::lookAt(eye, glm::vec3(100.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+    const gltf::ShadowLight light = {1, viewProj, 1.0f};
+    gltf::ShadowSettings settings;
+    gltf::ShadowAtlas atlas;
+    gltf::init_shadow_atlas(atlas, settings);
+    std::vector<gltf::ShadowUpdate> updates;
+    gltf::schedule_shadow_updates(atlas, std::vector<gltf::ShadowLight>(1, light), asset, meshes,
+                                  worldMatrices, settings, updates);
+    CHECK(updates.size() == 1);
+    if (updates.size() != 1) return;
+    CHECK(updates[0].casters.size() == 1);
+    CHECK(atlas.casters.size() == 1 && atlas.casters[0].skinned);
+    if (atlas.casters.size() != 1) return;
+
+    // The bounds reach the joint, so a cube shadow map there covers them
+    CHECK(atlas.casters[0].bounds.max.x >= 100.0f);
+    std::vector<gltf::CubeShadowCaster> cubeCasters;
+    CHECK(gltf::cull_cube_shadow_casters(atlas.casters, eye, 0.01f, 20.0f, cubeCasters) == 6);
+    CHECK(cubeCasters.size() == 1 && cubeCasters[0].faces == 0x3f);
+}
+
+// Compressed environment levels survive the KTX2 cache with their faces in
+// order and the sizes of the mip chain
+static void test_ktx2_cubemap_round_trip(void)
+{
+    std::vector<cg::CubemapFaces> levels(3);
+    for (size_t i = 0; i < levels.size(); ++i) {
+        levels[i].size = 8 >> i;
+        for (int face = 0; face < 6; ++face) {
+            levels[i].faces[face].assign(size_t(levels[i].size) * levels[i].size * 4,
+                                         char(40 * face + i));
+        }
+    }
+    std::vector<char> bytes;
+    CHECK(gltf::encode_ktx2_cubemap(levels, bytes));
+    std::vector<cg::CubemapFaces> decoded;
+    CHECK(gltf::decode_ktx2_cubemap(bytes, "rgba8.ktx2", decoded));
+    CHECK(decoded.size() == levels.size());
+    for (size_t i = 0; i < decoded.size() && i < levels.size(); ++i) {
+        CHECK(decoded[i].size == levels[i].size && decoded[i].format == 0);
+        for (int face = 0; face < 6; ++face) {
+            CHECK(decoded[i].faces[face] == levels[i].faces[face]);
+        }
+    }
+
+    cg::compress_cubemap(levels, cg::FORMAT_BC1);
+    CHECK(levels[2].faces[5].size() == cg::compressed_image_size(cg::FORMAT_BC1, 2, 2));
+    CHECK(gltf::encode_ktx2_cubemap(levels, bytes));
+    CHECK(gltf::decode_ktx2_cubemap(bytes, "bc1.ktx2", decoded));
+    CHECK(decoded.size() == levels.size());
+    for (size_t i = 0; i < decoded.size() && i < levels.size(); ++i) {
+        CHECK(decoded[i].size == levels[i].size && decoded[i].format == cg::FORMAT_BC1);
+        for (int face = 0; face < 6; ++face) {
+            CHECK(decoded[i].faces[face] == levels[i].faces[face]);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filter = "";
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 < argc && std::strcmp(argv[i], "--filter") == 0) {
+            filter = argv[i + 1];
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--filter name]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    const struct {
+        const char *name;
+        void (*func)(void);
+    } tests[] = {{"bump_map_becomes_normal_map", test_bump_map_becomes_normal_map},
+                 {"node_model_matrix_order", test_node_model_matrix_order},
+                 {"directional_lights", test_directional_lights},
+                 {"skinned_shadow_casters", test_skinned_shadow_casters},
+                 {"ktx2_cubemap_round_trip", test_ktx2_cubemap_round_trip}};
+
+    for (const auto &test : tests) {
+        if (!std::strstr(test.name, filter)) continue;
+        const int failuresBefore = g_failures;
+        test.func();
+        std::cout << (g_failures == failuresBefore ? "PASS " : "FAIL ") << test.name << std::endl;
+    }
+    return g_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,246 @@
+// Offline optimizer that turns glTF assets into render-ready GLB files: the
+// vertices are welded, reordered for the vertex cache and overdraw and
+// quantized, levels of detail are generated, and textures are compressed to
+// BCn with full mip chains and embedded as KTX2, so that the viewer has
+// almost nothing left to do at load time. Runs without a window or OpenGL
+// context, and processes several assets in parallel.
+//
+// Usage: model_viewer_optimizer [options] <file.gltf | file.glb | directory>...
+//
+
+#include "gltf_io.h"
+#include "gltf_mesh.h"
+#include "gltf_scene.h"
+#include "gltf_texture.h"
+#include "cg_parallel.h"
+#include "cg_utils.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+struct OptimizerSettings {
+    std::string outDir = "optimized/";
+    unsigned threads = 0;       // Assets processed at the same time (0 = one per core)
+    float weldEpsilon = 0.0f;   // See gltf::weld_vertices()
+    int lodLevels = 3;
+    float lodRatio = 0.5f;      // Triangles of each level relative to the previous one
+    bool quantize = true;
+    bool compressTextures = true;
+    bool hasBPTC = false;       // BC7 needs OpenGL 4.2 or ARB_texture_compression_bptc
+    std::string cacheDir;       // For compressed images (shared with the viewer)
+};
+
+struct AssetReport {
+    std::string input;
+    bool ok = false;
+    size_t bytesIn = 0;   // The .gltf or .glb file with its buffers and images
+    size_t bytesOut = 0;  // The .glb file
+    size_t vertices = 0;
+    size_t triangles = 0;
+    double acmrBefore = 0.0;
+    double acmrAfter = 0.0;
+    int lodLevels = 0;
+    int textures = 0;
+    double ms = 0.0;
+};
+
+static size_t file_size(const std::string &filename)
+{
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    return file ? size_t(file.tellg()) : 0;
+}
+
+static void count_geometry(const gltf::GLTFAsset &asset, AssetReport &report)
+{
+    std::set<int> positions;
+    for (const auto &mesh : asset.meshes) {
+        for (const auto &primitive : mesh.primitives) {
+            const int position = gltf::find_attribute(primitive, gltf::SEMANTIC_POSITION);
+            if (position >= 0 && positions.insert(position).second) {
+                report.vertices += asset.accessors[position].count;
+            }
+            report.triangles += asset.accessors[primitive.indices].count / 3;
+        }
+    }
+}
+
+static AssetReport optimize_asset(const OptimizerSettings &settings, const std::string &input)
+{
+    AssetReport report;
+    report.input = input;
+    const auto start = std::chrono::steady_clock::now();
+
+    const size_t slash = input.find_last_of("/\\");
+    const std::string filedir = slash == std::string::npos ? "" : input.substr(0, slash + 1);
+    const std::string filename = input.substr(filedir.size());
+    gltf::GLTFAsset asset;
+    if (!gltf::load_gltf_asset(filename, filedir, asset)) return report;
+    report.bytesIn = file_size(input);
+    for (const auto &buffer : asset.buffers) {
+        if (!buffer.uri.empty()) report.bytesIn += file_size(filedir + buffer.uri);
+    }
+    for (const auto &image : asset.images) {
+        if (!image.uri.empty()) report.bytesIn += file_size(filedir + image.uri);
+    }
+
+    // Geometry: the levels of detail reuse the reordered vertices, and are
+    // quantized along with them
+    gltf::weld_vertices(asset, settings.weldEpsilon);
+    const gltf::VertexCacheStats cache = gltf::optimize_vertex_cache(asset);
+    report.acmrBefore = cache.acmrBefore;
+    report.acmrAfter = cache.acmrAfter;
+    if (settings.lodLevels > 0) {
+        report.lodLevels = gltf::generate_lods(asset, settings.lodLevels, settings.lodRatio).levels;
+    }
+    if (settings.quantize) {
+        // Vertices that only differed below the new precision become equal
+        gltf::quantize_attributes(asset);
+        gltf::weld_vertices(asset, 0.0f);
+    }
+    count_geometry(asset, report);
+
+    // Textures get the formats and mip chains that the viewer would build at
+    // load time. Occlusion maps are not packed into metallic-roughness maps,
+    // since the unpacked maps would be left without data to embed.
+    if (settings.compressTextures) {
+        gltf::TextureCompressionSettings compression;
+        compression.hasS3TC = true;
+        compression.hasBPTC = settings.hasBPTC;
+        compression.cacheDir = settings.cacheDir;
+        gltf::choose_texture_formats(asset, false);
+        gltf::generate_mipmaps(asset, cg::MIP_FILTER_KAISER);
+        gltf::compress_textures(asset, compression);
+    }
+    report.textures = gltf::embed_ktx2_images(asset);
+    for (auto &texture : asset.textures) texture.fallbackSource = -1;
+
+    const std::string stem = filename.substr(0, filename.rfind('.'));
+    if (!gltf::compact_buffers(asset) ||
+        !gltf::save_glb_asset(stem + ".glb", settings.outDir, asset)) {
+        return report;
+    }
+    report.bytesOut = file_size(settings.outDir + stem + ".glb");
+    report.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+                    .count();
+    report.ok = true;
+    return report;
+}
+
+static void print_usage(const char *program)
+{
+    std::cerr << "Usage: " << program << " [options] <file.gltf | file.glb | directory>...\n"
+              << "  --out dir          Output directory (default: optimized)\n"
+              << "  --threads n        Assets processed in parallel (default: one per core)\n"
+              << "  --weld epsilon     Merge vertices closer than epsilon (default: 0)\n"
+              << "  --lods n           Levels of detail per primitive (default: 3)\n"
+              << "  --lod-ratio r      Triangles of each level relative to the previous "
+                 "(default: 0.5)\n"
+              << "  --no-quantize      Keep float normals, tangents, texcoords and colors\n"
+              << "  --no-compress      Embed textures uncompressed and without mipmaps\n"
+              << "  --bc7              Allow BC7 (needs OpenGL 4.2) instead of BC1 and BC3"
+              << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    OptimizerSettings settings;
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (arg == "--out" && hasValue) {
+            settings.outDir = std::string(argv[++i]) + "/";
+        } else if (arg == "--threads" && hasValue) {
+            settings.threads = unsigned(std::max(0, std::atoi(argv[++i])));
+        } else if (arg == "--weld" && hasValue) {
+            settings.weldEpsilon = float(std::atof(argv[++i]));
+        } else if (arg == "--lods" && hasValue) {
+            settings.lodLevels = std::atoi(argv[++i]);
+        } else if (arg == "--lod-ratio" && hasValue) {
+            settings.lodRatio = glm::clamp(float(std::atof(argv[++i])), 0.01f, 0.99f);
+        } else if (arg == "--no-quantize") {
+            settings.quantize = false;
+        } else if (arg == "--no-compress") {
+            settings.compressTextures = false;
+        } else if (arg == "--bc7") {
+            settings.hasBPTC = true;
+        } else if (arg.compare(0, 2, "--") == 0) {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        } else if (gltf::is_gltf_file(arg)) {
+            inputs.push_back(arg);
+        } else {
+            std::vector<std::string> names;
+            if (!gltf::list_gltf_files(arg, names)) {
+                std::cerr << "Error: " << arg << " is neither a glTF file nor a directory"
+                          << std::endl;
+                return EXIT_FAILURE;
+            }
+            for (const auto &name : names) inputs.push_back(arg + "/" + name);
+        }
+    }
+    if (inputs.empty()) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const std::string rootDir = cg::get_env_var("MODEL_VIEWER_ROOT");
+    if (!rootDir.empty()) settings.cacheDir = rootDir + "/cache";
+#ifdef _WIN32
+    _mkdir(settings.outDir.c_str());
+#else
+    mkdir(settings.outDir.c_str(), 0755);
+#endif
+
+    // Each asset is optimized on its own thread (the stages also spread their
+    // work over threads, which helps when there are few assets)
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<AssetReport> reports(inputs.size());
+    cg::parallel_for(
+        int(inputs.size()), [&](int i) { reports[i] = optimize_asset(settings, inputs[i]); },
+        settings.threads);
+    const double totalMs =
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+            .count();
+
+    std::printf("%-32s %10s %10s %6s %9s %9s %11s %4s %8s %9s\n", "asset", "in KiB", "out KiB",
+                "ratio", "vertices", "triangles", "ACMR", "LODs", "textures", "ms");
+    size_t bytesIn = 0, bytesOut = 0;
+    int failed = 0;
+    for (const auto &report : reports) {
+        if (!report.ok) {
+            std::printf("%-32s failed\n", report.input.c_str());
+            failed += 1;
+            continue;
+        }
+        char acmr[32];
+        std::snprintf(acmr, sizeof(acmr), "%.2f->%.2f", report.acmrBefore, report.acmrAfter);
+        std::printf("%-32s %10.1f %10.1f %5.0f%% %9zu %9zu %11s %4d %8d %9.1f\n",
+                    report.input.c_str(), report.bytesIn / 1024.0, report.bytesOut / 1024.0,
+                    report.bytesIn ? 100.0 * report.bytesOut / report.bytesIn : 0.0,
+                    report.vertices, report.triangles, acmr, report.lodLevels, report.textures,
+                    report.ms);
+        bytesIn += report.bytesIn;
+        bytesOut += report.bytesOut;
+    }
+    std::printf("%d asset(s) in %.1f ms on %u thread(s): %.1f -> %.1f KiB, %d failed\n",
+                int(reports.size()) - failed, totalMs,
+                settings.threads ? settings.threads : cg::num_worker_threads(), bytesIn / 1024.0,
+                bytesOut / 1024.0, failed);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}